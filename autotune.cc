@@ -0,0 +1,231 @@
+#include <algorithm>
+#include "autotune.h"
+
+/* most completions taken in one poll */
+#define TUNE_MAX_POLL 64
+
+enum tune_knob {
+    KNOB_DEPTH,
+    KNOB_POST_BATCH,
+    KNOB_SIGNAL,
+    KNOB_POLL_BATCH,
+    KNOB_INLINE,
+    KNOB_COUNT
+};
+
+static const char *knob_names[] = {"depth", "post batch", "signal interval", "poll batch", "inline"};
+
+static int *knob(struct tune_t *t, int k) {
+    switch (k) {
+        case KNOB_DEPTH:
+            return &t->depth;
+        case KNOB_POST_BATCH:
+            return &t->post_batch;
+        case KNOB_SIGNAL:
+            return &t->signal_every;
+        case KNOB_POLL_BATCH:
+            return &t->poll_batch;
+        default:
+            return &t->inline_data;
+    }
+}
+
+static int same_tune(const struct tune_t *a, const struct tune_t *b) {
+    return a->depth == b->depth && a->signal_every == b->signal_every && a->inline_data == b->inline_data &&
+           a->post_batch == b->post_batch && a->poll_batch == b->poll_batch;
+}
+
+static int tune_valid(const struct tune_t *t, uint32_t size, const struct tune_limits_t *lim) {
+    /* a batch or a signal interval longer than the queue could never be posted or completed */
+    return t->depth >= 1 && t->depth <= lim->max_depth && t->post_batch >= 1 && t->post_batch <= t->depth &&
+           t->post_batch <= MAX_POST_BATCH && t->signal_every >= 1 && t->signal_every <= t->depth &&
+           t->poll_batch >= 1 && t->poll_batch <= TUNE_MAX_POLL && (!t->inline_data || size <= lim->max_inline);
+}
+
+/* every value a knob is tried at, smallest first */
+static std::vector<int> knob_values(int k, uint32_t size, const struct tune_limits_t *lim) {
+    std::vector<int> values;
+    int top;
+    if (k == KNOB_INLINE) {
+        values.push_back(0);
+        if (size <= lim->max_inline)
+            values.push_back(1);
+        return values;
+    }
+    top = k == KNOB_POLL_BATCH ? TUNE_MAX_POLL : k == KNOB_POST_BATCH ? std::min(lim->max_depth, MAX_POST_BATCH)
+                                                                      : lim->max_depth;
+    for (int v = 1; v <= top; v *= 2)
+        values.push_back(v);
+    return values;
+}
+
+void tune_defaults(struct tune_t *t, int depth) {
+    t->depth = depth;
+    t->signal_every = 1;
+    t->inline_data = 0;
+    t->post_batch = 1;
+    t->poll_batch = 1;
+}
+
+/*
+ * Coordinate search: one knob at a time, the others held at the best values so far, until a whole round
+ * changes nothing. A larger value has to beat the current one by 2% to be taken, so of two configurations
+ * that perform the same the one holding fewer WRs and batching less wins. Once three doublings in a row
+ * of a knob stop paying off, its larger values would only cost more for the same rate and are not measured.
+ */
+int autotune_size(uint32_t size, const struct tune_limits_t *lim, const tune_measure_fn &measure,
+                  struct tune_entry_t *best, std::vector<struct tune_point_t> *measured) {
+    struct tune_t cur;
+    double cur_rate = 0;
+    int changed = 1;
+    int round;
+    auto rate_of = [&](const struct tune_t *t, double *rate) -> int {
+        for (auto &p : *measured) {
+            if (same_tune(&p.t, t)) {
+                *rate = p.msg_per_s;
+                return 0;
+            }
+        }
+        if (measure(t, rate))
+            return 1;
+        measured->push_back({*t, *rate});
+        log_debug("  depth %d, signal every %d, inline %d, post batch %d, poll batch %d: %.0f msg/s\n", t->depth,
+                  t->signal_every, t->inline_data, t->post_batch, t->poll_batch, *rate);
+        return 0;
+    };
+    measured->clear();
+    tune_defaults(&cur, 1);
+    if (rate_of(&cur, &cur_rate))
+        return 1;
+    for (round = 0; round < 3 && changed; round++) {
+        changed = 0;
+        for (int k = 0; k < KNOB_COUNT; k++) {
+            double prev = -1;
+            double rate;
+            int flat = 0;
+            int best_value = *knob(&cur, k);
+            for (int v : knob_values(k, size, lim)) {
+                struct tune_t t = cur;
+                *knob(&t, k) = v;
+                if (!tune_valid(&t, size, lim))
+                    continue;
+                if (rate_of(&t, &rate))
+                    return 1;
+                if (v != best_value && (rate > cur_rate * 1.02 || (v < best_value && rate >= cur_rate * 0.98))) {
+                    best_value = v;
+                    cur_rate = rate;
+                }
+                if (prev >= 0 && rate < prev * 1.02) {
+                    if (++flat >= 3)
+                        break;
+                } else {
+                    flat = 0;
+                }
+                prev = rate;
+            }
+            if (best_value != *knob(&cur, k)) {
+                log_debug("  %s: %d -> %d\n", knob_names[k], *knob(&cur, k), best_value);
+                *knob(&cur, k) = best_value;
+                changed = 1;
+            }
+        }
+    }
+    best->size = size;
+    best->t = cur;
+    best->msg_per_s = cur_rate;
+    return 0;
+}
+
+/* the configurations no other one beats on rate while holding at most as many WRs */
+void tune_frontier(const std::vector<struct tune_point_t> &measured, std::vector<struct tune_point_t> *frontier) {
+    frontier->clear();
+    for (auto &p : measured) {
+        int dominated = 0;
+        for (auto &q : measured) {
+            if (q.msg_per_s >= p.msg_per_s && q.t.depth <= p.t.depth &&
+                (q.msg_per_s > p.msg_per_s || q.t.depth < p.t.depth)) {
+                dominated = 1;
+                break;
+            }
+        }
+        if (!dominated)
+            frontier->push_back(p);
+    }
+    std::sort(frontier->begin(), frontier->end(), [](const struct tune_point_t &a, const struct tune_point_t &b) {
+        return a.t.depth < b.t.depth;
+    });
+}
+
+/*
+ * One line per message size, # starts a comment:
+ *   # size depth signal_every inline post_batch poll_batch msg_per_s
+ *   64 32 8 1 4 16 11832270
+ */
+int save_profile(const char *path, const char *header, const std::vector<struct tune_entry_t> &entries) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "failed to open profile %s\n", path);
+        return 1;
+    }
+    fprintf(f, "# %s\n", header);
+    fprintf(f, "# size depth signal_every inline post_batch poll_batch msg_per_s\n");
+    for (auto &e : entries)
+        fprintf(f, "%u %d %d %d %d %d %.0f\n", e.size, e.t.depth, e.t.signal_every, e.t.inline_data,
+                e.t.post_batch, e.t.poll_batch, e.msg_per_s);
+    if (fclose(f)) {
+        fprintf(stderr, "failed to write profile %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+int load_profile(const char *path, std::vector<struct tune_entry_t> *entries) {
+    char line[256];
+    int lineno = 0;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "failed to open profile %s\n", path);
+        return 1;
+    }
+    entries->clear();
+    while (fgets(line, sizeof(line), f)) {
+        struct tune_entry_t e;
+        char *p = line;
+        lineno++;
+        if (strchr(line, '#'))
+            *strchr(line, '#') = '\0';
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (!*p || *p == '\n')
+            continue;
+        if (sscanf(p, "%u %d %d %d %d %d %lf", &e.size, &e.t.depth, &e.t.signal_every, &e.t.inline_data,
+                   &e.t.post_batch, &e.t.poll_batch, &e.msg_per_s) != 7) {
+            fprintf(stderr, "%s:%d: expected size depth signal_every inline post_batch poll_batch msg_per_s\n",
+                    path, lineno);
+            fclose(f);
+            return 1;
+        }
+        entries->push_back(e);
+    }
+    fclose(f);
+    std::sort(entries->begin(), entries->end(), [](const struct tune_entry_t &a, const struct tune_entry_t &b) {
+        return a.size < b.size;
+    });
+    if (entries->empty()) {
+        fprintf(stderr, "profile %s has no entries\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+/* the entry for the largest size not above the given one, or the smallest entry */
+int profile_lookup(const std::vector<struct tune_entry_t> &entries, uint32_t size, struct tune_t *t) {
+    if (entries.empty())
+        return 1;
+    *t = entries[0].t;
+    for (auto &e : entries) {
+        if (e.size <= size)
+            *t = e.t;
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef RDMA_TEST_AUTOTUNE_H
+#define RDMA_TEST_AUTOTUNE_H
+
+#include <functional>
+#include <vector>
+#include "rdma_common.h"
+
+/* inline data a QP is asked for when inlining is one of the options */
+#define TUNE_INLINE_DATA 256
+
+/* the knobs of the streaming loop */
+struct tune_t {
+    int depth;            /* outstanding WRs */
+    int signal_every;     /* one WR in this many asks for a completion */
+    int inline_data;      /* payload copied into the WQE, needs the QP's max_inline_data */
+    int post_batch;       /* WRs chained into one ibv_post_send() */
+    int poll_batch;       /* completions taken per ibv_poll_cq() */
+};
+
+/* one configuration that was measured */
+struct tune_point_t {
+    struct tune_t t;
+    double msg_per_s;
+};
+
+/* how far each knob may go on this connection */
+struct tune_limits_t {
+    int max_depth;
+    uint32_t max_inline;  /* 0 if the QP has no inline data */
+};
+
+/* the best settings found for one message size */
+struct tune_entry_t {
+    uint32_t size;
+    struct tune_t t;
+    double msg_per_s;
+};
+
+/* runs the loop with the given knobs and reports the message rate, non-zero on failure */
+typedef std::function<int(const struct tune_t *t, double *msg_per_s)> tune_measure_fn;
+
+void tune_defaults(struct tune_t *t, int depth);
+
+int autotune_size(uint32_t size, const struct tune_limits_t *lim, const tune_measure_fn &measure,
+                  struct tune_entry_t *best, std::vector<struct tune_point_t> *measured);
+
+void tune_frontier(const std::vector<struct tune_point_t> &measured, std::vector<struct tune_point_t> *frontier);
+
+int save_profile(const char *path, const char *header, const std::vector<struct tune_entry_t> &entries);
+
+int load_profile(const char *path, std::vector<struct tune_entry_t> *entries);
+
+int profile_lookup(const std::vector<struct tune_entry_t> &entries, uint32_t size, struct tune_t *t);
+
+#endif //RDMA_TEST_AUTOTUNE_H
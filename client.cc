@@ -2,433 +2,1905 @@
 // Created by 熊嘉晟 on 2024/7/12.
 //
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "client.h"
 
-void print_config(void) {
-    fprintf(stdout, " ------------------------------------------------\n");
-    fprintf(stdout, " Device name : \"%s\"\n", config.dev_name);
-    fprintf(stdout, " IB port : %u\n", config.ib_port);
-    if (config.server_name)
-        fprintf(stdout, " IP : %s\n", config.server_name);
-    fprintf(stdout, " TCP port : %u\n", config.tcp_port);
-    if (config.gid_idx >= 0)
-        fprintf(stdout, " GID index : %u\n", config.gid_idx);
-    fprintf(stdout, " ------------------------------------------------\n\n");
+static void zc_send_done(void *ctx, struct zc_buf_t *, int status) {
+    int *errors = (int *) ctx;
+    if (status)
+        (*errors)++;
 }
 
-void resources_init(struct resources *res) {
-    memset(res, 0, sizeof *res);
-    res->sock = -1;
-}
-
-int resources_create(struct resources *res) {
-    struct ibv_device **dev_list = NULL;
-    struct ibv_qp_init_attr qp_init_attr;
-    struct ibv_device *ib_dev = NULL;
-    size_t size;
-    int i;
-    int mr_flags = 0;
-    int cq_size = 0;
-    int num_devices;
+int run_zcsend(struct resources *res, int count) {
+    int depth = config.depth;
+    uint32_t payload_len = config.msg_size;
+    uint32_t msg_len = sizeof(struct msg_hdr_t) + payload_len;
+    struct msg_hdr_t *hdrs = NULL;
+    char *payloads = NULL;
+    struct zc_buf_t *zbs = NULL;
+    struct ibv_mr *hdr_mr = NULL;
+    struct ibv_mr *payload_mr = NULL;
+    int errors = 0;
     int rc = 0;
-    res->sock = sock_connect(config.server_name, config.tcp_port);
-    if (res->sock < 0) {
-        fprintf(stderr, "failed to establish TCP connection to server %s, port %d\n", config.server_name,
-                config.tcp_port);
-        rc = -1;
-        goto resources_create_exit;
-    }
-    fprintf(stdout, "TCP connection was established\n");
-    fprintf(stdout, "searching for IB devices in host\n");
-    /* get device names in the system */
-    dev_list = ibv_get_device_list(&num_devices);
-    if (!dev_list) {
-        fprintf(stderr, "failed to get IB devices list\n");
+    int i;
+    /* the caller's own buffers, kept apart from res->buf */
+    hdrs = (struct msg_hdr_t *) calloc(depth, sizeof(struct msg_hdr_t));
+    payloads = (char *) malloc((size_t) depth * payload_len);
+    zbs = (struct zc_buf_t *) calloc(depth, sizeof(struct zc_buf_t));
+    if (!hdrs || !payloads || !zbs) {
+        fprintf(stderr, "failed to allocate %d zero-copy buffers\n", depth);
+        rc = 1;
+        goto run_zcsend_exit;
+    }
+    memset(payloads, 'z', (size_t) depth * payload_len);
+    hdr_mr = zc_register(res, hdrs, depth * sizeof(struct msg_hdr_t));
+    payload_mr = zc_register(res, payloads, (size_t) depth * payload_len);
+    if (!hdr_mr || !payload_mr) {
         rc = 1;
-        goto resources_create_exit;
+        goto run_zcsend_exit;
     }
-    /* if there isn't any IB device in host */
-    if (!num_devices) {
-        fprintf(stderr, "found %d device(s)\n", num_devices);
+    for (i = 0; i < depth; i++) {
+        zbs[i].hdr = (char *) &hdrs[i];
+        zbs[i].hdr_len = sizeof(struct msg_hdr_t);
+        zbs[i].hdr_lkey = hdr_mr->lkey;
+        zbs[i].payload = payloads + (size_t) i * payload_len;
+        zbs[i].payload_len = payload_len;
+        zbs[i].payload_lkey = payload_mr->lkey;
+        zbs[i].cb = zc_send_done;
+        zbs[i].ctx = &errors;
+    }
+    if (ctrl_sync(res->sock, 'Z')) {
+        fprintf(stderr, "sync error before zero-copy sends\n");
         rc = 1;
-        goto resources_create_exit;
+        goto run_zcsend_exit;
     }
-    fprintf(stdout, "found %d device(s)\n", num_devices);
-    /* search for the specific device in device list */
-    for (i = 0; i < num_devices; i++) {
-        if (!config.dev_name) {
-            config.dev_name = strdup(ibv_get_device_name(dev_list[i]));
-            fprintf(stdout, "device not specified, using first one found: %s\n", config.dev_name);
+    {
+        /* zero-copy: header and payload are gathered straight from the caller's buffers */
+        auto start = std::chrono::high_resolution_clock::now();
+        for (i = 0; i < count; i++) {
+            struct zc_buf_t *zb = &zbs[i % depth];
+            /* only blocks while the HCA still owns this slot */
+            if (zc_wait(res, zb)) {
+                rc = 1;
+                goto run_zcsend_exit;
+            }
+            hdrs[i % depth].seq = i;
+            hdrs[i % depth].len = payload_len;
+            if (zc_post_send(res, zb)) {
+                rc = 1;
+                goto run_zcsend_exit;
+            }
         }
-        if (!strcmp(ibv_get_device_name(dev_list[i]), config.dev_name)) {
-            ib_dev = dev_list[i];
-            break;
+        for (i = 0; i < depth; i++) {
+            if (zc_wait(res, &zbs[i])) {
+                rc = 1;
+                goto run_zcsend_exit;
+            }
         }
+        auto end = std::chrono::high_resolution_clock::now();
+        double secs = std::chrono::duration<double>(end - start).count();
+        log_info("zero-copy send: %d messages of %u bytes in %.3f s, %.0f msg/s, %.2f MB/s\n", count, msg_len,
+                secs, count / secs, (double) count * msg_len / secs / 1e6);
+        emit_rate_result("zcsend", msg_len, depth, count, secs);
     }
-    /* if the device wasn't found in host */
-    if (!ib_dev) {
-        fprintf(stderr, "IB device %s wasn't found\n", config.dev_name);
-        rc = 1;
-        goto resources_create_exit;
+    /* staged: the same slots now point into res->buf and every message is copied there first */
+    for (i = 0; i < depth; i++) {
+        zbs[i].hdr = res->buf + (size_t) i * msg_len;
+        zbs[i].hdr_len = msg_len;
+        zbs[i].hdr_lkey = res->mr->lkey;
+        zbs[i].payload = NULL;
+        zbs[i].payload_len = 0;
     }
-    /* get device handle */
-    res->ib_ctx = ibv_open_device(ib_dev);
-    if (!res->ib_ctx) {
-        fprintf(stderr, "failed to open device %s\n", config.dev_name);
-        rc = 1;
-        goto resources_create_exit;
-    }
-    /* We are now done with device list, free it */
-    ibv_free_device_list(dev_list);
-    dev_list = NULL;
-    ib_dev = NULL;
-    /* query port properties */
-    if (ibv_query_port(res->ib_ctx, config.ib_port, &res->port_attr)) {
-        fprintf(stderr, "ibv_query_port on port %u failed\n", config.ib_port);
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (i = 0; i < count; i++) {
+            struct zc_buf_t *zb = &zbs[i % depth];
+            if (zc_wait(res, zb)) {
+                rc = 1;
+                goto run_zcsend_exit;
+            }
+            hdrs[i % depth].seq = i;
+            hdrs[i % depth].len = payload_len;
+            memcpy(zb->hdr, &hdrs[i % depth], sizeof(struct msg_hdr_t));
+            memcpy(zb->hdr + sizeof(struct msg_hdr_t), payloads + (size_t) (i % depth) * payload_len, payload_len);
+            if (zc_post_send(res, zb)) {
+                rc = 1;
+                goto run_zcsend_exit;
+            }
+        }
+        for (i = 0; i < depth; i++) {
+            if (zc_wait(res, &zbs[i])) {
+                rc = 1;
+                goto run_zcsend_exit;
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double secs = std::chrono::duration<double>(end - start).count();
+        log_info("staged send: %d messages of %u bytes in %.3f s, %.0f msg/s, %.2f MB/s\n", count, msg_len,
+                secs, count / secs, (double) count * msg_len / secs / 1e6);
+        emit_rate_result("zcsend-staged", msg_len, depth, count, secs);
+    }
+    if (errors) {
+        fprintf(stderr, "%d sends completed with errors\n", errors);
         rc = 1;
-        goto resources_create_exit;
+        goto run_zcsend_exit;
     }
-    /* allocate Protection Domain */
-    res->pd = ibv_alloc_pd(res->ib_ctx);
-    if (!res->pd) {
-        fprintf(stderr, "ibv_alloc_pd failed\n");
+    if (ctrl_sync(res->sock, 'Z')) {
+        fprintf(stderr, "sync error after zero-copy sends\n");
         rc = 1;
-        goto resources_create_exit;
     }
-    /* each side will send only one WR, so Completion Queue with 1 entry is enough */
-    cq_size = 1;
-    res->cq = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
-    if (!res->cq) {
-        fprintf(stderr, "failed to create CQ with %u entries\n", cq_size);
+run_zcsend_exit:
+    if (hdr_mr)
+        ibv_dereg_mr(hdr_mr);
+    if (payload_mr)
+        ibv_dereg_mr(payload_mr);
+    free(hdrs);
+    free(payloads);
+    free(zbs);
+    return rc;
+}
+
+int run_pingpong(struct resources *res, int count) {
+    uint32_t size = config.msg_size;
+    struct result_t result;
+    struct ibv_sge send_sge;
+    struct ibv_sge recv_sge;
+    struct rdma_op_t send_op;
+    struct rdma_op_t recv_op;
+    struct ibv_wc wc;
+    uint64_t *rtt;
+    int got_send;
+    int got_recv;
+    int rc = 0;
+    int i;
+    /* the first half of the buffer is sent, the reply lands in the second half */
+    send_sge.addr = (uintptr_t) res->buf;
+    send_sge.length = size;
+    send_sge.lkey = res->mr->lkey;
+    recv_sge.addr = (uintptr_t) (res->buf + size);
+    recv_sge.length = size;
+    recv_sge.lkey = res->mr->lkey;
+    memset(&send_op, 0, sizeof(send_op));
+    send_op.opcode = IBV_WR_SEND;
+    send_op.sg_list = &send_sge;
+    send_op.num_sge = 1;
+    send_op.send_flags = IBV_SEND_SIGNALED;
+    memset(&recv_op, 0, sizeof(recv_op));
+    recv_op.sg_list = &recv_sge;
+    recv_op.num_sge = 1;
+    rtt = (uint64_t *) malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+    if (!rtt) {
+        fprintf(stderr, "failed to malloc %d latency samples\n", count);
+        return 1;
+    }
+    /* the reply must find a receive already posted, datagrams are dropped otherwise */
+    if (post_receive_op(res, &recv_op)) {
+        fprintf(stderr, "failed to post RR\n");
         rc = 1;
-        goto resources_create_exit;
+        goto run_pingpong_exit;
     }
-    /* allocate the memory buffer that will hold the data */
-    size = MSG_SIZE;
-    res->buf = (char *) malloc(size);
-    if (!res->buf) {
-        fprintf(stderr, "failed to malloc %Zu bytes to memory buffer\n", size);
+    if (ctrl_sync(res->sock, 'P')) {
+        fprintf(stderr, "sync error before ping-pong\n");
         rc = 1;
-        goto resources_create_exit;
-    }
-    memset(res->buf, 0, size);
-    /* register the memory buffer */
-    mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-    res->mr = ibv_reg_mr(res->pd, res->buf, size, mr_flags);
-    if (!res->mr) {
-        fprintf(stderr, "ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
+        goto run_pingpong_exit;
+    }
+    for (i = 0; i < count; i++) {
+        *(uint64_t *) res->buf = i;
+        auto start = std::chrono::high_resolution_clock::now();
+        if (post_send_op(res, &send_op)) {
+            fprintf(stderr, "failed to post SR\n");
+            rc = 1;
+            goto run_pingpong_exit;
+        }
+        /* our send and the reply complete in either order */
+        got_send = got_recv = 0;
+        while (!got_send || !got_recv) {
+            if (poll_completion_quiet(res, &wc)) {
+                fprintf(stderr, "ping-pong failed at message %d\n", i);
+                rc = 1;
+                goto run_pingpong_exit;
+            }
+            if (wc.opcode & IBV_WC_RECV)
+                got_recv = 1;
+            else
+                got_send = 1;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        rtt[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        if (*(uint64_t *) (res->buf + size) != (uint64_t) i) {
+            fprintf(stderr, "reply %d carries the wrong sequence number\n", i);
+            rc = 1;
+            goto run_pingpong_exit;
+        }
+        if (i + 1 < count && post_receive_op(res, &recv_op)) {
+            fprintf(stderr, "failed to post RR\n");
+            rc = 1;
+            goto run_pingpong_exit;
+        }
+    }
+    log_info("%s ping-pong with %u byte messages\n", transport_name(config.qp_type), size);
+    result_init(&result, "pingpong", size, 1);
+    result.count = count;
+    result.has_latency = 1;
+    summarize_latency(rtt, count, &result.lat);
+    print_latency_summary("round-trip latency", &result.lat);
+    results_emit(&result);
+    if (ctrl_sync(res->sock, 'P')) {
+        fprintf(stderr, "sync error after ping-pong\n");
         rc = 1;
-        goto resources_create_exit;
     }
-    fprintf(stdout, "MR was registered with addr=%p, lkey=0x%x, rkey=0x%x, flags=0x%x\n", res->buf, res->mr->lkey, res->mr->rkey, mr_flags);
-    /* create the Queue Pair */
+run_pingpong_exit:
+    free(rtt);
+    return rc;
+}
+
+int run_bw(struct resources *res, int count, int opcode) {
+    uint32_t size = config.msg_size;
+    int depth = config.depth;
+    struct ibv_sge sge;
+    struct rdma_op_t op;
+    struct ibv_wc wc;
+    int posted = 0;
+    int completed = 0;
+    int slot;
+    sge.length = size;
+    sge.lkey = res->mr->lkey;
+    memset(&op, 0, sizeof(op));
+    op.opcode = opcode;
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    op.send_flags = IBV_SEND_SIGNALED;
+    op.rkey = res->remote_props.rkey;
+    if (ctrl_sync(res->sock, 'B')) {
+        fprintf(stderr, "sync error before bandwidth test\n");
+        return 1;
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    while (completed < count) {
+        /* keep the send queue full, every slot carries its sequence number so the receiver can spot losses */
+        while (posted < count && posted - completed < depth) {
+            slot = posted % depth;
+            sge.addr = (uintptr_t) (res->buf + (size_t) slot * size);
+            *(uint64_t *) (res->buf + (size_t) slot * size) = posted;
+            op.wr_id = slot;
+            /* a write leaves no trace at the receiver, so the sequence number also travels as immediate data */
+            op.remote_addr = res->remote_props.addr + (uint64_t) slot * size;
+            op.imm_data = htonl(posted);
+            if (post_send_op(res, &op)) {
+                fprintf(stderr, "failed to post SR %d\n", posted);
+                return 1;
+            }
+            posted++;
+        }
+        if (poll_completion_quiet(res, &wc)) {
+            fprintf(stderr, "send %d failed\n", completed);
+            return 1;
+        }
+        completed++;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double secs = std::chrono::duration<double>(end - start).count();
+    log_info("%s %s bandwidth: %d messages of %u bytes, depth %d, in %.3f s, %.0f msg/s, %.2f MB/s\n",
+            transport_name(config.qp_type), opcode == IBV_WR_SEND ? "send" : "write", count, size, depth, secs, count / secs, (double) count * size / secs / 1e6);
+    emit_rate_result(opcode == IBV_WR_SEND ? "bw" : "wbw", size, depth, count, secs);
+    if (ctrl_sync(res->sock, 'B')) {
+        fprintf(stderr, "sync error after bandwidth test\n");
+        return 1;
+    }
+    return 0;
+}
+
+int report_peer_footprint(struct resources *res, int peers) {
+    struct ibv_qp_init_attr qp_init_attr;
+    struct ibv_ah_attr ah_attr;
+    struct ibv_qp **qps;
+    struct ibv_ah **ahs;
+    size_t rss_before;
+    size_t rc_bytes;
+    size_t ud_bytes;
+    int rc_qps = 0;
+    int ud_ahs = 0;
+    int i;
+    qps = (struct ibv_qp **) calloc(peers, sizeof(struct ibv_qp *));
+    ahs = (struct ibv_ah **) calloc(peers, sizeof(struct ibv_ah *));
+    if (!qps || !ahs) {
+        fprintf(stderr, "failed to allocate footprint tables for %d peers\n", peers);
+        free(qps);
+        free(ahs);
+        return 1;
+    }
+    /* RC: one QP per peer, with the same capabilities as ours */
     memset(&qp_init_attr, 0, sizeof(qp_init_attr));
     qp_init_attr.qp_type = IBV_QPT_RC;
     qp_init_attr.sq_sig_all = 1;
     qp_init_attr.send_cq = res->cq;
     qp_init_attr.recv_cq = res->cq;
-    qp_init_attr.cap.max_send_wr = 1;
-    qp_init_attr.cap.max_recv_wr = 1;
-    qp_init_attr.cap.max_send_sge = 1;
-    qp_init_attr.cap.max_recv_sge = 1;
-    res->qp = ibv_create_qp(res->pd, &qp_init_attr);
-    if (!res->qp) {
-        fprintf(stderr, "failed to create QP\n");
+    qp_init_attr.cap = res->qp_cap;
+    rss_before = get_rss_bytes();
+    for (rc_qps = 0; rc_qps < peers; rc_qps++) {
+        qps[rc_qps] = ibv_create_qp(res->pd, &qp_init_attr);
+        if (!qps[rc_qps])
+            break;
+    }
+    rc_bytes = get_rss_bytes() - rss_before;
+    for (i = 0; i < rc_qps; i++)
+        ibv_destroy_qp(qps[i]);
+    /* UD: the one QP we already have plus an address handle per peer */
+    fill_ah_attr(&ah_attr, &config, res->remote_props.lid, res->remote_props.gid);
+    rss_before = get_rss_bytes();
+    for (ud_ahs = 0; ud_ahs < peers; ud_ahs++) {
+        ahs[ud_ahs] = ibv_create_ah(res->pd, &ah_attr);
+        if (!ahs[ud_ahs])
+            break;
+    }
+    ud_bytes = get_rss_bytes() - rss_before;
+    for (i = 0; i < ud_ahs; i++)
+        ibv_destroy_ah(ahs[i]);
+    log_info("footprint for %d peers (user space resident memory):\n", peers);
+    log_info("  rc: %d QPs, %zu bytes, %zu bytes per peer%s\n", rc_qps, rc_bytes,
+            rc_qps ? rc_bytes / rc_qps : 0, rc_qps < peers ? " (QP creation failed early)" : "");
+    log_info("  ud: 1 QP + %d AHs, %zu bytes, %zu bytes per peer%s\n", ud_ahs, ud_bytes,
+            ud_ahs ? ud_bytes / ud_ahs : 0, ud_ahs < peers ? " (AH creation failed early)" : "");
+    free(qps);
+    free(ahs);
+    return 0;
+}
+
+int run_connbench(int conns, int threads) {
+    struct resources *conn_res;
+    struct result_t result;
+    std::vector<struct setup_times_t> times;
+    std::vector<std::thread> pool;
+    std::atomic<int> next(0);
+    std::atomic<int> failed(0);
+    int rc = 0;
+    int i;
+    /* slot 0 is the connection set up on its own, the rest are set up in parallel */
+    conn_res = (struct resources *) calloc(conns + 1, sizeof(struct resources));
+    if (!conn_res) {
+        fprintf(stderr, "failed to allocate %d connections\n", conns);
+        return 1;
+    }
+    for (i = 0; i <= conns; i++)
+        resources_init(&conn_res[i], &config);
+    /* this one also resolves config.dev_name before the workers start */
+    if (resources_create(&conn_res[0]) || connect_qp(&conn_res[0])) {
+        fprintf(stderr, "failed to set up the first connection\n");
         rc = 1;
-        goto resources_create_exit;
+        goto run_connbench_exit;
     }
-    fprintf(stdout, "QP was created, QP number=0x%x\n", res->qp->qp_num);
-    resources_create_exit:
-    if (rc) {
-        /* Error encountered, cleanup */
-        if (res->qp) {
-            ibv_destroy_qp(res->qp);
-            res->qp = NULL;
+    print_setup_times("single connection setup", &conn_res[0].setup_times, 1);
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (i = 0; i < threads; i++) {
+            pool.emplace_back([&]() {
+                int n;
+                while ((n = next.fetch_add(1)) < conns) {
+                    if (resources_create(&conn_res[n + 1]) || connect_qp(&conn_res[n + 1]))
+                        failed++;
+                }
+            });
         }
-        if (res->mr) {
-            ibv_dereg_mr(res->mr);
-            res->mr = NULL;
+        for (auto &worker : pool)
+            worker.join();
+        auto end = std::chrono::high_resolution_clock::now();
+        double secs = std::chrono::duration<double>(end - start).count();
+        for (i = 1; i <= conns; i++)
+            times.push_back(conn_res[i].setup_times);
+        print_setup_times("parallel connection setup", times.data(), conns);
+        log_info("%d connections (%d failed) from %d threads in %.3f s, %.0f connections/s\n", conns,
+                failed.load(), threads, secs, (conns - failed.load()) / secs);
+        result_init(&result, "connbench", 0, 0);
+        result.threads = threads;
+        result.count = conns - failed.load();
+        result.secs = secs;
+        result.rc = failed.load() ? 1 : 0;
+        results_emit(&result);
+    }
+    if (failed.load())
+        rc = 1;
+run_connbench_exit:
+    /* the server tears its side down once our sockets are closed */
+    for (i = 0; i <= conns; i++) {
+        if (resources_destroy(&conn_res[i]))
+            rc = 1;
+    }
+    free(conn_res);
+    return rc;
+}
+
+int post_faulty(struct resources *res, int opcode) {
+    struct rdma_op_t op;
+    struct ibv_sge sge;
+    memset(&sge, 0, sizeof(sge));
+    sge.addr = (uintptr_t) res->buf;
+    sge.length = MSG_SIZE;
+    sge.lkey = res->mr->lkey;
+    /* a wrong rkey makes the responder NAK with a remote access error, which moves both QPs to ERR */
+    memset(&op, 0, sizeof(op));
+    op.opcode = opcode;
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    op.send_flags = IBV_SEND_SIGNALED;
+    op.remote_addr = res->remote_props.addr;
+    op.rkey = res->remote_props.rkey ^ 0xffff;
+    log_info("posting request with a bad rkey to inject an error\n");
+    return post_send_op(res, &op);
+}
+
+int request_recovery(struct resources *res) {
+    struct ctrl_hdr_t hdr;
+    char tag;
+    /* the server is waiting at the end-of-test barrier, a RECOVER there makes it join the recovery.
+     * Its SYNC is already on the wire, it sends it again once the QP is back */
+    if (ctrl_send(res->sock, CTRL_RECOVER, NULL, 0) || ctrl_recv(res->sock, &hdr, &tag, 1) ||
+        hdr.type != CTRL_SYNC) {
+        fprintf(stderr, "failed to request QP recovery\n");
+        return 1;
+    }
+    return recover_qp(res);
+}
+
+/* for the ops that keep one sample per request */
+void emit_latency_result(const char *op, const char *label, uint64_t *samples, int count) {
+    struct result_t r;
+    result_init(&r, op, config.msg_size, 1);
+    r.count = count;
+    r.has_latency = 1;
+    summarize_latency(samples, count, &r.lat);
+    print_latency_summary(label, &r.lat);
+    results_emit(&r);
+}
+
+/* for the ops that only measure how long all of their messages took */
+void emit_rate_result(const char *op, uint32_t size, int depth, int count, double secs) {
+    struct result_t r;
+    result_init(&r, op, size, depth);
+    r.count = count;
+    r.secs = secs;
+    results_emit(&r);
+}
+
+void fill_session(struct ctrl_session_t *session, const struct config_t *cfg, const char *op, int count) {
+    uint32_t flags = 0;
+    if (cfg->recover)
+        flags |= CTRL_F_RECOVER;
+    if (cfg->use_rdmacm)
+        flags |= CTRL_F_RDMACM;
+    memset(session, 0, sizeof(*session));
+    strncpy(session->op, op, CTRL_OP_LEN);
+    session->count = htonl(count);
+    session->msg_size = htonl(cfg->msg_size);
+    session->depth = htonl(cfg->depth);
+    session->max_sge = htonl(cfg->max_sge);
+    session->qp_type = htonl(cfg->qp_type);
+    session->chase_nodes = htonl(cfg->chase_nodes);
+    session->flags = htonl(flags);
+}
+
+int open_session(struct resources *res, const char *op, int count) {
+    struct ctrl_session_t session;
+    struct ctrl_accept_t accepted;
+    if (strlen(op) > CTRL_OP_LEN) {
+        fprintf(stderr, "operation name %s is too long\n", op);
+        return 1;
+    }
+    res->sock = sock_connect(res->cfg->server_name, res->cfg->tcp_port);
+    if (res->sock < 0) {
+        fprintf(stderr, "failed to establish control connection\n");
+        return 1;
+    }
+    /* the server sets itself up from what we ask for */
+    fill_session(&session, res->cfg, op, count);
+    if (ctrl_request_session(res->sock, &session, &accepted))
+        return 1;
+    log_debug("server accepted %s session, registered %" PRIu64 " bytes\n", op, accepted.buf_size);
+    return 0;
+}
+
+/* one request as the pool benchmark sees it: a single RDMA read of the server's message */
+static int pool_request(struct resources *res) {
+    struct ibv_wc wc;
+    if (post_read(res, res->remote_props.addr, MSG_SIZE) || poll_completion_quiet(res, &wc))
+        return 1;
+    if (wc.status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "pooled read failed with status 0x%x\n", wc.status);
+        return 1;
+    }
+    return 0;
+}
+
+int run_poolbench(int count, int spares) {
+    struct conn_pool_t pool;
+    struct ctrl_session_t session;
+    struct resources *res;
+    std::vector<uint64_t> samples(count);
+    uint64_t start;
+    int rc = 0;
+    int i;
+    /* baseline: every request pays for a whole connection setup and teardown */
+    for (i = 0; i < count; i++) {
+        start = now_ns();
+        res = (struct resources *) malloc(sizeof(struct resources));
+        if (!res) {
+            fprintf(stderr, "failed to allocate connection\n");
+            return 1;
         }
-        if (res->buf) {
-            free(res->buf);
-            res->buf = NULL;
+        resources_init(res, &config);
+        if (open_session(res, "pool", 0) || resources_create(res) || connect_qp(res) || pool_request(res)) {
+            fprintf(stderr, "connect-per-request failed at request %d\n", i);
+            resources_destroy(res);
+            free(res);
+            return 1;
         }
-        if (res->cq) {
-            ibv_destroy_cq(res->cq);
-            res->cq = NULL;
+        resources_destroy(res);
+        free(res);
+        samples[i] = now_ns() - start;
+    }
+    emit_latency_result("pool-connect", "connect per request", samples.data(), count);
+    fill_session(&session, &config, "pool", 0);
+    conn_pool_init(&pool, spares, &session, &config);
+    if (conn_pool_warm(&pool, config.server_name, config.tcp_port)) {
+        fprintf(stderr, "failed to warm up the connection pool\n");
+        conn_pool_destroy(&pool);
+        return 1;
+    }
+    results_mark();
+    for (i = 0; i < count; i++) {
+        start = now_ns();
+        res = conn_pool_get(&pool, config.server_name, config.tcp_port);
+        if (!res) {
+            rc = 1;
+            break;
         }
-        if (res->pd) {
-            ibv_dealloc_pd(res->pd);
-            res->pd = NULL;
+        /* an injected error leaves the QP in ERR, the next user gets it back reset */
+        if (i == config.inject_error) {
+            struct ibv_wc wc;
+            if (!post_faulty(res, IBV_WR_RDMA_READ))
+                poll_completion_quiet(res, &wc);
+        } else if (pool_request(res)) {
+            conn_pool_put(&pool, config.server_name, config.tcp_port, res);
+            rc = 1;
+            break;
         }
-        if (res->ib_ctx) {
-            ibv_close_device(res->ib_ctx);
-            res->ib_ctx = NULL;
+        conn_pool_put(&pool, config.server_name, config.tcp_port, res);
+        samples[i] = now_ns() - start;
+    }
+    if (!rc) {
+        emit_latency_result("pool-get", "pooled connection", samples.data(), count);
+        log_info("pool: %d spares, %d hits, %d misses, %d resets, %d recoveries\n", spares, pool.hits,
+                pool.misses, pool.resets, pool.recoveries);
+    }
+    /* the server tears its side of each connection down once our socket is closed */
+    conn_pool_destroy(&pool);
+    return rc;
+}
+
+int run_rdma_mt(struct resources *res, int count, int opcode, int threads) {
+    uint32_t size = config.msg_size;
+    int depth = config.depth;
+    std::vector<std::thread> workers;
+    std::atomic<int> issued(0);
+    std::atomic<int> completed(0);
+    std::atomic<int> inflight(0);
+    std::atomic<int> failed(0);
+    std::atomic<uint64_t> last_progress(now_ns());
+    int i;
+    /* every thread posts to and polls the one QP and CQ, a slot is claimed before its WR is posted */
+    auto worker = [&](int id) {
+        struct ibv_sge sge;
+        struct rdma_op_t op;
+        struct ibv_wc wc[16];
+        unsigned long spins = 0;
+        int cur;
+        int got;
+        int n;
+        sge.length = size;
+        sge.lkey = res->mr->lkey;
+        memset(&op, 0, sizeof(op));
+        op.opcode = opcode;
+        op.sg_list = &sge;
+        op.num_sge = 1;
+        op.send_flags = IBV_SEND_SIGNALED;
+        op.rkey = res->remote_props.rkey;
+        if (rt_tune_thread(&config, id))
+            failed = 1;
+        while (completed.load() < count && !failed.load()) {
+            cur = inflight.load();
+            if (cur < depth && inflight.compare_exchange_weak(cur, cur + 1)) {
+                n = issued.fetch_add(1);
+                if (n >= count) {
+                    inflight--;
+                } else {
+                    sge.addr = (uintptr_t) (res->buf + (size_t) (n % depth) * size);
+                    op.remote_addr = res->remote_props.addr + (uint64_t) (n % depth) * size;
+                    op.wr_id = n;
+                    if (post_send_op(res, &op)) {
+                        fprintf(stderr, "failed to post SR %d\n", n);
+                        failed = 1;
+                    }
+                }
+            }
+            got = ibv_poll_cq(res->cq, 16, wc);
+            if (got < 0) {
+                fprintf(stderr, "poll CQ failed\n");
+                failed = 1;
+            }
+            for (int k = 0; k < got; k++) {
+                if (wc[k].status != IBV_WC_SUCCESS) {
+                    fprintf(stderr, "WR %" PRIu64 " failed with status 0x%x\n", wc[k].wr_id, wc[k].status);
+                    failed = 1;
+                }
+            }
+            if (got > 0) {
+                completed += got;
+                inflight -= got;
+                last_progress = now_ns();
+            } else if ((++spins & 4095) == 0 &&
+                       now_ns() - last_progress.load() > (uint64_t) MAX_POLL_CQ_TIMEOUT * 1000000) {
+                fprintf(stderr, "completion wasn't found in the CQ after timeout\n");
+                failed = 1;
+            }
+        }
+    };
+    for (i = 0; i < threads; i++)
+        workers.emplace_back(worker, i);
+    for (auto &w : workers)
+        w.join();
+    return failed.load();
+}
+
+int run_scenario(struct resources *res, const struct scenario_t *sc) {
+    std::vector<struct scenario_result_t> results;
+    struct ctrl_session_t step;
+    struct ctrl_accept_t accepted;
+    struct scenario_result_t r;
+    uint64_t start;
+    int aborted = 0;
+    int failed = 0;
+    for (auto &op : sc->ops) {
+        for (uint32_t size : sc->sizes) {
+            for (int depth : sc->depths) {
+                for (int threads : sc->threads) {
+                    int one_sided = op == "read" || op == "write";
+                    memset(&r, 0, sizeof(r));
+                    strncpy(r.op, op.c_str(), CTRL_OP_LEN);
+                    r.size = size;
+                    r.depth = depth;
+                    r.threads = threads;
+                    r.count = sc->iterations;
+                    if (aborted)
+                        r.note = "skipped, an earlier step failed";
+                    else if (threads > 1 && !one_sided)
+                        r.note = "skipped, only read and write use more than one thread";
+                    else if ((op == "read" && config.qp_type != IBV_QPT_RC) ||
+                             (op == "write" && config.qp_type == IBV_QPT_UD))
+                        r.note = "skipped, not supported by the transport";
+                    if (r.note) {
+                        results.push_back(r);
+                        continue;
+                    }
+                    /* the two-sided ops carry a sequence number in every message */
+                    config.msg_size = one_sided || size >= sizeof(uint64_t) ? size : sizeof(uint64_t);
+                    config.depth = depth;
+                    fill_session(&step, &config, op.c_str(), r.count);
+                    log_debug("step: %s, %u bytes, depth %d, %d threads\n", r.op, size, depth, threads);
+                    if (ctrl_request_step(res->sock, &step, &accepted)) {
+                        r.rc = 1;
+                        aborted = 1;
+                        failed++;
+                        results.push_back(r);
+                        continue;
+                    }
+                    results_mark();
+                    start = now_ns();
+                    if (one_sided)
+                        r.rc = run_rdma_mt(res, r.count, op == "read" ? IBV_WR_RDMA_READ : IBV_WR_RDMA_WRITE, threads)
+                               || ctrl_sync(res->sock, 'S');
+                    else if (op == "pingpong")
+                        r.rc = run_pingpong(res, r.count);
+                    else
+                        r.rc = run_bw(res, r.count, op == "bw" ? IBV_WR_SEND : IBV_WR_RDMA_WRITE_WITH_IMM);
+                    r.secs = (now_ns() - start) / 1e9;
+                    /* pingpong and bw emit their own results */
+                    if (one_sided) {
+                        struct result_t out;
+                        result_init(&out, r.op, size, depth);
+                        out.threads = threads;
+                        out.count = r.count;
+                        out.secs = r.secs;
+                        out.rc = r.rc;
+                        results_emit(&out);
+                    }
+                    /* a failed step leaves the QP or the server somewhere we can't continue from */
+                    if (r.rc) {
+                        aborted = 1;
+                        failed++;
+                    }
+                    results.push_back(r);
+                }
+            }
+        }
+    }
+    if (!aborted && ctrl_send(res->sock, CTRL_END, NULL, 0))
+        failed++;
+    print_scenario_results(results);
+    return failed ? 1 : 0;
+}
+
+/*
+ * Operations are due on a schedule of their own, a completion never delays the next one. Latency is taken
+ * from when an op was due rather than from when it got posted, so the time it spent waiting for a free
+ * slot is counted instead of silently lowering the offered load.
+ */
+int run_openloop(struct resources *res, int count, int opcode, double rate, enum arrival_dist dist,
+                 struct load_point_t *pt) {
+    uint32_t size = res->cfg->msg_size;
+    int depth = res->cfg->depth;
+    std::vector<uint64_t> due(depth);
+    std::vector<uint64_t> posted(depth);
+    std::vector<int> free_slots;
+    struct arrival_t arrival;
+    struct ibv_sge sge;
+    struct rdma_op_t op;
+    struct ibv_wc wc[16];
+    uint64_t start, next_due, now, last_progress;
+    unsigned long spins = 0;
+    int issued = 0;
+    int completed = 0;
+    int stalled = -1;
+    int slot;
+    int got;
+    int i;
+    for (i = depth - 1; i >= 0; i--)
+        free_slots.push_back(i);
+    histogram_init(&pt->response);
+    histogram_init(&pt->service);
+    pt->offered = rate;
+    pt->count = count;
+    pt->backlogged = 0;
+    arrival_init(&arrival, dist, rate);
+    sge.length = size;
+    sge.lkey = res->mr->lkey;
+    memset(&op, 0, sizeof(op));
+    op.opcode = opcode;
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    op.send_flags = IBV_SEND_SIGNALED;
+    op.rkey = res->remote_props.rkey;
+    start = now_ns();
+    next_due = start;
+    last_progress = start;
+    while (completed < count) {
+        now = now_ns();
+        while (issued < count && next_due <= now && !free_slots.empty()) {
+            slot = free_slots.back();
+            free_slots.pop_back();
+            sge.addr = (uintptr_t) (res->buf + (size_t) slot * size);
+            op.remote_addr = res->remote_props.addr + (uint64_t) slot * size;
+            op.wr_id = slot;
+            due[slot] = next_due;
+            posted[slot] = now_ns();
+            if (post_send_op(res, &op)) {
+                fprintf(stderr, "failed to post SR %d\n", issued);
+                return 1;
+            }
+            issued++;
+            next_due += arrival_next(&arrival);
+        }
+        /* the op that is due now has to wait for a completion */
+        if (issued < count && next_due <= now && free_slots.empty() && stalled != issued) {
+            stalled = issued;
+            pt->backlogged++;
+        }
+        got = ibv_poll_cq(res->cq, 16, wc);
+        if (got < 0) {
+            fprintf(stderr, "poll CQ failed\n");
+            return 1;
         }
-        if (dev_list) {
-            ibv_free_device_list(dev_list);
-            dev_list = NULL;
+        now = now_ns();
+        for (i = 0; i < got; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "WR %" PRIu64 " failed with status 0x%x\n", wc[i].wr_id, wc[i].status);
+                return 1;
+            }
+            slot = (int) wc[i].wr_id;
+            histogram_record(&pt->response, now - due[slot]);
+            histogram_record(&pt->service, now - posted[slot]);
+            free_slots.push_back(slot);
         }
-        if (res->sock >= 0) {
-            if (close(res->sock))
-                fprintf(stderr, "failed to close socket\n");
-            res->sock = -1;
+        if (got > 0) {
+            completed += got;
+            last_progress = now;
+        } else if (issued > completed && (++spins & 4095) == 0 &&
+                   now - last_progress > (uint64_t) MAX_POLL_CQ_TIMEOUT * 1000000) {
+            fprintf(stderr, "completion wasn't found in the CQ after timeout\n");
+            return 1;
         }
     }
-    return rc;
+    pt->secs = (now_ns() - start) / 1e9;
+    pt->achieved = count / pt->secs;
+    return 0;
+}
+
+static int load_opcode(const char *name, int *opcode) {
+    if (!strcmp(name, "read")) {
+        *opcode = IBV_WR_RDMA_READ;
+    } else if (!strcmp(name, "write")) {
+        *opcode = IBV_WR_RDMA_WRITE;
+    } else {
+        fprintf(stderr, "the open loop issues read or write, not %s\n", name);
+        return 1;
+    }
+    return 0;
 }
 
-int resources_destroy(struct resources *res) {
+/* one open-loop run per offered load, over the one connection */
+int run_load_sweep(struct resources *res, int count) {
+    std::vector<double> rates;
+    std::vector<struct load_point_t> points;
+    struct latency_stats_t response;
+    struct latency_stats_t service;
+    enum arrival_dist dist;
+    struct result_t result;
+    char op_name[CTRL_OP_LEN + 1];
+    int opcode;
     int rc = 0;
-    if (res->qp)
-        if (ibv_destroy_qp(res->qp))
-        {
-            fprintf(stderr, "failed to destroy QP\n");
+    if (!config.rates || parse_rates(config.rates, &rates)) {
+        fprintf(stderr, "openloop needs --rate with a list of offered loads\n");
+        return 1;
+    }
+    if (parse_arrival(config.arrival, &dist)) {
+        fprintf(stderr, "unknown arrival distribution %s\n", config.arrival);
+        return 1;
+    }
+    if (load_opcode(config.load_op, &opcode))
+        return 1;
+    snprintf(op_name, sizeof(op_name), "open-%s", config.load_op);
+    points.resize(rates.size());
+    for (size_t i = 0; i < rates.size(); i++) {
+        struct load_point_t *pt = &points[i];
+        if (run_openloop(res, count, opcode, rates[i], dist, pt)) {
             rc = 1;
+            points.resize(i);
+            break;
         }
-    if (res->mr)
-        if (ibv_dereg_mr(res->mr))
-        {
-            fprintf(stderr, "failed to deregister MR\n");
-            rc = 1;
+        histogram_summarize(&pt->response, &response);
+        histogram_summarize(&pt->service, &service);
+        log_info("offered %.0f ops/s (%s): achieved %.0f ops/s, %d of %d ops found every slot busy\n",
+                 pt->offered, arrival_name(dist), pt->achieved, pt->backlogged, count);
+        print_latency_summary("  response time, from when due", &response);
+        print_latency_summary("  service time, from when posted", &service);
+        result_init(&result, op_name, config.msg_size, config.depth);
+        result.count = count;
+        result.secs = pt->secs;
+        result.offered = pt->offered;
+        result.has_latency = 1;
+        result.lat = response;
+        results_emit(&result);
+    }
+    log_info("%12s %12s %10s %10s %10s %10s\n", "offered/s", "achieved/s", "p50 ns", "p99 ns", "p99.9 ns",
+             "busy");
+    for (auto &pt : points) {
+        log_info("%12.0f %12.0f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10d\n", pt.offered, pt.achieved,
+                 histogram_percentile(&pt.response, 0.50), histogram_percentile(&pt.response, 0.99),
+                 histogram_percentile(&pt.response, 0.999), pt.backlogged);
+    }
+    return rc;
+}
+
+/*
+ * Binary search on offered load for the highest one whose response time at the connection's
+ * slo_percentile stays under its slo_ns. A load only passes if the open loop also kept up with it.
+ */
+int search_capacity(struct resources *res, int count, int opcode, enum arrival_dist dist, struct capacity_t *cap) {
+    struct load_point_t pt;
+    double q = res->cfg->slo_percentile / 100;
+    double lo = 0;
+    double hi;
+    double mid;
+    uint64_t at;
+    memset(&cap->lat, 0, sizeof(cap->lat));
+    cap->capacity = 0;
+    cap->at_percentile = 0;
+    /* everything due at once, the most the QP does at this depth bounds the search */
+    if (run_openloop(res, count, opcode, 1e12, ARRIVAL_CONSTANT, &pt))
+        return 1;
+    cap->saturation = pt.achieved;
+    cap->probes = 1;
+    hi = pt.achieved;
+    while (cap->probes < 16 && hi - lo > hi * 0.02) {
+        mid = (lo + hi) / 2;
+        if (run_openloop(res, count, opcode, mid, dist, &pt))
+            return 1;
+        cap->probes++;
+        at = histogram_percentile(&pt.response, q);
+        log_debug("  %.0f ops/s offered, %.0f achieved, p%g %" PRIu64 " ns\n", mid, pt.achieved,
+                  res->cfg->slo_percentile, at);
+        if (at <= res->cfg->slo_ns && pt.achieved >= mid * 0.95) {
+            lo = mid;
+            cap->capacity = mid;
+            cap->at_percentile = at;
+            histogram_summarize(&pt.response, &cap->lat);
+        } else {
+            hi = mid;
         }
-    if (res->buf)
-        free(res->buf);
-    if (res->cq)
-        if (ibv_destroy_cq(res->cq))
-        {
-            fprintf(stderr, "failed to destroy CQ\n");
-            rc = 1;
+    }
+    return 0;
+}
+
+/* a capacity per transport and message size, each transport over a connection of its own */
+int run_capacity_search(int count) {
+    std::vector<uint32_t> sizes;
+    std::vector<enum ibv_qp_type> transports;
+    struct capacity_t cap;
+    struct result_t result;
+    enum arrival_dist dist;
+    enum ibv_qp_type qp_type;
+    char op_name[CTRL_OP_LEN + 1];
+    char buf[256];
+    char *name;
+    char *save;
+    int opcode;
+    int rc = 0;
+    if (!config.slo_ns) {
+        fprintf(stderr, "slo needs a latency bound, --slo\n");
+        return 1;
+    }
+    if (config.slo_percentile <= 0 || config.slo_percentile >= 100) {
+        fprintf(stderr, "invalid percentile %g\n", config.slo_percentile);
+        return 1;
+    }
+    if (parse_arrival(config.arrival, &dist)) {
+        fprintf(stderr, "unknown arrival distribution %s\n", config.arrival);
+        return 1;
+    }
+    if (load_opcode(config.load_op, &opcode))
+        return 1;
+    if (!config.sizes)
+        sizes.push_back(config.msg_size);
+    else if (parse_sizes(config.sizes, &sizes)) {
+        fprintf(stderr, "invalid size list %s\n", config.sizes);
+        return 1;
+    }
+    if (!config.transports) {
+        transports.push_back(config.qp_type);
+    } else {
+        snprintf(buf, sizeof(buf), "%s", config.transports);
+        for (name = strtok_r(buf, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+            if (parse_transport(name, &qp_type)) {
+                fprintf(stderr, "unknown transport %s\n", name);
+                return 1;
+            }
+            transports.push_back(qp_type);
         }
-    if (res->pd)
-        if (ibv_dealloc_pd(res->pd))
-        {
-            fprintf(stderr, "failed to deallocate PD\n");
-            rc = 1;
+    }
+    snprintf(op_name, sizeof(op_name), "slo-%s", config.load_op);
+    log_info("%-4s %10s %14s %14s %12s %12s %7s\n", "qp", "size", "saturation/s", "capacity/s", "MB/s",
+             "at bound ns", "probes");
+    for (enum ibv_qp_type t : transports) {
+        /* reads need RC, writes anything but UD */
+        if (t == IBV_QPT_UD || (opcode == IBV_WR_RDMA_READ && t != IBV_QPT_RC)) {
+            log_info("%-4s %10s  skipped, %s doesn't support %s\n", transport_name(t), "-", transport_name(t),
+                     config.load_op);
+            continue;
         }
-    if (res->ib_ctx)
-        if (ibv_close_device(res->ib_ctx))
-        {
-            fprintf(stderr, "failed to close device context\n");
-            rc = 1;
+        /* every transport gets a connection of its own, with buffers on both sides sized for the largest message */
+        rdma::Endpoint ep(config);
+        struct resources *res = ep.res();
+        ep.config()->qp_type = t;
+        ep.config()->msg_size = *std::max_element(sizes.begin(), sizes.end());
+        ep.config()->buf_size = (size_t) ep.config()->depth * ep.config()->msg_size;
+        if (open_session(res, "openloop", count) || ep.open(res->sock) || ep.connect()) {
+            fprintf(stderr, "failed to connect over %s\n", transport_name(t));
+            return 1;
         }
-    if (res->sock >= 0)
-        if (close(res->sock))
-        {
-            fprintf(stderr, "failed to close socket\n");
-            rc = 1;
+        results_context(config.dev_name, config.ib_port, &res->port_attr, transport_name(t));
+        results_mark();
+        for (uint32_t size : sizes) {
+            ep.config()->msg_size = size;
+            if (search_capacity(res, count, opcode, dist, &cap)) {
+                rc = 1;
+                break;
+            }
+            log_info("%-4s %10u %14.0f %14.0f %12.2f %12" PRIu64 " %7d%s\n", transport_name(t), size,
+                     cap.saturation, cap.capacity, cap.capacity * size / 1e6, cap.at_percentile, cap.probes,
+                     cap.capacity > 0 ? "" : "  bound not met at any load");
+            result_init(&result, op_name, size, config.depth);
+            result.count = count;
+            result.offered = cap.capacity;
+            result.secs = cap.capacity > 0 ? count / cap.capacity : 0;
+            result.has_latency = cap.capacity > 0;
+            result.lat = cap.lat;
+            /* the CPU of every probe of the search goes with its result */
+            result.cpu_ops = (uint64_t) count * cap.probes;
+            results_emit(&result);
         }
+        if (!rc && ctrl_sync(res->sock, 'O'))
+            rc = 1;
+        if (ep.close())
+            rc = 1;
+        if (rc)
+            break;
+    }
     return rc;
 }
 
-int connect_qp(struct resources *res) {
-    struct cm_con_data_t local_con_data;
-    struct cm_con_data_t remote_con_data;
-    struct cm_con_data_t tmp_con_data;
-    int rc = 0;
-    char temp_char;
-    union ibv_gid my_gid;
-    if (config.gid_idx >= 0) {
-        rc = ibv_query_gid(res->ib_ctx, config.ib_port, config.gid_idx, &my_gid);
-        if (rc) {
-            fprintf(stderr, "could not get gid for port %d, index %d\n", config.ib_port, config.gid_idx);
-            goto connect_qp_exit;
+/*
+ * Streams one-sided ops with the knobs in t. wr_id is the op's index, a signaled completion stands for
+ * every op posted before it, so the unsignaled ones free their slots together with it.
+ */
+int run_stream(struct resources *res, int count, int opcode, const struct tune_t *t, double *secs) {
+    uint32_t size = config.msg_size;
+    struct rdma_op_t ops[MAX_POST_BATCH];
+    struct ibv_sge sges[MAX_POST_BATCH];
+    struct ibv_wc wc[64];
+    uint64_t start, last_progress;
+    unsigned long spins = 0;
+    int issued = 0;
+    int completed = 0;
+    int got;
+    int n;
+    int i;
+    if (t->depth < 1 || t->post_batch < 1 || t->post_batch > std::min(t->depth, MAX_POST_BATCH) ||
+        t->signal_every < 1 || t->signal_every > t->depth || t->poll_batch < 1 || t->poll_batch > 64) {
+        fprintf(stderr, "invalid stream settings: depth %d, signal every %d, post batch %d, poll batch %d\n",
+                t->depth, t->signal_every, t->post_batch, t->poll_batch);
+        return 1;
+    }
+    if (t->signal_every > 1 && !config.selective_signal) {
+        fprintf(stderr, "the QP signals every WR, it wasn't created for a signal interval\n");
+        return 1;
+    }
+    if (t->inline_data && (opcode != IBV_WR_RDMA_WRITE || size > res->qp_cap.max_inline_data)) {
+        fprintf(stderr, "inline data needs writes of at most %u bytes\n", res->qp_cap.max_inline_data);
+        return 1;
+    }
+    memset(ops, 0, sizeof(ops));
+    for (i = 0; i < MAX_POST_BATCH; i++) {
+        sges[i].length = size;
+        sges[i].lkey = res->mr->lkey;
+        ops[i].opcode = opcode;
+        ops[i].sg_list = &sges[i];
+        ops[i].num_sge = 1;
+        ops[i].rkey = res->remote_props.rkey;
+    }
+    start = now_ns();
+    last_progress = start;
+    while (completed < count) {
+        while ((n = std::min(std::min(t->post_batch, count - issued), t->depth - (issued - completed))) > 0) {
+            for (i = 0; i < n; i++) {
+                int idx = issued + i;
+                int slot = idx % t->depth;
+                sges[i].addr = (uintptr_t) (res->buf + (size_t) slot * size);
+                ops[i].remote_addr = res->remote_props.addr + (uint64_t) slot * size;
+                ops[i].wr_id = idx;
+                ops[i].send_flags = t->inline_data ? IBV_SEND_INLINE : 0;
+                /* the last op is always signaled so the stream can drain */
+                if ((idx + 1) % t->signal_every == 0 || idx + 1 == count)
+                    ops[i].send_flags |= IBV_SEND_SIGNALED;
+            }
+            if (post_send_batch(res, ops, n)) {
+                fprintf(stderr, "failed to post %d SRs at %d\n", n, issued);
+                return 1;
+            }
+            issued += n;
+        }
+        got = ibv_poll_cq(res->cq, t->poll_batch, wc);
+        if (got < 0) {
+            fprintf(stderr, "poll CQ failed\n");
+            return 1;
+        }
+        for (i = 0; i < got; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "WR %" PRIu64 " failed with status 0x%x\n", wc[i].wr_id, wc[i].status);
+                return 1;
+            }
+            completed = (int) wc[i].wr_id + 1;
+        }
+        if (got > 0) {
+            last_progress = now_ns();
+        } else if ((++spins & 4095) == 0 && now_ns() - last_progress > (uint64_t) MAX_POLL_CQ_TIMEOUT * 1000000) {
+            fprintf(stderr, "completion wasn't found in the CQ after timeout\n");
+            return 1;
         }
-    } else {
-        memset(&my_gid, 0, sizeof my_gid);
-    }
-    /* exchange using TCP sockets info required to connect QPs */
-    local_con_data.addr = htonll((uintptr_t) res->buf);
-    local_con_data.rkey = htonl(res->mr->rkey);
-    local_con_data.qp_num = htonl(res->qp->qp_num);
-    local_con_data.lid = htons(res->port_attr.lid);
-    memcpy(local_con_data.gid, &my_gid, 16);
-    fprintf(stdout, "\nLocal LID = 0x%x\n", res->port_attr.lid);
-    if (sock_sync_data(res->sock, sizeof(struct cm_con_data_t), (char *) &local_con_data, (char *) &tmp_con_data) < 0) {
-        fprintf(stderr, "failed to exchange connection data between sides\n");
-        rc = 1;
-        goto connect_qp_exit;
-    }
-    remote_con_data.addr = ntohll(tmp_con_data.addr);
-    remote_con_data.rkey = ntohl(tmp_con_data.rkey);
-    remote_con_data.qp_num = ntohl(tmp_con_data.qp_num);
-    remote_con_data.lid = ntohs(tmp_con_data.lid);
-    memcpy(remote_con_data.gid, tmp_con_data.gid, 16);
-    res->remote_props = remote_con_data;
-    fprintf(stdout, "Remote address = 0x%" PRIx64 "\n", remote_con_data.addr);
-    fprintf(stdout, "Remote rkey = 0x%x\n", remote_con_data.rkey);
-    fprintf(stdout, "Remote QP number = 0x%x\n", remote_con_data.qp_num);
-    fprintf(stdout, "Remote LID = 0x%x\n", remote_con_data.lid);
-    if (config.gid_idx >= 0) {
-        uint8_t *p = remote_con_data.gid;
-        fprintf(stdout, "Remote GID = %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:"
-                        "%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
-                p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
-                p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
-    }
-    /* modify the QP to init */
-    rc = modify_qp_to_init(res->qp);
-    if (rc) {
-        fprintf(stderr, "failed to modify QP state to INIT\n");
-        goto connect_qp_exit;
-    }
-    /* modify the QP to RTR */
-    rc = modify_qp_to_rtr(res->qp, remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid);
-    if (rc)
-    {
-        fprintf(stderr, "failed to modify QP state to RTR\n");
-        goto connect_qp_exit;
     }
-    rc = modify_qp_to_rts(res->qp);
-    if (rc)
-    {
-        fprintf(stderr, "failed to modify QP state to RTR\n");
-        goto connect_qp_exit;
+    *secs = (now_ns() - start) / 1e9;
+    return 0;
+}
+
+/* the stream with the settings --profile has for this size, or one WR at a time signaling each */
+int run_stream_op(struct resources *res, int count) {
+    std::vector<struct tune_entry_t> profile;
+    struct tune_t t;
+    char op_name[CTRL_OP_LEN + 1];
+    double secs;
+    int opcode;
+    if (load_opcode(config.load_op, &opcode))
+        return 1;
+    tune_defaults(&t, config.depth);
+    if (config.profile && (load_profile(config.profile, &profile) || profile_lookup(profile, config.msg_size, &t)))
+        return 1;
+    if (t.depth > config.depth) {
+        fprintf(stderr, "profile asks for depth %d, the QP was created for %d\n", t.depth, config.depth);
+        return 1;
     }
-    fprintf(stdout, "QP state was change to RTS\n");
-    /* sync to make sure that both sides are in states that they can connect to prevent packet loose */
-    if (sock_sync_data(res->sock, 1, "Q", &temp_char)) /* just send a dummy char back and forth */
-    {
-        fprintf(stderr, "sync error after QPs are were moved to RTS\n");
-        rc = 1;
+    log_info("stream: depth %d, signal every %d, inline %s, post batch %d, poll batch %d\n", t.depth,
+             t.signal_every, t.inline_data ? "on" : "off", t.post_batch, t.poll_batch);
+    if (run_stream(res, count, opcode, &t, &secs))
+        return 1;
+    log_info("%s %s stream: %d ops of %u bytes in %.3f s, %.0f ops/s, %.2f MB/s\n",
+             transport_name(config.qp_type), config.load_op, count, config.msg_size, secs, count / secs,
+             (double) count * config.msg_size / secs / 1e6);
+    snprintf(op_name, sizeof(op_name), "stream-%s", config.load_op);
+    emit_rate_result(op_name, config.msg_size, t.depth, count, secs);
+    return 0;
+}
+
+/* the best stream settings for every --sizes entry, written to --profile */
+int run_autotune(struct resources *res, int count, const std::vector<uint32_t> &sizes) {
+    std::vector<struct tune_entry_t> entries;
+    std::vector<struct tune_point_t> measured;
+    std::vector<struct tune_point_t> frontier;
+    struct tune_limits_t lim;
+    struct tune_entry_t best;
+    struct result_t result;
+    char header[256];
+    int opcode;
+    if (load_opcode(config.load_op, &opcode))
+        return 1;
+    lim.max_depth = config.depth;
+    /* reads bring their data back, there is nothing to inline */
+    lim.max_inline = opcode == IBV_WR_RDMA_WRITE ? res->qp_cap.max_inline_data : 0;
+    auto measure = [&](const struct tune_t *t, double *msg_per_s) -> int {
+        double secs;
+        if (run_stream(res, count, opcode, t, &secs))
+            return 1;
+        *msg_per_s = count / secs;
+        return 0;
+    };
+    log_info("%10s %6s %7s %7s %6s %6s %14s %12s %9s\n", "size", "depth", "signal", "inline", "post", "poll",
+             "msg/s", "MB/s", "measured");
+    for (uint32_t size : sizes) {
+        config.msg_size = size;
+        if (autotune_size(size, &lim, measure, &best, &measured))
+            return 1;
+        entries.push_back(best);
+        log_info("%10u %6d %7d %7s %6d %6d %14.0f %12.2f %9zu\n", size, best.t.depth, best.t.signal_every,
+                 best.t.inline_data ? "on" : "off", best.t.post_batch, best.t.poll_batch, best.msg_per_s,
+                 best.msg_per_s * size / 1e6, measured.size());
+        tune_frontier(measured, &frontier);
+        for (auto &p : frontier)
+            log_debug("  frontier: depth %d, %.0f msg/s\n", p.t.depth, p.msg_per_s);
+        result_init(&result, "autotune", size, best.t.depth);
+        result.count = count;
+        result.secs = count / best.msg_per_s;
+        /* the CPU of every setting tried goes with the best one */
+        result.cpu_ops = (uint64_t) count * measured.size();
+        results_emit(&result);
     }
-connect_qp_exit:
-    return rc;
+    if (!config.profile)
+        return 0;
+    snprintf(header, sizeof(header), "autotune profile: %s port %d, %s, %s, up to depth %d", config.dev_name,
+             config.ib_port, transport_name(config.qp_type), config.load_op, config.depth);
+    if (save_profile(config.profile, header, entries))
+        return 1;
+    log_info("profile written to %s\n", config.profile);
+    return 0;
 }
 
-int sock_sync_data(int sock, int xfer_size, char *local_data, char *remote_data) {
+/* logical ops one after the other until count of them are done, each on the slot of its index */
+static rdma::Task coro_worker(rdma::AsyncEndpoint *ep, int opcode, int count, int *next, uint64_t *lat_ns) {
+    uint32_t size = ep->res()->cfg->msg_size;
+    int depth = ep->res()->cfg->depth;
+    int n;
+    while ((n = (*next)++) < count) {
+        size_t off = (size_t) (n % depth) * size;
+        uint64_t start = now_ns();
+        int rc;
+        if (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD)
+            rc = co_await ep->fetch_add(off, off, 1);
+        else if (opcode == IBV_WR_RDMA_READ)
+            rc = co_await ep->read(off, off, size);
+        else
+            rc = co_await ep->write(off, off, size);
+        if (rc)
+            co_return 1;
+        lat_ns[n] = now_ns() - start;
+    }
+    co_return 0;
+}
+
+/*
+ * config.coros coroutines on this thread share count ops over the one QP, the reactor posts at most depth
+ * of them at once. The same ops from the hand-written loop at the same depth show what the coroutines cost.
+ */
+int run_coro(struct resources *res, int count) {
+    std::vector<uint64_t> lat_ns(count > 0 ? count : 0);
+    struct result_t result;
+    struct tune_t t;
+    char op_name[CTRL_OP_LEN + 1];
+    double secs, loop_secs;
+    uint64_t start;
+    int next = 0;
+    int opcode;
     int rc;
-    int read_bytes = 0;
-    int total_read_bytes = 0;
-    rc = write(sock, local_data, xfer_size);
-    if (rc < xfer_size) {
-        fprintf(stderr, "failed to send data during sock_sync_data\n");
-    } else {
-        rc = 0;
+    int i;
+    if (count <= 0 || config.coros <= 0) {
+        fprintf(stderr, "the coroutine benchmark needs a positive number of ops and coroutines\n");
+        return 1;
     }
-    while (!rc && total_read_bytes < xfer_size) {
-        read_bytes = read(sock, remote_data, xfer_size);
-        if (read_bytes > 0){
-            total_read_bytes += read_bytes;
-        } else {
-            rc = read_bytes;
+    if (!strcmp(config.load_op, "fadd")) {
+        opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+        if (config.msg_size % sizeof(uint64_t)) {
+            fprintf(stderr, "fetch-and-add needs slots aligned to 8 bytes, not %u\n", config.msg_size);
+            return 1;
         }
+    } else if (load_opcode(config.load_op, &opcode)) {
+        return 1;
     }
-    return rc;
+    {
+        rdma::Reactor reactor;
+        rdma::AsyncEndpoint ep(reactor, res);
+        for (i = 0; i < config.coros; i++)
+            reactor.spawn(coro_worker(&ep, opcode, count, &next, lat_ns.data()));
+        start = now_ns();
+        rc = reactor.run();
+        secs = (now_ns() - start) / 1e9;
+        if (rc)
+            return 1;
+        const struct rdma::reactor_stats_t &st = reactor.stats();
+        log_info("%d coroutines, %d %s ops of %u bytes in %.3f s, %.0f ops/s\n", config.coros, count,
+                 config.load_op, config.msg_size, secs, count / secs);
+        log_info("at most %d ops waited for one of the %d WR slots, %" PRIu64 " polls (%.1f%% empty)\n",
+                 st.max_waiting, config.depth, st.polls, st.polls ? 100.0 * st.empty_polls / st.polls : 0);
+    }
+    snprintf(op_name, sizeof(op_name), "coro-%s", config.load_op);
+    result_init(&result, op_name, opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ? sizeof(uint64_t) : config.msg_size,
+                config.depth);
+    result.threads = 1;
+    result.count = count;
+    result.secs = secs;
+    result.has_latency = 1;
+    summarize_latency(lat_ns.data(), count, &result.lat);
+    print_latency_summary("coroutine op latency, queueing included", &result.lat);
+    results_emit(&result);
+    /* run_stream() only does reads and writes */
+    if (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD)
+        return 0;
+    tune_defaults(&t, config.depth);
+    if (run_stream(res, count, opcode, &t, &loop_secs))
+        return 1;
+    log_info("hand-written loop at depth %d: %.0f ops/s, the coroutines reach %.1f%% of it\n", config.depth,
+             count / loop_secs, 100.0 * loop_secs / secs);
+    snprintf(op_name, sizeof(op_name), "loop-%s", config.load_op);
+    emit_rate_result(op_name, config.msg_size, config.depth, count, loop_secs);
+    return 0;
 }
 
-int modify_qp_to_init(struct ibv_qp *qp) {
-    struct ibv_qp_attr attr;
-    int flags;
-    int rc;
-    memset(&attr, 0, sizeof(attr));
-    attr.qp_state = IBV_QPS_INIT;
-    attr.port_num = config.ib_port;
-    attr.pkey_index = 0;
-    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-    flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
-    rc = ibv_modify_qp(qp, &attr, flags);
-    if (rc) {
-        fprintf(stderr, "failed to modify QP state to INIT\n");
+/* one reusable request of a submitter, busy while its WR is outstanding */
+struct dispatch_slot_t {
+    struct dispatch_req_t req;
+    std::atomic<int> busy;
+    uint64_t posted_ns;
+    uint64_t done_ns;
+    int status;
+};
+
+static void dispatch_done(void *ctx, struct dispatch_req_t *, const struct ibv_wc *wc) {
+    struct dispatch_slot_t *slot = (struct dispatch_slot_t *) ctx;
+    slot->done_ns = now_ns();
+    slot->status = wc->status;
+    slot->busy.store(0, std::memory_order_release);
+}
+
+/* the callbacks a submitter is waiting for and the latencies they came with */
+struct submit_window_t {
+    struct dispatch_slot_t *slots;  /* window of them, reused in turn */
+    int window;
+    int first_slot;                 /* slot index in the shared buffer layout of slots[0] */
+    std::vector<uint64_t> lat_ns;
+};
+
+typedef std::function<int(struct rdma_op_t *op, struct dispatch_req_t *req)> submit_fn;
+
+/* waits for the slot's callback, as long as a CQ is allowed to stay silent */
+static int wait_slot(struct dispatch_slot_t *slot) {
+    uint64_t start = now_ns();
+    while (slot->busy.load(std::memory_order_acquire)) {
+        if (now_ns() - start > (uint64_t) MAX_POLL_CQ_TIMEOUT * 1000000) {
+            fprintf(stderr, "no callback after timeout\n");
+            return 1;
+        }
+        std::this_thread::yield();
+    }
+    return 0;
+}
+
+/*
+ * Submits ops one-sided WRs through submit, each into a slot of the window as soon as the slot's previous
+ * WR has been called back, and waits for the last ones. Latency is from submit to the callback.
+ */
+static int submit_window(struct resources *res, int opcode, int ops, struct submit_window_t *w,
+                         const submit_fn &submit, std::atomic<int> *failed) {
+    uint32_t size = config.msg_size;
+    struct rdma_op_t op;
+    struct ibv_sge sge;
+    sge.length = size;
+    sge.lkey = res->mr->lkey;
+    memset(&op, 0, sizeof(op));
+    op.opcode = opcode;
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    op.rkey = res->remote_props.rkey;
+    w->lat_ns.reserve(ops);
+    for (int n = 0; n < ops + w->window && !failed->load(); n++) {
+        struct dispatch_slot_t *slot = &w->slots[n % w->window];
+        int idx = (w->first_slot + n % w->window) % config.depth;
+        if (wait_slot(slot)) {
+            *failed = 1;
+            return 1;
+        }
+        /* the slot's previous WR is done, its latency is in */
+        if (n >= w->window && n - w->window < ops) {
+            if (slot->status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "WR failed with status 0x%x\n", slot->status);
+                *failed = 1;
+                break;
+            }
+            w->lat_ns.push_back(slot->done_ns - slot->posted_ns);
+        }
+        if (n >= ops)
+            continue;
+        sge.addr = (uintptr_t) (res->buf + (size_t) idx * size);
+        op.remote_addr = res->remote_props.addr + (uint64_t) idx * size;
+        op.send_flags = 0;
+        slot->busy = 1;
+        slot->posted_ns = now_ns();
+        if (submit(&op, &slot->req)) {
+            slot->busy = 0;
+            *failed = 1;
+        }
+    }
+    /* an early way out still has to wait for what is outstanding, the slots go away with us */
+    for (int k = 0; k < w->window; k++) {
+        if (wait_slot(&w->slots[k])) {
+            *failed = 1;
+            return 1;
+        }
+    }
+    return failed->load();
+}
+
+/* submitters threads share count ops, each with a window of its own, the backend is what submit goes to */
+static int run_submitters(struct resources **conns, int submitters, int count, int opcode,
+                          const std::function<submit_fn(int id)> &backend, struct result_t *result) {
+    int window = std::max(1, config.depth / submitters);
+    std::unique_ptr<struct dispatch_slot_t[]> slots(new struct dispatch_slot_t[submitters * window]);
+    std::vector<struct submit_window_t> windows(submitters);
+    std::vector<std::thread> workers;
+    std::vector<uint64_t> all;
+    std::atomic<int> failed(0);
+    uint64_t start;
+    for (int i = 0; i < submitters * window; i++) {
+        slots[i].req.cb = dispatch_done;
+        slots[i].req.ctx = &slots[i];
+        slots[i].busy = 0;
+    }
+    for (int i = 0; i < submitters; i++) {
+        windows[i].slots = &slots[i * window];
+        windows[i].window = window;
+        windows[i].first_slot = i * window;
+    }
+    start = now_ns();
+    for (int i = 0; i < submitters; i++) {
+        workers.emplace_back([&, i]() {
+            int ops = count / submitters + (i < count % submitters);
+            if (rt_tune_thread(&config, i)) {
+                failed = 1;
+                return;
+            }
+            submit_window(conns[i], opcode, ops, &windows[i], backend(i), &failed);
+        });
+    }
+    for (auto &w : workers)
+        w.join();
+    result->secs = (now_ns() - start) / 1e9;
+    if (failed.load())
+        return 1;
+    for (auto &w : windows)
+        all.insert(all.end(), w.lat_ns.begin(), w.lat_ns.end());
+    result->threads = submitters;
+    result->depth = submitters * window;
+    result->count = count;
+    result->has_latency = 1;
+    summarize_latency(all.data(), (int) all.size(), &result->lat);
+    return 0;
+}
+
+/*
+ * 1, 2, 4, ... up to config.threads submitter threads post over the one QP and never poll, the dispatcher
+ * thread calls them back. Each submitter has its share of the depth as slots and reuses a slot once its
+ * callback has run, latency is from submit() to the callback.
+ */
+int run_dispatch(struct resources *res, int count) {
+    std::vector<struct resources *> conns(config.threads, res);
+    struct dispatch_stats_t st;
+    struct result_t result;
+    char op_name[CTRL_OP_LEN + 1];
+    int opcode;
+    int rc = 0;
+    if (count <= 0) {
+        fprintf(stderr, "the dispatch benchmark needs a positive number of ops\n");
+        return 1;
+    }
+    if (load_opcode(config.load_op, &opcode))
+        return 1;
+    snprintf(op_name, sizeof(op_name), "dispatch-%s", config.load_op);
+    log_info("%10s %8s %14s %10s %10s %10s %12s\n", "submitters", "window", "ops/s", "p50 ns", "p99 ns",
+             "max ns", "CQEs/poll");
+    for (int submitters = 1; submitters <= config.threads && !rc; submitters *= 2) {
+        rdma::Dispatcher dispatcher;
+        int conn = dispatcher.attach(res);
+        if (conn < 0 || dispatcher.start())
+            return 1;
+        result_init(&result, op_name, config.msg_size, 0);
+        rc = run_submitters(conns.data(), submitters, count, opcode, [&](int) -> submit_fn {
+            return [&](struct rdma_op_t *op, struct dispatch_req_t *req) {
+                return dispatcher.submit(conn, op, req);
+            };
+        }, &result);
+        if (dispatcher.stop() || rc) {
+            rc = 1;
+            break;
+        }
+        st = dispatcher.stats();
+        log_info("%10d %8d %14.0f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %12.2f\n", submitters,
+                 result.depth / submitters, count / result.secs, result.lat.p50, result.lat.p99, result.lat.max,
+                 st.polls > st.empty_polls ? (double) st.completions / (st.polls - st.empty_polls) : 0);
+        results_emit(&result);
     }
     return rc;
 }
 
-int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, uint8_t *dgid) {
-    struct ibv_qp_attr attr;
-    int flags;
-    int rc;
-    memset(&attr, 0, sizeof(attr));
-    attr.qp_state = IBV_QPS_RTR;
-    attr.path_mtu = IBV_MTU_256;
-    attr.dest_qp_num = remote_qpn;
-    attr.rq_psn = 0;
-    attr.max_dest_rd_atomic = 1;
-    attr.min_rnr_timer = 0x12;
-    attr.ah_attr.is_global = 0;
-    attr.ah_attr.dlid = dlid;
-    attr.ah_attr.sl = 0;
-    attr.ah_attr.src_path_bits = 0;
-    attr.ah_attr.port_num = config.ib_port;
-    if (config.gid_idx >= 0)
-    {
-        attr.ah_attr.is_global = 1;
-        attr.ah_attr.port_num = 1;
-        memcpy(&attr.ah_attr.grh.dgid, dgid, 16);
-        attr.ah_attr.grh.flow_label = 0;
-        attr.ah_attr.grh.hop_limit = 1;
-        attr.ah_attr.grh.sgid_index = config.gid_idx;
-        attr.ah_attr.grh.traffic_class = 0;
-    }
-    flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
-            IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
-    rc = ibv_modify_qp(qp, &attr, flags);
-    if (rc)
-        fprintf(stderr, "failed to modify QP state to RTR\n");
+/*
+ * The same submitters against three ways of sharing the send path: the lock-free ring in front of one QP,
+ * the one QP posted to under a mutex, and a QP per thread. A dispatcher thread polls for the last two, the
+ * ring's owner thread for the first. Every connection is a pool session, the server keeps those going on
+ * threads of their own while we use them side by side.
+ */
+int run_mpsc(int count) {
+    std::vector<std::unique_ptr<rdma::Endpoint>> eps;
+    std::vector<struct resources *> shared;
+    std::vector<struct resources *> own;
+    struct shared_qp_stats_t st;
+    struct result_t result;
+    int opcode;
+    int rc = 0;
+    if (count <= 0) {
+        fprintf(stderr, "the submission queue benchmark needs a positive number of ops\n");
+        return 1;
+    }
+    if (load_opcode(config.load_op, &opcode))
+        return 1;
+    for (int i = 0; i < config.threads; i++) {
+        eps.emplace_back(new rdma::Endpoint(config));
+        struct resources *res = eps[i]->res();
+        if (open_session(res, "pool", 0) || eps[i]->open(res->sock) || eps[i]->connect()) {
+            fprintf(stderr, "failed to set up connection %d\n", i);
+            return 1;
+        }
+        shared.push_back(eps[0]->res());
+        own.push_back(res);
+    }
+    results_context(config.dev_name, config.ib_port, &eps[0]->res()->port_attr, transport_name(config.qp_type));
+    results_mark();
+    log_info("%10s %8s %-7s %14s %10s %10s %12s\n", "submitters", "window", "post", "ops/s", "p50 ns", "p99 ns",
+             "WRs/post");
+    auto report = [&](const char *name, double per_post) {
+        log_info("%10d %8d %-7s %14.0f %10" PRIu64 " %10" PRIu64 " %12.2f\n", result.threads,
+                 result.depth / result.threads, name, count / result.secs, result.lat.p50, result.lat.p99,
+                 per_post);
+        results_emit(&result);
+    };
+    for (int submitters = 1; submitters <= config.threads && !rc; submitters *= 2) {
+        /* one owner thread chains whatever the submitters put in the ring */
+        {
+            rdma::SharedQp sq(shared[0]);
+            sq.start();
+            result_init(&result, "mpsc-ring", config.msg_size, 0);
+            rc = run_submitters(shared.data(), submitters, count, opcode, [&](int) -> submit_fn {
+                return [&](struct rdma_op_t *op, struct dispatch_req_t *req) { return sq.enqueue(op, req); };
+            }, &result);
+            if (sq.stop() || rc) {
+                rc = 1;
+                break;
+            }
+            st = sq.stats();
+            report("ring", st.doorbells ? (double) st.wrs / st.doorbells : 0);
+        }
+        /* every submitter posts its own WR, one at a time */
+        {
+            rdma::Dispatcher dispatcher;
+            std::mutex post_lock;
+            int conn = dispatcher.attach(shared[0]);
+            if (conn < 0 || dispatcher.start())
+                return 1;
+            result_init(&result, "mpsc-mutex", config.msg_size, 0);
+            rc = run_submitters(shared.data(), submitters, count, opcode, [&](int) -> submit_fn {
+                return [&](struct rdma_op_t *op, struct dispatch_req_t *req) {
+                    std::lock_guard<std::mutex> guard(post_lock);
+                    return dispatcher.submit(conn, op, req);
+                };
+            }, &result);
+            if (dispatcher.stop() || rc) {
+                rc = 1;
+                break;
+            }
+            report("mutex", 1);
+        }
+        /* nothing shared on the way to the HCA */
+        {
+            rdma::Dispatcher dispatcher;
+            std::vector<int> conns;
+            for (int i = 0; i < submitters; i++)
+                conns.push_back(dispatcher.attach(own[i]));
+            if (dispatcher.start())
+                return 1;
+            result_init(&result, "mpsc-perqp", config.msg_size, 0);
+            rc = run_submitters(own.data(), submitters, count, opcode, [&](int id) -> submit_fn {
+                int conn = conns[id];
+                return [&dispatcher, conn](struct rdma_op_t *op, struct dispatch_req_t *req) {
+                    return dispatcher.submit(conn, op, req);
+                };
+            }, &result);
+            if (dispatcher.stop() || rc) {
+                rc = 1;
+                break;
+            }
+            report("per-qp", 1);
+        }
+    }
+    /* the server ends each pool session once its socket is closed */
     return rc;
 }
 
-int modify_qp_to_rts(struct ibv_qp *qp) {
-    struct ibv_qp_attr attr;
-    int flags;
-    int rc;
-    memset(&attr, 0, sizeof(attr));
-    attr.qp_state = IBV_QPS_RTS;
-    attr.timeout = 0x12;
-    attr.retry_cnt = 6;
-    attr.rnr_retry = 0;
-    attr.sq_psn = 0;
-    attr.max_rd_atomic = 1;
-    flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
-            IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
-    rc = ibv_modify_qp(qp, &attr, flags);
-    if (rc) {
-        fprintf(stderr, "failed to modify QP state to RTS\n");
+/* one connection of the CQ benchmark, its completions find it through their QP number */
+struct cq_conn_t {
+    struct resources *res;
+    struct cq_bench_t *bench;
+    int outstanding;
+    uint64_t issued;
+    std::vector<uint64_t> posted_ns;  /* by slot, the slot is the WR's wr_id */
+};
+
+/* what the connections of one run add up to */
+struct cq_bench_t {
+    std::vector<uint64_t> lat_ns;
+    int completed;
+    int failed;
+    uint64_t polls;
+    uint64_t empty_polls;
+};
+
+static void cq_conn_done(void *ctx, const struct ibv_wc *wc) {
+    struct cq_conn_t *c = (struct cq_conn_t *) ctx;
+    struct cq_bench_t *b = c->bench;
+    if (wc->status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "WR %" PRIu64 " failed with status 0x%x\n", wc->wr_id, wc->status);
+        b->failed = 1;
+    }
+    if (b->completed < (int) b->lat_ns.size())
+        b->lat_ns[b->completed] = now_ns() - c->posted_ns[wc->wr_id];
+    b->completed++;
+    c->outstanding--;
+}
+
+/* tops the connection up to depth WRs as long as there are ops left to issue */
+static int cq_conn_fill(struct cq_conn_t *c, int opcode, int *left) {
+    struct resources *res = c->res;
+    uint32_t size = res->cfg->msg_size;
+    int depth = res->cfg->depth;
+    struct rdma_op_t ops[MAX_POST_BATCH];
+    struct ibv_sge sges[MAX_POST_BATCH];
+    int n = std::min(std::min(depth - c->outstanding, *left), MAX_POST_BATCH);
+    int i;
+    if (n <= 0)
+        return 0;
+    memset(ops, 0, n * sizeof(ops[0]));
+    for (i = 0; i < n; i++) {
+        /* RC completes in order, the slot is free again by the time the count comes back round to it */
+        int slot = (int) ((c->issued + i) % depth);
+        sges[i].addr = (uintptr_t) (res->buf + (size_t) slot * size);
+        sges[i].length = size;
+        sges[i].lkey = res->mr->lkey;
+        ops[i].opcode = opcode;
+        ops[i].sg_list = &sges[i];
+        ops[i].num_sge = 1;
+        ops[i].remote_addr = res->remote_props.addr + (uint64_t) slot * size;
+        ops[i].rkey = res->remote_props.rkey;
+        ops[i].wr_id = slot;
+        ops[i].send_flags = IBV_SEND_SIGNALED;
+        c->posted_ns[slot] = now_ns();
     }
+    if (post_send_batch(res, ops, n)) {
+        fprintf(stderr, "failed to post %d SRs\n", n);
+        return 1;
+    }
+    c->issued += n;
+    c->outstanding += n;
+    *left -= n;
+    return 0;
+}
+
+/* count ops over the first n connections, their completions taken off one shared CQ or a CQ each */
+static int cq_bench_run(std::vector<struct cq_conn_t> &conns, int n, rdma::SharedCq *shared, int count,
+                        int opcode, struct cq_bench_t *b, double *secs) {
+    struct ibv_wc wc[16];
+    uint64_t start, last_progress;
+    unsigned long spins = 0;
+    int left = count;
+    int got;
+    int i;
+    int j;
+    b->lat_ns.assign(count, 0);
+    b->completed = 0;
+    b->failed = 0;
+    b->polls = 0;
+    b->empty_polls = 0;
+    for (i = 0; i < n; i++) {
+        conns[i].bench = b;
+        conns[i].outstanding = 0;
+    }
+    start = now_ns();
+    last_progress = start;
+    while (b->completed < count && !b->failed) {
+        for (i = 0; i < n; i++) {
+            if (cq_conn_fill(&conns[i], opcode, &left))
+                return 1;
+        }
+        got = 0;
+        if (shared) {
+            /* one poll sees every connection's completions, the QP number says whose they are */
+            got = shared->poll(16, cq_conn_done);
+            if (got < 0)
+                return 1;
+            b->polls++;
+            if (!got)
+                b->empty_polls++;
+        } else {
+            /* round-robin over a CQ per connection, most of them empty once there are many */
+            for (i = 0; i < n; i++) {
+                int polled = ibv_poll_cq(conns[i].res->cq, 16, wc);
+                if (polled < 0) {
+                    fprintf(stderr, "poll CQ failed\n");
+                    return 1;
+                }
+                b->polls++;
+                if (!polled)
+                    b->empty_polls++;
+                for (j = 0; j < polled; j++)
+                    cq_conn_done(&conns[i], &wc[j]);
+                got += polled;
+            }
+        }
+        if (got > 0) {
+            last_progress = now_ns();
+        } else if ((++spins & 4095) == 0 && now_ns() - last_progress > (uint64_t) MAX_POLL_CQ_TIMEOUT * 1000000) {
+            fprintf(stderr, "completion wasn't found in the CQ after timeout\n");
+            return 1;
+        }
+    }
+    *secs = (now_ns() - start) / 1e9;
+    return b->failed;
+}
+
+int run_cqshare(int count) {
+    /* declared first so it goes last, the connections' QPs and MRs hold on to its CQ and PD */
+    rdma::SharedCq shared;
+    std::vector<std::unique_ptr<rdma::Endpoint>> eps;
+    std::vector<struct cq_conn_t> own;
+    std::vector<struct cq_conn_t> pooled;
+    struct cq_bench_t bench;
+    struct result_t result;
+    double secs;
+    int conns = config.conns;
+    int opcode;
+    int rc = 0;
+    if (count <= 0) {
+        fprintf(stderr, "the CQ benchmark needs a positive number of ops\n");
+        return 1;
+    }
+    if (load_opcode(config.load_op, &opcode))
+        return 1;
+    /* room for every connection's WRs, as far as the device goes */
+    if (shared.open(&config, 2 * config.depth * conns))
+        return 1;
+    log_info("shared CQ of %d entries for %d connections\n", shared.entries(), conns);
+    /* a connection with a CQ of its own and one on the shared CQ for each of them */
+    for (int i = 0; i < 2 * conns; i++) {
+        eps.emplace_back(new rdma::Endpoint(config));
+        struct resources *res = eps[i]->res();
+        if (open_session(res, "pool", 0) || (i >= conns && shared.attach(res)) || eps[i]->open(res->sock) ||
+            eps[i]->connect()) {
+            fprintf(stderr, "failed to set up connection %d\n", i);
+            return 1;
+        }
+    }
+    own.resize(conns);
+    pooled.resize(conns);
+    for (int i = 0; i < conns; i++) {
+        own[i].res = eps[i]->res();
+        pooled[i].res = eps[conns + i]->res();
+        own[i].posted_ns.resize(config.depth);
+        pooled[i].posted_ns.resize(config.depth);
+        shared.route(pooled[i].res, &pooled[i]);
+    }
+    results_context(config.dev_name, config.ib_port, &eps[0]->res()->port_attr, transport_name(config.qp_type));
+    log_info("%6s %-7s %14s %12s %10s %10s %10s\n", "conns", "cq", "ops/s", "polls/op", "empty %", "p50 ns",
+             "p99 ns");
+    results_mark();
+    for (int n = 1; !rc; n = std::min(2 * n, conns)) {
+        for (int mode = 0; mode < 2 && !rc; mode++) {
+            const char *name = mode ? "shared" : "per-qp";
+            if (cq_bench_run(mode ? pooled : own, n, mode ? &shared : NULL, count, opcode, &bench, &secs)) {
+                fprintf(stderr, "%s CQ run over %d connections failed\n", name, n);
+                rc = 1;
+                break;
+            }
+            /* depth is what all n connections keep outstanding together */
+            result_init(&result, mode ? "cq-shared" : "cq-perqp", config.msg_size, n * config.depth);
+            result.count = count;
+            result.secs = secs;
+            summarize_latency(bench.lat_ns.data(), count, &result.lat);
+            result.has_latency = 1;
+            log_info("%6d %-7s %14.0f %12.2f %10.1f %10" PRIu64 " %10" PRIu64 "\n", n, name, count / secs,
+                     (double) bench.polls / count, bench.polls ? 100.0 * bench.empty_polls / bench.polls : 0.0,
+                     result.lat.p50, result.lat.p99);
+            results_emit(&result);
+        }
+        if (n == conns)
+            break;
+    }
+    for (auto &c : pooled)
+        shared.detach(c.res);
+    /* the server ends each pool session once its socket is closed */
     return rc;
 }
 
-int poll_completion(struct resources *res) {
+/* what one jitter run saw, the outliers and what happened on the thread that could explain them */
+struct jitter_run_t {
+    struct latency_stats_t lat;
+    int outliers;             /* ops that took longer than JITTER_OUTLIER_NS */
+    int migrations;           /* times the thread was found on another core than for the op before */
+    struct rt_usage_t usage;  /* faults and context switches over the run */
+};
+
+/* count ops one at a time, each one timed from post to completion */
+static int jitter_run(struct resources *res, int count, int opcode, std::vector<uint64_t> &lat_ns,
+                      struct jitter_run_t *run) {
+    struct rt_usage_t before;
+    struct rdma_op_t op;
+    struct ibv_sge sge;
     struct ibv_wc wc;
-    unsigned long start_time_msec;
-    unsigned long cur_time_msec;
-    struct timeval cur_time;
-    int poll_result;
-    int rc = 0;
-    /* poll the completion for a while before giving up of doing it .. */
-    gettimeofday(&cur_time, NULL);
-    start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-    do {
-        poll_result = ibv_poll_cq(res->cq, 1, &wc);
-        gettimeofday(&cur_time, NULL);
-        cur_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-    } while ((poll_result == 0) && ((cur_time_msec - start_time_msec) < MAX_POLL_CQ_TIMEOUT));
-    if (poll_result < 0) {
-        /* poll CQ failed */
-        fprintf(stderr, "poll CQ failed\n");
-        rc = 1;
-    } else if (poll_result == 0) {
-        /* the CQ is empty */
-        fprintf(stderr, "completion wasn't found in the CQ after timeout\n");
-        rc = 1;
-    } else {
-        /* CQE found */
-        fprintf(stdout, "completion was found in CQ with status 0x%x\n", wc.status);
-        /* check the completion status (here we don't care about the completion opcode */
+    uint64_t start;
+    int last_cpu;
+    int cpu;
+    int i;
+    memset(run, 0, sizeof(*run));
+    sge.addr = (uintptr_t) res->buf;
+    sge.length = config.msg_size;
+    sge.lkey = res->mr->lkey;
+    memset(&op, 0, sizeof(op));
+    op.opcode = opcode;
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    op.send_flags = IBV_SEND_SIGNALED;
+    op.remote_addr = res->remote_props.addr;
+    op.rkey = res->remote_props.rkey;
+    /* touched before the clock starts, the samples' pages are not what we measure */
+    lat_ns.assign(count, 0);
+    last_cpu = sched_getcpu();
+    rt_usage(&before);
+    for (i = 0; i < count; i++) {
+        start = now_ns();
+        if (post_send_op(res, &op) || poll_completion_quiet(res, &wc))
+            return 1;
+        lat_ns[i] = now_ns() - start;
         if (wc.status != IBV_WC_SUCCESS) {
-            fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", wc.status, wc.vendor_err);
-            rc = 1;
+            fprintf(stderr, "op %d failed with status 0x%x\n", i, wc.status);
+            return 1;
         }
+        if (lat_ns[i] > JITTER_OUTLIER_NS)
+            run->outliers++;
+        cpu = sched_getcpu();
+        if (cpu != last_cpu)
+            run->migrations++;
+        last_cpu = cpu;
     }
-    return rc;
+    rt_usage(&run->usage);
+    run->usage.minflt -= before.minflt;
+    run->usage.majflt -= before.majflt;
+    run->usage.nvcsw -= before.nvcsw;
+    run->usage.nivcsw -= before.nivcsw;
+    summarize_latency(lat_ns.data(), count, &run->lat);
+    return 0;
+}
+
+static void jitter_report(const char *name, const struct jitter_run_t *run) {
+    log_info("%-8s %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %8d %7ld %7ld %7d\n", name,
+             run->lat.p50, run->lat.p99, run->lat.p999, run->lat.p9999, run->lat.max, run->outliers,
+             run->usage.minflt + run->usage.majflt, run->usage.nvcsw + run->usage.nivcsw, run->migrations);
+}
+
+int run_jitter(struct resources *res, int count) {
+    std::vector<uint64_t> lat_ns;
+    struct jitter_run_t runs[2];
+    struct result_t result;
+    char op_name[CTRL_OP_LEN + 1];
+    int warmup = std::max(1, count / 100);
+    int opcode;
+    int i;
+    if (count <= 0) {
+        fprintf(stderr, "the jitter report needs a positive number of ops\n");
+        return 1;
+    }
+    if (load_opcode(config.load_op, &opcode))
+        return 1;
+    for (i = 0; i < 2; i++) {
+        if (i == 1) {
+            /* the same again pinned next to the device with all memory locked, and SCHED_FIFO if asked for */
+            config.pin = 1;
+            config.lock_mem = 1;
+            if (rt_setup(&config) || rt_tune_thread(&config, 0))
+                return 1;
+            rt_prefault(res->buf, config.buf_size);
+        }
+        /* both runs start from a warm QP, only what the tuning changes is left to differ */
+        if (jitter_run(res, warmup, opcode, lat_ns, &runs[i])) {
+            fprintf(stderr, "%s jitter warmup failed\n", i ? "tuned" : "default");
+            return 1;
+        }
+        results_mark();
+        if (jitter_run(res, count, opcode, lat_ns, &runs[i])) {
+            fprintf(stderr, "%s jitter run failed\n", i ? "tuned" : "default");
+            return 1;
+        }
+        snprintf(op_name, sizeof(op_name), "jitter-%s%s", config.load_op, i ? "-rt" : "");
+        result_init(&result, op_name, config.msg_size, 1);
+        result.count = count;
+        result.has_latency = 1;
+        result.lat = runs[i].lat;
+        results_emit(&result);
+    }
+    log_info("%d %s ops of %u bytes, one at a time, outliers above %d us\n", count, config.load_op, config.msg_size,
+             JITTER_OUTLIER_NS / 1000);
+    log_info("%-8s %9s %9s %9s %9s %9s %8s %7s %7s %7s\n", "run", "p50 ns", "p99 ns", "p99.9 ns", "p99.99 ns",
+             "max ns", "outliers", "faults", "ctxsw", "migr");
+    jitter_report("default", &runs[0]);
+    jitter_report("tuned", &runs[1]);
+    if (runs[0].lat.p9999)
+        log_info("p99.99 went from %" PRIu64 " ns to %" PRIu64 " ns, %.1f%% lower\n", runs[0].lat.p9999,
+                 runs[1].lat.p9999, 100.0 * ((double) runs[0].lat.p9999 - runs[1].lat.p9999) / runs[0].lat.p9999);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
     struct resources res;
+    struct scenario_t scenario;
+    std::vector<uint32_t> tune_sizes;
+    struct result_t result;
+    std::chrono::high_resolution_clock::time_point setup_start;
     int rc = 0;
-    char temp_char;
     int count = 0;
+    /* recovery starts over from random PSNs, two clients started together must not pick the same */
+    srand48(getpid() ^ time(NULL));
     while (true) {
         int c;
         static struct option long_options[] = {
@@ -439,9 +1911,39 @@ int main(int argc, char *argv[]) {
                 {.name = "ip-addr", .has_arg = 1, .val = 'a'},
                 {.name = "op", .has_arg = 1, .val = 'o'},
                 {.name = "times", .has_arg = 1, .val = 't'},
+                {.name = "size", .has_arg = 1, .val = 's'},
+                {.name = "sge", .has_arg = 1, .val = 'e'},
+                {.name = "depth", .has_arg = 1, .val = 'q'},
+                {.name = "transport", .has_arg = 1, .val = 'x'},
+                {.name = "cm", .has_arg = 1, .val = 'c'},
+                {.name = "conns", .has_arg = 1, .val = 'k'},
+                {.name = "nodes", .has_arg = 1, .val = 'n'},
+                {.name = "spares", .has_arg = 1, .val = 'S'},
+                {.name = "scenario", .has_arg = 1, .val = 'f'},
+                {.name = "rate", .has_arg = 1, .val = 'L'},
+                {.name = "arrival", .has_arg = 1, .val = 'A'},
+                {.name = "load-op", .has_arg = 1, .val = 'l'},
+                {.name = "slo", .has_arg = 1, .val = 'b'},
+                {.name = "percentile", .has_arg = 1, .val = 'P'},
+                {.name = "sizes", .has_arg = 1, .val = 'z'},
+                {.name = "transports", .has_arg = 1, .val = 'T'},
+                {.name = "profile", .has_arg = 1, .val = 'u'},
+                {.name = "threads", .has_arg = 1, .val = 'j'},
+                {.name = "coros", .has_arg = 1, .val = 'C'},
+                {.name = "recover", .has_arg = 0, .val = 'R'},
+                {.name = "format", .has_arg = 1, .val = 'F'},
+                {.name = "output", .has_arg = 1, .val = 'O'},
+                {.name = "verbose", .has_arg = 0, .val = 'v'},
+                {.name = "quiet", .has_arg = 0, .val = 'Q'},
+                {.name = "inject-error", .has_arg = 1, .val = 'E'},
+                {.name = "peers", .has_arg = 1, .val = 'r'},
+                {.name = "pin", .has_arg = 0, .val = 'N'},
+                {.name = "cpus", .has_arg = 1, .val = 'U'},
+                {.name = "fifo", .has_arg = 1, .val = 'Y'},
+                {.name = "mlock", .has_arg = 0, .val = 'M'},
                 {.name = NULL, .has_arg = 0, .val = '\0'}
         };
-        c = getopt_long(argc, argv, "p:d:i:g:a:o:t:", long_options, NULL);
+        c = getopt_long(argc, argv, "p:d:i:g:a:o:t:s:e:q:x:r:c:k:n:S:f:L:A:l:b:P:z:T:u:j:C:RE:F:O:vQNU:Y:M", long_options, NULL);
         if (c == -1) {
             break;
         }
@@ -475,25 +1977,290 @@ int main(int argc, char *argv[]) {
             case 't':
                 count = strtol(optarg, NULL, 0);
                 break;
+            case 's':
+                config.msg_size = strtoul(optarg, NULL, 0);
+                if (config.msg_size == 0) {
+                    fprintf(stderr, "Invalid message size\n");
+                    return 1;
+                }
+                break;
+            case 'e':
+                config.max_sge = strtol(optarg, NULL, 0);
+                if (config.max_sge <= 0) {
+                    fprintf(stderr, "Invalid number of SGEs\n");
+                    return 1;
+                }
+                break;
+            case 'q':
+                config.depth = strtol(optarg, NULL, 0);
+                if (config.depth <= 0) {
+                    fprintf(stderr, "Invalid queue depth\n");
+                    return 1;
+                }
+                break;
+            case 'x':
+                if (parse_transport(optarg, &config.qp_type)) {
+                    fprintf(stderr, "Invalid transport %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (parse_cm(optarg, &config.use_rdmacm)) {
+                    fprintf(stderr, "Invalid connection setup %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                config.conns = strtol(optarg, NULL, 0);
+                if (config.conns <= 0) {
+                    fprintf(stderr, "Invalid number of connections\n");
+                    return 1;
+                }
+                break;
+            case 'n':
+                config.chase_nodes = strtol(optarg, NULL, 0);
+                if (config.chase_nodes <= 0) {
+                    fprintf(stderr, "Invalid number of nodes\n");
+                    return 1;
+                }
+                break;
+            case 'f':
+                config.scenario = strdup(optarg);
+                break;
+            case 'L':
+                config.rates = strdup(optarg);
+                break;
+            case 'A':
+                config.arrival = strdup(optarg);
+                break;
+            case 'l':
+                config.load_op = strdup(optarg);
+                break;
+            case 'b':
+                if (parse_duration(optarg, &config.slo_ns)) {
+                    fprintf(stderr, "Invalid latency bound\n");
+                    return 1;
+                }
+                break;
+            case 'P':
+                config.slo_percentile = strtod(optarg, NULL);
+                break;
+            case 'z':
+                config.sizes = strdup(optarg);
+                break;
+            case 'T':
+                config.transports = strdup(optarg);
+                break;
+            case 'u':
+                config.profile = strdup(optarg);
+                break;
+            case 'S':
+                config.spares = strtol(optarg, NULL, 0);
+                if (config.spares <= 0) {
+                    fprintf(stderr, "Invalid number of spare connections\n");
+                    return 1;
+                }
+                break;
+            case 'j':
+                config.threads = strtol(optarg, NULL, 0);
+                if (config.threads <= 0) {
+                    fprintf(stderr, "Invalid number of threads\n");
+                    return 1;
+                }
+                break;
+            case 'C':
+                config.coros = strtol(optarg, NULL, 0);
+                if (config.coros <= 0) {
+                    fprintf(stderr, "Invalid number of coroutines\n");
+                    return 1;
+                }
+                break;
+            case 'R':
+                config.recover = 1;
+                break;
+            case 'F':
+                config.result_format = strdup(optarg);
+                break;
+            case 'O':
+                config.result_path = strdup(optarg);
+                break;
+            case 'v':
+                verbosity++;
+                break;
+            case 'Q':
+                verbosity = VERBOSE_QUIET;
+                break;
+            case 'E':
+                config.inject_error = strtol(optarg, NULL, 0);
+                break;
+            case 'r':
+                config.peers = strtol(optarg, NULL, 0);
+                if (config.peers < 0) {
+                    fprintf(stderr, "Invalid number of peers\n");
+                    return 1;
+                }
+                break;
+            case 'N':
+                config.pin = 1;
+                break;
+            case 'U':
+                config.pin = 1;
+                config.cpus = strdup(optarg);
+                break;
+            case 'Y':
+                config.rt_prio = strtol(optarg, NULL, 0);
+                if (config.rt_prio < sched_get_priority_min(SCHED_FIFO) ||
+                    config.rt_prio > sched_get_priority_max(SCHED_FIFO)) {
+                    fprintf(stderr, "Invalid SCHED_FIFO priority\n");
+                    return 1;
+                }
+                break;
+            case 'M':
+                config.lock_mem = 1;
+                break;
             default:
                 fprintf(stderr, "Invalid command line argument\n");
                 return 1;
         }
     }
     if (config.server_name) {
-        printf("Remote server: %s\n", config.server_name);
+        log_info("Remote server: %s\n", config.server_name);
     } else {
         fprintf(stderr, "Remote server not specified\n");
         return 1;
     }
-    print_config();
-    resources_init(&res);
-    if (resources_create(&res)) {
-        fprintf(stderr, "failed to create resources\n");
+    if (results_open(config.result_format, config.result_path))
+        return 1;
+    /* before any thread is started, the workers' CPU is only counted if they inherit the counters */
+    cpu_meter_open();
+    if (config.scenario) {
+        if (load_scenario(config.scenario, &scenario))
+            return 1;
+        /* the connection is set up once for the largest step */
+        config.operation = (char *) "scenario";
+        config.msg_size = *std::max_element(scenario.sizes.begin(), scenario.sizes.end());
+        config.depth = *std::max_element(scenario.depths.begin(), scenario.depths.end());
+    }
+    if (!strcmp(config.operation, "chase")) {
+        /* every hop reads one whole node into the local buffer */
+        config.buf_size = CHASE_NODE_SIZE;
+    } else if (!strcmp(config.operation, "sge")) {
+        /* fragments with a gap after each one, followed by the staging area of the copy variant */
+        config.buf_size = (size_t) 3 * config.max_sge * config.msg_size;
+    } else if (!strcmp(config.operation, "zcsend")) {
+        /* header and payload go out as two segments, res->buf is only the staging area */
+        if (config.max_sge < 2)
+            config.max_sge = 2;
+        config.buf_size = (size_t) config.depth * (sizeof(struct msg_hdr_t) + config.msg_size);
+    } else if (!strcmp(config.operation, "pingpong")) {
+        /* room for the request and the reply, each with a sequence number */
+        if (config.msg_size < sizeof(uint64_t))
+            config.msg_size = sizeof(uint64_t);
+        config.buf_size = (size_t) 2 * config.msg_size;
+    } else if (!strcmp(config.operation, "bw") || !strcmp(config.operation, "wbw")) {
+        /* one slot per outstanding send, each with a sequence number */
+        if (config.msg_size < sizeof(uint64_t))
+            config.msg_size = sizeof(uint64_t);
+        config.buf_size = (size_t) config.depth * config.msg_size;
+    } else if (!strcmp(config.operation, "openloop") || !strcmp(config.operation, "coro") ||
+               !strcmp(config.operation, "dispatch") || !strcmp(config.operation, "jitter")) {
+        /* a slot per outstanding WR */
+        config.buf_size = (size_t) config.depth * config.msg_size;
+    } else if (!strcmp(config.operation, "cqshare")) {
+        /* a slot per outstanding WR on each connection */
+        config.buf_size = (size_t) config.depth * config.msg_size;
+    } else if (!strcmp(config.operation, "mpsc")) {
+        /* a slot per outstanding WR, the ring only asks for a completion at the end of each chain */
+        config.buf_size = (size_t) config.depth * config.msg_size;
+        config.selective_signal = 1;
+    } else if (!strcmp(config.operation, "stream") || !strcmp(config.operation, "autotune")) {
+        if (!strcmp(config.operation, "autotune")) {
+            if (!config.sizes)
+                tune_sizes.push_back(config.msg_size);
+            else if (parse_sizes(config.sizes, &tune_sizes)) {
+                fprintf(stderr, "invalid size list %s\n", config.sizes);
+                return 1;
+            }
+            config.msg_size = *std::max_element(tune_sizes.begin(), tune_sizes.end());
+        }
+        /* a slot per outstanding WR, signaled only where the stream asks for it */
+        config.buf_size = (size_t) config.depth * config.msg_size;
+        config.selective_signal = 1;
+        if (!strcmp(config.load_op, "write"))
+            config.max_inline = TUNE_INLINE_DATA;
+    } else if (!strcmp(config.operation, "scenario")) {
+        /* a slot per outstanding WR, and at least the two of a ping-pong */
+        if (config.msg_size < sizeof(uint64_t))
+            config.msg_size = sizeof(uint64_t);
+        config.buf_size = (size_t) std::max(config.depth, 2) * config.msg_size;
+    }
+    /* --pin looks for the cores next to the device before it is opened */
+    resolve_device_name(&config);
+    print_config(&config);
+    /* before anything is allocated, so it comes from the pinned core's node and is locked as it is;
+       the jitter report runs once untuned first and tunes itself */
+    if (strcmp(config.operation, "jitter") && (rt_setup(&config) || rt_tune_thread(&config, 0)))
+        return 1;
+    resources_init(&res, &config);
+    /* connbench and pool open their own connections, there is no port to describe yet */
+    results_context(config.dev_name, config.ib_port, NULL, transport_name(config.qp_type));
+    results_mark();
+    if (!strcmp(config.operation, "connbench")) {
+        /* sets up its own connections */
+        rc = run_connbench(config.conns, config.threads);
+        goto main_exit;
+    }
+    if (!strcmp(config.operation, "slo")) {
+        /* connects once per transport */
+        rc = run_capacity_search(count);
+        goto main_exit;
+    }
+    if (!strcmp(config.operation, "mpsc")) {
+        /* a connection per thread for the per-QP baseline */
+        rc = run_mpsc(count);
+        goto main_exit;
+    }
+    if (!strcmp(config.operation, "cqshare")) {
+        /* --conns connections on CQs of their own and as many on one shared CQ */
+        rc = run_cqshare(count);
+        goto main_exit;
+    }
+    if (!strcmp(config.operation, "pool")) {
+        /* connects through the pool, or once per request for the baseline */
+        rc = run_poolbench(count, config.spares);
+        goto main_exit;
+    }
+    /* the control socket negotiates the session and carries the barriers, it isn't part of the timed setup */
+    if (open_session(&res, config.operation, count)) {
+        rc = 1;
         goto main_exit;
     }
-    if (connect_qp(&res)) {
-        fprintf(stderr, "failed to connect QPs\n");
+    if (config.use_rdmacm) {
+        setup_start = std::chrono::high_resolution_clock::now();
+        if (cm_resources_create(&res, &config)) {
+            fprintf(stderr, "failed to connect through RDMA-CM\n");
+            goto main_exit;
+        }
+    } else {
+        setup_start = std::chrono::high_resolution_clock::now();
+        if (resources_create(&res)) {
+            fprintf(stderr, "failed to create resources\n");
+            goto main_exit;
+        }
+        if (connect_qp(&res)) {
+            fprintf(stderr, "failed to connect QPs\n");
+            goto main_exit;
+        }
+    }
+    results_context(config.dev_name, config.ib_port, &res.port_attr, transport_name(config.qp_type));
+    if (config.lock_mem)
+        rt_prefault(res.buf, config.buf_size);
+    /* the CPU of the first result is that of the op, not of connecting */
+    results_mark();
+    log_info("connection setup (%s) took %.1f us\n", config.use_rdmacm ? "rdmacm" : "tcp",
+            std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - setup_start).count());
+    if (config.peers > 0 && report_peer_footprint(&res, config.peers)) {
+        rc = 1;
         goto main_exit;
     }
     if (!strcmp(config.operation, "send")) {
@@ -513,7 +2280,8 @@ int main(int argc, char *argv[]) {
             std::chrono::nanoseconds elapsed = end - start;
             total += elapsed;
         }
-        fprintf(stdout, "RDMA send operation took %lld ns\n", total.count());
+        log_info("RDMA send operation took %lld ns\n", total.count());
+        emit_rate_result("send", MSG_SIZE, 1, count, total.count() / 1e9);
     } else if (!strcmp(config.operation, "receive")) {
         for (int i = 0; i < count; ++i) {
             if (post_receive(&res)) {
@@ -525,16 +2293,17 @@ int main(int argc, char *argv[]) {
                 goto main_exit;
             }
         }
-        fprintf(stdout, "Message is: %s\n", res.buf);
+        log_info("Message is: %s\n", res.buf);
     } else if (!strcmp(config.operation, "read")) {
-        if (sock_sync_data(res.sock, 1, "R", &temp_char)) {
+        if (ctrl_sync(res.sock, 'R')) {
             fprintf(stderr, "sync error before RDMA ops\n");
             rc = 1;
             goto main_exit;
         }
         std::chrono::nanoseconds total(0);
+        int faulty = config.inject_error;
         for (int i = 0; i < count; ++i) {
-            if (post_send(&res, IBV_WR_RDMA_READ)) {
+            if (i == faulty ? post_faulty(&res, IBV_WR_RDMA_READ) : post_send(&res, IBV_WR_RDMA_READ)) {
                 fprintf(stderr, "failed to post SR 2\n");
                 rc = 1;
                 goto main_exit;
@@ -542,6 +2311,12 @@ int main(int argc, char *argv[]) {
             auto start = std::chrono::high_resolution_clock::now();
             if (poll_completion(&res)) {
                 fprintf(stderr, "poll completion failed 2\n");
+                /* bring the same QP back and do the op again, so every op counted has completed */
+                if (config.recover && !request_recovery(&res)) {
+                    faulty = -1;
+                    --i;
+                    continue;
+                }
                 rc = 1;
                 goto main_exit;
             }
@@ -549,22 +2324,24 @@ int main(int argc, char *argv[]) {
             std::chrono::nanoseconds elapsed = end - start;
             total += elapsed;
         }
-        fprintf(stdout, "RDMA read operation took %lld ns\n", total.count());
-        fprintf(stdout, "Contents of server's buffer: '%s'\n", res.buf);
-        if (sock_sync_data(res.sock, 1, "R", &temp_char)) {
+        log_info("RDMA read operation took %lld ns\n", total.count());
+        emit_rate_result("read", MSG_SIZE, 1, count, total.count() / 1e9);
+        log_info("Contents of server's buffer: '%s'\n", res.buf);
+        if (ctrl_sync(res.sock, 'R')) {
             fprintf(stderr, "sync error before RDMA ops\n");
             rc = 1;
             goto main_exit;
         }
     } else if (!strcmp(config.operation, "write")) {
-        if (sock_sync_data(res.sock, 1, "W", &temp_char)) {
+        if (ctrl_sync(res.sock, 'W')) {
             fprintf(stderr, "sync error after RDMA ops\n");
             rc = 1;
             goto main_exit;
         }
         std::chrono::nanoseconds total(0);
+        int faulty = config.inject_error;
         for (int i = 0; i < count; ++i) {
-            if (post_send(&res, IBV_WR_RDMA_WRITE)) {
+            if (i == faulty ? post_faulty(&res, IBV_WR_RDMA_WRITE) : post_send(&res, IBV_WR_RDMA_WRITE)) {
                 fprintf(stderr, "failed to post SR 3\n");
                 rc = 1;
                 goto main_exit;
@@ -572,6 +2349,12 @@ int main(int argc, char *argv[]) {
             auto start = std::chrono::high_resolution_clock::now();
             if (poll_completion(&res)) {
                 fprintf(stderr, "poll completion failed 3\n");
+                /* bring the same QP back and do the op again, so every op counted has completed */
+                if (config.recover && !request_recovery(&res)) {
+                    faulty = -1;
+                    --i;
+                    continue;
+                }
                 rc = 1;
                 goto main_exit;
             }
@@ -579,12 +2362,168 @@ int main(int argc, char *argv[]) {
             std::chrono::nanoseconds elapsed = end - start;
             total += elapsed;
         }
-        fprintf(stdout, "RDMA write operation took %lld ns\n", total.count());
-        if (sock_sync_data(res.sock, 1, "W", &temp_char)) {
+        log_info("RDMA write operation took %lld ns\n", total.count());
+        emit_rate_result("write", MSG_SIZE, 1, count, total.count() / 1e9);
+        if (ctrl_sync(res.sock, 'W')) {
             fprintf(stderr, "sync error after RDMA ops\n");
             rc = 1;
             goto main_exit;
         }
+    } else if (!strcmp(config.operation, "chase")) {
+        struct chase_node_t *node = (struct chase_node_t *) res.buf;
+        struct ibv_wc wc;
+        uint64_t *hops;
+        uint64_t next;
+        if (count <= 0) {
+            fprintf(stderr, "number of hops must be positive\n");
+            rc = 1;
+            goto main_exit;
+        }
+        hops = (uint64_t *) malloc(count * sizeof(uint64_t));
+        if (!hops) {
+            fprintf(stderr, "failed to malloc %d latency samples\n", count);
+            rc = 1;
+            goto main_exit;
+        }
+        if (ctrl_sync(res.sock, 'C')) {
+            fprintf(stderr, "sync error before pointer chasing\n");
+            free(hops);
+            rc = 1;
+            goto main_exit;
+        }
+        /* the list head is the first node of the server's region, every next address comes from the last read */
+        next = res.remote_props.addr;
+        for (int i = 0; i < count; ++i) {
+            auto start = std::chrono::high_resolution_clock::now();
+            if (post_read(&res, next, CHASE_NODE_SIZE) || poll_completion_quiet(&res, &wc)) {
+                fprintf(stderr, "pointer chasing failed at hop %d\n", i);
+                free(hops);
+                rc = 1;
+                goto main_exit;
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            hops[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+            next = ntohll(node->next);
+        }
+        log_info("walked %d hops, last node index %" PRIu64 "\n", count, ntohll(node->index));
+        result_init(&result, "chase", CHASE_NODE_SIZE, 1);
+        result.count = count;
+        result.has_latency = 1;
+        summarize_latency(hops, count, &result.lat);
+        print_latency_summary("RDMA pointer chasing per-hop latency", &result.lat);
+        results_emit(&result);
+        free(hops);
+        if (ctrl_sync(res.sock, 'C')) {
+            fprintf(stderr, "sync error after pointer chasing\n");
+            rc = 1;
+            goto main_exit;
+        }
+    } else if (!strcmp(config.operation, "sge")) {
+        /* config.max_sge has been clamped to what the QP supports by now */
+        int frags = config.max_sge;
+        uint32_t frag_size = config.msg_size;
+        char *staging = res.buf + (size_t) 2 * frags * frag_size;
+        std::vector<struct ibv_sge> frag_sges(frags);
+        std::vector<uint64_t> gather_ns(count > 0 ? count : 0);
+        std::vector<uint64_t> copy_ns(count > 0 ? count : 0);
+        struct ibv_sge staging_sge;
+        struct rdma_op_t op;
+        struct ibv_wc wc;
+        for (int i = 0; i < frags; ++i) {
+            char *frag = res.buf + (size_t) 2 * i * frag_size;
+            memset(frag, 'a' + i % 26, frag_size);
+            frag_sges[i].addr = (uintptr_t) frag;
+            frag_sges[i].length = frag_size;
+            frag_sges[i].lkey = res.mr->lkey;
+        }
+        staging_sge.addr = (uintptr_t) staging;
+        staging_sge.length = frags * frag_size;
+        staging_sge.lkey = res.mr->lkey;
+        memset(&op, 0, sizeof(op));
+        op.opcode = IBV_WR_RDMA_WRITE;
+        op.send_flags = IBV_SEND_SIGNALED;
+        op.remote_addr = res.remote_props.addr;
+        op.rkey = res.remote_props.rkey;
+        if (ctrl_sync(res.sock, 'G')) {
+            fprintf(stderr, "sync error before RDMA ops\n");
+            rc = 1;
+            goto main_exit;
+        }
+        /* gather the fragments straight from where they are with one WR */
+        op.sg_list = frag_sges.data();
+        op.num_sge = frags;
+        for (int i = 0; i < count; ++i) {
+            auto start = std::chrono::high_resolution_clock::now();
+            if (post_send_op(&res, &op) || poll_completion_quiet(&res, &wc)) {
+                fprintf(stderr, "gather write failed\n");
+                rc = 1;
+                goto main_exit;
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            gather_ns[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        }
+        log_info("%d fragments of %u bytes per RDMA write\n", frags, frag_size);
+        /* emitted before the copy variant runs, the CPU of each goes with its own result */
+        result_init(&result, "sge-gather", frags * frag_size, 1);
+        result.count = count;
+        result.has_latency = 1;
+        summarize_latency(gather_ns.data(), count, &result.lat);
+        print_latency_summary("gather (multi-SGE) write", &result.lat);
+        results_emit(&result);
+        /* copy the fragments into the staging area first and post a single segment */
+        op.sg_list = &staging_sge;
+        op.num_sge = 1;
+        for (int i = 0; i < count; ++i) {
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int j = 0; j < frags; ++j)
+                memcpy(staging + (size_t) j * frag_size, (char *) frag_sges[j].addr, frag_size);
+            if (post_send_op(&res, &op) || poll_completion_quiet(&res, &wc)) {
+                fprintf(stderr, "staged write failed\n");
+                rc = 1;
+                goto main_exit;
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            copy_ns[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        }
+        result.op = "sge-copy";
+        summarize_latency(copy_ns.data(), count, &result.lat);
+        print_latency_summary("copy to staging buffer write", &result.lat);
+        results_emit(&result);
+        if (ctrl_sync(res.sock, 'G')) {
+            fprintf(stderr, "sync error after RDMA ops\n");
+            rc = 1;
+            goto main_exit;
+        }
+    } else if (!strcmp(config.operation, "zcsend")) {
+        if (run_zcsend(&res, count)) {
+            rc = 1;
+            goto main_exit;
+        }
+    } else if (!strcmp(config.operation, "pingpong")) {
+        if (run_pingpong(&res, count)) {
+            rc = 1;
+            goto main_exit;
+        }
+    } else if (!strcmp(config.operation, "bw") || !strcmp(config.operation, "wbw")) {
+        if (run_bw(&res, count, strcmp(config.operation, "bw") ? IBV_WR_RDMA_WRITE_WITH_IMM : IBV_WR_SEND)) {
+            rc = 1;
+            goto main_exit;
+        }
+    } else if (!strcmp(config.operation, "scenario")) {
+        rc = run_scenario(&res, &scenario);
+    } else if (!strcmp(config.operation, "stream")) {
+        rc = run_stream_op(&res, count) || ctrl_sync(res.sock, 'O');
+    } else if (!strcmp(config.operation, "autotune")) {
+        rc = run_autotune(&res, count, tune_sizes) || ctrl_sync(res.sock, 'O');
+    } else if (!strcmp(config.operation, "coro")) {
+        rc = run_coro(&res, count) || ctrl_sync(res.sock, 'O');
+    } else if (!strcmp(config.operation, "dispatch")) {
+        rc = run_dispatch(&res, count) || ctrl_sync(res.sock, 'O');
+    } else if (!strcmp(config.operation, "jitter")) {
+        rc = run_jitter(&res, count) || ctrl_sync(res.sock, 'O');
+    } else if (!strcmp(config.operation, "openloop")) {
+        /* the server only waits for us to finish the sweep */
+        rc = run_load_sweep(&res, count) || ctrl_sync(res.sock, 'O');
     } else {
         fprintf(stderr, "unknown operation\n");
         goto main_exit;
@@ -594,6 +2533,8 @@ main_exit:
         fprintf(stderr, "failed to destroy resources\n");
         rc = 1;
     }
-    fprintf(stdout, "test result is %d\n", rc);
+    log_info("test result is %d\n", rc);
+    cpu_meter_close();
+    results_close();
     return rc;
 }
\ No newline at end of file
@@ -6,6 +6,19 @@
 #define RDMA_TEST_CLIENT_H
 
 #include "rdma_common.h"
+#include "endpoint.h"
+#include "results.h"
+#include "conn_pool.h"
+#include "scenario.h"
+#include "loadgen.h"
+#include "autotune.h"
+#include "coro.h"
+#include "dispatcher.h"
+#include "shared_qp.h"
+#include "realtime.h"
+
+/* ops slower than this are counted as outliers by the jitter report */
+#define JITTER_OUTLIER_NS 50000
 
 struct config_t config = {
         "mlx5_0",  /* dev_name */
@@ -13,25 +26,95 @@ struct config_t config = {
         2345, /* tcp_port */
         10241,     /* ib_port */
         0, /* gid_idx */
-        "receive" /* mode */
+        "receive", /* mode */
+        MSG_SIZE, /* buf_size */
+        1 << 16, /* chase_nodes */
+        1, /* max_sge */
+        MSG_SIZE, /* msg_size */
+        1, /* depth */
+        IBV_QPT_RC, /* qp_type */
+        0, /* peers */
+        0, /* use_rdmacm */
+        1, /* conns */
+        1, /* threads */
+        0, /* recover */
+        -1, /* inject_error */
+        1, /* spares */
+        0, /* daemon */
+        8, /* pool_bufs */
+        1 << 20, /* pool_buf_size */
+        NULL, /* scenario */
+        "text", /* result_format */
+        NULL, /* result_path */
+        NULL, /* rates */
+        "poisson", /* arrival */
+        "read", /* load_op */
+        0, /* slo_ns */
+        99.0, /* slo_percentile */
+        NULL, /* sizes */
+        NULL, /* transports */
+        0, /* selective_signal */
+        0, /* max_inline */
+        NULL, /* profile */
+        1024, /* coros */
+        0, /* shards */
+        0, /* pin */
+        NULL, /* cpus */
+        0, /* rt_prio */
+        0 /* lock_mem */
 };
 
-int resources_create(struct resources *res);
+int run_zcsend(struct resources *res, int count);
+
+int run_pingpong(struct resources *res, int count);
+
+int run_bw(struct resources *res, int count, int opcode);
+
+int report_peer_footprint(struct resources *res, int peers);
+
+int run_connbench(int conns, int threads);
+
+int post_faulty(struct resources *res, int opcode);
+
+int request_recovery(struct resources *res);
+
+void emit_latency_result(const char *op, const char *label, uint64_t *samples, int count);
+
+void emit_rate_result(const char *op, uint32_t size, int depth, int count, double secs);
+
+void fill_session(struct ctrl_session_t *session, const struct config_t *cfg, const char *op, int count);
+
+int open_session(struct resources *res, const char *op, int count);
+
+int run_poolbench(int count, int spares);
+
+int run_rdma_mt(struct resources *res, int count, int opcode, int threads);
+
+int run_scenario(struct resources *res, const struct scenario_t *sc);
+
+int run_openloop(struct resources *res, int count, int opcode, double rate, enum arrival_dist dist,
+                 struct load_point_t *pt);
+
+int run_load_sweep(struct resources *res, int count);
+
+int search_capacity(struct resources *res, int count, int opcode, enum arrival_dist dist, struct capacity_t *cap);
+
+int run_capacity_search(int count);
 
-void resources_init(struct resources *res);
+int run_stream(struct resources *res, int count, int opcode, const struct tune_t *t, double *secs);
 
-void print_config(void);
+int run_stream_op(struct resources *res, int count);
 
-int resources_destroy(struct resources *res);
+int run_autotune(struct resources *res, int count, const std::vector<uint32_t> &sizes);
 
-int sock_sync_data(int sock, int xfer_size, char *local_data, char *remote_data);
+int run_coro(struct resources *res, int count);
 
-int modify_qp_to_init(struct ibv_qp *qp);
+int run_dispatch(struct resources *res, int count);
 
-int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, uint8_t *dgid);
+int run_mpsc(int count);
 
-int modify_qp_to_rts(struct ibv_qp *qp);
+int run_cqshare(int count);
 
-int poll_completion(struct resources *res);
+int run_jitter(struct resources *res, int count);
 
 #endif //RDMA_TEST_CLIENT_H
@@ -0,0 +1,293 @@
+#include "cm_connect.h"
+
+#ifdef HAVE_RDMACM
+
+#include <rdma/rdma_cma.h>
+
+/* wait for the next CM event and check that it is the expected one, the caller acks it */
+static int cm_wait_event(struct rdma_event_channel *channel, enum rdma_cm_event_type expected,
+                         struct rdma_cm_event **event) {
+    if (rdma_get_cm_event(channel, event)) {
+        perror("rdma_get_cm_event");
+        return 1;
+    }
+    if ((*event)->event != expected) {
+        fprintf(stderr, "expected CM event %s, got %s with status %d\n", rdma_event_str(expected),
+                rdma_event_str((*event)->event), (*event)->status);
+        rdma_ack_cm_event(*event);
+        *event = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/* PD, CQ, MR and QP on the device the CM picked for this connection */
+static int cm_alloc_verbs(struct resources *res, struct config_t *cfg, struct rdma_cm_id *id) {
+    struct ibv_qp_init_attr qp_init_attr;
+    int mr_flags;
+    res->ib_ctx = id->verbs;
+    if (ibv_query_device(res->ib_ctx, &res->device_attr)) {
+        fprintf(stderr, "ibv_query_device failed\n");
+        return 1;
+    }
+    if (ibv_query_port(res->ib_ctx, id->port_num, &res->port_attr)) {
+        fprintf(stderr, "ibv_query_port on port %u failed\n", id->port_num);
+        return 1;
+    }
+    res->pd = ibv_alloc_pd(res->ib_ctx);
+    if (!res->pd) {
+        fprintf(stderr, "ibv_alloc_pd failed\n");
+        return 1;
+    }
+    res->cq = ibv_create_cq(res->ib_ctx, 2 * cfg->depth, NULL, NULL, 0);
+    if (!res->cq) {
+        fprintf(stderr, "failed to create CQ with %u entries\n", 2 * cfg->depth);
+        return 1;
+    }
+    res->buf = (char *) malloc(cfg->buf_size);
+    if (!res->buf) {
+        fprintf(stderr, "failed to malloc %zu bytes to memory buffer\n", cfg->buf_size);
+        return 1;
+    }
+    memset(res->buf, 0, cfg->buf_size);
+    mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    res->mr = ibv_reg_mr(res->pd, res->buf, cfg->buf_size, mr_flags);
+    if (!res->mr) {
+        fprintf(stderr, "ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
+        return 1;
+    }
+    if (cfg->max_sge > res->device_attr.max_sge)
+        cfg->max_sge = res->device_attr.max_sge;
+    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+    qp_init_attr.qp_type = IBV_QPT_RC;
+    qp_init_attr.sq_sig_all = 1;
+    qp_init_attr.send_cq = res->cq;
+    qp_init_attr.recv_cq = res->cq;
+    qp_init_attr.cap.max_send_wr = cfg->depth;
+    qp_init_attr.cap.max_recv_wr = cfg->depth;
+    qp_init_attr.cap.max_send_sge = cfg->max_sge;
+    qp_init_attr.cap.max_recv_sge = cfg->max_sge;
+    /* the CM drives the QP through INIT, RTR and RTS itself */
+    if (rdma_create_qp(id, res->pd, &qp_init_attr)) {
+        perror("rdma_create_qp");
+        return 1;
+    }
+    res->qp = id->qp;
+    res->qp_cap = qp_init_attr.cap;
+    log_debug("QP was created through the CM, QP number=0x%x\n", res->qp->qp_num);
+    return 0;
+}
+
+static void cm_pack_con_data(struct resources *res, struct cm_con_data_t *data) {
+    memset(data, 0, sizeof(*data));
+    data->addr = htonll((uintptr_t) res->buf);
+    data->rkey = htonl(res->mr->rkey);
+    data->qp_num = htonl(res->qp->qp_num);
+    data->lid = htons(res->port_attr.lid);
+}
+
+static int cm_unpack_con_data(const void *private_data, uint8_t private_data_len, struct resources *res) {
+    struct cm_con_data_t tmp_con_data;
+    if (!private_data || private_data_len < sizeof(struct cm_con_data_t)) {
+        fprintf(stderr, "CM private data of %u bytes doesn't carry the connection data\n", private_data_len);
+        return 1;
+    }
+    memcpy(&tmp_con_data, private_data, sizeof(tmp_con_data));
+    res->remote_props.addr = ntohll(tmp_con_data.addr);
+    res->remote_props.rkey = ntohl(tmp_con_data.rkey);
+    res->remote_props.qp_num = ntohl(tmp_con_data.qp_num);
+    res->remote_props.lid = ntohs(tmp_con_data.lid);
+    log_debug("Remote address = 0x%" PRIx64 "\n", res->remote_props.addr);
+    log_debug("Remote rkey = 0x%x\n", res->remote_props.rkey);
+    log_debug("Remote QP number = 0x%x\n", res->remote_props.qp_num);
+    return 0;
+}
+
+int cm_listen(struct resources *res, struct config_t *cfg) {
+    struct sockaddr_in addr;
+    res->cm_channel = rdma_create_event_channel();
+    if (!res->cm_channel) {
+        perror("rdma_create_event_channel");
+        return 1;
+    }
+    if (rdma_create_id(res->cm_channel, &res->cm_listen_id, NULL, RDMA_PS_TCP)) {
+        perror("rdma_create_id");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(cfg->tcp_port + CM_PORT_OFFSET);
+    if (rdma_bind_addr(res->cm_listen_id, (struct sockaddr *) &addr)) {
+        perror("rdma_bind_addr");
+        return 1;
+    }
+    if (rdma_listen(res->cm_listen_id, 1)) {
+        perror("rdma_listen");
+        return 1;
+    }
+    log_debug("waiting on port %d for RDMA-CM connection\n", cfg->tcp_port + CM_PORT_OFFSET);
+    return 0;
+}
+
+int cm_resources_create(struct resources *res, struct config_t *cfg) {
+    struct rdma_cm_event *event = NULL;
+    struct rdma_conn_param conn_param;
+    struct cm_con_data_t local_con_data;
+    struct addrinfo *resolved_addr = NULL;
+    struct addrinfo hints;
+    char service[6];
+    int rc = 0;
+    /* partially created resources are left for resources_destroy() on failure */
+    if (cfg->qp_type != IBV_QPT_RC) {
+        fprintf(stderr, "RDMA-CM connections are only supported on rc\n");
+        return 1;
+    }
+    memset(&conn_param, 0, sizeof(conn_param));
+    conn_param.private_data = &local_con_data;
+    conn_param.private_data_len = sizeof(local_con_data);
+    conn_param.retry_count = 6;
+    conn_param.rnr_retry_count = 7;
+    if (!cfg->server_name) {
+        /* server mode, cm_listen() was called before the control socket was accepted */
+        if (cm_wait_event(res->cm_channel, RDMA_CM_EVENT_CONNECT_REQUEST, &event)) {
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        res->cm_id = event->id;
+        rc = cm_unpack_con_data(event->param.conn.private_data, event->param.conn.private_data_len, res);
+        rdma_ack_cm_event(event);
+        if (rc || cm_alloc_verbs(res, cfg, res->cm_id)) {
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        cm_pack_con_data(res, &local_con_data);
+        conn_param.responder_resources = rd_atomic_depth(cfg, res->device_attr.max_qp_rd_atom);
+        conn_param.initiator_depth = rd_atomic_depth(cfg, res->device_attr.max_qp_init_rd_atom);
+        if (rdma_accept(res->cm_id, &conn_param)) {
+            perror("rdma_accept");
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        if (cm_wait_event(res->cm_channel, RDMA_CM_EVENT_ESTABLISHED, &event)) {
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        rdma_ack_cm_event(event);
+    } else {
+        /* client mode, the CM resolves the GID and the route to the server */
+        res->cm_channel = rdma_create_event_channel();
+        if (!res->cm_channel) {
+            perror("rdma_create_event_channel");
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        if (rdma_create_id(res->cm_channel, &res->cm_id, NULL, RDMA_PS_TCP)) {
+            perror("rdma_create_id");
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        sprintf(service, "%d", cfg->tcp_port + CM_PORT_OFFSET);
+        rc = getaddrinfo(cfg->server_name, service, &hints, &resolved_addr);
+        if (rc) {
+            fprintf(stderr, "%s for %s:%s\n", gai_strerror(rc), cfg->server_name, service);
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        if (rdma_resolve_addr(res->cm_id, NULL, resolved_addr->ai_addr, CM_TIMEOUT_MS) ||
+            cm_wait_event(res->cm_channel, RDMA_CM_EVENT_ADDR_RESOLVED, &event)) {
+            fprintf(stderr, "failed to resolve address of %s\n", cfg->server_name);
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        rdma_ack_cm_event(event);
+        if (rdma_resolve_route(res->cm_id, CM_TIMEOUT_MS) ||
+            cm_wait_event(res->cm_channel, RDMA_CM_EVENT_ROUTE_RESOLVED, &event)) {
+            fprintf(stderr, "failed to resolve route to %s\n", cfg->server_name);
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        rdma_ack_cm_event(event);
+        if (cm_alloc_verbs(res, cfg, res->cm_id)) {
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        cm_pack_con_data(res, &local_con_data);
+        conn_param.responder_resources = rd_atomic_depth(cfg, res->device_attr.max_qp_rd_atom);
+        conn_param.initiator_depth = rd_atomic_depth(cfg, res->device_attr.max_qp_init_rd_atom);
+        if (rdma_connect(res->cm_id, &conn_param)) {
+            perror("rdma_connect");
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        if (cm_wait_event(res->cm_channel, RDMA_CM_EVENT_ESTABLISHED, &event)) {
+            rc = 1;
+            goto cm_resources_create_exit;
+        }
+        /* the server's buffer address and rkey come back with the accept */
+        rc = cm_unpack_con_data(event->param.conn.private_data, event->param.conn.private_data_len, res);
+        rdma_ack_cm_event(event);
+        if (rc)
+            goto cm_resources_create_exit;
+    }
+    log_debug("QP %u connected through RDMA-CM\n", res->qp->qp_num);
+cm_resources_create_exit:
+    if (resolved_addr)
+        freeaddrinfo(resolved_addr);
+    return rc;
+}
+
+int cm_disconnect(struct resources *res) {
+    if (!res->cm_id)
+        return 0;
+    /* the QP belongs to the CM id, it has to go before the verbs resources it uses */
+    if (res->qp) {
+        rdma_disconnect(res->cm_id);
+        rdma_destroy_qp(res->cm_id);
+        res->qp = NULL;
+    }
+    return 0;
+}
+
+int cm_release(struct resources *res) {
+    int rc = 0;
+    if (res->cm_id && rdma_destroy_id(res->cm_id)) {
+        fprintf(stderr, "failed to destroy CM id\n");
+        rc = 1;
+    }
+    if (res->cm_listen_id && rdma_destroy_id(res->cm_listen_id)) {
+        fprintf(stderr, "failed to destroy CM listen id\n");
+        rc = 1;
+    }
+    if (res->cm_channel)
+        rdma_destroy_event_channel(res->cm_channel);
+    res->cm_id = NULL;
+    res->cm_listen_id = NULL;
+    res->cm_channel = NULL;
+    return rc;
+}
+
+#else
+
+int cm_listen(struct resources *, struct config_t *) {
+    fprintf(stderr, "built without librdmacm, only the TCP connection exchange is available\n");
+    return 1;
+}
+
+int cm_resources_create(struct resources *, struct config_t *) {
+    fprintf(stderr, "built without librdmacm, only the TCP connection exchange is available\n");
+    return 1;
+}
+
+int cm_disconnect(struct resources *) {
+    return 0;
+}
+
+int cm_release(struct resources *) {
+    return 0;
+}
+
+#endif
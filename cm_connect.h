@@ -0,0 +1,19 @@
+#ifndef RDMA_TEST_CM_CONNECT_H
+#define RDMA_TEST_CM_CONNECT_H
+
+#include "rdma_common.h"
+
+/* address resolution and route lookup timeout in millisec */
+#define CM_TIMEOUT_MS 2000
+/* the CM listens next to the TCP control port, on iWARP both share the host port space */
+#define CM_PORT_OFFSET 1
+
+int cm_listen(struct resources *res, struct config_t *cfg);
+
+int cm_resources_create(struct resources *res, struct config_t *cfg);
+
+int cm_disconnect(struct resources *res);
+
+int cm_release(struct resources *res);
+
+#endif //RDMA_TEST_CM_CONNECT_H
@@ -0,0 +1,134 @@
+#include "conn_pool.h"
+
+static std::string conn_pool_key(const char *host, int port) {
+    return std::string(host) + ":" + std::to_string(port);
+}
+
+/* full resources_create() + connect_qp() to the given peer, this is what the pool saves */
+static struct resources *conn_pool_connect(struct conn_pool_t *pool, const char *host, int port) {
+    struct ctrl_accept_t accepted;
+    struct resources *res = (struct resources *) malloc(sizeof(struct resources));
+    if (!res) {
+        fprintf(stderr, "failed to allocate pooled connection\n");
+        return NULL;
+    }
+    resources_init(res, pool->cfg);
+    res->sock = sock_connect(host, port);
+    if (res->sock < 0 || ctrl_request_session(res->sock, &pool->session, &accepted) || resources_create(res) ||
+        connect_qp(res)) {
+        fprintf(stderr, "failed to connect to %s:%d\n", host, port);
+        resources_destroy(res);
+        free(res);
+        return NULL;
+    }
+    return res;
+}
+
+static void conn_pool_close(struct resources *res) {
+    resources_destroy(res);
+    free(res);
+}
+
+/* make a returned connection look freshly connected again */
+static int conn_pool_reset(struct conn_pool_t *pool, struct resources *res) {
+    struct ibv_qp_attr attr;
+    struct ibv_qp_init_attr init_attr;
+    struct ibv_wc wc;
+    /* completions the previous user didn't reap would be mistaken for the next user's */
+    while (ibv_poll_cq(res->cq, 1, &wc) > 0)
+        ;
+    if (ibv_query_qp(res->qp, &attr, IBV_QP_STATE, &init_attr)) {
+        fprintf(stderr, "failed to query state of pooled QP\n");
+        return 1;
+    }
+    if (attr.qp_state != IBV_QPS_RTS) {
+        /* the server recovers its side when it reads the RECOVER */
+        if (ctrl_send(res->sock, CTRL_RECOVER, NULL, 0) || recover_qp(res))
+            return 1;
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->recoveries++;
+    }
+    return 0;
+}
+
+void conn_pool_init(struct conn_pool_t *pool, int spares, const struct ctrl_session_t *session,
+                    struct config_t *cfg) {
+    pool->spares = spares;
+    pool->cfg = cfg;
+    pool->session = *session;
+    pool->hits = 0;
+    pool->misses = 0;
+    pool->resets = 0;
+    pool->recoveries = 0;
+}
+
+int conn_pool_warm(struct conn_pool_t *pool, const char *host, int port) {
+    std::string key = conn_pool_key(host, port);
+    struct resources *res;
+    int missing;
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        missing = pool->spares - (int) pool->idle[key].size();
+    }
+    /* connecting happens outside the lock, it is the slow part */
+    for (; missing > 0; missing--) {
+        res = conn_pool_connect(pool, host, port);
+        if (!res)
+            return 1;
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->idle[key].push_back({res, 0});
+    }
+    return 0;
+}
+
+struct resources *conn_pool_get(struct conn_pool_t *pool, const char *host, int port) {
+    std::string key = conn_pool_key(host, port);
+    struct pooled_conn_t conn = {NULL, 0};
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        std::vector<struct pooled_conn_t> &idle = pool->idle[key];
+        if (!idle.empty()) {
+            conn = idle.back();
+            idle.pop_back();
+            pool->hits++;
+        } else {
+            pool->misses++;
+        }
+    }
+    if (!conn.res)
+        return conn_pool_connect(pool, host, port);
+    /* returned connections are only reset when they are needed again */
+    if (conn.dirty) {
+        if (conn_pool_reset(pool, conn.res)) {
+            fprintf(stderr, "pooled connection to %s couldn't be reset, reconnecting\n", key.c_str());
+            conn_pool_close(conn.res);
+            return conn_pool_connect(pool, host, port);
+        }
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->resets++;
+    }
+    return conn.res;
+}
+
+void conn_pool_put(struct conn_pool_t *pool, const char *host, int port, struct resources *res) {
+    std::string key = conn_pool_key(host, port);
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        std::vector<struct pooled_conn_t> &idle = pool->idle[key];
+        if ((int) idle.size() < pool->spares) {
+            idle.push_back({res, 1});
+            return;
+        }
+    }
+    /* enough spares already */
+    conn_pool_close(res);
+}
+
+void conn_pool_destroy(struct conn_pool_t *pool) {
+    std::lock_guard<std::mutex> guard(pool->lock);
+    for (auto &peer : pool->idle) {
+        for (auto &conn : peer.second)
+            conn_pool_close(conn.res);
+    }
+    pool->idle.clear();
+}
@@ -0,0 +1,41 @@
+#ifndef RDMA_TEST_CONN_POOL_H
+#define RDMA_TEST_CONN_POOL_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "rdma_common.h"
+#include "endpoint.h"
+
+/* an established connection waiting in the pool */
+struct pooled_conn_t {
+    struct resources *res;
+    int dirty; /* handed out before, reset before it is handed out again */
+};
+
+/* established connections to known peers, keyed by "host:port" */
+struct conn_pool_t {
+    int spares;                                                 /* warm connections kept per peer */
+    struct config_t *cfg;                                       /* what every pooled connection is set up with */
+    struct ctrl_session_t session;                              /* what every pooled connection asks for */
+    std::mutex lock;                                            /* protects idle and the counters */
+    std::map<std::string, std::vector<struct pooled_conn_t>> idle;
+    int hits;                                                   /* handed out from the pool */
+    int misses;                                                 /* had to be connected on demand */
+    int resets;                                                 /* dirty connections reset on the way out */
+    int recoveries;                                             /* of those, QPs brought back from ERR */
+};
+
+void conn_pool_init(struct conn_pool_t *pool, int spares, const struct ctrl_session_t *session,
+                    struct config_t *cfg);
+
+int conn_pool_warm(struct conn_pool_t *pool, const char *host, int port);
+
+struct resources *conn_pool_get(struct conn_pool_t *pool, const char *host, int port);
+
+void conn_pool_put(struct conn_pool_t *pool, const char *host, int port, struct resources *res);
+
+void conn_pool_destroy(struct conn_pool_t *pool);
+
+#endif //RDMA_TEST_CONN_POOL_H
@@ -0,0 +1,255 @@
+#include <algorithm>
+#include "coro.h"
+
+namespace rdma {
+
+std::coroutine_handle<> Task::promise_type::final_awaiter::await_suspend(
+        std::coroutine_handle<promise_type> h) noexcept {
+    promise_type &p = h.promise();
+    /* straight back into whoever awaited us, without growing the stack */
+    if (p.continuation)
+        return p.continuation;
+    if (p.reactor) {
+        p.reactor->running_--;
+        if (p.rc)
+            p.reactor->failed_ = 1;
+    }
+    return std::noop_coroutine();
+}
+
+Task &Task::operator=(Task &&other) noexcept {
+    if (this != &other) {
+        if (h_)
+            h_.destroy();
+        h_ = other.h_;
+        other.h_ = nullptr;
+    }
+    return *this;
+}
+
+Task::~Task() {
+    if (h_)
+        h_.destroy();
+}
+
+std::coroutine_handle<> Task::await_suspend(std::coroutine_handle<> caller) noexcept {
+    h_.promise().continuation = caller;
+    return h_;
+}
+
+OpAwaiter::OpAwaiter(AsyncEndpoint *ep, const struct rdma_op_t &op, int recv, uint32_t *byte_len)
+        : ep_(ep), op_(op), recv_(recv), byte_len_(byte_len) {
+    sge_ = *op.sg_list;
+}
+
+bool OpAwaiter::await_suspend(std::coroutine_handle<> h) {
+    h_ = h;
+    if (ep_->acquire(this)) {
+        /* nothing was posted, carry on with the error */
+        rc_ = 1;
+        return false;
+    }
+    return true;
+}
+
+/* wr_id is this awaiter, it stays put in the suspended coroutine's frame until the completion is in */
+int OpAwaiter::post() {
+    op_.sg_list = &sge_;
+    op_.num_sge = 1;
+    op_.wr_id = (uintptr_t) this;
+    if (recv_)
+        return post_receive_op(ep_->res_, &op_);
+    /* the reactor needs a completion for every op, whatever the QP signals by default */
+    op_.send_flags |= IBV_SEND_SIGNALED;
+    return post_send_op(ep_->res_, &op_);
+}
+
+void OpAwaiter::complete(const struct ibv_wc *wc) {
+    if (wc->status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "WR with opcode %d failed with status 0x%x\n", op_.opcode, wc->status);
+        rc_ = 1;
+    }
+    if (byte_len_)
+        *byte_len_ = wc->byte_len;
+}
+
+Reactor::~Reactor() {
+    /* tasks left over after a stall are destroyed with whatever they were waiting for */
+    tasks_.clear();
+}
+
+void Reactor::spawn(Task &&task) {
+    task.h_.promise().reactor = this;
+    tasks_.push_back(std::move(task));
+}
+
+void Reactor::attach(struct ibv_cq *cq) {
+    if (std::find(cqs_.begin(), cqs_.end(), cq) == cqs_.end())
+        cqs_.push_back(cq);
+}
+
+void Reactor::detach(struct ibv_cq *cq) {
+    for (auto *ep : endpoints_) {
+        if (ep->res_->cq == cq)
+            return;
+    }
+    cqs_.erase(std::remove(cqs_.begin(), cqs_.end(), cq), cqs_.end());
+}
+
+/* resumes the coroutine of every completion found, -1 if the CQ couldn't be polled */
+int Reactor::poll(struct ibv_cq *cq) {
+    struct ibv_wc wc[16];
+    int got = ibv_poll_cq(cq, 16, wc);
+    int i;
+    stats_.polls++;
+    if (got < 0) {
+        fprintf(stderr, "poll CQ failed\n");
+        return -1;
+    }
+    if (got == 0)
+        stats_.empty_polls++;
+    for (i = 0; i < got; i++) {
+        OpAwaiter *op = (OpAwaiter *) (uintptr_t) wc[i].wr_id;
+        op->complete(&wc[i]);
+        /* the freed slot goes to the next waiting op before this coroutine can post another one */
+        op->ep_->release(op->recv_);
+        stats_.completions++;
+        op->h_.resume();
+    }
+    return got;
+}
+
+int Reactor::run() {
+    uint64_t last_progress = now_ns();
+    unsigned long spins = 0;
+    size_t started = 0;
+    int got;
+    failed_ = 0;
+    while (true) {
+        /* tasks spawned from inside other tasks get started here too */
+        while (started < tasks_.size()) {
+            std::coroutine_handle<Task::promise_type> h = tasks_[started++].h_;
+            running_++;
+            h.resume();
+        }
+        if (!running_)
+            break;
+        got = 0;
+        for (size_t i = 0; i < cqs_.size(); i++) {
+            int n = poll(cqs_[i]);
+            if (n < 0)
+                return 1;
+            got += n;
+        }
+        if (got > 0) {
+            last_progress = now_ns();
+        } else if ((++spins & 4095) == 0 && now_ns() - last_progress > (uint64_t) MAX_POLL_CQ_TIMEOUT * 1000000) {
+            fprintf(stderr, "completion wasn't found in the CQ after timeout, %d tasks still waiting\n", running_);
+            return 1;
+        }
+    }
+    tasks_.clear();
+    return failed_;
+}
+
+AsyncEndpoint::AsyncEndpoint(Reactor &reactor, struct resources *res)
+        : reactor_(&reactor), res_(res), send_slots_(res->qp_cap.max_send_wr), recv_slots_(res->qp_cap.max_recv_wr) {
+    reactor_->endpoints_.push_back(this);
+    reactor_->attach(res->cq);
+}
+
+AsyncEndpoint::~AsyncEndpoint() {
+    auto &eps = reactor_->endpoints_;
+    eps.erase(std::remove(eps.begin(), eps.end(), this), eps.end());
+    reactor_->detach(res_->cq);
+}
+
+/* posts op if its queue has room, otherwise queues it behind the others */
+int AsyncEndpoint::acquire(OpAwaiter *op) {
+    int *slots = op->recv_ ? &recv_slots_ : &send_slots_;
+    std::deque<OpAwaiter *> &wait = op->recv_ ? recv_wait_ : send_wait_;
+    if (*slots > 0 && wait.empty()) {
+        if (op->post()) {
+            fprintf(stderr, "failed to post %s WR\n", op->recv_ ? "receive" : "send");
+            return 1;
+        }
+        (*slots)--;
+        return 0;
+    }
+    wait.push_back(op);
+    reactor_->stats_.queued++;
+    reactor_->stats_.max_waiting = std::max(reactor_->stats_.max_waiting, (int) waiting());
+    return 0;
+}
+
+/* a WR of this queue completed, its slot goes to the ops waiting for one */
+void AsyncEndpoint::release(int recv) {
+    int *slots = recv ? &recv_slots_ : &send_slots_;
+    std::deque<OpAwaiter *> &wait = recv ? recv_wait_ : send_wait_;
+    (*slots)++;
+    while (*slots > 0 && !wait.empty()) {
+        OpAwaiter *op = wait.front();
+        wait.pop_front();
+        if (op->post()) {
+            fprintf(stderr, "failed to post %s WR\n", recv ? "receive" : "send");
+            op->rc_ = 1;
+            op->h_.resume();
+            continue;
+        }
+        (*slots)--;
+    }
+}
+
+OpAwaiter AsyncEndpoint::one_sided(int opcode, size_t local_off, uint64_t remote_off, uint32_t length) {
+    struct rdma_op_t op;
+    struct ibv_sge sge;
+    sge.addr = (uintptr_t) (res_->buf + local_off);
+    sge.length = length;
+    sge.lkey = res_->mr->lkey;
+    memset(&op, 0, sizeof(op));
+    op.opcode = opcode;
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    op.remote_addr = res_->remote_props.addr + remote_off;
+    op.rkey = res_->remote_props.rkey;
+    return OpAwaiter(this, op, 0, nullptr);
+}
+
+OpAwaiter AsyncEndpoint::write(size_t local_off, uint64_t remote_off, uint32_t length) {
+    return one_sided(IBV_WR_RDMA_WRITE, local_off, remote_off, length);
+}
+
+OpAwaiter AsyncEndpoint::read(size_t local_off, uint64_t remote_off, uint32_t length) {
+    return one_sided(IBV_WR_RDMA_READ, local_off, remote_off, length);
+}
+
+OpAwaiter AsyncEndpoint::send(size_t local_off, uint32_t length) {
+    return one_sided(IBV_WR_SEND, local_off, 0, length);
+}
+
+OpAwaiter AsyncEndpoint::recv(size_t local_off, uint32_t length, uint32_t *byte_len) {
+    struct rdma_op_t op;
+    struct ibv_sge sge;
+    sge.addr = (uintptr_t) (res_->buf + local_off);
+    sge.length = length;
+    sge.lkey = res_->mr->lkey;
+    memset(&op, 0, sizeof(op));
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    return OpAwaiter(this, op, 1, byte_len);
+}
+
+OpAwaiter AsyncEndpoint::fetch_add(size_t local_off, uint64_t remote_off, uint64_t add) {
+    OpAwaiter op = one_sided(IBV_WR_ATOMIC_FETCH_AND_ADD, local_off, remote_off, sizeof(uint64_t));
+    op.op_.compare_add = add;
+    return op;
+}
+
+OpAwaiter AsyncEndpoint::compare_swap(size_t local_off, uint64_t remote_off, uint64_t compare, uint64_t swap) {
+    OpAwaiter op = one_sided(IBV_WR_ATOMIC_CMP_AND_SWP, local_off, remote_off, sizeof(uint64_t));
+    op.op_.compare_add = compare;
+    op.op_.swap = swap;
+    return op;
+}
+
+} // namespace rdma
@@ -0,0 +1,162 @@
+#ifndef RDMA_TEST_CORO_H
+#define RDMA_TEST_CORO_H
+
+#include <coroutine>
+#include <deque>
+#include <vector>
+#include "rdma_common.h"
+
+/*
+ * Coroutines over post/poll. An operation is posted when it is awaited, with the address of its awaiter as
+ * wr_id, and its coroutine is resumed by the reactor of the thread once the completion with that wr_id
+ * comes in. Awaiting an operation gives 0 or 1 like the rest of the code, a failed completion is reported
+ * by the reactor. A reactor, its endpoints and their coroutines all belong to one thread.
+ */
+namespace rdma {
+
+class Reactor;
+class AsyncEndpoint;
+
+/* a coroutine returning a status code, it starts running when awaited or when its reactor runs */
+class Task {
+public:
+    struct promise_type {
+        int rc = 0;
+        std::coroutine_handle<> continuation;  /* the coroutine awaiting this one, if any */
+        Reactor *reactor = nullptr;             /* the reactor running this one, if spawned */
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept;
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(int v) { rc = v; }
+        /* the code doesn't throw */
+        void unhandled_exception() { abort(); }
+    };
+
+    Task() = default;
+    explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    Task(Task &&other) noexcept : h_(other.h_) { other.h_ = nullptr; }
+    Task &operator=(Task &&other) noexcept;
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task();
+
+    bool await_ready() const noexcept { return !h_ || h_.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept;
+    int await_resume() const noexcept { return h_ ? h_.promise().rc : 1; }
+    bool done() const { return !h_ || h_.done(); }
+    int rc() const { return h_ ? h_.promise().rc : 1; }
+
+private:
+    friend class Reactor;
+    std::coroutine_handle<promise_type> h_;
+};
+
+/* one posted WR, awaiting it posts it and suspends until its completion is in */
+class OpAwaiter {
+public:
+    OpAwaiter(AsyncEndpoint *ep, const struct rdma_op_t &op, int recv, uint32_t *byte_len);
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h);
+    int await_resume() const noexcept { return rc_; }
+
+private:
+    friend class Reactor;
+    friend class AsyncEndpoint;
+    int post();
+    void complete(const struct ibv_wc *wc);
+
+    AsyncEndpoint *ep_;
+    struct rdma_op_t op_;
+    struct ibv_sge sge_;
+    int recv_;
+    uint32_t *byte_len_;
+    int rc_ = 0;
+    std::coroutine_handle<> h_;
+};
+
+/* what a reactor has seen since it was created */
+struct reactor_stats_t {
+    uint64_t completions;   /* CQEs handed to their coroutines */
+    uint64_t polls;         /* ibv_poll_cq() calls */
+    uint64_t empty_polls;   /* of them, those that found nothing */
+    uint64_t queued;        /* operations that waited for a free WR slot */
+    int max_waiting;        /* most operations waiting for a slot at once */
+};
+
+/*
+ * Polls the CQs of its endpoints and resumes the coroutine each completion belongs to. Spawned tasks
+ * run until they all finish, run() then returns non-zero if any of them failed or the CQs stalled.
+ */
+class Reactor {
+public:
+    Reactor() = default;
+    ~Reactor();
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+    void spawn(Task &&task);
+    int run();
+    const struct reactor_stats_t &stats() const { return stats_; }
+
+private:
+    friend class AsyncEndpoint;
+    friend struct Task::promise_type::final_awaiter;
+    void attach(struct ibv_cq *cq);
+    void detach(struct ibv_cq *cq);
+    int poll(struct ibv_cq *cq);
+
+    std::vector<struct ibv_cq *> cqs_;
+    std::vector<Task> tasks_;
+    std::vector<AsyncEndpoint *> endpoints_;
+    int running_ = 0;
+    int failed_ = 0;
+    struct reactor_stats_t stats_ = {};
+};
+
+/*
+ * The operations of one connection as awaitables. Offsets are into res->buf and the peer's buffer, at most
+ * as many WRs as the QP was created for are posted on each queue and the rest wait their turn in order.
+ */
+class AsyncEndpoint {
+public:
+    AsyncEndpoint(Reactor &reactor, struct resources *res);
+    ~AsyncEndpoint();
+    AsyncEndpoint(const AsyncEndpoint &) = delete;
+    AsyncEndpoint &operator=(const AsyncEndpoint &) = delete;
+
+    OpAwaiter write(size_t local_off, uint64_t remote_off, uint32_t length);
+    OpAwaiter read(size_t local_off, uint64_t remote_off, uint32_t length);
+    OpAwaiter send(size_t local_off, uint32_t length);
+    /* byte_len, if given, gets the size of what arrived */
+    OpAwaiter recv(size_t local_off, uint32_t length, uint32_t *byte_len = nullptr);
+    /* the remote word's old value lands at local_off */
+    OpAwaiter fetch_add(size_t local_off, uint64_t remote_off, uint64_t add);
+    OpAwaiter compare_swap(size_t local_off, uint64_t remote_off, uint64_t compare, uint64_t swap);
+
+    struct resources *res() { return res_; }
+    /* operations waiting for a WR slot */
+    size_t waiting() const { return send_wait_.size() + recv_wait_.size(); }
+
+private:
+    friend class OpAwaiter;
+    friend class Reactor;
+    OpAwaiter one_sided(int opcode, size_t local_off, uint64_t remote_off, uint32_t length);
+    int acquire(OpAwaiter *op);
+    void release(int recv);
+
+    Reactor *reactor_;
+    struct resources *res_;
+    int send_slots_;
+    int recv_slots_;
+    std::deque<OpAwaiter *> send_wait_;
+    std::deque<OpAwaiter *> recv_wait_;
+};
+
+} // namespace rdma
+
+#endif //RDMA_TEST_CORO_H
@@ -0,0 +1,120 @@
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "cpu_meter.h"
+
+enum {
+    METER_CYCLES,
+    METER_INSTRUCTIONS,
+    METER_CACHE_MISSES,
+    METER_CTX_SWITCHES,
+    METER_EVENTS
+};
+
+static int fds[METER_EVENTS] = {-1, -1, -1, -1};
+static int opened = 0;
+static int user_only = 0;
+
+static int open_event(uint32_t type, uint64_t config, int exclude_kernel) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.inherit = 1;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    /* not a group, inherited counters can't be read as one; each is scaled on its own instead */
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void close_events(int first, int last) {
+    int err = errno;
+    for (int i = first; i <= last; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+    errno = err;
+}
+
+/* all three or none, errno tells why */
+static int open_hw_events(int exclude_kernel) {
+    static const uint64_t events[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                      PERF_COUNT_HW_CACHE_MISSES};
+    for (int i = METER_CYCLES; i <= METER_CACHE_MISSES; i++) {
+        fds[i] = open_event(PERF_TYPE_HARDWARE, events[i], exclude_kernel);
+        if (fds[i] < 0) {
+            close_events(METER_CYCLES, METER_CACHE_MISSES);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int cpu_meter_open(void) {
+    if (opened)
+        return 0;
+    user_only = 0;
+    if (open_hw_events(0)) {
+        /* perf_event_paranoid 2 still lets us count our own user space */
+        if (errno == EACCES && !open_hw_events(1))
+            user_only = 1;
+        else
+            log_debug("no hardware counters (%s), CPU time only\n", strerror(errno));
+    }
+    fds[METER_CTX_SWITCHES] = open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 0);
+    opened = 1;
+    return 0;
+}
+
+int cpu_meter_ready(void) {
+    return opened;
+}
+
+static uint64_t read_event(int fd) {
+    uint64_t v[3];
+    if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v))
+        return 0;
+    /* counted only part of the time it was enabled, another event had the PMU for the rest */
+    if (v[2] && v[2] < v[1])
+        return (uint64_t) ((double) v[0] * v[1] / v[2]);
+    return v[0];
+}
+
+void cpu_meter_read(struct cpu_usage_t *u) {
+    struct rusage ru;
+    memset(u, 0, sizeof(*u));
+    if (!getrusage(RUSAGE_SELF, &ru)) {
+        u->user_s = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+        u->sys_s = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+        u->ctx_switches = ru.ru_nvcsw + ru.ru_nivcsw;
+    }
+    if (fds[METER_CYCLES] >= 0) {
+        u->cycles = read_event(fds[METER_CYCLES]);
+        u->instructions = read_event(fds[METER_INSTRUCTIONS]);
+        u->cache_misses = read_event(fds[METER_CACHE_MISSES]);
+        u->hw = 1;
+        u->user_only = user_only;
+    }
+    if (fds[METER_CTX_SWITCHES] >= 0)
+        u->ctx_switches = read_event(fds[METER_CTX_SWITCHES]);
+}
+
+void cpu_usage_delta(const struct cpu_usage_t *from, const struct cpu_usage_t *to, struct cpu_usage_t *d) {
+    d->user_s = to->user_s - from->user_s;
+    d->sys_s = to->sys_s - from->sys_s;
+    d->cycles = to->cycles - from->cycles;
+    d->instructions = to->instructions - from->instructions;
+    d->cache_misses = to->cache_misses - from->cache_misses;
+    d->ctx_switches = to->ctx_switches - from->ctx_switches;
+    d->hw = to->hw;
+    d->user_only = to->user_only;
+}
+
+void cpu_meter_close(void) {
+    close_events(METER_CYCLES, METER_CTX_SWITCHES);
+    opened = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef RDMA_TEST_CPU_METER_H
+#define RDMA_TEST_CPU_METER_H
+
+#include "rdma_common.h"
+
+/* CPU the whole process used, threads included, counters stay 0 where the kernel doesn't allow them */
+struct cpu_usage_t {
+    double user_s;           /* getrusage() */
+    double sys_s;
+    uint64_t cycles;         /* perf_event_open() hardware counters, hw says whether they were counted */
+    uint64_t instructions;
+    uint64_t cache_misses;
+    uint64_t ctx_switches;   /* the software event, or voluntary plus involuntary from getrusage() */
+    int hw;
+    int user_only;           /* the hardware counters leave the kernel out, perf_event_paranoid asks for it */
+};
+
+/*
+ * Opens the counters for this thread and every thread it starts afterwards, so it goes before any worker
+ * exists. A thread's counts are added to ours when it exits; the benchmarks join theirs before reporting.
+ * Without permission for hardware counters (perf_event_paranoid, containers, VMs) only getrusage() is used.
+ */
+int cpu_meter_open(void);
+
+int cpu_meter_ready(void);
+
+/* totals since the meter was opened, scaled up where the kernel multiplexed a counter */
+void cpu_meter_read(struct cpu_usage_t *u);
+
+/* to - from */
+void cpu_usage_delta(const struct cpu_usage_t *from, const struct cpu_usage_t *to, struct cpu_usage_t *d);
+
+void cpu_meter_close(void);
+
+#endif //RDMA_TEST_CPU_METER_H
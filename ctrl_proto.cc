@@ -0,0 +1,213 @@
+#include <errno.h>
+#include "ctrl_proto.h"
+
+static const char *ctrl_type_name(uint16_t type) {
+    switch (type) {
+        case CTRL_HELLO:
+            return "HELLO";
+        case CTRL_ACCEPT:
+            return "ACCEPT";
+        case CTRL_REJECT:
+            return "REJECT";
+        case CTRL_CONN_DATA:
+            return "CONN_DATA";
+        case CTRL_PSN:
+            return "PSN";
+        case CTRL_SYNC:
+            return "SYNC";
+        case CTRL_RECOVER:
+            return "RECOVER";
+        case CTRL_STEP:
+            return "STEP";
+        case CTRL_END:
+            return "END";
+        default:
+            return "unknown";
+    }
+}
+
+static int write_full(int sock, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    ssize_t n;
+    while (len > 0) {
+        n = write(sock, p, len);
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_full(int sock, void *data, size_t len) {
+    char *p = (char *) data;
+    ssize_t n;
+    while (len > 0) {
+        n = read(sock, p, len);
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int ctrl_send(int sock, uint16_t type, const void *payload, uint32_t len) {
+    struct ctrl_hdr_t hdr;
+    hdr.magic = htonl(CTRL_MAGIC);
+    hdr.version = htons(CTRL_VERSION);
+    hdr.type = htons(type);
+    hdr.len = htonl(len);
+    if (write_full(sock, &hdr, sizeof(hdr)) || (len && write_full(sock, payload, len))) {
+        fprintf(stderr, "failed to send %s frame\n", ctrl_type_name(type));
+        return 1;
+    }
+    return 0;
+}
+
+/* turns a header that came off the wire into host order and checks it can be read on */
+static int ctrl_check_hdr(struct ctrl_hdr_t *hdr, uint32_t max_len) {
+    hdr->magic = ntohl(hdr->magic);
+    hdr->version = ntohs(hdr->version);
+    hdr->type = ntohs(hdr->type);
+    hdr->len = ntohl(hdr->len);
+    if (hdr->magic != CTRL_MAGIC) {
+        fprintf(stderr, "peer doesn't speak the control protocol (magic 0x%x)\n", hdr->magic);
+        return 1;
+    }
+    if (hdr->len > max_len) {
+        fprintf(stderr, "%s frame of %u bytes doesn't fit into %u\n", ctrl_type_name(hdr->type), hdr->len, max_len);
+        return 1;
+    }
+    return 0;
+}
+
+/* reads one frame, hdr comes back in host order. The version is left for the caller to check */
+int ctrl_recv(int sock, struct ctrl_hdr_t *hdr, void *payload, uint32_t max_len) {
+    if (read_full(sock, hdr, sizeof(*hdr))) {
+        fprintf(stderr, "control connection closed by peer\n");
+        return 1;
+    }
+    if (ctrl_check_hdr(hdr, max_len))
+        return 1;
+    if (hdr->len && read_full(sock, payload, hdr->len)) {
+        fprintf(stderr, "control connection closed in the middle of a frame\n");
+        return 1;
+    }
+    return 0;
+}
+
+int ctrl_recv_some(int sock, struct ctrl_frame_t *f) {
+    char *hdr = (char *) &f->hdr;
+    ssize_t n;
+    while (f->got < sizeof(f->hdr) || f->got < sizeof(f->hdr) + f->hdr.len) {
+        /* the header first, its length says how much of the payload belongs to the frame */
+        if (f->got < sizeof(f->hdr))
+            n = recv(sock, hdr + f->got, sizeof(f->hdr) - f->got, MSG_DONTWAIT);
+        else
+            n = recv(sock, f->payload + (f->got - sizeof(f->hdr)), sizeof(f->hdr) + f->hdr.len - f->got,
+                     MSG_DONTWAIT);
+        if (n == 0) {
+            fprintf(stderr, f->got ? "control connection closed in the middle of a frame\n" :
+                            "control connection closed by peer\n");
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("control socket recv");
+            return -1;
+        }
+        f->got += n;
+        if (f->got == sizeof(f->hdr) && ctrl_check_hdr(&f->hdr, sizeof(f->payload)))
+            return -1;
+    }
+    return 1;
+}
+
+static int ctrl_check_type(const struct ctrl_hdr_t *hdr, uint16_t type, uint32_t len) {
+    if (hdr->version != CTRL_VERSION) {
+        fprintf(stderr, "peer speaks control protocol version %u, we speak %u\n", hdr->version, CTRL_VERSION);
+        return 1;
+    }
+    if (hdr->type != type || hdr->len != len) {
+        fprintf(stderr, "expected %s frame, peer sent %s of %u bytes\n", ctrl_type_name(type),
+                ctrl_type_name(hdr->type), hdr->len);
+        return 1;
+    }
+    return 0;
+}
+
+int ctrl_frame_expect(const struct ctrl_frame_t *f, uint16_t type, uint32_t len) {
+    return ctrl_check_type(&f->hdr, type, len);
+}
+
+/* a different tag means the two sides went down different code paths */
+static int ctrl_check_tag(char remote_tag, char tag) {
+    if (remote_tag != tag) {
+        fprintf(stderr, "peer is at barrier '%c', we are at '%c'\n", remote_tag, tag);
+        return 1;
+    }
+    return 0;
+}
+
+int ctrl_frame_sync(const struct ctrl_frame_t *f, char tag) {
+    return ctrl_check_type(&f->hdr, CTRL_SYNC, 1) || ctrl_check_tag(f->payload[0], tag);
+}
+
+/* reads one frame and fails unless it is of the given type and exactly len bytes long */
+static int ctrl_expect(int sock, uint16_t type, void *payload, uint32_t len) {
+    struct ctrl_hdr_t hdr;
+    if (ctrl_recv(sock, &hdr, payload, len))
+        return 1;
+    return ctrl_check_type(&hdr, type, len);
+}
+
+/* both sides send their frame first, so this can't deadlock */
+int ctrl_exchange(int sock, uint16_t type, const void *local, void *remote, uint32_t len) {
+    if (ctrl_send(sock, type, local, len))
+        return 1;
+    return ctrl_expect(sock, type, remote, len);
+}
+
+int ctrl_sync(int sock, char tag) {
+    char remote_tag;
+    if (ctrl_exchange(sock, CTRL_SYNC, &tag, &remote_tag, 1))
+        return 1;
+    return ctrl_check_tag(remote_tag, tag);
+}
+
+/* sends a HELLO or STEP and waits for the server to accept or reject it */
+static int ctrl_request(int sock, uint16_t type, const struct ctrl_session_t *session,
+                        struct ctrl_accept_t *accepted) {
+    struct ctrl_hdr_t hdr;
+    char payload[CTRL_MAX_PAYLOAD + 1];
+    if (ctrl_send(sock, type, session, sizeof(*session)))
+        return 1;
+    if (ctrl_recv(sock, &hdr, payload, CTRL_MAX_PAYLOAD))
+        return 1;
+    if (hdr.type == CTRL_REJECT) {
+        payload[hdr.len] = '\0';
+        fprintf(stderr, "server rejected the %s: %s\n", type == CTRL_HELLO ? "session" : "step", payload);
+        return 1;
+    }
+    if (hdr.version != CTRL_VERSION || hdr.type != CTRL_ACCEPT || hdr.len != sizeof(*accepted)) {
+        fprintf(stderr, "unexpected %s frame (version %u) in reply to %s\n", ctrl_type_name(hdr.type),
+                hdr.version, ctrl_type_name(type));
+        return 1;
+    }
+    memcpy(accepted, payload, sizeof(*accepted));
+    accepted->buf_size = ntohll(accepted->buf_size);
+    accepted->msg_size = ntohl(accepted->msg_size);
+    return 0;
+}
+
+int ctrl_request_session(int sock, const struct ctrl_session_t *session, struct ctrl_accept_t *accepted) {
+    return ctrl_request(sock, CTRL_HELLO, session, accepted);
+}
+
+int ctrl_request_step(int sock, const struct ctrl_session_t *step, struct ctrl_accept_t *accepted) {
+    return ctrl_request(sock, CTRL_STEP, step, accepted);
+}
@@ -0,0 +1,89 @@
+#ifndef RDMA_TEST_CTRL_PROTO_H
+#define RDMA_TEST_CTRL_PROTO_H
+
+#include "rdma_common.h"
+
+/* "RDTC", first word of every control frame */
+#define CTRL_MAGIC 0x52445443
+/* bumped whenever a frame layout changes, both sides must agree */
+#define CTRL_VERSION 2
+/* longest frame payload we accept */
+#define CTRL_MAX_PAYLOAD 256
+/* longest operation name a session can ask for */
+#define CTRL_OP_LEN 16
+
+/* frame types */
+enum ctrl_type {
+    CTRL_HELLO = 1,   /* client asks for a session, payload is ctrl_session_t */
+    CTRL_ACCEPT,      /* server agreed, payload is ctrl_accept_t */
+    CTRL_REJECT,      /* server refused, payload is the reason */
+    CTRL_CONN_DATA,   /* cm_con_data_t for connect_qp() */
+    CTRL_PSN,         /* fresh PSN during QP recovery */
+    CTRL_SYNC,        /* barrier, payload is a one-byte tag both sides must agree on */
+    CTRL_RECOVER,     /* sent instead of a CTRL_SYNC to ask for QP recovery */
+    CTRL_STEP,        /* next step of a scenario session, payload is ctrl_session_t */
+    CTRL_END          /* the scenario is over */
+};
+
+/* session flags */
+#define CTRL_F_RECOVER 0x1 /* the client may ask for QP recovery */
+#define CTRL_F_RDMACM 0x2  /* the QP is connected through RDMA-CM */
+
+/* precedes every frame, all fields in network order */
+struct ctrl_hdr_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint32_t len; /* payload bytes following the header */
+} __attribute__((packed));
+
+/* what the client wants to run, all fields in network order */
+struct ctrl_session_t {
+    char op[CTRL_OP_LEN];
+    uint32_t count;       /* iterations */
+    uint32_t msg_size;
+    uint32_t depth;
+    uint32_t max_sge;
+    uint32_t qp_type;
+    uint32_t chase_nodes;
+    uint32_t flags;       /* CTRL_F_* */
+} __attribute__((packed));
+
+/* how the server set itself up for the session, in network order */
+struct ctrl_accept_t {
+    uint64_t buf_size; /* bytes the server registered */
+    uint32_t msg_size; /* message size after the server's adjustments */
+} __attribute__((packed));
+
+/* a frame read a piece at a time, for sockets an event loop only reads once they are readable */
+struct ctrl_frame_t {
+    struct ctrl_hdr_t hdr;          /* in host order once all of it is in */
+    char payload[CTRL_MAX_PAYLOAD];
+    uint32_t got;                   /* bytes of the frame read so far, 0 before the next one */
+};
+
+int ctrl_send(int sock, uint16_t type, const void *payload, uint32_t len);
+
+int ctrl_recv(int sock, struct ctrl_hdr_t *hdr, void *payload, uint32_t max_len);
+
+/*
+ * Reads what the socket has of the frame without blocking: 1 once the frame is complete, 0 while more of it
+ * is to come, -1 if the peer closed the connection or doesn't speak the protocol. Never reads past the frame.
+ */
+int ctrl_recv_some(int sock, struct ctrl_frame_t *f);
+
+/* fails unless the complete frame is of the given type and exactly len bytes long */
+int ctrl_frame_expect(const struct ctrl_frame_t *f, uint16_t type, uint32_t len);
+
+/* fails unless the complete frame is a SYNC with our tag */
+int ctrl_frame_sync(const struct ctrl_frame_t *f, char tag);
+
+int ctrl_exchange(int sock, uint16_t type, const void *local, void *remote, uint32_t len);
+
+int ctrl_sync(int sock, char tag);
+
+int ctrl_request_session(int sock, const struct ctrl_session_t *session, struct ctrl_accept_t *accepted);
+
+int ctrl_request_step(int sock, const struct ctrl_session_t *step, struct ctrl_accept_t *accepted);
+
+#endif //RDMA_TEST_CTRL_PROTO_H
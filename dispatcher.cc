@@ -0,0 +1,133 @@
+#include <algorithm>
+#include "dispatcher.h"
+
+/* most completions taken in one poll */
+#define DISPATCH_MAX_POLL 64
+
+namespace rdma {
+
+Dispatcher::Dispatcher(int poll_batch) : poll_batch_(std::min(std::max(poll_batch, 1), DISPATCH_MAX_POLL)) {
+}
+
+Dispatcher::~Dispatcher() {
+    stop();
+}
+
+int Dispatcher::attach(struct resources *res) {
+    std::unique_ptr<conn_t> conn(new conn_t);
+    if (poller_.joinable()) {
+        fprintf(stderr, "connections have to be attached before the dispatcher starts\n");
+        return -1;
+    }
+    conn->res = res;
+    conn->slots = res->qp_cap.max_send_wr;
+    conn->free_slots = conn->slots;
+    conns_.push_back(std::move(conn));
+    if (std::find(cqs_.begin(), cqs_.end(), res->cq) == cqs_.end())
+        cqs_.push_back(res->cq);
+    return (int) conns_.size() - 1;
+}
+
+int Dispatcher::start() {
+    if (poller_.joinable())
+        return 0;
+    memset(&stats_, 0, sizeof(stats_));
+    stopping_ = 0;
+    failed_ = 0;
+    poller_ = std::thread(&Dispatcher::run, this);
+    return 0;
+}
+
+int Dispatcher::stop() {
+    if (!poller_.joinable())
+        return failed_.load();
+    stopping_ = 1;
+    poller_.join();
+    return failed_.load();
+}
+
+int Dispatcher::submit(int conn, struct rdma_op_t *op, struct dispatch_req_t *req) {
+    conn_t *c;
+    int cur;
+    if (conn < 0 || conn >= (int) conns_.size()) {
+        fprintf(stderr, "no connection %d on the dispatcher\n", conn);
+        return 1;
+    }
+    c = conns_[conn].get();
+    /* claim a send slot, the dispatcher hands it back with the completion */
+    while (true) {
+        cur = c->free_slots.load();
+        if (cur > 0 && c->free_slots.compare_exchange_weak(cur, cur - 1))
+            break;
+        if (failed_.load() || !poller_.joinable()) {
+            fprintf(stderr, "the dispatcher isn't running\n");
+            return 1;
+        }
+        std::this_thread::yield();
+    }
+    req->conn = conn;
+    op->wr_id = (uintptr_t) req;
+    op->send_flags |= IBV_SEND_SIGNALED;
+    /* the provider serializes posts to one QP from several threads */
+    if (post_send_op(c->res, op)) {
+        c->free_slots++;
+        return 1;
+    }
+    return 0;
+}
+
+/* calls back every request that completed, -1 if the CQ couldn't be polled */
+int Dispatcher::poll(struct ibv_cq *cq) {
+    struct ibv_wc wc[DISPATCH_MAX_POLL];
+    int got = ibv_poll_cq(cq, poll_batch_, wc);
+    int i;
+    stats_.polls++;
+    if (got < 0) {
+        fprintf(stderr, "poll CQ failed\n");
+        return -1;
+    }
+    if (got == 0)
+        stats_.empty_polls++;
+    for (i = 0; i < got; i++) {
+        struct dispatch_req_t *req = (struct dispatch_req_t *) (uintptr_t) wc[i].wr_id;
+        if (wc[i].status != IBV_WC_SUCCESS)
+            stats_.failed++;
+        /* the slot is free before the callback runs, it may well submit the next WR */
+        conns_[req->conn]->free_slots++;
+        stats_.completions++;
+        req->cb(req->ctx, req, &wc[i]);
+    }
+    return got;
+}
+
+void Dispatcher::run() {
+    uint64_t last_progress = now_ns();
+    unsigned long spins = 0;
+    int outstanding;
+    int got;
+    while (true) {
+        got = 0;
+        for (auto *cq : cqs_) {
+            int n = poll(cq);
+            if (n < 0) {
+                failed_ = 1;
+                return;
+            }
+            got += n;
+        }
+        outstanding = 0;
+        for (auto &c : conns_)
+            outstanding += c->slots - c->free_slots.load();
+        if (got > 0 || !outstanding) {
+            last_progress = now_ns();
+            if (!outstanding && stopping_.load())
+                return;
+        } else if ((++spins & 4095) == 0 && now_ns() - last_progress > (uint64_t) MAX_POLL_CQ_TIMEOUT * 1000000) {
+            fprintf(stderr, "completion wasn't found in the CQ after timeout, %d WRs outstanding\n", outstanding);
+            failed_ = 1;
+            return;
+        }
+    }
+}
+
+} // namespace rdma
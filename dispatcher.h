@@ -0,0 +1,73 @@
+#ifndef RDMA_TEST_DISPATCHER_H
+#define RDMA_TEST_DISPATCHER_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "rdma_common.h"
+
+struct dispatch_req_t;
+
+/* called on the dispatcher's thread once the WR of req has completed, wc->status tells how */
+typedef void (*dispatch_cb)(void *ctx, struct dispatch_req_t *req, const struct ibv_wc *wc);
+
+/* caller-owned request, it must stay put until its callback has run */
+struct dispatch_req_t {
+    dispatch_cb cb;   /* completion callback */
+    void *ctx;        /* passed back to cb */
+    int conn;         /* connection the WR was posted on, set by submit() */
+};
+
+/* what the dispatcher has seen since it was started */
+struct dispatch_stats_t {
+    uint64_t completions;  /* callbacks made */
+    uint64_t polls;        /* ibv_poll_cq() calls */
+    uint64_t empty_polls;  /* of them, those that found nothing */
+    uint64_t failed;       /* completions with an error status */
+};
+
+/*
+ * One thread that drains the CQs of its connections in batches and calls the callback of each request,
+ * found through wr_id, so the threads that submit never poll. submit() may be called from any number of
+ * threads, it waits for one of the QP's send slots and posts the WR signaled. Every WR on an attached CQ
+ * has to come through submit().
+ */
+namespace rdma {
+
+class Dispatcher {
+public:
+    explicit Dispatcher(int poll_batch = 16);
+    ~Dispatcher();
+    Dispatcher(const Dispatcher &) = delete;
+    Dispatcher &operator=(const Dispatcher &) = delete;
+    /* before start() only, gives the number submit() knows the connection by */
+    int attach(struct resources *res);
+    int start();
+    /* waits for the outstanding WRs, non-zero if a CQ failed or stopped completing them */
+    int stop();
+    int submit(int conn, struct rdma_op_t *op, struct dispatch_req_t *req);
+    /* only stable once stopped */
+    const struct dispatch_stats_t &stats() const { return stats_; }
+
+private:
+    struct conn_t {
+        struct resources *res;
+        int slots;                    /* send WRs the QP was created for */
+        std::atomic<int> free_slots;
+    };
+    void run();
+    int poll(struct ibv_cq *cq);
+
+    std::vector<std::unique_ptr<conn_t>> conns_;
+    std::vector<struct ibv_cq *> cqs_;
+    std::thread poller_;
+    std::atomic<int> stopping_{0};
+    std::atomic<int> failed_{0};
+    int poll_batch_;
+    struct dispatch_stats_t stats_ = {};
+};
+
+} // namespace rdma
+
+#endif //RDMA_TEST_DISPATCHER_H
@@ -0,0 +1,835 @@
+#include <algorithm>
+#include "endpoint.h"
+
+void print_config(const struct config_t *cfg) {
+    log_debug(" ------------------------------------------------\n");
+    log_debug(" Device name : \"%s\"\n", cfg->dev_name);
+    log_debug(" IB port : %u\n", cfg->ib_port);
+    if (cfg->server_name)
+        log_debug(" IP : %s\n", cfg->server_name);
+    log_debug(" TCP port : %u\n", cfg->tcp_port);
+    if (cfg->gid_idx >= 0)
+        log_debug(" GID index : %u\n", cfg->gid_idx);
+    log_debug(" Transport : %s\n", transport_name(cfg->qp_type));
+    log_debug(" Connection setup : %s\n", cfg->use_rdmacm ? "rdmacm" : "tcp");
+    log_debug(" ------------------------------------------------\n\n");
+}
+
+void resources_init(struct resources *res, struct config_t *cfg) {
+    memset(res, 0, sizeof *res);
+    res->sock = -1;
+    res->cfg = cfg;
+}
+
+int resolve_device_name(struct config_t *cfg) {
+    struct ibv_device **dev_list;
+    int num_devices;
+    if (cfg->dev_name)
+        return 0;
+    dev_list = ibv_get_device_list(&num_devices);
+    if (!dev_list)
+        return 1;
+    if (num_devices > 0) {
+        cfg->dev_name = strdup(ibv_get_device_name(dev_list[0]));
+        log_debug("device not specified, using first one found: %s\n", cfg->dev_name);
+    }
+    ibv_free_device_list(dev_list);
+    return cfg->dev_name ? 0 : 1;
+}
+
+struct ibv_context *open_device(struct config_t *cfg) {
+    struct ibv_device **dev_list = NULL;
+    struct ibv_device *ib_dev = NULL;
+    struct ibv_context *ib_ctx;
+    int num_devices;
+    int i;
+    log_debug("searching for IB devices in host\n");
+    /* get device names in the system */
+    dev_list = ibv_get_device_list(&num_devices);
+    if (!dev_list) {
+        fprintf(stderr, "failed to get IB devices list\n");
+        return NULL;
+    }
+    /* if there isn't any IB device in host */
+    if (!num_devices) {
+        fprintf(stderr, "found %d device(s)\n", num_devices);
+        ibv_free_device_list(dev_list);
+        return NULL;
+    }
+    log_debug("found %d device(s)\n", num_devices);
+    if (resolve_device_name(cfg)) {
+        ibv_free_device_list(dev_list);
+        return NULL;
+    }
+    /* search for the specific device in device list */
+    for (i = 0; i < num_devices; i++) {
+        if (!strcmp(ibv_get_device_name(dev_list[i]), cfg->dev_name)) {
+            ib_dev = dev_list[i];
+            break;
+        }
+    }
+    /* if the device wasn't found in host */
+    if (!ib_dev) {
+        fprintf(stderr, "IB device %s wasn't found\n", cfg->dev_name);
+        ibv_free_device_list(dev_list);
+        return NULL;
+    }
+    /* get device handle */
+    ib_ctx = ibv_open_device(ib_dev);
+    if (!ib_ctx)
+        fprintf(stderr, "failed to open device %s\n", cfg->dev_name);
+    /* We are now done with device list, free it */
+    ibv_free_device_list(dev_list);
+    return ib_ctx;
+}
+
+int resources_create(struct resources *res) {
+    struct config_t *cfg = res->cfg;
+    struct ibv_qp_init_attr qp_init_attr;
+    rdma::Device dev;
+    rdma::ProtectionDomain pd;
+    rdma::CompletionQueue cq;
+    rdma::MemoryRegion mr;
+    rdma::QueuePair qp;
+    /* the daemon's device, PD and buffer are set already and stay the daemon's */
+    struct ibv_context *ib_ctx = res->ib_ctx;
+    struct ibv_pd *pd_handle = res->pd;
+    struct ibv_mr *mr_handle = res->mr;
+    /* a server shard hands in the CQ all of its QPs complete on */
+    struct ibv_cq *cq_handle = res->cq;
+    size_t size;
+    int mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    int cq_size = 0;
+    int max_sge;
+    int rc = 0;
+    uint64_t phase_start = now_ns();
+    /* the socket may have been connected or accepted by the caller already */
+    if (res->sock < 0) {
+        if (!cfg->server_name)
+            log_debug("waiting on port %d for TCP connection\n", cfg->tcp_port);
+        res->sock = sock_connect(cfg->server_name, cfg->tcp_port);
+    }
+    if (res->sock < 0) {
+        fprintf(stderr, "failed to establish TCP connection on port %d\n", cfg->tcp_port);
+        return -1;
+    }
+    log_debug("TCP connection was established\n");
+    res->setup_times.addr_exchange = now_ns() - phase_start;
+    phase_start = now_ns();
+    if (!ib_ctx) {
+        if (dev.open(cfg)) {
+            rc = 1;
+            goto resources_create_exit;
+        }
+        ib_ctx = dev.get();
+    }
+    /* query port properties */
+    if (ibv_query_port(ib_ctx, cfg->ib_port, &res->port_attr)) {
+        fprintf(stderr, "ibv_query_port on port %u failed\n", cfg->ib_port);
+        rc = 1;
+        goto resources_create_exit;
+    }
+    /* a datagram can't be larger than the path MTU */
+    if (cfg->qp_type == IBV_QPT_UD && cfg->msg_size > (128u << res->port_attr.active_mtu)) {
+        fprintf(stderr, "UD messages are limited to %u bytes on port %u\n", 128u << res->port_attr.active_mtu,
+                cfg->ib_port);
+        rc = 1;
+        goto resources_create_exit;
+    }
+    /* query device capabilities, the scatter/gather limits are taken from here */
+    if (ibv_query_device(ib_ctx, &res->device_attr)) {
+        fprintf(stderr, "ibv_query_device on device %s failed\n", cfg->dev_name);
+        rc = 1;
+        goto resources_create_exit;
+    }
+    res->setup_times.device_open = now_ns() - phase_start;
+    phase_start = now_ns();
+    if (!pd_handle) {
+        if (pd.alloc(ib_ctx)) {
+            rc = 1;
+            goto resources_create_exit;
+        }
+        pd_handle = pd.get();
+    }
+    /* RC peers may also target the buffer with atomics where the device has them */
+    if (cfg->qp_type == IBV_QPT_RC && res->device_attr.atomic_cap != IBV_ATOMIC_NONE)
+        mr_flags |= IBV_ACCESS_REMOTE_ATOMIC;
+    res->setup_times.pd_alloc = now_ns() - phase_start;
+    phase_start = now_ns();
+    if (!cq_handle) {
+        /* each side keeps at most depth WRs outstanding on each of its queues */
+        cq_size = 2 * cfg->depth;
+        if (cq.create(ib_ctx, cq_size)) {
+            rc = 1;
+            goto resources_create_exit;
+        }
+        cq_handle = cq.get();
+    }
+    res->setup_times.cq_create = now_ns() - phase_start;
+    phase_start = now_ns();
+    if (!res->shared_buf) {
+        /* allocate the memory buffer that will hold the data */
+        size = cfg->buf_size;
+        /* UD receives need room for the GRH in front of the payload, it is kept at the tail of the buffer */
+        if (cfg->qp_type == IBV_QPT_UD)
+            size += UD_GRH_SIZE;
+        if (mr.alloc(pd_handle, size, mr_flags)) {
+            rc = 1;
+            goto resources_create_exit;
+        }
+        mr_handle = mr.get();
+    }
+    log_debug("MR was registered with addr=%p, lkey=0x%x, rkey=0x%x, flags=0x%x\n", mr_handle->addr,
+              mr_handle->lkey, mr_handle->rkey, mr_flags);
+    res->setup_times.mr_reg = now_ns() - phase_start;
+    phase_start = now_ns();
+    /* create the Queue Pair */
+    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+    qp_init_attr.qp_type = cfg->qp_type;
+    qp_init_attr.sq_sig_all = !cfg->selective_signal;
+    qp_init_attr.send_cq = cq_handle;
+    qp_init_attr.recv_cq = cq_handle;
+    qp_init_attr.cap.max_send_wr = cfg->depth;
+    qp_init_attr.cap.max_recv_wr = cfg->depth;
+    /* never ask for more scatter/gather entries than the device supports, the GRH takes an extra receive SGE on UD */
+    max_sge = res->device_attr.max_sge - (cfg->qp_type == IBV_QPT_UD ? 1 : 0);
+    if (max_sge < 1) {
+        fprintf(stderr, "device supports only %d SGEs per WR, too few for UD receives\n", res->device_attr.max_sge);
+        rc = 1;
+        goto resources_create_exit;
+    }
+    if (cfg->max_sge > max_sge) {
+        log_info("device supports only %d SGEs per WR, requested %d\n", max_sge, cfg->max_sge);
+        cfg->max_sge = max_sge;
+    }
+    qp_init_attr.cap.max_send_sge = cfg->max_sge;
+    qp_init_attr.cap.max_recv_sge = cfg->max_sge;
+    if (cfg->qp_type == IBV_QPT_UD)
+        qp_init_attr.cap.max_recv_sge++;
+    qp_init_attr.cap.max_inline_data = cfg->max_inline;
+    if (qp.create(pd_handle, &qp_init_attr) && cfg->max_inline) {
+        /* devices differ in how much inline data they take, go without rather than fail */
+        log_info("QP with %u bytes of inline data was refused, creating it without\n", cfg->max_inline);
+        qp_init_attr.cap.max_inline_data = 0;
+        qp.create(pd_handle, &qp_init_attr);
+    }
+    if (!qp) {
+        fprintf(stderr, "failed to create QP\n");
+        rc = 1;
+        goto resources_create_exit;
+    }
+    /* ibv_create_qp() reports back the capabilities that were actually granted */
+    res->qp_cap = qp_init_attr.cap;
+    res->setup_times.qp_create = now_ns() - phase_start;
+    log_debug("QP was created, QP number=0x%x\n", qp.get()->qp_num);
+    /* everything is in place, from here on resources_destroy() owns it */
+    res->ib_ctx = ib_ctx;
+    dev.release();
+    res->pd = pd_handle;
+    pd.release();
+    res->cq = cq_handle;
+    cq.release();
+    if (!res->shared_buf) {
+        res->mr = mr.release(&res->buf);
+        if (cfg->qp_type == IBV_QPT_UD)
+            res->grh = res->buf + cfg->buf_size;
+    }
+    res->qp = qp.release();
+    resources_create_exit:
+    if (rc) {
+        /* Error encountered, whatever was created is released on the way out */
+        if (res->sock >= 0) {
+            if (close(res->sock))
+                fprintf(stderr, "failed to close socket\n");
+            res->sock = -1;
+        }
+    }
+    return rc;
+}
+
+int resources_destroy(struct resources *res) {
+    int rc = 0;
+    /* a QP created through the CM is torn down through it */
+    if (cm_disconnect(res))
+        rc = 1;
+    if (res->ah)
+        if (ibv_destroy_ah(res->ah)) {
+            fprintf(stderr, "failed to destroy AH\n");
+            rc = 1;
+        }
+    if (res->qp)
+        if (ibv_destroy_qp(res->qp)) {
+            fprintf(stderr, "failed to destroy QP\n");
+            rc = 1;
+        }
+    /* the daemon's buffers and device stay registered and open for the next session */
+    if (res->mr && !res->shared_buf)
+        if (ibv_dereg_mr(res->mr)) {
+            fprintf(stderr, "failed to deregister MR\n");
+            rc = 1;
+        }
+    if (res->buf && !res->shared_buf)
+        free(res->buf);
+    if (res->cq && !res->shared_cq)
+        if (ibv_destroy_cq(res->cq)) {
+            fprintf(stderr, "failed to destroy CQ\n");
+            rc = 1;
+        }
+    if (res->pd && !res->shared_dev)
+        if (ibv_dealloc_pd(res->pd)) {
+            fprintf(stderr, "failed to deallocate PD\n");
+            rc = 1;
+        }
+    if (res->ib_ctx && !res->cm_id && !res->shared_dev)
+        if (ibv_close_device(res->ib_ctx)) {
+            fprintf(stderr, "failed to close device context\n");
+            rc = 1;
+        }
+    if (res->sock >= 0)
+        if (close(res->sock)) {
+            fprintf(stderr, "failed to close socket\n");
+            rc = 1;
+        }
+    if (cm_release(res))
+        rc = 1;
+    return rc;
+}
+
+/*
+ * Reads and atomics the QP takes in, no more than the peer keeps in flight. Both sides settle on the
+ * smaller of their depths, as RDMA-CM does with the connection parameters.
+ */
+static uint8_t dest_rd_atomic(const struct resources *res) {
+    return std::min(rd_atomic_depth(res->cfg, res->device_attr.max_qp_rd_atom), res->remote_props.init_rd_atomic);
+}
+
+/* and the ones it keeps in flight, no more than the peer takes in */
+static uint8_t init_rd_atomic(const struct resources *res) {
+    return std::min(rd_atomic_depth(res->cfg, res->device_attr.max_qp_init_rd_atom), res->remote_props.rd_atomic);
+}
+
+int connect_qp_local(struct resources *res, struct cm_con_data_t *local) {
+    const struct config_t *cfg = res->cfg;
+    union ibv_gid my_gid;
+    if (cfg->gid_idx >= 0) {
+        if (ibv_query_gid(res->ib_ctx, cfg->ib_port, cfg->gid_idx, &my_gid)) {
+            fprintf(stderr, "could not get gid for port %d, index %d\n", cfg->ib_port, cfg->gid_idx);
+            return 1;
+        }
+    } else {
+        memset(&my_gid, 0, sizeof my_gid);
+    }
+    local->addr = htonll((uintptr_t) res->buf);
+    local->rkey = htonl(res->mr->rkey);
+    local->qp_num = htonl(res->qp->qp_num);
+    local->lid = htons(res->port_attr.lid);
+    memcpy(local->gid, &my_gid, 16);
+    local->rd_atomic = rd_atomic_depth(cfg, res->device_attr.max_qp_rd_atom);
+    local->init_rd_atomic = rd_atomic_depth(cfg, res->device_attr.max_qp_init_rd_atom);
+    log_debug("\nLocal LID = 0x%x\n", res->port_attr.lid);
+    return 0;
+}
+
+int connect_qp_remote(struct resources *res, const struct cm_con_data_t *remote) {
+    const struct config_t *cfg = res->cfg;
+    struct cm_con_data_t remote_con_data;
+    int rc = 0;
+    uint64_t phase_start;
+    remote_con_data.addr = ntohll(remote->addr);
+    remote_con_data.rkey = ntohl(remote->rkey);
+    remote_con_data.qp_num = ntohl(remote->qp_num);
+    remote_con_data.lid = ntohs(remote->lid);
+    memcpy(remote_con_data.gid, remote->gid, 16);
+    remote_con_data.rd_atomic = remote->rd_atomic;
+    remote_con_data.init_rd_atomic = remote->init_rd_atomic;
+    res->remote_props = remote_con_data;
+    log_debug("Remote address = 0x%" PRIx64 "\n", remote_con_data.addr);
+    log_debug("Remote rkey = 0x%x\n", remote_con_data.rkey);
+    log_debug("Remote QP number = 0x%x\n", remote_con_data.qp_num);
+    log_debug("Remote LID = 0x%x\n", remote_con_data.lid);
+    if (cfg->gid_idx >= 0) {
+        uint8_t *p = remote_con_data.gid;
+        log_debug("Remote GID = %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:"
+                        "%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
+                p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+                p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
+    }
+    phase_start = now_ns();
+    /* modify the QP to init */
+    rc = modify_qp_to_init(res->qp, cfg, res->device_attr.atomic_cap);
+    if (rc) {
+        fprintf(stderr, "failed to modify QP state to INIT\n");
+        goto connect_qp_remote_exit;
+    }
+    res->setup_times.qp_init = now_ns() - phase_start;
+    phase_start = now_ns();
+    /* modify the QP to RTR */
+    rc = modify_qp_to_rtr(res->qp, cfg, remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid, 0,
+                          dest_rd_atomic(res));
+    if (rc) {
+        fprintf(stderr, "failed to modify QP state to RTR\n");
+        goto connect_qp_remote_exit;
+    }
+    res->setup_times.qp_rtr = now_ns() - phase_start;
+    phase_start = now_ns();
+    rc = modify_qp_to_rts(res->qp, 0, init_rd_atomic(res));
+    if (rc) {
+        fprintf(stderr, "failed to modify QP state to RTS\n");
+        goto connect_qp_remote_exit;
+    }
+    /* datagrams carry their destination in an address handle instead of the QP context */
+    if (cfg->qp_type == IBV_QPT_UD) {
+        struct ibv_ah_attr ah_attr;
+        fill_ah_attr(&ah_attr, cfg, remote_con_data.lid, remote_con_data.gid);
+        res->ah = ibv_create_ah(res->pd, &ah_attr);
+        if (!res->ah) {
+            fprintf(stderr, "failed to create AH\n");
+            rc = 1;
+            goto connect_qp_remote_exit;
+        }
+    }
+    log_debug("QP %u successfully connected\n", res->qp->qp_num);
+    res->setup_times.qp_rts = now_ns() - phase_start;
+    connect_qp_remote_exit:
+    return rc;
+}
+
+int connect_qp(struct resources *res) {
+    struct cm_con_data_t local_con_data;
+    struct cm_con_data_t remote_con_data;
+    int rc = 0;
+    uint64_t phase_start;
+    rc = connect_qp_local(res, &local_con_data);
+    if (rc)
+        goto connect_qp_exit;
+    phase_start = now_ns();
+    /* exchange using TCP sockets info required to connect QPs */
+    if (ctrl_exchange(res->sock, CTRL_CONN_DATA, &local_con_data, &remote_con_data, sizeof(struct cm_con_data_t))) {
+        fprintf(stderr, "failed to exchange connection data between sides\n");
+        rc = 1;
+        goto connect_qp_exit;
+    }
+    res->setup_times.addr_exchange += now_ns() - phase_start;
+    rc = connect_qp_remote(res, &remote_con_data);
+    if (rc)
+        goto connect_qp_exit;
+    phase_start = now_ns();
+    /* sync to make sure that both sides are in states that they can connect to prevent packet loss */
+    if (ctrl_sync(res->sock, 'Q')) {
+        fprintf(stderr, "sync error after QPs are were moved to RTS\n");
+        rc = 1;
+    }
+    res->setup_times.addr_exchange += now_ns() - phase_start;
+    connect_qp_exit:
+    return rc;
+}
+
+int recover_qp_begin(struct resources *res, uint32_t *local_psn) {
+    struct ibv_wc wc;
+    if (res->cm_id) {
+        fprintf(stderr, "QPs connected through RDMA-CM can't be recovered in place\n");
+        return 1;
+    }
+    /* drop whatever the error flushed into the CQ, MRs, PD and CQ are kept */
+    while (!res->shared_cq && ibv_poll_cq(res->cq, 1, &wc) > 0)
+        ;
+    if (modify_qp_to_reset(res->qp))
+        return 1;
+    /* start over from fresh PSNs so nothing from before the error is accepted */
+    *local_psn = (uint32_t) lrand48() & 0xffffff;
+    return 0;
+}
+
+int recover_qp_finish(struct resources *res, uint32_t local_psn, uint32_t remote_psn) {
+    if (modify_qp_to_init(res->qp, res->cfg, res->device_attr.atomic_cap) ||
+        modify_qp_to_rtr(res->qp, res->cfg, res->remote_props.qp_num, res->remote_props.lid, res->remote_props.gid,
+                         remote_psn, dest_rd_atomic(res)) ||
+        modify_qp_to_rts(res->qp, local_psn, init_rd_atomic(res))) {
+        fprintf(stderr, "failed to bring QP back to RTS\n");
+        return 1;
+    }
+    return 0;
+}
+
+int recover_qp(struct resources *res) {
+    uint32_t local_psn;
+    uint32_t remote_psn;
+    uint32_t tmp_psn;
+    uint64_t start = now_ns();
+    if (recover_qp_begin(res, &local_psn))
+        return 1;
+    tmp_psn = htonl(local_psn);
+    if (ctrl_exchange(res->sock, CTRL_PSN, &tmp_psn, &remote_psn, sizeof(uint32_t))) {
+        fprintf(stderr, "failed to exchange PSNs during recovery\n");
+        return 1;
+    }
+    remote_psn = ntohl(remote_psn);
+    if (recover_qp_finish(res, local_psn, remote_psn))
+        return 1;
+    /* both sides have to be in RTS again before anything is posted */
+    if (ctrl_sync(res->sock, 'Q')) {
+        fprintf(stderr, "sync error after QP recovery\n");
+        return 1;
+    }
+    log_info("QP %u recovered in %.1f us, local PSN 0x%x, remote PSN 0x%x\n", res->qp->qp_num,
+            (now_ns() - start) / 1e3, local_psn, remote_psn);
+    return 0;
+}
+
+int modify_qp_to_init(struct ibv_qp *qp, const struct config_t *cfg, enum ibv_atomic_cap atomic_cap) {
+    struct ibv_qp_attr attr;
+    int flags;
+    int rc;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.port_num = cfg->ib_port;
+    attr.pkey_index = 0;
+    if (qp->qp_type == IBV_QPT_UD) {
+        /* datagram QPs are matched on the Q_Key, there is no remote access */
+        attr.qkey = UD_QKEY;
+        flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY;
+    } else if (qp->qp_type == IBV_QPT_UC) {
+        /* UC has no responder resources for reads or atomics */
+        attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+        flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
+    } else {
+        attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+        /* atomics only where the device has them, as for the MR */
+        if (atomic_cap != IBV_ATOMIC_NONE)
+            attr.qp_access_flags |= IBV_ACCESS_REMOTE_ATOMIC;
+        flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
+    }
+    rc = ibv_modify_qp(qp, &attr, flags);
+    if (rc) {
+        fprintf(stderr, "failed to modify QP state to INIT\n");
+    }
+    return rc;
+}
+
+void fill_ah_attr(struct ibv_ah_attr *ah_attr, const struct config_t *cfg, uint16_t dlid, uint8_t *dgid) {
+    memset(ah_attr, 0, sizeof(*ah_attr));
+    ah_attr->is_global = 0;
+    ah_attr->dlid = dlid;
+    ah_attr->sl = 0;
+    ah_attr->src_path_bits = 0;
+    ah_attr->port_num = cfg->ib_port;
+    if (cfg->gid_idx >= 0) {
+        ah_attr->is_global = 1;
+        ah_attr->port_num = 1;
+        memcpy(&ah_attr->grh.dgid, dgid, 16);
+        ah_attr->grh.flow_label = 0;
+        ah_attr->grh.hop_limit = 1;
+        ah_attr->grh.sgid_index = cfg->gid_idx;
+        ah_attr->grh.traffic_class = 0;
+    }
+}
+
+int modify_qp_to_reset(struct ibv_qp *qp) {
+    struct ibv_qp_attr attr;
+    int rc;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RESET;
+    rc = ibv_modify_qp(qp, &attr, IBV_QP_STATE);
+    if (rc) {
+        fprintf(stderr, "failed to modify QP state to RESET\n");
+    }
+    return rc;
+}
+
+int modify_qp_to_rtr(struct ibv_qp *qp, const struct config_t *cfg, uint32_t remote_qpn, uint16_t dlid,
+                     uint8_t *dgid, uint32_t rq_psn, uint8_t max_dest_rd_atomic) {
+    struct ibv_qp_attr attr;
+    int flags;
+    int rc;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    if (qp->qp_type == IBV_QPT_UD) {
+        /* the destination of a datagram is given per WR */
+        flags = IBV_QP_STATE;
+    } else {
+        attr.path_mtu = IBV_MTU_256;
+        attr.dest_qp_num = remote_qpn;
+        attr.rq_psn = rq_psn;
+        /* the peer's reads and atomics in flight, a deeper autotuner search only pays off if they fit */
+        attr.max_dest_rd_atomic = max_dest_rd_atomic;
+        attr.min_rnr_timer = 0x12;
+        fill_ah_attr(&attr.ah_attr, cfg, dlid, dgid);
+        flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+                IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+        /* no reads and no RNR NAKs on UC */
+        if (qp->qp_type == IBV_QPT_UC)
+            flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN;
+    }
+    rc = ibv_modify_qp(qp, &attr, flags);
+    if (rc)
+        fprintf(stderr, "failed to modify QP state to RTR\n");
+    return rc;
+}
+
+int modify_qp_to_rts(struct ibv_qp *qp, uint32_t sq_psn, uint8_t max_rd_atomic) {
+    struct ibv_qp_attr attr;
+    int flags;
+    int rc;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.timeout = 0x12;
+    attr.retry_cnt = 6;
+    /* pipelined sends can briefly outrun the peer's reposted receives, keep retrying instead of failing */
+    attr.rnr_retry = 7;
+    attr.sq_psn = sq_psn;
+    attr.max_rd_atomic = max_rd_atomic;
+    flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+            IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
+    /* nothing is acknowledged on UC and UD, so there are no retry or read attributes */
+    if (qp->qp_type == IBV_QPT_UC || qp->qp_type == IBV_QPT_UD)
+        flags = IBV_QP_STATE | IBV_QP_SQ_PSN;
+    rc = ibv_modify_qp(qp, &attr, flags);
+    if (rc) {
+        fprintf(stderr, "failed to modify QP state to RTS\n");
+    }
+    return rc;
+}
+
+int poll_completion(struct resources *res) {
+    struct ibv_wc wc;
+    unsigned long start_time_msec;
+    unsigned long cur_time_msec;
+    struct timeval cur_time;
+    int poll_result;
+    int rc = 0;
+    /* poll the completion for a while before giving up of doing it .. */
+    gettimeofday(&cur_time, NULL);
+    start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
+    int count = 0;
+    do {
+        count++;
+        poll_result = ibv_poll_cq(res->cq, 1, &wc);
+        gettimeofday(&cur_time, NULL);
+        cur_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
+    } while ((poll_result == 0) && ((cur_time_msec - start_time_msec) < MAX_POLL_CQ_TIMEOUT));
+    log_debug("poll count: %d\n", count);
+    if (poll_result < 0) {
+        /* poll CQ failed */
+        fprintf(stderr, "poll CQ failed\n");
+        rc = 1;
+    } else if (poll_result == 0) {
+        /* the CQ is empty */
+        fprintf(stderr, "completion wasn't found in the CQ after timeout\n");
+        rc = 1;
+    } else {
+        /* CQE found */
+        log_debug("completion was found in CQ with status 0x%x\n", wc.status);
+        /* check the completion status (here we don't care about the completion opcode */
+        if (wc.status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", wc.status, wc.vendor_err);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+namespace rdma {
+
+Device::~Device() {
+    if (ctx_ && ibv_close_device(ctx_))
+        fprintf(stderr, "failed to close device context\n");
+}
+
+int Device::open(struct config_t *cfg) {
+    ctx_ = open_device(cfg);
+    return ctx_ ? 0 : 1;
+}
+
+struct ibv_context *Device::release() {
+    struct ibv_context *ctx = ctx_;
+    ctx_ = nullptr;
+    return ctx;
+}
+
+ProtectionDomain::~ProtectionDomain() {
+    if (pd_ && ibv_dealloc_pd(pd_))
+        fprintf(stderr, "failed to deallocate PD\n");
+}
+
+int ProtectionDomain::alloc(struct ibv_context *ctx) {
+    pd_ = ibv_alloc_pd(ctx);
+    if (!pd_) {
+        fprintf(stderr, "ibv_alloc_pd failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+struct ibv_pd *ProtectionDomain::release() {
+    struct ibv_pd *pd = pd_;
+    pd_ = nullptr;
+    return pd;
+}
+
+CompletionQueue::~CompletionQueue() {
+    if (cq_ && ibv_destroy_cq(cq_))
+        fprintf(stderr, "failed to destroy CQ\n");
+}
+
+int CompletionQueue::create(struct ibv_context *ctx, int entries) {
+    cq_ = ibv_create_cq(ctx, entries, NULL, NULL, 0);
+    if (!cq_) {
+        fprintf(stderr, "failed to create CQ with %u entries\n", entries);
+        return 1;
+    }
+    return 0;
+}
+
+struct ibv_cq *CompletionQueue::release() {
+    struct ibv_cq *cq = cq_;
+    cq_ = nullptr;
+    return cq;
+}
+
+MemoryRegion::~MemoryRegion() {
+    if (mr_ && ibv_dereg_mr(mr_))
+        fprintf(stderr, "failed to deregister MR\n");
+    free(buf_);
+}
+
+int MemoryRegion::alloc(struct ibv_pd *pd, size_t size, int access) {
+    buf_ = (char *) malloc(size);
+    if (!buf_) {
+        fprintf(stderr, "failed to malloc %zu bytes to memory buffer\n", size);
+        return 1;
+    }
+    memset(buf_, 0, size);
+    mr_ = ibv_reg_mr(pd, buf_, size, access);
+    if (!mr_) {
+        fprintf(stderr, "ibv_reg_mr failed with mr_flags=0x%x\n", access);
+        return 1;
+    }
+    return 0;
+}
+
+struct ibv_mr *MemoryRegion::release(char **buf) {
+    struct ibv_mr *mr = mr_;
+    *buf = buf_;
+    mr_ = nullptr;
+    buf_ = nullptr;
+    return mr;
+}
+
+QueuePair::~QueuePair() {
+    if (qp_ && ibv_destroy_qp(qp_))
+        fprintf(stderr, "failed to destroy QP\n");
+}
+
+/* quiet on failure, the caller may try again with other capabilities */
+int QueuePair::create(struct ibv_pd *pd, struct ibv_qp_init_attr *attr) {
+    qp_ = ibv_create_qp(pd, attr);
+    return qp_ ? 0 : 1;
+}
+
+struct ibv_qp *QueuePair::release() {
+    struct ibv_qp *qp = qp_;
+    qp_ = nullptr;
+    return qp;
+}
+
+Endpoint::Endpoint(const struct config_t &cfg) : cfg_(cfg) {
+    resources_init(&res_, &cfg_);
+}
+
+Endpoint::~Endpoint() {
+    close();
+}
+
+int Endpoint::open(int sock) {
+    res_.sock = sock;
+    if (cfg_.use_rdmacm) {
+        /* the CM connects the QP while creating it */
+        if (cm_resources_create(&res_, &cfg_)) {
+            fprintf(stderr, "failed to connect through RDMA-CM\n");
+            return 1;
+        }
+        return 0;
+    }
+    return resources_create(&res_);
+}
+
+int Endpoint::connect() {
+    if (res_.cm_id)
+        return 0;
+    return connect_qp(&res_);
+}
+
+int Endpoint::recover() {
+    return recover_qp(&res_);
+}
+
+/* safe to call more than once, the endpoint can be opened again afterwards */
+int Endpoint::close() {
+    int rc = resources_destroy(&res_);
+    resources_init(&res_, &cfg_);
+    return rc;
+}
+
+int SharedCq::open(struct config_t *cfg, int entries) {
+    struct ibv_device_attr attr;
+    if (dev_.open(cfg))
+        return 1;
+    if (ibv_query_device(dev_.get(), &attr)) {
+        fprintf(stderr, "ibv_query_device on device %s failed\n", cfg->dev_name);
+        return 1;
+    }
+    entries_ = entries > 0 ? std::min(entries, attr.max_cqe) : attr.max_cqe;
+    if (pd_.alloc(dev_.get()) || cq_.create(dev_.get(), entries_))
+        return 1;
+    /* the driver may round it up */
+    entries_ = cq_.get()->cqe;
+    reserved_ = 0;
+    log_debug("shared CQ with %d entries created\n", entries_);
+    return 0;
+}
+
+int SharedCq::attach(struct resources *res) {
+    int need = 2 * res->cfg->depth;
+    if (reserved_ + need > entries_) {
+        fprintf(stderr, "the shared CQ has %d of its %d entries left, the connection needs %d\n",
+                entries_ - reserved_, entries_, need);
+        return 1;
+    }
+    reserved_ += need;
+    res->ib_ctx = dev_.get();
+    res->pd = pd_.get();
+    res->cq = cq_.get();
+    res->shared_dev = 1;
+    res->shared_cq = 1;
+    return 0;
+}
+
+void SharedCq::route(struct resources *res, void *ctx) {
+    qps_[res->qp->qp_num] = ctx;
+}
+
+void SharedCq::detach(struct resources *res) {
+    if (res->qp)
+        qps_.erase(res->qp->qp_num);
+    if (res->cq == cq_.get())
+        reserved_ -= 2 * res->cfg->depth;
+}
+
+int SharedCq::poll(int max, shared_cq_cb cb) {
+    struct ibv_wc wc[64];
+    int got;
+    int i;
+    got = ibv_poll_cq(cq_.get(), std::min(max, 64), wc);
+    if (got < 0) {
+        fprintf(stderr, "poll CQ failed\n");
+        return -1;
+    }
+    for (i = 0; i < got; i++) {
+        auto it = qps_.find(wc[i].qp_num);
+        if (it != qps_.end())
+            cb(it->second, &wc[i]);
+    }
+    return got;
+}
+
+} // namespace rdma
@@ -0,0 +1,198 @@
+#ifndef RDMA_TEST_ENDPOINT_H
+#define RDMA_TEST_ENDPOINT_H
+
+#include <memory>
+#include <unordered_map>
+#include "rdma_common.h"
+#include "cm_connect.h"
+#include "ctrl_proto.h"
+
+/*
+ * The connection layer both binaries are built on. Everything here works from the config_t the
+ * resources were initialized with (res->cfg), nothing reads the binaries' global config, so one process
+ * can hold any number of connections set up differently.
+ */
+
+void print_config(const struct config_t *cfg);
+
+void resources_init(struct resources *res, struct config_t *cfg);
+
+/* fills in the first device found when --ib-dev wasn't given, the one open_device() then opens */
+int resolve_device_name(struct config_t *cfg);
+
+struct ibv_context *open_device(struct config_t *cfg);
+
+int resources_create(struct resources *res);
+
+int resources_destroy(struct resources *res);
+
+/* our half of the connection data, in network order, for the peer to reach the QP */
+int connect_qp_local(struct resources *res, struct cm_con_data_t *local);
+
+/* takes the peer's half as it came off the wire and brings the QP up to RTS */
+int connect_qp_remote(struct resources *res, const struct cm_con_data_t *remote);
+
+int connect_qp(struct resources *res);
+
+/* the QP back to RESET and the fresh PSN it starts over from, before the PSNs are exchanged */
+int recover_qp_begin(struct resources *res, uint32_t *local_psn);
+
+/* back to RTS once the peer's PSN is known */
+int recover_qp_finish(struct resources *res, uint32_t local_psn, uint32_t remote_psn);
+
+int recover_qp(struct resources *res);
+
+int modify_qp_to_init(struct ibv_qp *qp, const struct config_t *cfg, enum ibv_atomic_cap atomic_cap);
+
+void fill_ah_attr(struct ibv_ah_attr *ah_attr, const struct config_t *cfg, uint16_t dlid, uint8_t *dgid);
+
+int modify_qp_to_reset(struct ibv_qp *qp);
+
+int modify_qp_to_rtr(struct ibv_qp *qp, const struct config_t *cfg, uint32_t remote_qpn, uint16_t dlid,
+                     uint8_t *dgid, uint32_t rq_psn, uint8_t max_dest_rd_atomic);
+
+int modify_qp_to_rts(struct ibv_qp *qp, uint32_t sq_psn, uint8_t max_rd_atomic);
+
+int poll_completion(struct resources *res);
+
+/*
+ * Owning wrappers of the verbs objects. Opening or creating one returns non-zero on failure like the
+ * rest of the code, an empty wrapper is false, and whatever a wrapper still holds is released when it
+ * goes out of scope. release() hands the handle over to a struct resources.
+ */
+namespace rdma {
+
+class Device {
+public:
+    Device() = default;
+    ~Device();
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+    int open(struct config_t *cfg);
+    struct ibv_context *get() const { return ctx_; }
+    struct ibv_context *release();
+    explicit operator bool() const { return ctx_ != nullptr; }
+private:
+    struct ibv_context *ctx_ = nullptr;
+};
+
+class ProtectionDomain {
+public:
+    ProtectionDomain() = default;
+    ~ProtectionDomain();
+    ProtectionDomain(const ProtectionDomain &) = delete;
+    ProtectionDomain &operator=(const ProtectionDomain &) = delete;
+    int alloc(struct ibv_context *ctx);
+    struct ibv_pd *get() const { return pd_; }
+    struct ibv_pd *release();
+    explicit operator bool() const { return pd_ != nullptr; }
+private:
+    struct ibv_pd *pd_ = nullptr;
+};
+
+class CompletionQueue {
+public:
+    CompletionQueue() = default;
+    ~CompletionQueue();
+    CompletionQueue(const CompletionQueue &) = delete;
+    CompletionQueue &operator=(const CompletionQueue &) = delete;
+    int create(struct ibv_context *ctx, int entries);
+    struct ibv_cq *get() const { return cq_; }
+    struct ibv_cq *release();
+    explicit operator bool() const { return cq_ != nullptr; }
+private:
+    struct ibv_cq *cq_ = nullptr;
+};
+
+/* a malloc()ed buffer and its registration */
+class MemoryRegion {
+public:
+    MemoryRegion() = default;
+    ~MemoryRegion();
+    MemoryRegion(const MemoryRegion &) = delete;
+    MemoryRegion &operator=(const MemoryRegion &) = delete;
+    int alloc(struct ibv_pd *pd, size_t size, int access);
+    struct ibv_mr *get() const { return mr_; }
+    char *buf() const { return buf_; }
+    struct ibv_mr *release(char **buf);
+    explicit operator bool() const { return mr_ != nullptr; }
+private:
+    struct ibv_mr *mr_ = nullptr;
+    char *buf_ = nullptr;
+};
+
+class QueuePair {
+public:
+    QueuePair() = default;
+    ~QueuePair();
+    QueuePair(const QueuePair &) = delete;
+    QueuePair &operator=(const QueuePair &) = delete;
+    int create(struct ibv_pd *pd, struct ibv_qp_init_attr *attr);
+    struct ibv_qp *get() const { return qp_; }
+    struct ibv_qp *release();
+    explicit operator bool() const { return qp_ != nullptr; }
+private:
+    struct ibv_qp *qp_ = nullptr;
+};
+
+/* one connection with a config of its own, torn down when it goes out of scope */
+class Endpoint {
+public:
+    explicit Endpoint(const struct config_t &cfg);
+    ~Endpoint();
+    Endpoint(const Endpoint &) = delete;
+    Endpoint &operator=(const Endpoint &) = delete;
+    /* sock is the control connection if the caller has one already, -1 to connect or accept on cfg */
+    int open(int sock = -1);
+    int connect();
+    int recover();
+    int close();
+    struct resources *res() { return &res_; }
+    struct config_t *config() { return &cfg_; }
+private:
+    struct config_t cfg_;
+    struct resources res_;
+};
+
+/* called by SharedCq::poll() with the context the completion's QP was routed to */
+typedef void (*shared_cq_cb)(void *ctx, const struct ibv_wc *wc);
+
+/*
+ * One device context, PD and CQ that any number of connections complete on, instead of a CQ each. A
+ * connection is attached before resources_create(), so its QP and MR are created on them, and routed
+ * once its QP exists. poll() takes completions off the one CQ in batches and hands each to the context
+ * of its QP, found by wc.qp_num, wr_id is left to the connection. The CQ is sized from max_cqe, every
+ * attached connection reserves 2 * depth entries of it. The connections have to be gone before it is.
+ */
+class SharedCq {
+public:
+    SharedCq() = default;
+    ~SharedCq() = default;
+    SharedCq(const SharedCq &) = delete;
+    SharedCq &operator=(const SharedCq &) = delete;
+    /* entries is capped by the device, 0 for as many as it allows */
+    int open(struct config_t *cfg, int entries = 0);
+    /* before the connection's resources are created, non-zero if the CQ has no room left for it */
+    int attach(struct resources *res);
+    /* once the QP is there, its completions go to ctx */
+    void route(struct resources *res, void *ctx);
+    /* before the connection is destroyed, it gives its entries back */
+    void detach(struct resources *res);
+    /* up to max completions, -1 if the CQ couldn't be polled, completions of unknown QPs are dropped */
+    int poll(int max, shared_cq_cb cb);
+    struct ibv_cq *cq() const { return cq_.get(); }
+    int entries() const { return entries_; }
+    int reserved() const { return reserved_; }
+
+private:
+    Device dev_;
+    ProtectionDomain pd_;
+    CompletionQueue cq_;
+    int entries_ = 0;
+    int reserved_ = 0;
+    std::unordered_map<uint32_t, void *> qps_;
+};
+
+} // namespace rdma
+
+#endif //RDMA_TEST_ENDPOINT_H
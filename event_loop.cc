@@ -0,0 +1,225 @@
+#include <fcntl.h>
+#include "event_loop.h"
+
+namespace rdma {
+
+EventLoop::~EventLoop() {
+    /* the fds and channels belong to whoever added them */
+    if (epfd_ >= 0)
+        close(epfd_);
+}
+
+int EventLoop::open() {
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    return 0;
+}
+
+int EventLoop::add(int fd, uint32_t events, fd_handler handler) {
+    std::unique_ptr<entry_t> e(new entry_t());
+    struct epoll_event ev;
+    if (fds_.count(fd)) {
+        fprintf(stderr, "fd %d is in the event loop already\n", fd);
+        return 1;
+    }
+    e->fd = fd;
+    e->handler = std::move(handler);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = e.get();
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev)) {
+        perror("epoll_ctl add");
+        return 1;
+    }
+    fds_[fd] = std::move(e);
+    return 0;
+}
+
+int EventLoop::modify(int fd, uint32_t events) {
+    auto it = fds_.find(fd);
+    struct epoll_event ev;
+    if (it == fds_.end())
+        return 1;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = it->second.get();
+    if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev)) {
+        perror("epoll_ctl mod");
+        return 1;
+    }
+    return 0;
+}
+
+/* before the fd is closed, a closed fd can't be taken out of the set anymore */
+int EventLoop::remove(int fd) {
+    auto it = fds_.find(fd);
+    int rc = 0;
+    if (it == fds_.end())
+        return 1;
+    if (epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, NULL)) {
+        perror("epoll_ctl del");
+        rc = 1;
+    }
+    /* the handler may be the one running, it is freed once the batch is handled */
+    it->second->removed = 1;
+    removed_.push_back(std::move(it->second));
+    fds_.erase(it);
+    return rc;
+}
+
+int EventLoop::add_cq(struct ibv_cq *cq, wc_handler handler) {
+    struct ibv_comp_channel *ch = cq->channel;
+    struct entry_t *e;
+    int flags;
+    if (!ch) {
+        fprintf(stderr, "the CQ has no completion channel\n");
+        return 1;
+    }
+    /* events are taken off the channel until it runs dry, it must not block then */
+    flags = fcntl(ch->fd, F_GETFL);
+    if (flags < 0 || fcntl(ch->fd, F_SETFL, flags | O_NONBLOCK)) {
+        perror("fcntl");
+        return 1;
+    }
+    if (add(ch->fd, EPOLLIN, nullptr))
+        return 1;
+    e = fds_[ch->fd].get();
+    e->cq = cq;
+    e->on_wc = std::move(handler);
+    if (ibv_req_notify_cq(cq, 0)) {
+        fprintf(stderr, "failed to arm the CQ\n");
+        remove(ch->fd);
+        return 1;
+    }
+    /* what completed before the CQ was armed raises no event */
+    return poll_cq(e) < 0;
+}
+
+int EventLoop::remove_cq(struct ibv_cq *cq) {
+    return remove(cq->channel->fd);
+}
+
+int EventLoop::drain_cq(struct ibv_cq *cq) {
+    auto it = fds_.find(cq->channel->fd);
+    if (it == fds_.end())
+        return 1;
+    return poll_cq(it->second.get()) < 0;
+}
+
+/* polls the CQ empty into its handler, -1 if it couldn't be polled */
+int EventLoop::poll_cq(struct entry_t *e) {
+    struct ibv_wc wc[16];
+    int total = 0;
+    int got;
+    int i;
+    do {
+        got = ibv_poll_cq(e->cq, 16, wc);
+        if (got < 0) {
+            fprintf(stderr, "poll CQ failed\n");
+            return -1;
+        }
+        for (i = 0; i < got && !e->removed; i++)
+            e->on_wc(&wc[i]);
+        total += got;
+        stats_.completions += got;
+    } while (got == 16 && !e->removed);
+    return total;
+}
+
+void EventLoop::cq_event(struct entry_t *e) {
+    struct ibv_cq *cq;
+    void *ctx;
+    unsigned int events = 0;
+    while (!ibv_get_cq_event(e->cq->channel, &cq, &ctx))
+        events++;
+    if (!events)
+        return;
+    ibv_ack_cq_events(e->cq, events);
+    stats_.cq_events += events;
+    /* armed again before polling, whatever completes in between raises the next event */
+    if (ibv_req_notify_cq(e->cq, 0))
+        fprintf(stderr, "failed to arm the CQ\n");
+    poll_cq(e);
+}
+
+uint64_t EventLoop::add_timer(uint64_t delay_ns, timer_handler handler) {
+    uint64_t id = next_timer_++;
+    uint64_t deadline = now_ns() + delay_ns;
+    timers_.emplace(std::make_pair(deadline, id), std::move(handler));
+    deadlines_[id] = deadline;
+    return id;
+}
+
+void EventLoop::cancel_timer(uint64_t id) {
+    auto it = deadlines_.find(id);
+    if (it == deadlines_.end())
+        return;
+    timers_.erase(std::make_pair(it->second, id));
+    deadlines_.erase(it);
+}
+
+int EventLoop::fire_timers() {
+    uint64_t now = now_ns();
+    int fired = 0;
+    while (!timers_.empty() && timers_.begin()->first.first <= now) {
+        auto it = timers_.begin();
+        timer_handler handler = std::move(it->second);
+        deadlines_.erase(it->first.second);
+        timers_.erase(it);
+        handler();
+        fired++;
+        stats_.timers++;
+    }
+    return fired;
+}
+
+int EventLoop::run_once(int timeout_ms) {
+    struct epoll_event events[64];
+    int wait_ms;
+    int n;
+    int i;
+    /* don't sleep past the next timer, rounded up so it is due once we wake */
+    if (!timers_.empty()) {
+        uint64_t deadline = timers_.begin()->first.first;
+        uint64_t now = now_ns();
+        wait_ms = deadline > now ? (int) ((deadline - now + 999999) / 1000000) : 0;
+        if (timeout_ms < 0 || wait_ms < timeout_ms)
+            timeout_ms = wait_ms;
+    }
+    n = epoll_wait(epfd_, events, 64, timeout_ms);
+    stats_.waits++;
+    if (n < 0) {
+        if (errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+        n = 0;
+    }
+    for (i = 0; i < n; i++) {
+        struct entry_t *e = (struct entry_t *) events[i].data.ptr;
+        if (e->removed)
+            continue;
+        stats_.fd_events++;
+        if (e->cq)
+            cq_event(e);
+        else
+            e->handler(events[i].events);
+    }
+    fire_timers();
+    removed_.clear();
+    return 0;
+}
+
+int EventLoop::run() {
+    stopping_ = 0;
+    while (!stopping_) {
+        if (run_once(-1))
+            return 1;
+    }
+    return 0;
+}
+
+} // namespace rdma
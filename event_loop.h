@@ -0,0 +1,86 @@
+#ifndef RDMA_TEST_EVENT_LOOP_H
+#define RDMA_TEST_EVENT_LOOP_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
+#include "rdma_common.h"
+
+/* called with the epoll events that fired on the fd */
+typedef std::function<void(uint32_t events)> fd_handler;
+/* called once for every completion polled off a CQ */
+typedef std::function<void(const struct ibv_wc *wc)> wc_handler;
+typedef std::function<void()> timer_handler;
+
+/* what an event loop has handled since it was opened */
+struct event_loop_stats_t {
+    uint64_t waits;        /* epoll_wait() calls */
+    uint64_t fd_events;    /* fd handlers called, CQ channels included */
+    uint64_t cq_events;    /* completion events taken off the channels */
+    uint64_t completions;  /* work completions handed to wc handlers */
+    uint64_t timers;       /* timers that fired */
+};
+
+/*
+ * One epoll set over sockets, eventfds and the completion channels of CQs, plus timers, so a thread can
+ * wait for control messages and completions at once instead of blocking in a read or spinning on a CQ.
+ * A CQ is added with the channel it was created on, the loop arms it, takes the events off the channel
+ * and polls the CQ empty into its handler. Handlers run on the thread calling run(), they may add and
+ * remove fds, CQs and timers, their own included.
+ */
+namespace rdma {
+
+class EventLoop {
+public:
+    EventLoop() = default;
+    ~EventLoop();
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+    int open();
+    int add(int fd, uint32_t events, fd_handler handler);
+    int modify(int fd, uint32_t events);
+    int remove(int fd);
+    /* the CQ must have a completion channel of its own */
+    int add_cq(struct ibv_cq *cq, wc_handler handler);
+    int remove_cq(struct ibv_cq *cq);
+    /* hands whatever is in the CQ to its handler now, without waiting for the channel */
+    int drain_cq(struct ibv_cq *cq);
+    /* fires once after delay_ns, gives the id cancel_timer() takes */
+    uint64_t add_timer(uint64_t delay_ns, timer_handler handler);
+    void cancel_timer(uint64_t id);
+    /* waits at most timeout_ms for events, -1 for until the next timer, and handles them */
+    int run_once(int timeout_ms);
+    /* runs until stop() is called from a handler, non-zero if epoll failed */
+    int run();
+    void stop() { stopping_ = 1; }
+    const struct event_loop_stats_t &stats() const { return stats_; }
+
+private:
+    struct entry_t {
+        int fd;
+        fd_handler handler;
+        struct ibv_cq *cq;   /* set for completion channels */
+        wc_handler on_wc;
+        int removed;
+    };
+    int poll_cq(struct entry_t *e);
+    void cq_event(struct entry_t *e);
+    int fire_timers();
+
+    int epfd_ = -1;
+    std::unordered_map<int, std::unique_ptr<entry_t>> fds_;
+    /* entries removed while their events may still be in the batch being handled */
+    std::vector<std::unique_ptr<entry_t>> removed_;
+    std::map<std::pair<uint64_t, uint64_t>, timer_handler> timers_;  /* by deadline, then id */
+    std::unordered_map<uint64_t, uint64_t> deadlines_;                /* deadline of each timer id */
+    uint64_t next_timer_ = 1;
+    int stopping_ = 0;
+    struct event_loop_stats_t stats_ = {};
+};
+
+} // namespace rdma
+
+#endif //RDMA_TEST_EVENT_LOOP_H
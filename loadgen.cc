@@ -0,0 +1,165 @@
+#include <ctype.h>
+#include <algorithm>
+#include "loadgen.h"
+#include "scenario.h"
+
+static int bucket_of(uint64_t ns) {
+    int msb;
+    int shift;
+    if (ns < 2 * HIST_SUB)
+        return (int) ns;
+    msb = 63 - __builtin_clzll(ns);
+    shift = msb - HIST_SUB_BITS;
+    return HIST_SUB * (shift + 1) + (int) ((ns >> shift) - HIST_SUB);
+}
+
+/* middle of the range a bucket covers */
+static uint64_t bucket_value(int idx) {
+    int shift;
+    uint64_t sub;
+    if (idx < 2 * HIST_SUB)
+        return idx;
+    shift = idx / HIST_SUB - 1;
+    sub = idx % HIST_SUB + HIST_SUB;
+    return (sub << shift) + ((1ULL << shift) >> 1);
+}
+
+void histogram_init(struct histogram_t *h) {
+    h->counts.assign(HIST_BUCKETS, 0);
+    h->count = 0;
+    h->total = 0;
+    h->min = UINT64_MAX;
+    h->max = 0;
+}
+
+void histogram_record(struct histogram_t *h, uint64_t ns) {
+    h->counts[bucket_of(ns)]++;
+    h->count++;
+    h->total += ns;
+    if (ns < h->min)
+        h->min = ns;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+/* q in [0, 1], the answer is off by at most half a bucket and never outside [min, max] */
+uint64_t histogram_percentile(const struct histogram_t *h, double q) {
+    uint64_t rank;
+    uint64_t seen = 0;
+    uint64_t v;
+    if (!h->count)
+        return 0;
+    rank = (uint64_t) (q * (h->count - 1)) + 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            v = bucket_value(i);
+            return std::min(std::max(v, h->min), h->max);
+        }
+    }
+    return h->max;
+}
+
+void histogram_summarize(const struct histogram_t *h, struct latency_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    if (!h->count)
+        return;
+    st->count = (int) h->count;
+    st->total = h->total;
+    st->min = h->min;
+    st->avg = h->total / h->count;
+    st->p50 = histogram_percentile(h, 0.50);
+    st->p90 = histogram_percentile(h, 0.90);
+    st->p99 = histogram_percentile(h, 0.99);
+    st->p999 = histogram_percentile(h, 0.999);
+    st->p9999 = histogram_percentile(h, 0.9999);
+    st->max = h->max;
+}
+
+int parse_arrival(const char *name, enum arrival_dist *dist) {
+    if (!strcmp(name, "constant"))
+        *dist = ARRIVAL_CONSTANT;
+    else if (!strcmp(name, "poisson"))
+        *dist = ARRIVAL_POISSON;
+    else
+        return 1;
+    return 0;
+}
+
+const char *arrival_name(enum arrival_dist dist) {
+    return dist == ARRIVAL_POISSON ? "poisson" : "constant";
+}
+
+void arrival_init(struct arrival_t *a, enum arrival_dist dist, double rate) {
+    a->dist = dist;
+    a->mean_ns = 1e9 / rate;
+    a->rng.seed(std::random_device{}());
+    a->gap = std::exponential_distribution<double>(1.0 / a->mean_ns);
+}
+
+/* gap to the next arrival in ns */
+uint64_t arrival_next(struct arrival_t *a) {
+    if (a->dist == ARRIVAL_POISSON)
+        return (uint64_t) a->gap(a->rng);
+    return (uint64_t) a->mean_ns;
+}
+
+/* comma-separated ops/s, each with an optional k or m suffix (powers of ten) */
+int parse_rates(const char *list, std::vector<double> *rates) {
+    const char *s = list;
+    char *end;
+    double rate;
+    rates->clear();
+    while (*s) {
+        rate = strtod(s, &end);
+        if (end == s)
+            return 1;
+        switch (tolower((unsigned char) *end)) {
+            case 'k':
+                rate *= 1e3;
+                end++;
+                break;
+            case 'm':
+                rate *= 1e6;
+                end++;
+                break;
+        }
+        if (rate <= 0 || (*end && *end != ','))
+            return 1;
+        rates->push_back(rate);
+        s = *end ? end + 1 : end;
+    }
+    return rates->empty();
+}
+
+/* comma-separated message sizes, k, m and g are powers of two as everywhere else */
+int parse_sizes(const char *list, std::vector<uint32_t> *sizes) {
+    char buf[1024];
+    char *value;
+    char *save;
+    uint64_t n;
+    snprintf(buf, sizeof(buf), "%s", list);
+    sizes->clear();
+    for (value = strtok_r(buf, ",", &save); value; value = strtok_r(NULL, ",", &save)) {
+        if (parse_count(value, &n) || n > INT32_MAX)
+            return 1;
+        sizes->push_back((uint32_t) n);
+    }
+    return sizes->empty();
+}
+
+/* a latency bound, ns unless it ends in us or ms */
+int parse_duration(const char *s, uint64_t *ns) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v <= 0)
+        return 1;
+    if (!strcmp(end, "ms"))
+        v *= 1e6;
+    else if (!strcmp(end, "us"))
+        v *= 1e3;
+    else if (*end && strcmp(end, "ns"))
+        return 1;
+    *ns = (uint64_t) v;
+    return *ns == 0;
+}
@@ -0,0 +1,77 @@
+#ifndef RDMA_TEST_LOADGEN_H
+#define RDMA_TEST_LOADGEN_H
+
+#include <random>
+#include <vector>
+#include "rdma_common.h"
+
+/* log-linear buckets: exact below 2 * HIST_SUB, HIST_SUB buckets per power of two above, about 3% wide */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * (65 - HIST_SUB_BITS))
+
+/* latencies in ns, fixed size however many samples go in */
+struct histogram_t {
+    std::vector<uint64_t> counts;
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+void histogram_init(struct histogram_t *h);
+
+void histogram_record(struct histogram_t *h, uint64_t ns);
+
+uint64_t histogram_percentile(const struct histogram_t *h, double q);
+
+void histogram_summarize(const struct histogram_t *h, struct latency_stats_t *st);
+
+enum arrival_dist {
+    ARRIVAL_CONSTANT,
+    ARRIVAL_POISSON  /* exponential gaps */
+};
+
+/* when the next operation is due, independent of when the last one completed */
+struct arrival_t {
+    enum arrival_dist dist;
+    double mean_ns;       /* 1e9 / rate */
+    std::mt19937_64 rng;
+    std::exponential_distribution<double> gap;
+};
+
+/* one offered load of a sweep */
+struct load_point_t {
+    double offered;       /* ops/s asked for */
+    double achieved;      /* ops/s completed */
+    double secs;
+    int count;
+    int backlogged;       /* ops that were due while every slot was busy */
+    struct histogram_t response; /* from when each op was due */
+    struct histogram_t service;  /* from when it was posted */
+};
+
+/* outcome of a capacity search at one size */
+struct capacity_t {
+    double saturation;    /* ops/s with every op due at once */
+    double capacity;      /* highest offered load that met the bound, 0 if none did */
+    int probes;           /* open-loop runs the search took */
+    struct latency_stats_t lat; /* response time at that load */
+    uint64_t at_percentile;     /* the percentile the bound applies to, at that load */
+};
+
+int parse_arrival(const char *name, enum arrival_dist *dist);
+
+const char *arrival_name(enum arrival_dist dist);
+
+void arrival_init(struct arrival_t *a, enum arrival_dist dist, double rate);
+
+uint64_t arrival_next(struct arrival_t *a);
+
+int parse_rates(const char *list, std::vector<double> *rates);
+
+int parse_sizes(const char *list, std::vector<uint32_t> *sizes);
+
+int parse_duration(const char *s, uint64_t *ns);
+
+#endif //RDMA_TEST_LOADGEN_H
@@ -4,6 +4,8 @@
 
 #include "rdma_common.h"
 
+int verbosity = VERBOSE_INFO;
+
 int sock_connect(const char *servername, int port) {
     struct addrinfo *resolved_addr = NULL;
     struct addrinfo *iterator;
@@ -32,7 +34,7 @@ int sock_connect(const char *servername, int port) {
             if (servername) {
                 /* Client mode. Initiate connection to remote */
                 if ((tmp = connect(sockfd, iterator->ai_addr, iterator->ai_addrlen))) {
-                    fprintf(stdout, "failed connect \n");
+                    log_info("failed connect \n");
                     close(sockfd);
                     sockfd = -1;
                 }
@@ -63,36 +65,275 @@ int sock_connect(const char *servername, int port) {
     return sockfd;
 }
 
-int post_receive(struct resources *res) {
+int sock_listen(int port) {
+    struct addrinfo *resolved_addr = NULL;
+    struct addrinfo *iterator;
+    char service[6];
+    int listenfd = -1;
+    int rc;
+    int on = 1;
+    struct addrinfo hints = {
+            .ai_flags = AI_PASSIVE,
+            .ai_family = AF_INET,
+            .ai_socktype = SOCK_STREAM
+    };
+    sprintf(service, "%d", port);
+    rc = getaddrinfo(NULL, service, &hints, &resolved_addr);
+    if (rc) {
+        fprintf(stderr, "%s for port %d\n", gai_strerror(rc), port);
+        return -1;
+    }
+    /* unlike sock_connect(), the listening socket is kept so many connections can be accepted */
+    for (iterator = resolved_addr; iterator && listenfd < 0; iterator = iterator->ai_next) {
+        listenfd = socket(iterator->ai_family, iterator->ai_socktype, iterator->ai_protocol);
+        if (listenfd < 0)
+            continue;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(listenfd, iterator->ai_addr, iterator->ai_addrlen) || listen(listenfd, SOMAXCONN)) {
+            close(listenfd);
+            listenfd = -1;
+        }
+    }
+    freeaddrinfo(resolved_addr);
+    if (listenfd < 0)
+        fprintf(stderr, "failed to listen on port %d\n", port);
+    return listenfd;
+}
+
+int sock_accept(int listenfd) {
+    int sockfd = accept(listenfd, NULL, 0);
+    if (sockfd < 0)
+        perror("server accept");
+    return sockfd;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void print_setup_times(const char *label, struct setup_times_t *times, int count) {
+    struct setup_times_t avg;
+    uint64_t total;
+    int i;
+    if (count <= 0)
+        return;
+    memset(&avg, 0, sizeof(avg));
+    for (i = 0; i < count; i++) {
+        avg.device_open += times[i].device_open;
+        avg.pd_alloc += times[i].pd_alloc;
+        avg.cq_create += times[i].cq_create;
+        avg.mr_reg += times[i].mr_reg;
+        avg.qp_create += times[i].qp_create;
+        avg.addr_exchange += times[i].addr_exchange;
+        avg.qp_init += times[i].qp_init;
+        avg.qp_rtr += times[i].qp_rtr;
+        avg.qp_rts += times[i].qp_rts;
+    }
+    total = avg.device_open + avg.pd_alloc + avg.cq_create + avg.mr_reg + avg.qp_create + avg.addr_exchange +
+            avg.qp_init + avg.qp_rtr + avg.qp_rts;
+    log_info("%s: average over %d connection(s), %.1f us in total\n", label, count, total / 1e3 / count);
+    log_info("  device open    %10.1f us\n", avg.device_open / 1e3 / count);
+    log_info("  PD alloc       %10.1f us\n", avg.pd_alloc / 1e3 / count);
+    log_info("  CQ create      %10.1f us\n", avg.cq_create / 1e3 / count);
+    log_info("  MR register    %10.1f us\n", avg.mr_reg / 1e3 / count);
+    log_info("  QP create      %10.1f us\n", avg.qp_create / 1e3 / count);
+    log_info("  addr exchange  %10.1f us\n", avg.addr_exchange / 1e3 / count);
+    log_info("  RESET->INIT    %10.1f us\n", avg.qp_init / 1e3 / count);
+    log_info("  INIT->RTR      %10.1f us\n", avg.qp_rtr / 1e3 / count);
+    log_info("  RTR->RTS       %10.1f us\n", avg.qp_rts / 1e3 / count);
+}
+
+int parse_transport(const char *name, enum ibv_qp_type *qp_type) {
+    if (!strcmp(name, "rc")) {
+        *qp_type = IBV_QPT_RC;
+    } else if (!strcmp(name, "uc")) {
+        *qp_type = IBV_QPT_UC;
+    } else if (!strcmp(name, "ud")) {
+        *qp_type = IBV_QPT_UD;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+const char *transport_name(enum ibv_qp_type qp_type) {
+    switch (qp_type) {
+        case IBV_QPT_RC:
+            return "rc";
+        case IBV_QPT_UC:
+            return "uc";
+        case IBV_QPT_UD:
+            return "ud";
+        default:
+            return "unknown";
+    }
+}
+
+int parse_cm(const char *name, int *use_rdmacm) {
+    if (!strcmp(name, "tcp")) {
+        *use_rdmacm = 0;
+    } else if (!strcmp(name, "rdmacm")) {
+        *use_rdmacm = 1;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+/* reads and atomics a QP keeps in flight, one per WR the test queues as far as the device allows */
+uint8_t rd_atomic_depth(const struct config_t *cfg, int device_max) {
+    int depth = cfg->depth < device_max ? cfg->depth : device_max;
+    if (depth > UINT8_MAX)
+        depth = UINT8_MAX;
+    return depth > 1 ? (uint8_t) depth : 1;
+}
+
+size_t get_rss_bytes(void) {
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+int post_receive_op(struct resources *res, struct rdma_op_t *op) {
     struct ibv_recv_wr rr;
-    struct ibv_sge sge;
     struct ibv_recv_wr *bad_wr;
+    struct ibv_sge ud_sges[MAX_UD_RECV_SGE];
+    int num_sge = op->num_sge;
+    int i;
+    /* UD receives get the GRH scratch area prepended */
+    if (res->qp->qp_type == IBV_QPT_UD)
+        num_sge++;
+    if (op->num_sge < 1 || num_sge > (int) res->qp_cap.max_recv_sge || num_sge > MAX_UD_RECV_SGE) {
+        fprintf(stderr, "receive with %d SGEs, QP allows 1..%u\n", num_sge, res->qp_cap.max_recv_sge);
+        return 1;
+    }
+    /* prepare the receive work request */
+    memset(&rr, 0, sizeof(rr));
+    rr.next = NULL;
+    rr.wr_id = op->wr_id;
+    rr.sg_list = op->sg_list;
+    rr.num_sge = op->num_sge;
+    if (res->qp->qp_type == IBV_QPT_UD) {
+        /* the GRHs of all receives land in the same scratch area, nobody reads them */
+        ud_sges[0].addr = (uintptr_t) res->grh;
+        ud_sges[0].length = UD_GRH_SIZE;
+        ud_sges[0].lkey = res->mr->lkey;
+        for (i = 0; i < op->num_sge; i++)
+            ud_sges[i + 1] = op->sg_list[i];
+        rr.sg_list = ud_sges;
+        rr.num_sge = num_sge;
+    }
+    /* post the Receive Request to the RQ */
+    return ibv_post_recv(res->qp, &rr, &bad_wr);
+}
+
+/* checks op against the QP and turns it into sr */
+static int fill_send_wr(struct resources *res, struct rdma_op_t *op, struct ibv_send_wr *sr) {
+    int atomic = op->opcode == IBV_WR_ATOMIC_CMP_AND_SWP || op->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD;
+    int max_sge = res->qp_cap.max_send_sge;
+    /* RDMA reads may have a lower scatter limit than the rest */
+    if (op->opcode == IBV_WR_RDMA_READ && res->device_attr.max_sge_rd > 0 && res->device_attr.max_sge_rd < max_sge)
+        max_sge = res->device_attr.max_sge_rd;
+    if (op->num_sge < 1 || op->num_sge > max_sge) {
+        fprintf(stderr, "send with %d SGEs, QP allows 1..%d\n", op->num_sge, max_sge);
+        return 1;
+    }
+    if (res->qp->qp_type == IBV_QPT_UD && op->opcode != IBV_WR_SEND && op->opcode != IBV_WR_SEND_WITH_IMM) {
+        fprintf(stderr, "RDMA operations are not supported on UD QPs\n");
+        return 1;
+    }
+    if (res->qp->qp_type == IBV_QPT_UC && op->opcode == IBV_WR_RDMA_READ) {
+        fprintf(stderr, "RDMA reads are not supported on UC QPs\n");
+        return 1;
+    }
+    if (atomic && (res->qp->qp_type != IBV_QPT_RC || op->num_sge != 1 || op->sg_list[0].length != sizeof(uint64_t))) {
+        fprintf(stderr, "atomics need an RC QP and one 8-byte segment\n");
+        return 1;
+    }
+    /* prepare the send work request */
+    memset(sr, 0, sizeof(*sr));
+    sr->next = NULL;
+    sr->wr_id = op->wr_id;
+    sr->sg_list = op->sg_list;
+    sr->num_sge = op->num_sge;
+    sr->opcode = (ibv_wr_opcode) op->opcode;
+    sr->send_flags = op->send_flags;
+    sr->imm_data = op->imm_data;
+    if (res->qp->qp_type == IBV_QPT_UD) {
+        /* datagrams are addressed per WR */
+        sr->wr.ud.ah = res->ah;
+        sr->wr.ud.remote_qpn = res->remote_props.qp_num;
+        sr->wr.ud.remote_qkey = UD_QKEY;
+    } else if (atomic) {
+        sr->wr.atomic.remote_addr = op->remote_addr;
+        sr->wr.atomic.rkey = op->rkey;
+        sr->wr.atomic.compare_add = op->compare_add;
+        sr->wr.atomic.swap = op->swap;
+    } else if (op->opcode != IBV_WR_SEND) {
+        sr->wr.rdma.remote_addr = op->remote_addr;
+        sr->wr.rdma.rkey = op->rkey;
+    }
+    return 0;
+}
+
+int post_send_op(struct resources *res, struct rdma_op_t *op) {
+    struct ibv_send_wr sr;
+    struct ibv_send_wr *bad_wr = NULL;
+    if (fill_send_wr(res, op, &sr))
+        return 1;
+    return ibv_post_send(res->qp, &sr, &bad_wr);
+}
+
+/* chains up to MAX_POST_BATCH WRs into one ibv_post_send() */
+int post_send_batch(struct resources *res, struct rdma_op_t *ops, int count) {
+    struct ibv_send_wr sr[MAX_POST_BATCH];
+    struct ibv_send_wr *bad_wr = NULL;
+    int i;
+    if (count < 1 || count > MAX_POST_BATCH) {
+        fprintf(stderr, "batch of %d WRs, at most %d can be posted at once\n", count, MAX_POST_BATCH);
+        return 1;
+    }
+    for (i = 0; i < count; i++) {
+        if (fill_send_wr(res, &ops[i], &sr[i]))
+            return 1;
+        if (i > 0)
+            sr[i - 1].next = &sr[i];
+    }
+    return ibv_post_send(res->qp, sr, &bad_wr);
+}
+
+int post_receive(struct resources *res) {
+    struct rdma_op_t op;
+    struct ibv_sge sge;
     int rc;
     /* prepare the scatter/gather entry */
     memset(&sge, 0, sizeof(sge));
     sge.addr = (uintptr_t) res->buf;
     sge.length = MSG_SIZE;
     sge.lkey = res->mr->lkey;
-    /* prepare the receive work request */
-    memset(&rr, 0, sizeof(rr));
-    rr.next = NULL;
-    rr.wr_id = 0;
-    rr.sg_list = &sge;
-    rr.num_sge = 1;
-    /* post the Receive Request to the RQ */
-    rc = ibv_post_recv(res->qp, &rr, &bad_wr);
+    memset(&op, 0, sizeof(op));
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    rc = post_receive_op(res, &op);
     if (rc) {
         fprintf(stderr, "failed to post RR\n");
     } else {
-        fprintf(stdout, "Receive Request was posted\n");
+        log_debug("Receive Request was posted\n");
     }
     return rc;
 }
 
 int post_send(struct resources *res, int opcode) {
-    struct ibv_send_wr sr;
+    struct rdma_op_t op;
     struct ibv_sge sge;
-    struct ibv_send_wr *bad_wr = NULL;
     int rc;
     /* prepare the scatter/gather entry */
     memset(&sge, 0, sizeof(sge));
@@ -100,36 +341,227 @@ int post_send(struct resources *res, int opcode) {
     sge.length = MSG_SIZE;
     sge.lkey = res->mr->lkey;
     /* prepare the send work request */
-    memset(&sr, 0, sizeof(sr));
-    sr.next = NULL;
-    sr.wr_id = 0;
-    sr.sg_list = &sge;
-    sr.num_sge = 1;
-    sr.opcode = (ibv_wr_opcode) opcode;
-    sr.send_flags = IBV_SEND_SIGNALED;
-    if (opcode != IBV_WR_SEND) {
-        sr.wr.rdma.remote_addr = res->remote_props.addr;
-        sr.wr.rdma.rkey = res->remote_props.rkey;
-    }
+    memset(&op, 0, sizeof(op));
+    op.opcode = opcode;
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    op.send_flags = IBV_SEND_SIGNALED;
+    op.remote_addr = res->remote_props.addr;
+    op.rkey = res->remote_props.rkey;
     /* there is a Receive Request in the responder side, so we won't get any into RNR flow */
-    rc = ibv_post_send(res->qp, &sr, &bad_wr);
+    rc = post_send_op(res, &op);
     if (rc) {
         fprintf(stderr, "failed to post SR\n");
     } else {
         switch (opcode) {
             case IBV_WR_SEND:
-                fprintf(stdout, "Send Request was posted\n");
+                log_debug("Send Request was posted\n");
                 break;
             case IBV_WR_RDMA_READ:
-                fprintf(stdout, "RDMA Read Request was posted\n");
+                log_debug("RDMA Read Request was posted\n");
                 break;
             case IBV_WR_RDMA_WRITE:
-                fprintf(stdout, "RDMA Write Request was posted\n");
+                log_debug("RDMA Write Request was posted\n");
                 break;
             default:
-                fprintf(stdout, "Unknown Request was posted\n");
+                log_debug("Unknown Request was posted\n");
                 break;
         }
     }
     return rc;
-}
\ No newline at end of file
+}
+
+int post_read(struct resources *res, uint64_t remote_addr, uint32_t length) {
+    struct rdma_op_t op;
+    struct ibv_sge sge;
+    int rc;
+    /* prepare the scatter/gather entry */
+    memset(&sge, 0, sizeof(sge));
+    sge.addr = (uintptr_t) res->buf;
+    sge.length = length;
+    sge.lkey = res->mr->lkey;
+    /* prepare the RDMA read work request for an arbitrary remote address */
+    memset(&op, 0, sizeof(op));
+    op.opcode = IBV_WR_RDMA_READ;
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    op.send_flags = IBV_SEND_SIGNALED;
+    op.remote_addr = remote_addr;
+    op.rkey = res->remote_props.rkey;
+    rc = post_send_op(res, &op);
+    if (rc) {
+        fprintf(stderr, "failed to post RDMA read of 0x%" PRIx64 "\n", remote_addr);
+    }
+    return rc;
+}
+
+int poll_completion_quiet(struct resources *res, struct ibv_wc *wc) {
+    unsigned long start_time_msec;
+    unsigned long cur_time_msec;
+    struct timeval cur_time;
+    int poll_result;
+    int spins = 0;
+    /* same as poll_completion() but nothing is printed on success, so it can be used inside timed loops */
+    gettimeofday(&cur_time, NULL);
+    start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
+    cur_time_msec = start_time_msec;
+    do {
+        poll_result = ibv_poll_cq(res->cq, 1, wc);
+        /* only look at the clock once in a while to keep it off the hot path */
+        if (poll_result == 0 && (++spins & 0xfff) == 0) {
+            gettimeofday(&cur_time, NULL);
+            cur_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
+        }
+    } while ((poll_result == 0) && ((cur_time_msec - start_time_msec) < MAX_POLL_CQ_TIMEOUT));
+    if (poll_result < 0) {
+        fprintf(stderr, "poll CQ failed\n");
+        return 1;
+    }
+    if (poll_result == 0) {
+        fprintf(stderr, "completion wasn't found in the CQ after timeout\n");
+        return 1;
+    }
+    if (wc->status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", wc->status, wc->vendor_err);
+        return 1;
+    }
+    return 0;
+}
+
+struct ibv_mr *zc_register(struct resources *res, void *addr, size_t length) {
+    struct ibv_mr *mr;
+    /* the HCA only reads these buffers, no remote access is granted */
+    mr = ibv_reg_mr(res->pd, addr, length, IBV_ACCESS_LOCAL_WRITE);
+    if (!mr) {
+        fprintf(stderr, "failed to register user buffer %p of %zu bytes\n", addr, length);
+    }
+    return mr;
+}
+
+int zc_post_send(struct resources *res, struct zc_buf_t *zb) {
+    struct rdma_op_t op;
+    struct ibv_sge sge[2];
+    int rc;
+    if (zb->in_flight) {
+        fprintf(stderr, "zero-copy buffer %p is still owned by the HCA\n", (void *) zb);
+        return 1;
+    }
+    /* header and payload are gathered by the HCA, nothing is copied */
+    memset(sge, 0, sizeof(sge));
+    sge[0].addr = (uintptr_t) zb->hdr;
+    sge[0].length = zb->hdr_len;
+    sge[0].lkey = zb->hdr_lkey;
+    sge[1].addr = (uintptr_t) zb->payload;
+    sge[1].length = zb->payload_len;
+    sge[1].lkey = zb->payload_lkey;
+    memset(&op, 0, sizeof(op));
+    op.opcode = IBV_WR_SEND;
+    op.wr_id = (uintptr_t) zb;
+    op.sg_list = sge;
+    op.num_sge = zb->payload_len ? 2 : 1;
+    op.send_flags = IBV_SEND_SIGNALED;
+    rc = post_send_op(res, &op);
+    if (rc) {
+        fprintf(stderr, "failed to post zero-copy send\n");
+        return rc;
+    }
+    zb->in_flight = 1;
+    res->zc_outstanding++;
+    return 0;
+}
+
+int zc_poll(struct resources *res, int max) {
+    struct ibv_wc wc[16];
+    struct zc_buf_t *zb;
+    int reaped = 0;
+    int n, i;
+    if (max > 16)
+        max = 16;
+    n = ibv_poll_cq(res->cq, max, wc);
+    if (n < 0) {
+        fprintf(stderr, "poll CQ failed\n");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        /* only zero-copy sends carry a buffer in wr_id */
+        if (!wc[i].wr_id) {
+            fprintf(stderr, "unexpected completion with status 0x%x\n", wc[i].status);
+            continue;
+        }
+        zb = (struct zc_buf_t *) wc[i].wr_id;
+        zb->in_flight = 0;
+        res->zc_outstanding--;
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", wc[i].status,
+                    wc[i].vendor_err);
+        }
+        /* ownership goes back to the caller */
+        if (zb->cb)
+            zb->cb(zb->ctx, zb, wc[i].status == IBV_WC_SUCCESS ? 0 : 1);
+        reaped++;
+    }
+    return reaped;
+}
+
+int zc_wait(struct resources *res, struct zc_buf_t *zb) {
+    unsigned long start_time_msec;
+    unsigned long cur_time_msec;
+    struct timeval cur_time;
+    gettimeofday(&cur_time, NULL);
+    start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
+    cur_time_msec = start_time_msec;
+    /* completions of other buffers are dispatched on the way */
+    while (zb->in_flight && (cur_time_msec - start_time_msec) < MAX_POLL_CQ_TIMEOUT) {
+        if (zc_poll(res, 16) < 0)
+            return 1;
+        gettimeofday(&cur_time, NULL);
+        cur_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
+    }
+    if (zb->in_flight) {
+        fprintf(stderr, "zero-copy send wasn't completed after timeout\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+void summarize_latency(uint64_t *samples_ns, int count, struct latency_stats_t *st) {
+    int i;
+    memset(st, 0, sizeof(*st));
+    if (count <= 0)
+        return;
+    /* sorts the samples in place */
+    qsort(samples_ns, count, sizeof(uint64_t), compare_u64);
+    st->count = count;
+    for (i = 0; i < count; i++)
+        st->total += samples_ns[i];
+    st->min = samples_ns[0];
+    st->avg = st->total / count;
+    st->p50 = samples_ns[count / 2];
+    st->p90 = samples_ns[(int) ((count - 1) * 0.90)];
+    st->p99 = samples_ns[(int) ((count - 1) * 0.99)];
+    st->p999 = samples_ns[(int) ((count - 1) * 0.999)];
+    st->p9999 = samples_ns[(int) ((count - 1) * 0.9999)];
+    st->max = samples_ns[count - 1];
+}
+
+void print_latency_summary(const char *label, const struct latency_stats_t *st) {
+    if (st->count <= 0) {
+        log_info("%s: no samples\n", label);
+        return;
+    }
+    log_info("%s: %d samples, total %" PRIu64 " ns\n", label, st->count, st->total);
+    log_info("  min %" PRIu64 " ns, avg %" PRIu64 " ns, p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, max %" PRIu64 " ns\n",
+             st->min, st->avg, st->p50, st->p99, st->max);
+}
+
+void print_latency_stats(const char *label, uint64_t *samples_ns, int count) {
+    struct latency_stats_t st;
+    summarize_latency(samples_ns, count, &st);
+    print_latency_summary(label, &st);
+}
@@ -21,12 +21,32 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+/* verbosity levels, results are printed from VERBOSE_INFO up and setup chatter from VERBOSE_DEBUG up */
+#define VERBOSE_QUIET 0
+#define VERBOSE_INFO 1
+#define VERBOSE_DEBUG 2
+
+extern int verbosity;
+
+#define log_info(...) do { if (verbosity >= VERBOSE_INFO) fprintf(stdout, __VA_ARGS__); } while (0)
+#define log_debug(...) do { if (verbosity >= VERBOSE_DEBUG) fprintf(stdout, __VA_ARGS__); } while (0)
+
 /* poll CQ timeout in millisec (2 seconds) */
 #define MAX_POLL_CQ_TIMEOUT 2000
+/* most WRs post_send_batch() chains into one post */
+#define MAX_POST_BATCH 64
 #define MSG "SEND operation "
 #define RDMAMSGR "RDMA read operation "
 #define RDMAMSGW "RDMA write operation"
 #define MSG_SIZE 30
+/* Q_Key shared by both sides of a UD connection */
+#define UD_QKEY 0x11111111
+/* every UD receive starts with a Global Routing Header of this size */
+#define UD_GRH_SIZE 40
+/* upper bound of scatter/gather entries for one UD receive, GRH included */
+#define MAX_UD_RECV_SGE 32
+/* size of one node in the remote pointer-chasing list (one cache line) */
+#define CHASE_NODE_SIZE 64
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
 static inline uint64_t htonll(uint64_t x) { return bswap_64(x); }
@@ -47,20 +67,113 @@ struct cm_con_data_t {
     uint32_t qp_num; /* QP number */
     uint16_t lid;	/* LID of the IB port */
     uint8_t gid[16]; /* gid */
+    uint8_t rd_atomic;      /* reads and atomics the QP takes in as responder */
+    uint8_t init_rd_atomic; /* and the ones it keeps in flight as initiator */
 } __attribute__((packed));
 
+/* node of the randomized linked list walked by the "chase" operation */
+struct chase_node_t {
+    uint64_t next;  /* remote address of the next node, network byte order */
+    uint64_t index; /* position of this node in the region */
+    char pad[CHASE_NODE_SIZE - 2 * sizeof(uint64_t)];
+};
+
+/* work request with an arbitrary list of local segments, all of them in registered memory */
+struct rdma_op_t {
+    int opcode;              /* IBV_WR_* opcode, ignored for receives */
+    uint64_t wr_id;          /* returned in the completion */
+    struct ibv_sge *sg_list; /* local segments */
+    int num_sge;             /* number of entries in sg_list */
+    uint64_t remote_addr;    /* remote address for RDMA read/write */
+    uint32_t rkey;           /* remote key for RDMA read/write */
+    int send_flags;          /* IBV_SEND_* flags */
+    uint32_t imm_data;       /* immediate data in network byte order, *_WITH_IMM opcodes only */
+    uint64_t compare_add;    /* value compared (CMP_AND_SWP) or added (FETCH_AND_ADD), atomics only */
+    uint64_t swap;           /* value swapped in, CMP_AND_SWP only */
+};
+
+/* application header that precedes every payload of the zero-copy benchmark */
+struct msg_hdr_t {
+    uint64_t seq; /* message sequence number */
+    uint32_t len; /* payload length */
+    uint32_t pad;
+};
+
+struct zc_buf_t;
+
+/* called once a zero-copy send has completed, the buffers belong to the caller again */
+typedef void (*zc_send_cb)(void *ctx, struct zc_buf_t *zb, int status);
+
+/* caller-owned message sent straight from registered memory, without staging it in res->buf */
+struct zc_buf_t {
+    char *hdr;             /* header, must be in registered memory */
+    uint32_t hdr_len;
+    uint32_t hdr_lkey;
+    char *payload;         /* payload, optional (payload_len 0), must be in registered memory */
+    uint32_t payload_len;
+    uint32_t payload_lkey;
+    zc_send_cb cb;         /* completion callback */
+    void *ctx;             /* passed back to cb */
+    int in_flight;         /* set while the HCA owns the buffers, they must not be touched */
+};
+
+/* time spent in each phase of connection setup, in nanoseconds */
+struct setup_times_t {
+    uint64_t device_open;   /* device lookup, open and port/device queries */
+    uint64_t pd_alloc;      /* PD allocation */
+    uint64_t cq_create;     /* CQ creation */
+    uint64_t mr_reg;        /* buffer allocation and registration */
+    uint64_t qp_create;     /* QP creation */
+    uint64_t addr_exchange; /* TCP connect, cm_con_data_t exchange and the final sync */
+    uint64_t qp_init;       /* RESET->INIT */
+    uint64_t qp_rtr;        /* INIT->RTR */
+    uint64_t qp_rts;        /* RTR->RTS */
+};
+
+struct rdma_cm_id;
+struct rdma_event_channel;
+
+/* summary of a set of latency samples, all in ns */
+struct latency_stats_t {
+    int count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t avg;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t p9999;
+    uint64_t max;
+};
+
+struct config_t;
+
 /* structure of system resources */
 struct resources {
+    struct config_t *cfg;                /* settings the resources are created and connected with */
     struct ibv_device_attr device_attr; /* Device attributes */
     struct ibv_port_attr port_attr;        /* IB port attributes */
+    struct ibv_qp_cap qp_cap;             /* capabilities granted to the QP */
     struct cm_con_data_t remote_props; /* values to connect to remote side */
     struct ibv_context *ib_ctx;           /* device handle */
     struct ibv_pd *pd;                   /* PD handle */
     struct ibv_cq *cq;                   /* CQ handle */
     struct ibv_qp *qp;                   /* QP handle */
     struct ibv_mr *mr;                   /* MR handle for buf */
+    struct ibv_ah *ah;                   /* address handle of the remote side, UD only */
     char *buf;                           /* memory buffer pointer, used for RDMA and send ops */
+    char *grh;                           /* tail of buf the GRHs of UD receives land in */
     int sock;                           /* TCP socket file descriptor */
+    struct rdma_event_channel *cm_channel; /* RDMA-CM event channel, --cm rdmacm only */
+    struct rdma_cm_id *cm_id;           /* RDMA-CM id owning qp, its device context is not ours to close */
+    struct rdma_cm_id *cm_listen_id;    /* RDMA-CM listening id, server only */
+    struct setup_times_t setup_times;   /* filled by resources_create() and connect_qp() */
+    int zc_outstanding;                 /* zero-copy sends not completed yet */
+    int shared_dev;                     /* ib_ctx and pd belong to the daemon, they outlive us */
+    int shared_buf;                     /* buf and mr come from the daemon's buffer pool */
+    int shared_cq;                      /* cq belongs to a server shard, its other QPs complete on it too, so
+                                           only its owner polls it */
 };
 
 /* structure of test parameters */
@@ -71,12 +184,89 @@ struct config_t {
     int ib_port;          /* local IB port to work with */
     int gid_idx;          /* gid index to use */
     char* operation;      /* RDMA operation */
+    size_t buf_size;      /* size of the registered memory buffer */
+    int chase_nodes;      /* number of nodes in the pointer-chasing list */
+    int max_sge;          /* scatter/gather entries per WR the QP is created with */
+    uint32_t msg_size;    /* message (or fragment) size used by the benchmarks */
+    int depth;            /* outstanding WRs allowed on each queue */
+    enum ibv_qp_type qp_type; /* transport of the QP: IBV_QPT_RC, IBV_QPT_UC or IBV_QPT_UD */
+    int peers;            /* report the QP footprint for this many peers, 0 to skip */
+    int use_rdmacm;       /* connect through librdmacm instead of the TCP exchange */
+    int conns;            /* connections established by connbench */
+    int threads;          /* worker threads */
+    int recover;          /* recover an errored QP in place instead of tearing everything down */
+    int inject_error;     /* iteration that is posted with a bad rkey to force an error, -1 for none */
+    int spares;           /* warm connections the pool keeps per peer */
+    int daemon;           /* keep device, PD and registered buffers across sessions */
+    int pool_bufs;        /* buffers the daemon registers up front */
+    size_t pool_buf_size; /* size of each of them */
+    char *scenario;       /* matrix of steps to run over one connection, NULL for a single op */
+    const char *result_format; /* text, json or csv */
+    char *result_path;    /* where structured results go, NULL for stdout */
+    char *rates;          /* offered loads of the open-loop sweep, ops/s */
+    const char *arrival;  /* constant or poisson inter-arrival times */
+    const char *load_op;  /* read or write, what the open loop issues */
+    uint64_t slo_ns;      /* latency bound of the capacity search */
+    double slo_percentile; /* percentile the bound applies to */
+    char *sizes;          /* message sizes the capacity search covers, NULL for msg_size */
+    char *transports;     /* transports it covers, NULL for qp_type */
+    int selective_signal; /* only WRs posted with IBV_SEND_SIGNALED complete */
+    uint32_t max_inline;  /* inline data the QP is created for */
+    char *profile;        /* tuned settings per message size, written by autotune */
+    int coros;            /* logical operations the coroutine benchmark keeps going on its thread */
+    int shards;           /* event loops the server runs, one per core, 0 for the single accept loop */
+    int pin;              /* pin the threads that post and poll, one core each */
+    char *cpus;           /* the cores they go to, NULL for those on the device's NUMA node */
+    int rt_prio;          /* SCHED_FIFO priority of those threads, 0 to leave them to the default scheduler */
+    int lock_mem;         /* mlockall() and pre-fault the buffers before anything is measured */
 };
 
 int sock_connect(const char *servername, int port);
 
+int sock_listen(int port);
+
+int sock_accept(int listenfd);
+
+uint64_t now_ns(void);
+
+void print_setup_times(const char *label, struct setup_times_t *times, int count);
+
+int parse_transport(const char *name, enum ibv_qp_type *qp_type);
+
+const char *transport_name(enum ibv_qp_type qp_type);
+
+int parse_cm(const char *name, int *use_rdmacm);
+
+uint8_t rd_atomic_depth(const struct config_t *cfg, int device_max);
+
+size_t get_rss_bytes(void);
+
 int post_receive(struct resources *res);
 
 int post_send(struct resources *res, int opcode);
 
+int post_read(struct resources *res, uint64_t remote_addr, uint32_t length);
+
+int post_send_op(struct resources *res, struct rdma_op_t *op);
+
+int post_send_batch(struct resources *res, struct rdma_op_t *ops, int count);
+
+int post_receive_op(struct resources *res, struct rdma_op_t *op);
+
+int poll_completion_quiet(struct resources *res, struct ibv_wc *wc);
+
+struct ibv_mr *zc_register(struct resources *res, void *addr, size_t length);
+
+int zc_post_send(struct resources *res, struct zc_buf_t *zb);
+
+int zc_poll(struct resources *res, int max);
+
+int zc_wait(struct resources *res, struct zc_buf_t *zb);
+
+void summarize_latency(uint64_t *samples_ns, int count, struct latency_stats_t *st);
+
+void print_latency_summary(const char *label, const struct latency_stats_t *st);
+
+void print_latency_stats(const char *label, uint64_t *samples_ns, int count);
+
 #endif //RDMA_TEST_RDMA_COMMON_H
@@ -0,0 +1,201 @@
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "realtime.h"
+
+/* stack touched up front with --mlock, more than any of the benchmark loops uses */
+#define RT_STACK_PREFAULT (256 * 1024)
+
+/* the cores rt_setup() picked, empty if threads aren't pinned */
+static std::vector<int> pinned_cpus;
+
+int parse_cpu_list(const char *list, std::vector<int> *cpus) {
+    const char *p = list;
+    char *end;
+    long first;
+    long last;
+    cpus->clear();
+    while (*p) {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            return 1;
+        last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first || last >= CPU_SETSIZE)
+                return 1;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+            cpus->push_back((int) cpu);
+        if (*p == ',')
+            p++;
+        else if (*p && *p != '\n')
+            return 1;
+        else
+            break;
+    }
+    return cpus->empty();
+}
+
+int device_numa_node(const char *dev_name) {
+    char path[256];
+    int node = -1;
+    FILE *f;
+    if (!dev_name)
+        return -1;
+    snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node", dev_name);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%d", &node) != 1)
+        node = -1;
+    fclose(f);
+    return node;
+}
+
+/* the cores of a NUMA node as the kernel lists them */
+static int node_cpus(int node, std::vector<int> *cpus) {
+    char path[128];
+    char list[4096];
+    FILE *f;
+    int rc;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (!f)
+        return 1;
+    rc = !fgets(list, sizeof(list), f) || parse_cpu_list(list, cpus);
+    fclose(f);
+    return rc;
+}
+
+/* the stack only grows as it is first touched, locked or not, so it is grown here instead of in a timed loop */
+static void prefault_stack(void) {
+    volatile char stack[RT_STACK_PREFAULT];
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < sizeof(stack); off += page)
+        stack[off] = 0;
+}
+
+int rt_setup(struct config_t *cfg) {
+    std::vector<int> wanted;
+    cpu_set_t allowed;
+    int node;
+    pinned_cpus.clear();
+    if (cfg->pin) {
+        if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+            perror("sched_getaffinity");
+            return 1;
+        }
+        if (cfg->cpus) {
+            if (parse_cpu_list(cfg->cpus, &wanted)) {
+                fprintf(stderr, "invalid cpu list %s\n", cfg->cpus);
+                return 1;
+            }
+        } else {
+            /* the cores next to the device, so buffers, WQEs and CQEs don't cross the interconnect */
+            node = device_numa_node(cfg->dev_name);
+            if (node < 0 || node_cpus(node, &wanted)) {
+                log_info("no NUMA node known for %s, pinning to any core we may run on\n",
+                         cfg->dev_name ? cfg->dev_name : "the device");
+                wanted.clear();
+                for (int i = 0; i < CPU_SETSIZE; i++)
+                    wanted.push_back(i);
+            } else {
+                log_debug("%s is on NUMA node %d\n", cfg->dev_name, node);
+            }
+        }
+        for (int cpu : wanted) {
+            if (CPU_ISSET(cpu, &allowed))
+                pinned_cpus.push_back(cpu);
+        }
+        if (pinned_cpus.empty()) {
+            fprintf(stderr, "none of the cores asked for are ones we may run on\n");
+            return 1;
+        }
+        log_info("pinning threads to %zu cores, from cpu %d\n", pinned_cpus.size(), pinned_cpus[0]);
+    }
+    if (cfg->rt_prio > 0) {
+        long runtime = -1;
+        FILE *f = fopen("/proc/sys/kernel/sched_rt_runtime_us", "r");
+        if (f) {
+            if (fscanf(f, "%ld", &runtime) != 1)
+                runtime = -1;
+            fclose(f);
+        }
+        /* a thread spinning on a CQ never yields, the kernel stalls it once its share is used up */
+        if (runtime >= 0)
+            log_info("SCHED_FIFO threads are throttled after %ld ms of every second, long spinning runs will "
+                     "see it\n", runtime / 1000);
+    }
+    if (cfg->lock_mem) {
+        /* MCL_FUTURE also locks whatever is allocated later, it is faulted in as it is mapped */
+        if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+            perror("mlockall");
+            return 1;
+        }
+        prefault_stack();
+        log_info("memory locked, RSS %zu KB\n", get_rss_bytes() / 1024);
+    }
+    return 0;
+}
+
+int rt_cpu(int index) {
+    if (pinned_cpus.empty())
+        return -1;
+    return pinned_cpus[index % pinned_cpus.size()];
+}
+
+int rt_cpu_count(void) {
+    return (int) pinned_cpus.size();
+}
+
+int rt_tune_thread(const struct config_t *cfg, int index) {
+    struct sched_param param;
+    cpu_set_t cpus;
+    int cpu = rt_cpu(index);
+    int err;
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err) {
+            fprintf(stderr, "failed to pin to cpu %d: %s\n", cpu, strerror(err));
+            return 1;
+        }
+    }
+    if (cfg->rt_prio > 0) {
+        /* a spinning FIFO thread keeps everything else of its priority off the core, pin it too */
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = cfg->rt_prio;
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err) {
+            fprintf(stderr, "failed to move to SCHED_FIFO priority %d: %s\n", cfg->rt_prio, strerror(err));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void rt_prefault(void *addr, size_t len) {
+    volatile char *p = (volatile char *) addr;
+    long page = sysconf(_SC_PAGESIZE);
+    /* written back as it was, the buffer may hold data already */
+    for (size_t off = 0; off < len; off += page)
+        p[off] = p[off];
+    if (len)
+        p[len - 1] = p[len - 1];
+}
+
+void rt_usage(struct rt_usage_t *u) {
+    struct rusage ru;
+    memset(u, 0, sizeof(*u));
+    if (getrusage(RUSAGE_THREAD, &ru))
+        return;
+    u->minflt = ru.ru_minflt;
+    u->majflt = ru.ru_majflt;
+    u->nvcsw = ru.ru_nvcsw;
+    u->nivcsw = ru.ru_nivcsw;
+}
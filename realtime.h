@@ -0,0 +1,43 @@
+#ifndef RDMA_TEST_REALTIME_H
+#define RDMA_TEST_REALTIME_H
+
+#include <vector>
+#include "rdma_common.h"
+
+/* rt_usage() of a thread, the faults and context switches behind most 50-100 us outliers */
+struct rt_usage_t {
+    long minflt;   /* page faults served without I/O */
+    long majflt;   /* page faults that needed I/O */
+    long nvcsw;    /* the thread gave up the cpu, blocked */
+    long nivcsw;   /* the scheduler took the cpu away */
+};
+
+/* "0-3,8,10-11" into the cores it names, in that order */
+int parse_cpu_list(const char *list, std::vector<int> *cpus);
+
+/* the NUMA node the device sits on, -1 if the kernel doesn't say */
+int device_numa_node(const char *dev_name);
+
+/*
+ * Works out what cfg asks for before anything is measured: the cores pinned threads go to (--cpus, or the
+ * cores of the device's NUMA node with --pin, narrowed to the ones we may run on) and, with --mlock, locks
+ * all current and future memory so no page is faulted in or swapped out while ops are timed. Call it once,
+ * before the buffers are allocated, so they come from the pinned core's node and are locked as they are.
+ */
+int rt_setup(struct config_t *cfg);
+
+/* pins the calling thread to the index-th of the cores rt_setup() picked and moves it to SCHED_FIFO */
+int rt_tune_thread(const struct config_t *cfg, int index);
+
+/* the core the index-th pinned thread goes to, -1 if threads aren't pinned */
+int rt_cpu(int index);
+
+/* how many cores there are to go round, 0 if threads aren't pinned */
+int rt_cpu_count(void);
+
+/* touches every page of [addr, addr + len) so the first op doesn't take the fault */
+void rt_prefault(void *addr, size_t len);
+
+void rt_usage(struct rt_usage_t *u);
+
+#endif //RDMA_TEST_REALTIME_H
@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <mutex>
+#include "results.h"
+
+static enum result_format format = RESULT_TEXT;
+static FILE *out = NULL;
+static int header_written = 0;
+/* the server's shards finish sessions on their own threads */
+static std::mutex lock;
+/* CPU totals when the window of the next result started */
+static struct cpu_usage_t mark;
+
+/* what every result is tagged with */
+static struct {
+    char host[NI_MAXHOST];
+    char device[64];
+    int ib_port;
+    int lid;
+    int mtu;              /* active MTU in bytes */
+    const char *link_layer;
+    double link_gbps;     /* active width times active speed */
+    char transport[8];
+} ctx;
+
+static const char *csv_columns =
+        "host,device,ib_port,lid,mtu,link_layer,link_gbps,transport,op,size,depth,threads,count,secs,"
+        "msg_per_s,mb_per_s,offered_per_s,lat_min_ns,lat_avg_ns,lat_p50_ns,lat_p90_ns,lat_p99_ns,lat_p999_ns,"
+        "lat_p9999_ns,lat_max_ns,cpu_user_s,cpu_sys_s,cpu_us_per_op,ctx_switches_per_op,cycles_per_op,"
+        "instructions_per_op,cache_misses_per_op,rc";
+
+static double lane_gbps(uint8_t speed) {
+    switch (speed) {
+        case 1:
+            return 2.5;
+        case 2:
+            return 5.0;
+        case 4:
+        case 8:
+            return 10.0;
+        case 16:
+            return 14.0;
+        case 32:
+            return 25.0;
+        case 64:
+            return 50.0;
+        case 128:
+            return 100.0;
+        default:
+            return 0.0;
+    }
+}
+
+/* JSON needs quotes, backslashes and control characters escaped, a host or op name may hold any of them */
+static void json_escape(const char *in, char *buf, size_t len) {
+    size_t n = 0;
+    for (; *in && n + 7 < len; in++) {
+        unsigned char c = (unsigned char) *in;
+        if (c == '"' || c == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = (char) c;
+        } else if (c < 0x20) {
+            n += snprintf(buf + n, len - n, "\\u%04x", c);
+        } else {
+            buf[n++] = (char) c;
+        }
+    }
+    buf[n] = '\0';
+}
+
+static int lanes(uint8_t width) {
+    switch (width) {
+        case 1:
+            return 1;
+        case 2:
+            return 4;
+        case 4:
+            return 8;
+        case 8:
+            return 12;
+        case 16:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+/* rows of a build with other columns can't go under the file's header, they wouldn't line up */
+static int results_check_header(const char *path) {
+    char line[1024];
+    int rc = 0;
+    if (fseek(out, 0, SEEK_SET) || !fgets(line, sizeof(line), out)) {
+        fprintf(stderr, "failed to read the header of result file %s\n", path);
+        rc = 1;
+        goto results_check_header_exit;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strcmp(line, csv_columns)) {
+        fprintf(stderr, "result file %s has other columns than this build writes, use a new file\n", path);
+        rc = 1;
+    }
+results_check_header_exit:
+    if (rc) {
+        fclose(out);
+        out = NULL;
+    }
+    return rc;
+}
+
+int results_open(const char *fmt, const char *path) {
+    if (!strcmp(fmt, "text")) {
+        format = RESULT_TEXT;
+    } else if (!strcmp(fmt, "json")) {
+        format = RESULT_JSON;
+    } else if (!strcmp(fmt, "csv")) {
+        format = RESULT_CSV;
+    } else {
+        fprintf(stderr, "unknown result format %s\n", fmt);
+        return 1;
+    }
+    if (!path || !strcmp(path, "-")) {
+        out = stdout;
+        /* the text lines would break the structured output */
+        if (format != RESULT_TEXT && verbosity < VERBOSE_DEBUG)
+            verbosity = VERBOSE_QUIET;
+    } else {
+        out = fopen(path, "a+");
+        if (!out) {
+            fprintf(stderr, "failed to open result file %s\n", path);
+            return 1;
+        }
+    }
+    /* a file appended to by an earlier run has its header already, the next one must match it */
+    header_written = fseek(out, 0, SEEK_END) == 0 && ftell(out) > 0;
+    if (header_written && format == RESULT_CSV && results_check_header(path))
+        return 1;
+    if (gethostname(ctx.host, sizeof(ctx.host)))
+        strcpy(ctx.host, "unknown");
+    ctx.link_layer = "unknown";
+    return 0;
+}
+
+void results_context(const char *dev_name, int ib_port, const struct ibv_port_attr *port_attr,
+                     const char *transport) {
+    std::lock_guard<std::mutex> guard(lock);
+    snprintf(ctx.device, sizeof(ctx.device), "%s", dev_name ? dev_name : "");
+    snprintf(ctx.transport, sizeof(ctx.transport), "%s", transport);
+    ctx.ib_port = ib_port;
+    if (port_attr) {
+        ctx.lid = port_attr->lid;
+        ctx.mtu = 128 << port_attr->active_mtu;
+        ctx.link_layer = port_attr->link_layer == IBV_LINK_LAYER_ETHERNET ? "ethernet" : "infiniband";
+        ctx.link_gbps = lanes(port_attr->active_width) * lane_gbps(port_attr->active_speed);
+    }
+}
+
+void result_init(struct result_t *r, const char *op, uint32_t size, int depth) {
+    memset(r, 0, sizeof(*r));
+    r->op = op;
+    r->size = size;
+    r->depth = depth;
+    r->threads = 1;
+}
+
+void results_mark(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (cpu_meter_ready())
+        cpu_meter_read(&mark);
+}
+
+/* what one op cost in CPU, cpu_us is also the cores it takes to do a million of them a second */
+struct cpu_per_op_t {
+    double cpu_us;
+    double sys_share;
+    double cycles;
+    double instructions;
+    double cache_misses;
+    double ctx_switches;
+};
+
+static void cpu_per_op(const struct cpu_usage_t *used, uint64_t count, struct cpu_per_op_t *op) {
+    double cpu_s = used->user_s + used->sys_s;
+    op->cpu_us = cpu_s * 1e6 / count;
+    op->sys_share = cpu_s > 0 ? used->sys_s / cpu_s : 0;
+    op->cycles = (double) used->cycles / count;
+    op->instructions = (double) used->instructions / count;
+    op->cache_misses = (double) used->cache_misses / count;
+    op->ctx_switches = (double) used->ctx_switches / count;
+}
+
+void results_emit(const struct result_t *r) {
+    double msg_rate = r->secs > 0 ? r->count / r->secs : 0;
+    double mb_rate = r->secs > 0 ? (double) r->count * r->size / r->secs / 1e6 : 0;
+    const struct latency_stats_t *lat = &r->lat;
+    struct cpu_usage_t now;
+    struct cpu_usage_t used;
+    struct cpu_per_op_t per_op;
+    uint64_t ops = r->cpu_ops ? r->cpu_ops : (uint64_t) std::max(r->count, 0);
+    int has_cpu = cpu_meter_ready() && ops > 0;
+    std::lock_guard<std::mutex> guard(lock);
+    if (has_cpu) {
+        cpu_meter_read(&now);
+        cpu_usage_delta(&mark, &now, &used);
+        cpu_per_op(&used, ops, &per_op);
+        log_info("%s cpu: %.3f us/op (%.0f%% sys), %.3f cores per Mops, %.4f context switches/op\n", r->op,
+                 per_op.cpu_us, 100 * per_op.sys_share, per_op.cpu_us, per_op.ctx_switches);
+        if (used.hw)
+            log_info("%s cpu: %.0f cycles/op, %.0f instructions/op, IPC %.2f, %.2f cache misses/op%s\n", r->op,
+                     per_op.cycles, per_op.instructions, used.cycles ? (double) used.instructions / used.cycles : 0,
+                     per_op.cache_misses, used.user_only ? ", user space only" : "");
+        /* the next result's window starts here, whatever ran in between is charged to it */
+        mark = now;
+    }
+    if (format == RESULT_TEXT || !out)
+        return;
+    if (format == RESULT_CSV) {
+        if (!header_written) {
+            fprintf(out, "%s\n", csv_columns);
+            header_written = 1;
+        }
+        fprintf(out, "%s,%s,%d,%d,%d,%s,%.1f,%s,%s,%u,%d,%d,%d,%.6f,%.1f,%.3f,", ctx.host, ctx.device, ctx.ib_port,
+                ctx.lid, ctx.mtu, ctx.link_layer, ctx.link_gbps, ctx.transport, r->op, r->size, r->depth, r->threads,
+                r->count, r->secs, msg_rate, mb_rate);
+        if (r->offered > 0)
+            fprintf(out, "%.1f,", r->offered);
+        else
+            fprintf(out, ",");
+        if (r->has_latency)
+            fprintf(out, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                         ",", lat->min, lat->avg, lat->p50, lat->p90, lat->p99, lat->p999, lat->p9999, lat->max);
+        else
+            fprintf(out, ",,,,,,,,");
+        if (has_cpu)
+            fprintf(out, "%.6f,%.6f,%.4f,%.4f,", used.user_s, used.sys_s, per_op.cpu_us, per_op.ctx_switches);
+        else
+            fprintf(out, ",,,,");
+        if (has_cpu && used.hw)
+            fprintf(out, "%.1f,%.1f,%.3f,", per_op.cycles, per_op.instructions, per_op.cache_misses);
+        else
+            fprintf(out, ",,,");
+        fprintf(out, "%d\n", r->rc);
+    } else {
+        char host[2 * NI_MAXHOST];
+        char device[sizeof(ctx.device) * 6];
+        char link_layer[64];
+        char transport[sizeof(ctx.transport) * 6];
+        char op[256];
+        json_escape(ctx.host, host, sizeof(host));
+        json_escape(ctx.device, device, sizeof(device));
+        json_escape(ctx.link_layer, link_layer, sizeof(link_layer));
+        json_escape(ctx.transport, transport, sizeof(transport));
+        json_escape(r->op, op, sizeof(op));
+        fprintf(out, "{\"host\":\"%s\",\"device\":\"%s\",\"ib_port\":%d,\"lid\":%d,\"mtu\":%d,\"link_layer\":\"%s\","
+                     "\"link_gbps\":%.1f,\"transport\":\"%s\",\"op\":\"%s\",\"size\":%u,\"depth\":%d,\"threads\":%d,"
+                     "\"count\":%d,\"secs\":%.6f,\"msg_per_s\":%.1f,\"mb_per_s\":%.3f", host, device, ctx.ib_port,
+                ctx.lid, ctx.mtu, link_layer, ctx.link_gbps, transport, op, r->size, r->depth, r->threads, r->count,
+                r->secs, msg_rate, mb_rate);
+        if (r->offered > 0)
+            fprintf(out, ",\"offered_per_s\":%.1f", r->offered);
+        if (r->has_latency)
+            fprintf(out, ",\"latency_ns\":{\"min\":%" PRIu64 ",\"avg\":%" PRIu64 ",\"p50\":%" PRIu64 ",\"p90\":%"
+                         PRIu64 ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64 ",\"p9999\":%" PRIu64 ",\"max\":%" PRIu64 "}",
+                    lat->min, lat->avg, lat->p50, lat->p90, lat->p99, lat->p999, lat->p9999, lat->max);
+        if (has_cpu) {
+            fprintf(out, ",\"cpu\":{\"user_s\":%.6f,\"sys_s\":%.6f,\"us_per_op\":%.4f,\"ctx_switches_per_op\":%.4f",
+                    used.user_s, used.sys_s, per_op.cpu_us, per_op.ctx_switches);
+            if (used.hw)
+                fprintf(out, ",\"cycles_per_op\":%.1f,\"instructions_per_op\":%.1f,\"cache_misses_per_op\":%.3f,"
+                             "\"user_only\":%s", per_op.cycles, per_op.instructions, per_op.cache_misses,
+                        used.user_only ? "true" : "false");
+            fprintf(out, "}");
+        }
+        fprintf(out, ",\"rc\":%d}\n", r->rc);
+    }
+    fflush(out);
+}
+
+void results_close(void) {
+    if (out && out != stdout)
+        fclose(out);
+    out = NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef RDMA_TEST_RESULTS_H
+#define RDMA_TEST_RESULTS_H
+
+#include "rdma_common.h"
+#include "cpu_meter.h"
+
+/* how results are written, text leaves them to the log_info() lines */
+enum result_format {
+    RESULT_TEXT,
+    RESULT_JSON,  /* one object per line */
+    RESULT_CSV    /* header first, then one row per result */
+};
+
+/* one measurement */
+struct result_t {
+    const char *op;
+    uint32_t size;        /* bytes per message */
+    int depth;
+    int threads;
+    int count;            /* messages, iterations or connections */
+    double secs;          /* wall time, 0 when only latencies were taken */
+    double offered;       /* ops/s an open loop was asked for, 0 for closed-loop runs */
+    int has_latency;
+    struct latency_stats_t lat;
+    uint64_t cpu_ops;     /* ops the CPU used since the last result paid for, 0 for count */
+    int rc;
+};
+
+int results_open(const char *format, const char *path);
+
+void results_context(const char *dev_name, int ib_port, const struct ibv_port_attr *port_attr,
+                     const char *transport);
+
+void result_init(struct result_t *r, const char *op, uint32_t size, int depth);
+
+/* starts the CPU window of the next result, each results_emit() starts the one after it */
+void results_mark(void);
+
+/* with the CPU meter open, the CPU used since the window started is reported per op along with r */
+void results_emit(const struct result_t *r);
+
+void results_close(void);
+
+#endif //RDMA_TEST_RESULTS_H
@@ -0,0 +1,145 @@
+#include <ctype.h>
+#include "scenario.h"
+
+/* ops that can be repeated over one connection, only the one-sided ones use more than one thread */
+static const char *scenario_ops[] = {"read", "write", "bw", "wbw", "pingpong"};
+
+int scenario_op_supported(const char *op) {
+    for (size_t i = 0; i < sizeof(scenario_ops) / sizeof(scenario_ops[0]); i++) {
+        if (!strcmp(op, scenario_ops[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static char *trim(char *s) {
+    char *end;
+    while (isspace((unsigned char) *s))
+        s++;
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1]))
+        *--end = '\0';
+    return s;
+}
+
+/* a positive number with an optional k, m or g suffix */
+int parse_count(const char *s, uint64_t *value) {
+    char *end;
+    *value = strtoull(s, &end, 0);
+    switch (tolower((unsigned char) *end)) {
+        case 'k':
+            *value <<= 10;
+            end++;
+            break;
+        case 'm':
+            *value <<= 20;
+            end++;
+            break;
+        case 'g':
+            *value <<= 30;
+            end++;
+            break;
+    }
+    return *end != '\0' || *value == 0;
+}
+
+/*
+ * One "key = value, value, ..." per line, # starts a comment:
+ *   ops = read, write, bw
+ *   sizes = 64, 4k, 64k
+ *   depths = 1, 16
+ *   threads = 1, 4
+ *   iterations = 10000
+ */
+int load_scenario(const char *path, struct scenario_t *sc) {
+    char line[1024];
+    int lineno = 0;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "failed to open scenario %s\n", path);
+        return 1;
+    }
+    sc->ops.clear();
+    sc->sizes.clear();
+    sc->depths.clear();
+    sc->threads.clear();
+    sc->iterations = 1000;
+    while (fgets(line, sizeof(line), f)) {
+        char *key;
+        char *values;
+        char *value;
+        char *save;
+        lineno++;
+        if (strchr(line, '#'))
+            *strchr(line, '#') = '\0';
+        key = trim(line);
+        if (!*key)
+            continue;
+        values = strchr(key, '=');
+        if (!values) {
+            fprintf(stderr, "%s:%d: expected key = values\n", path, lineno);
+            goto load_scenario_error;
+        }
+        *values++ = '\0';
+        key = trim(key);
+        for (value = strtok_r(values, ",", &save); value; value = strtok_r(NULL, ",", &save)) {
+            uint64_t n = 0;
+            value = trim(value);
+            if (!strcmp(key, "ops")) {
+                if (!scenario_op_supported(value)) {
+                    fprintf(stderr, "%s:%d: op %s can't be part of a scenario\n", path, lineno, value);
+                    goto load_scenario_error;
+                }
+                sc->ops.push_back(value);
+                continue;
+            }
+            if (parse_count(value, &n) || n > INT32_MAX) {
+                fprintf(stderr, "%s:%d: invalid value %s\n", path, lineno, value);
+                goto load_scenario_error;
+            }
+            if (!strcmp(key, "sizes")) {
+                sc->sizes.push_back((uint32_t) n);
+            } else if (!strcmp(key, "depths")) {
+                sc->depths.push_back((int) n);
+            } else if (!strcmp(key, "threads")) {
+                sc->threads.push_back((int) n);
+            } else if (!strcmp(key, "iterations")) {
+                sc->iterations = (int) n;
+            } else {
+                fprintf(stderr, "%s:%d: unknown key %s\n", path, lineno, key);
+                goto load_scenario_error;
+            }
+        }
+    }
+    fclose(f);
+    if (sc->ops.empty() || sc->sizes.empty()) {
+        fprintf(stderr, "scenario %s needs at least one op and one size\n", path);
+        return 1;
+    }
+    if (sc->depths.empty())
+        sc->depths.push_back(1);
+    if (sc->threads.empty())
+        sc->threads.push_back(1);
+    return 0;
+load_scenario_error:
+    fclose(f);
+    return 1;
+}
+
+void print_scenario_results(const std::vector<struct scenario_result_t> &results) {
+    int failed = 0;
+    log_info("%-10s %10s %6s %7s %10s %10s %12s %10s  %s\n", "op", "size", "depth", "threads", "iterations",
+            "secs", "msg/s", "MB/s", "result");
+    for (auto &r : results) {
+        if (r.note) {
+            log_info("%-10s %10u %6d %7d %10d %10s %12s %10s  %s\n", r.op, r.size, r.depth, r.threads, r.count,
+                    "-", "-", "-", r.note);
+            continue;
+        }
+        log_info("%-10s %10u %6d %7d %10d %10.3f %12.0f %10.2f  %s\n", r.op, r.size, r.depth, r.threads,
+                r.count, r.secs, r.count / r.secs, (double) r.count * r.size / r.secs / 1e6, r.rc ? "failed" : "ok");
+        if (r.rc)
+            failed++;
+    }
+    log_info("%zu steps, %d failed\n", results.size(), failed);
+}
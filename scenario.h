@@ -0,0 +1,38 @@
+#ifndef RDMA_TEST_SCENARIO_H
+#define RDMA_TEST_SCENARIO_H
+
+#include <string>
+#include <vector>
+#include "rdma_common.h"
+#include "ctrl_proto.h"
+
+/* ops, sizes, depths and thread counts to run, every combination is one step */
+struct scenario_t {
+    std::vector<std::string> ops;
+    std::vector<uint32_t> sizes;
+    std::vector<int> depths;
+    std::vector<int> threads;
+    int iterations;       /* per step */
+};
+
+/* outcome of one step */
+struct scenario_result_t {
+    char op[CTRL_OP_LEN + 1];
+    uint32_t size;
+    int depth;
+    int threads;
+    int count;
+    double secs;          /* wall time of the step, barriers included */
+    int rc;
+    const char *note;     /* why the step didn't run, NULL if it did */
+};
+
+int parse_count(const char *s, uint64_t *value);
+
+int load_scenario(const char *path, struct scenario_t *sc);
+
+int scenario_op_supported(const char *op);
+
+void print_scenario_results(const std::vector<struct scenario_result_t> &results);
+
+#endif //RDMA_TEST_SCENARIO_H
@@ -2,426 +2,1711 @@
 // Created by 熊嘉晟 on 2024/7/12.
 //
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include "server.h"
 
-void print_config(void) {
-    fprintf(stdout, " ------------------------------------------------\n");
-    fprintf(stdout, " Device name : \"%s\"\n", config.dev_name);
-    fprintf(stdout, " IB port : %u\n", config.ib_port);
-    if (config.server_name)
-        fprintf(stdout, " IP : %s\n", config.server_name);
-    fprintf(stdout, " TCP port : %u\n", config.tcp_port);
-    if (config.gid_idx >= 0)
-        fprintf(stdout, " GID index : %u\n", config.gid_idx);
-    fprintf(stdout, " ------------------------------------------------\n\n");
+int build_chase_list(struct resources *res, int nodes) {
+    const struct config_t *cfg = res->cfg;
+    struct chase_node_t *list = (struct chase_node_t *) res->buf;
+    uintptr_t base = (uintptr_t) res->buf;
+    int *order;
+    int i, j, tmp;
+    order = (int *) malloc(nodes * sizeof(int));
+    if (!order) {
+        fprintf(stderr, "failed to malloc chase order for %d nodes\n", nodes);
+        return 1;
+    }
+    /* Sattolo's shuffle gives a random permutation that is one single cycle, so every node is visited */
+    for (i = 0; i < nodes; i++)
+        order[i] = i;
+    for (i = nodes - 1; i > 0; i--) {
+        j = lrand48() % i;
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (i = 0; i < nodes; i++) {
+        memset(&list[i], 0, sizeof(list[i]));
+        list[i].next = htonll(base + (uint64_t) order[i] * CHASE_NODE_SIZE);
+        list[i].index = htonll(i);
+    }
+    free(order);
+    log_info("built pointer-chasing list of %d nodes (%zu bytes)\n", nodes, cfg->buf_size);
+    return 0;
+}
+
+int serve_zcsend(struct resources *res, int count) {
+    const struct config_t *cfg = res->cfg;
+    uint32_t msg_len = sizeof(struct msg_hdr_t) + cfg->msg_size;
+    int depth = cfg->depth;
+    int total = 2 * count; /* zero-copy round followed by the staged round */
+    struct msg_hdr_t *hdr;
+    struct rdma_op_t op;
+    struct ibv_sge sge;
+    struct ibv_wc wc;
+    int mismatches = 0;
+    int slot;
+    int i;
+    memset(&op, 0, sizeof(op));
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    sge.length = msg_len;
+    sge.lkey = res->mr->lkey;
+    /* keep a receive posted for every message the client may have in flight */
+    for (i = 0; i < depth && i < total; i++) {
+        sge.addr = (uintptr_t) (res->buf + (size_t) i * msg_len);
+        op.wr_id = i;
+        if (post_receive_op(res, &op)) {
+            fprintf(stderr, "failed to post RR\n");
+            return 1;
+        }
+    }
+    if (ctrl_sync(res->sock, 'Z')) {
+        fprintf(stderr, "sync error before zero-copy sends\n");
+        return 1;
+    }
+    for (i = 0; i < total; i++) {
+        if (poll_completion_quiet(res, &wc)) {
+            fprintf(stderr, "failed to receive message %d\n", i);
+            return 1;
+        }
+        slot = (int) wc.wr_id;
+        hdr = (struct msg_hdr_t *) (res->buf + (size_t) slot * msg_len);
+        if (wc.byte_len != msg_len || hdr->seq != (uint64_t) (i % count) || hdr->len != cfg->msg_size)
+            mismatches++;
+        /* hand the slot back to the RQ for a later message */
+        if (i + depth < total) {
+            sge.addr = (uintptr_t) hdr;
+            op.wr_id = slot;
+            if (post_receive_op(res, &op)) {
+                fprintf(stderr, "failed to post RR\n");
+                return 1;
+            }
+        }
+    }
+    log_info("received %d messages of %u bytes, %d out of sequence\n", total, msg_len, mismatches);
+    if (ctrl_sync(res->sock, 'Z')) {
+        fprintf(stderr, "sync error after zero-copy sends\n");
+        return 1;
+    }
+    return mismatches ? 1 : 0;
 }
 
-void resources_init(struct resources *res) {
-    memset(res, 0, sizeof *res);
-    res->sock = -1;
+int pingpong_post(struct resources *res, int reply) {
+    uint32_t size = res->cfg->msg_size;
+    struct ibv_sge sge;
+    struct rdma_op_t op;
+    sge.addr = (uintptr_t) (res->buf + (reply ? size : 0));
+    sge.length = size;
+    sge.lkey = res->mr->lkey;
+    memset(&op, 0, sizeof(op));
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    if (!reply)
+        return post_receive_op(res, &op);
+    op.opcode = IBV_WR_SEND;
+    op.send_flags = IBV_SEND_SIGNALED;
+    return post_send_op(res, &op);
 }
 
-int resources_create(struct resources *res) {
-    struct ibv_device **dev_list = NULL;
-    struct ibv_qp_init_attr qp_init_attr;
-    struct ibv_device *ib_dev = NULL;
-    size_t size;
+int serve_pingpong(struct resources *res, int count) {
+    const struct config_t *cfg = res->cfg;
+    uint32_t size = cfg->msg_size;
+    struct ibv_wc wc;
+    int sends_pending = 0;
     int i;
-    int mr_flags = 0;
-    int cq_size = 0;
-    int num_devices;
-    int rc = 0;
-    fprintf(stdout, "waiting on port %d for TCP connection\n", config.tcp_port);
-    res->sock = sock_connect(NULL, config.tcp_port);
-    if (res->sock < 0) {
-        fprintf(stderr, "failed to establish TCP connection with client on port %d\n", config.tcp_port);
-        rc = -1;
-        goto resources_create_exit;
-    }
-    fprintf(stdout, "TCP connection was established\n");
-    fprintf(stdout, "searching for IB devices in host\n");
-    /* get device names in the system */
-    dev_list = ibv_get_device_list(&num_devices);
-    if (!dev_list) {
-        fprintf(stderr, "failed to get IB devices list\n");
-        rc = 1;
-        goto resources_create_exit;
+    if (pingpong_post(res, 0)) {
+        fprintf(stderr, "failed to post RR\n");
+        return 1;
     }
-    /* if there isn't any IB device in host */
-    if (!num_devices) {
-        fprintf(stderr, "found %d device(s)\n", num_devices);
-        rc = 1;
-        goto resources_create_exit;
+    if (ctrl_sync(res->sock, 'P')) {
+        fprintf(stderr, "sync error before ping-pong\n");
+        return 1;
     }
-    fprintf(stdout, "found %d device(s)\n", num_devices);
-    /* search for the specific device in device list */
-    for (i = 0; i < num_devices; i++) {
-        if (!config.dev_name) {
-            config.dev_name = strdup(ibv_get_device_name(dev_list[i]));
-            fprintf(stdout, "device not specified, using first one found: %s\n", config.dev_name);
+    for (i = 0; i < count; i++) {
+        /* completions of earlier replies may still show up before the next request */
+        do {
+            if (poll_completion_quiet(res, &wc)) {
+                fprintf(stderr, "ping-pong failed at message %d\n", i);
+                return 1;
+            }
+            if (!(wc.opcode & IBV_WC_RECV))
+                sends_pending--;
+        } while (!(wc.opcode & IBV_WC_RECV));
+        memcpy(res->buf + size, res->buf, size);
+        /* the next request must find a receive posted before we answer this one */
+        if (i + 1 < count && pingpong_post(res, 0)) {
+            fprintf(stderr, "failed to post RR\n");
+            return 1;
         }
-        if (!strcmp(ibv_get_device_name(dev_list[i]), config.dev_name)) {
-            ib_dev = dev_list[i];
-            break;
+        while (sends_pending >= (int) res->qp_cap.max_send_wr) {
+            if (poll_completion_quiet(res, &wc)) {
+                fprintf(stderr, "reply failed\n");
+                return 1;
+            }
+            sends_pending--;
+        }
+        if (pingpong_post(res, 1)) {
+            fprintf(stderr, "failed to post SR\n");
+            return 1;
         }
+        sends_pending++;
     }
-    /* if the device wasn't found in host */
-    if (!ib_dev) {
-        fprintf(stderr, "IB device %s wasn't found\n", config.dev_name);
-        rc = 1;
-        goto resources_create_exit;
+    while (sends_pending > 0) {
+        if (poll_completion_quiet(res, &wc)) {
+            fprintf(stderr, "reply failed\n");
+            return 1;
+        }
+        sends_pending--;
     }
-    /* get device handle */
-    res->ib_ctx = ibv_open_device(ib_dev);
-    if (!res->ib_ctx) {
-        fprintf(stderr, "failed to open device %s\n", config.dev_name);
-        rc = 1;
-        goto resources_create_exit;
-    }
-    /* We are now done with device list, free it */
-    ibv_free_device_list(dev_list);
-    dev_list = NULL;
-    ib_dev = NULL;
-    /* query port properties */
-    if (ibv_query_port(res->ib_ctx, config.ib_port, &res->port_attr)) {
-        fprintf(stderr, "ibv_query_port on port %u failed\n", config.ib_port);
-        rc = 1;
-        goto resources_create_exit;
+    log_info("answered %d %s ping-pong messages of %u bytes\n", count, transport_name(cfg->qp_type), size);
+    if (ctrl_sync(res->sock, 'P')) {
+        fprintf(stderr, "sync error after ping-pong\n");
+        return 1;
     }
-    /* allocate Protection Domain */
-    res->pd = ibv_alloc_pd(res->ib_ctx);
-    if (!res->pd) {
-        fprintf(stderr, "ibv_alloc_pd failed\n");
-        rc = 1;
-        goto resources_create_exit;
+    return 0;
+}
+
+/* posts a receive into slot, the receive slots of a bandwidth test are msg_size apart */
+static int bw_post_slot(struct resources *res, int slot) {
+    struct ibv_sge sge;
+    struct rdma_op_t op;
+    sge.addr = (uintptr_t) (res->buf + (size_t) slot * res->cfg->msg_size);
+    sge.length = res->cfg->msg_size;
+    sge.lkey = res->mr->lkey;
+    memset(&op, 0, sizeof(op));
+    op.sg_list = &sge;
+    op.num_sge = 1;
+    op.wr_id = slot;
+    if (post_receive_op(res, &op)) {
+        fprintf(stderr, "failed to post RR\n");
+        return 1;
     }
-    /* each side will send only one WR, so Completion Queue with 1 entry is enough */
-    cq_size = 1;
-    res->cq = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
-    if (!res->cq) {
-        fprintf(stderr, "failed to create CQ with %u entries\n", cq_size);
-        rc = 1;
-        goto resources_create_exit;
+    return 0;
+}
+
+int bw_begin(struct resources *res, int count, struct recv_progress_t *p) {
+    int i;
+    memset(p, 0, sizeof(*p));
+    for (i = 0; i < res->cfg->depth && i < count; i++) {
+        if (bw_post_slot(res, i))
+            return 1;
     }
-    /* allocate the memory buffer that will hold the data */
-    size = MSG_SIZE;
-    res->buf = (char *) malloc(size);
-    if (!res->buf) {
-        fprintf(stderr, "failed to malloc %Zu bytes to memory buffer\n", size);
-        rc = 1;
-        goto resources_create_exit;
-    }
-    memset(res->buf, 0, size);
-    /* register the memory buffer */
-    mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-    res->mr = ibv_reg_mr(res->pd, res->buf, size, mr_flags);
-    if (!res->mr) {
-        fprintf(stderr, "ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
+    return 0;
+}
+
+int bw_recv(struct resources *res, const struct ibv_wc *wc, struct recv_progress_t *p) {
+    int slot = (int) wc->wr_id;
+    uint64_t seq;
+    p->last_ns = now_ns();
+    if (!p->received)
+        p->first_ns = p->last_ns;
+    p->received++;
+    /* writes carry their sequence number as immediate data, sends in the payload */
+    p->imm = wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM;
+    if (p->imm)
+        seq = ntohl(wc->imm_data);
+    else
+        seq = *(uint64_t *) (res->buf + (size_t) slot * res->cfg->msg_size);
+    if (seq != p->expected)
+        p->out_of_order++;
+    p->expected = seq + 1;
+    /* hand the slot back to the RQ */
+    return bw_post_slot(res, slot);
+}
+
+void bw_report(struct resources *res, int count, const struct recv_progress_t *p) {
+    const struct config_t *cfg = res->cfg;
+    struct result_t result;
+    double secs = (p->last_ns - p->first_ns) / 1e9;
+    log_info("%s receive: %d of %d messages of %u bytes, %d lost, %d sequence gaps, %.0f msg/s, %.2f MB/s\n",
+            transport_name(cfg->qp_type), p->received, count, cfg->msg_size, count - p->received,
+            p->out_of_order, secs > 0 ? p->received / secs : 0.0,
+            secs > 0 ? (double) p->received * cfg->msg_size / secs / 1e6 : 0.0);
+    result_init(&result, p->imm ? "wbw-recv" : "bw-recv", cfg->msg_size, cfg->depth);
+    result.count = p->received;
+    result.secs = secs;
+    results_emit(&result);
+}
+
+int serve_bw(struct resources *res, int count) {
+    struct recv_progress_t progress;
+    struct ibv_wc wc;
+    if (bw_begin(res, count, &progress))
+        return 1;
+    if (ctrl_sync(res->sock, 'B')) {
+        fprintf(stderr, "sync error before bandwidth test\n");
+        return 1;
+    }
+    while (progress.received < count) {
+        if (poll_completion_quiet(res, &wc)) {
+            /* unreliable transports simply stop delivering what was lost */
+            if (res->cfg->qp_type != IBV_QPT_RC && progress.received > 0)
+                break;
+            fprintf(stderr, "failed to receive message %d\n", progress.received);
+            return 1;
+        }
+        if (bw_recv(res, &wc, &progress))
+            return 1;
+    }
+    bw_report(res, count, &progress);
+    if (ctrl_sync(res->sock, 'B')) {
+        fprintf(stderr, "sync error after bandwidth test\n");
+        return 1;
+    }
+    return 0;
+}
+
+int serve_connbench(int conns, int threads) {
+    struct resources *conn_res;
+    std::vector<struct setup_times_t> times;
+    std::vector<std::thread> pool;
+    std::atomic<int> next(0);
+    std::atomic<int> failed(0);
+    char temp_char;
+    int listenfd;
+    int rc = 0;
+    int i;
+    listenfd = sock_listen(config.tcp_port);
+    if (listenfd < 0)
+        return 1;
+    conn_res = (struct resources *) calloc(conns + 1, sizeof(struct resources));
+    if (!conn_res) {
+        fprintf(stderr, "failed to allocate %d connections\n", conns);
+        close(listenfd);
+        return 1;
+    }
+    for (i = 0; i <= conns; i++)
+        resources_init(&conn_res[i], &config);
+    log_info("waiting on port %d for %d + %d connections\n", config.tcp_port, 1, conns);
+    /* the client sets up its first connection on its own */
+    conn_res[0].sock = sock_accept(listenfd);
+    if (conn_res[0].sock < 0 || resources_create(&conn_res[0]) || connect_qp(&conn_res[0])) {
+        fprintf(stderr, "failed to set up the first connection\n");
         rc = 1;
-        goto resources_create_exit;
-    }
-    fprintf(stdout, "MR was registered with addr=%p, lkey=0x%x, rkey=0x%x, flags=0x%x\n", res->buf, res->mr->lkey,
-            res->mr->rkey, mr_flags);
-    /* create the Queue Pair */
-    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-    qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.sq_sig_all = 1;
-    qp_init_attr.send_cq = res->cq;
-    qp_init_attr.recv_cq = res->cq;
-    qp_init_attr.cap.max_send_wr = 1;
-    qp_init_attr.cap.max_recv_wr = 1;
-    qp_init_attr.cap.max_send_sge = 1;
-    qp_init_attr.cap.max_recv_sge = 1;
-    res->qp = ibv_create_qp(res->pd, &qp_init_attr);
-    if (!res->qp) {
-        fprintf(stderr, "failed to create QP\n");
+        goto serve_connbench_exit;
+    }
+    print_setup_times("single connection setup", &conn_res[0].setup_times, 1);
+    /* every worker accepts and connects on its own, they share the listening socket */
+    for (i = 0; i < threads; i++) {
+        pool.emplace_back([&]() {
+            int n;
+            while ((n = next.fetch_add(1)) < conns) {
+                conn_res[n + 1].sock = sock_accept(listenfd);
+                if (conn_res[n + 1].sock < 0 || resources_create(&conn_res[n + 1]) || connect_qp(&conn_res[n + 1]))
+                    failed++;
+            }
+        });
+    }
+    for (auto &worker : pool)
+        worker.join();
+    for (i = 1; i <= conns; i++)
+        times.push_back(conn_res[i].setup_times);
+    print_setup_times("parallel connection setup", times.data(), conns);
+    log_info("%d connections accepted, %d failed\n", conns, failed.load());
+    if (failed.load())
         rc = 1;
-        goto resources_create_exit;
+serve_connbench_exit:
+    /* keep every QP until the client has closed the socket of its side */
+    for (i = 0; i <= conns; i++) {
+        if (conn_res[i].sock >= 0)
+            while (read(conn_res[i].sock, &temp_char, 1) > 0)
+                ;
+        if (resources_destroy(&conn_res[i]))
+            rc = 1;
     }
-    fprintf(stdout, "QP was created, QP number=0x%x\n", res->qp->qp_num);
-    resources_create_exit:
-    if (rc) {
-        /* Error encountered, cleanup */
-        if (res->qp) {
-            ibv_destroy_qp(res->qp);
-            res->qp = NULL;
+    free(conn_res);
+    close(listenfd);
+    return rc;
+}
+
+int serve_sync_msg(struct resources *res, char tag) {
+    struct ctrl_hdr_t hdr;
+    char remote_tag;
+    if (ctrl_recv(res->sock, &hdr, &remote_tag, 1))
+        return -1;
+    /* the client asks for recovery with a RECOVER instead of its SYNC, we resend ours once the QP is back */
+    if (hdr.type == CTRL_RECOVER) {
+        if (!res->cfg->recover) {
+            fprintf(stderr, "client requested QP recovery without asking for it in its session\n");
+            return -1;
         }
-        if (res->mr) {
-            ibv_dereg_mr(res->mr);
-            res->mr = NULL;
+        if (recover_qp(res) || ctrl_send(res->sock, CTRL_SYNC, &tag, 1))
+            return -1;
+        return 0;
+    }
+    if (hdr.type != CTRL_SYNC || remote_tag != tag) {
+        fprintf(stderr, "expected SYNC '%c' from the client\n", tag);
+        return -1;
+    }
+    return 1;
+}
+
+int serve_until_sync(struct resources *res, char tag) {
+    int rc;
+    if (ctrl_send(res->sock, CTRL_SYNC, &tag, 1))
+        return 1;
+    while ((rc = serve_sync_msg(res, tag)) == 0)
+        ;
+    return rc < 0;
+}
+
+int serve_scenario(struct resources *res) {
+    struct config_t *cfg = res->cfg;
+    struct ctrl_hdr_t hdr;
+    struct ctrl_session_t step;
+    struct ctrl_accept_t accepted;
+    char op[CTRL_OP_LEN + 1];
+    size_t buf_size = cfg->buf_size;
+    const char *reason;
+    int steps = 0;
+    int count;
+    int rc;
+    while (true) {
+        if (ctrl_recv(res->sock, &hdr, &step, sizeof(step)))
+            return 1;
+        if (hdr.type == CTRL_END)
+            break;
+        if (hdr.type != CTRL_STEP || hdr.len != sizeof(step)) {
+            fprintf(stderr, "expected STEP or END from the client\n");
+            return 1;
         }
-        if (res->buf) {
-            free(res->buf);
-            res->buf = NULL;
+        memcpy(op, step.op, CTRL_OP_LEN);
+        op[CTRL_OP_LEN] = '\0';
+        count = (int) ntohl(step.count);
+        cfg->msg_size = ntohl(step.msg_size);
+        cfg->depth = (int) ntohl(step.depth);
+        /* the QP and buffer were set up for the largest step, every step has to fit into them */
+        reason = NULL;
+        if (strcmp(op, "read") && strcmp(op, "write") && strcmp(op, "bw") && strcmp(op, "wbw") &&
+            strcmp(op, "pingpong"))
+            reason = "op can't be part of a scenario";
+        else if (count < 0 || cfg->msg_size == 0 || cfg->depth <= 0 ||
+                 (uint32_t) cfg->depth > res->qp_cap.max_send_wr || (uint32_t) cfg->depth > res->qp_cap.max_recv_wr)
+            reason = "invalid step parameters";
+        else if ((size_t) std::max(cfg->depth, 2) * cfg->msg_size > buf_size)
+            reason = "step doesn't fit into the registered buffer";
+        if (reason) {
+            fprintf(stderr, "rejecting step: %s\n", reason);
+            ctrl_send(res->sock, CTRL_REJECT, reason, strlen(reason));
+            return 1;
         }
-        if (res->cq) {
-            ibv_destroy_cq(res->cq);
-            res->cq = NULL;
+        cfg->operation = (char *) session_op(op);
+        accepted.buf_size = htonll(buf_size);
+        accepted.msg_size = htonl(cfg->msg_size);
+        if (ctrl_send(res->sock, CTRL_ACCEPT, &accepted, sizeof(accepted)))
+            return 1;
+        /* one-sided steps don't involve us until the client is done */
+        if (!strcmp(op, "read") || !strcmp(op, "write"))
+            rc = ctrl_sync(res->sock, 'S');
+        else if (!strcmp(op, "pingpong"))
+            rc = serve_pingpong(res, count);
+        else
+            rc = serve_bw(res, count);
+        if (rc)
+            return 1;
+        steps++;
+    }
+    log_info("scenario of %d steps done\n", steps);
+    return 0;
+}
+
+int check_fragments(struct resources *res) {
+    const struct config_t *cfg = res->cfg;
+    int frags = cfg->max_sge;
+    for (int i = 0; i < frags; ++i) {
+        char *frag = res->buf + (size_t) i * cfg->msg_size;
+        for (uint32_t j = 0; j < cfg->msg_size; ++j) {
+            if (frag[j] != 'a' + i % 26) {
+                fprintf(stderr, "fragment %d is corrupted at byte %u\n", i, j);
+                return 1;
+            }
         }
-        if (res->pd) {
-            ibv_dealloc_pd(res->pd);
-            res->pd = NULL;
+    }
+    log_info("all %d fragments of %u bytes arrived intact\n", frags, cfg->msg_size);
+    return 0;
+}
+
+int run_session(struct resources *res, int count) {
+    const struct config_t *cfg = res->cfg;
+    int rc = 0;
+    if (strcmp(cfg->operation, "send") == 0) {
+        strcpy(res->buf, MSG);
+        std::chrono::nanoseconds total(0);
+        for (int i = 0; i < count; ++i) {
+            if (post_send(res, IBV_WR_SEND)) {
+                fprintf(stderr, "failed to post SR\n");
+                return 1;
+            }
+            auto start = std::chrono::high_resolution_clock::now();
+            if (poll_completion(res)) {
+                fprintf(stderr, "poll completion failed\n");
+                return 1;
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            std::chrono::nanoseconds elapsed = end - start;
+            total += elapsed;
         }
-        if (res->ib_ctx) {
-            ibv_close_device(res->ib_ctx);
-            res->ib_ctx = NULL;
+        log_info("RDMA send operation took %lld ns\n", total.count());
+    } else if (strcmp(cfg->operation, "receive") == 0) {
+        for (int i = 0; i < count; ++i) {
+            if (post_receive(res)) {
+                fprintf(stderr, "failed to post RR\n");
+                return 1;
+            }
+            if (poll_completion(res)) {
+                fprintf(stderr, "poll completion failed\n");
+                return 1;
+            }
         }
-        if (dev_list) {
-            ibv_free_device_list(dev_list);
-            dev_list = NULL;
+        log_info("Message is: %s\n", res->buf);
+    } else if (!strcmp(cfg->operation, "read")) {
+        /* setup server buffer with read message */
+        strcpy(res->buf, RDMAMSGR);
+        /* Sync so we are sure server side has data ready before client tries to read it */
+        /* just exchange a tagged SYNC frame */
+        if (ctrl_sync(res->sock, 'R')) {
+            fprintf(stderr, "sync error before RDMA ops\n");
+            return 1;
         }
-        if (res->sock >= 0) {
-            if (close(res->sock))
-                fprintf(stderr, "failed to close socket\n");
-            res->sock = -1;
+        if (serve_until_sync(res, 'R')) {
+            fprintf(stderr, "sync error before RDMA ops\n");
+            return 1;
         }
+    } else if (!strcmp(cfg->operation, "write")) {
+        strcpy(res->buf, RDMAMSGW);
+        /* Sync so server will know that client is done mucking with its memory */
+        /* just exchange a tagged SYNC frame */
+        if (ctrl_sync(res->sock, 'W')) {
+            fprintf(stderr, "sync error after RDMA ops\n");
+            return 1;
+        }
+        log_info("Contents of server buffer: '%s'\n", res->buf);
+        if (serve_until_sync(res, 'W')) {
+            fprintf(stderr, "sync error after RDMA ops\n");
+            return 1;
+        }
+    } else if (!strcmp(cfg->operation, "chase")) {
+        if (build_chase_list(res, cfg->chase_nodes)) {
+            return 1;
+        }
+        /* Sync so the client only starts walking once the list is in place */
+        if (ctrl_sync(res->sock, 'C')) {
+            fprintf(stderr, "sync error before pointer chasing\n");
+            return 1;
+        }
+        /* wait until the client is done walking the list */
+        if (ctrl_sync(res->sock, 'C')) {
+            fprintf(stderr, "sync error after pointer chasing\n");
+            return 1;
+        }
+    } else if (!strcmp(cfg->operation, "sge")) {
+        /* the client gathers and writes while we wait */
+        if (ctrl_sync(res->sock, 'G')) {
+            fprintf(stderr, "sync error before RDMA ops\n");
+            return 1;
+        }
+        if (ctrl_sync(res->sock, 'G')) {
+            fprintf(stderr, "sync error after RDMA ops\n");
+            return 1;
+        }
+        rc = check_fragments(res);
+    } else if (!strcmp(cfg->operation, "zcsend")) {
+        if (serve_zcsend(res, count)) {
+            return 1;
+        }
+    } else if (!strcmp(cfg->operation, "pingpong")) {
+        if (serve_pingpong(res, count)) {
+            return 1;
+        }
+    } else if (!strcmp(cfg->operation, "bw") || !strcmp(cfg->operation, "wbw")) {
+        if (serve_bw(res, count)) {
+            return 1;
+        }
+    } else if (!strcmp(cfg->operation, "scenario")) {
+        rc = serve_scenario(res);
+    } else if (!strcmp(cfg->operation, "openloop")) {
+        /* the client's reads or writes don't involve us until its sweep is done */
+        if (serve_until_sync(res, 'O')) {
+            fprintf(stderr, "sync error after the open-loop sweep\n");
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "unknown operation\n");
+        return 1;
     }
     return rc;
 }
 
-int resources_destroy(struct resources *res) {
-    int rc = 0;
-    if (res->qp)
-        if (ibv_destroy_qp(res->qp)) {
-            fprintf(stderr, "failed to destroy QP\n");
-            rc = 1;
-        }
-    if (res->mr)
-        if (ibv_dereg_mr(res->mr)) {
-            fprintf(stderr, "failed to deregister MR\n");
-            rc = 1;
-        }
-    if (res->buf)
-        free(res->buf);
-    if (res->cq)
-        if (ibv_destroy_cq(res->cq)) {
-            fprintf(stderr, "failed to destroy CQ\n");
-            rc = 1;
+/* the client's op names its own side, send and receive are the other way round for us */
+static const char *session_ops[][2] = {
+        {"send",     "receive"},
+        {"receive",  "send"},
+        {"read",     "read"},
+        {"write",    "write"},
+        {"chase",    "chase"},
+        {"sge",      "sge"},
+        {"zcsend",   "zcsend"},
+        {"pingpong", "pingpong"},
+        {"bw",       "bw"},
+        {"wbw",      "wbw"},
+        {"pool",     "pool"},
+        {"scenario", "scenario"},
+        {"openloop", "openloop"},
+        /* one-sided streams, the server only waits for the end like for openloop */
+        {"stream",   "openloop"},
+        {"autotune", "openloop"},
+        {"coro",     "openloop"},
+        {"dispatch", "openloop"},
+        {"jitter",   "openloop"},
+};
+
+const char *session_op(const char *client_op) {
+    size_t i;
+    for (i = 0; i < sizeof(session_ops) / sizeof(session_ops[0]); i++) {
+        if (!strcmp(client_op, session_ops[i][0]))
+            return session_ops[i][1];
+    }
+    return NULL;
+}
+
+const char *configure_session(struct config_t *cfg, const struct ctrl_session_t *req, int *count) {
+    char op[CTRL_OP_LEN + 1];
+    uint32_t flags = ntohl(req->flags);
+    memcpy(op, req->op, CTRL_OP_LEN);
+    op[CTRL_OP_LEN] = '\0';
+    cfg->operation = (char *) session_op(op);
+    if (!cfg->operation)
+        return "unknown operation";
+    *count = (int) ntohl(req->count);
+    cfg->msg_size = ntohl(req->msg_size);
+    cfg->depth = (int) ntohl(req->depth);
+    cfg->max_sge = (int) ntohl(req->max_sge);
+    cfg->qp_type = (enum ibv_qp_type) ntohl(req->qp_type);
+    cfg->chase_nodes = (int) ntohl(req->chase_nodes);
+    cfg->recover = !!(flags & CTRL_F_RECOVER);
+    cfg->use_rdmacm = !!(flags & CTRL_F_RDMACM);
+    if (*count < 0 || cfg->msg_size == 0 || cfg->depth <= 0 || cfg->max_sge <= 0 || cfg->chase_nodes <= 0)
+        return "invalid session parameters";
+    if (cfg->qp_type != IBV_QPT_RC && cfg->qp_type != IBV_QPT_UC && cfg->qp_type != IBV_QPT_UD)
+        return "unknown transport";
+    /* our side of the buffer layout follows from the op */
+    cfg->buf_size = MSG_SIZE;
+    if (!strcmp(cfg->operation, "chase")) {
+        /* the whole list lives in the registered region */
+        cfg->buf_size = (size_t) cfg->chase_nodes * CHASE_NODE_SIZE;
+    } else if (!strcmp(cfg->operation, "sge")) {
+        /* the client writes all of its fragments back to back */
+        cfg->buf_size = (size_t) cfg->max_sge * cfg->msg_size;
+    } else if (!strcmp(cfg->operation, "zcsend")) {
+        /* one receive slot per message the client can have in flight */
+        cfg->buf_size = (size_t) cfg->depth * (sizeof(struct msg_hdr_t) + cfg->msg_size);
+    } else if (!strcmp(cfg->operation, "pingpong")) {
+        if (cfg->msg_size < sizeof(uint64_t))
+            cfg->msg_size = sizeof(uint64_t);
+        cfg->buf_size = (size_t) 2 * cfg->msg_size;
+    } else if (!strcmp(cfg->operation, "bw") || !strcmp(cfg->operation, "wbw")) {
+        /* one receive slot per message the client can have in flight */
+        if (cfg->msg_size < sizeof(uint64_t))
+            cfg->msg_size = sizeof(uint64_t);
+        cfg->buf_size = (size_t) cfg->depth * cfg->msg_size;
+    } else if (!strcmp(cfg->operation, "openloop")) {
+        /* every slot the client can have in flight reads or writes its own part */
+        cfg->buf_size = (size_t) cfg->depth * cfg->msg_size;
+    } else if (!strcmp(cfg->operation, "pool")) {
+        /* the client may keep depth one-sided WRs going on the connection, each on a slot of its own */
+        cfg->buf_size = std::max((size_t) MSG_SIZE, (size_t) cfg->depth * cfg->msg_size);
+    } else if (!strcmp(cfg->operation, "scenario")) {
+        /* sized for the largest step, the client asks for it */
+        if (cfg->msg_size < sizeof(uint64_t))
+            cfg->msg_size = sizeof(uint64_t);
+        cfg->buf_size = (size_t) std::max(cfg->depth, 2) * cfg->msg_size;
+    }
+    return NULL;
+}
+
+/* set once SIGINT or SIGTERM arrives, serve_sessions() stops accepting */
+static volatile sig_atomic_t stop_serving = 0;
+/* every session is recorded here, only --daemon shares the device and buffers */
+static struct daemon_t bench_daemon;
+
+static void handle_stop(int) {
+    stop_serving = 1;
+}
+
+/* SIGINT and SIGTERM are for the main thread, it has to see them to stop accepting */
+static void block_stop_signals(void) {
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+}
+
+int daemon_open(struct daemon_t *dm, struct config_t *cfg, int bufs, size_t buf_size) {
+    struct ibv_device_attr attr;
+    struct resources res;
+    std::vector<char *> taken;
+    int i;
+    dm->ib_ctx = open_device(cfg);
+    if (!dm->ib_ctx)
+        return 1;
+    if (ibv_query_device(dm->ib_ctx, &attr)) {
+        fprintf(stderr, "failed to query device %s\n", cfg->dev_name);
+        return 1;
+    }
+    dm->atomic_cap = attr.atomic_cap;
+    dm->pd = ibv_alloc_pd(dm->ib_ctx);
+    if (!dm->pd) {
+        fprintf(stderr, "ibv_alloc_pd failed\n");
+        return 1;
+    }
+    /* registering is what makes short sessions expensive, so it is done up front */
+    resources_init(&res, cfg);
+    for (i = 0; i < bufs; i++) {
+        if (daemon_get_buf(dm, &res, buf_size))
+            return 1;
+        taken.push_back(res.buf);
+    }
+    for (char *buf : taken)
+        daemon_put_buf(dm, buf);
+    log_info("daemon: device %s open, %d buffers of %zu bytes registered\n", cfg->dev_name, bufs, buf_size);
+    return 0;
+}
+
+int daemon_get_buf(struct daemon_t *dm, struct resources *res, size_t size) {
+    struct pooled_buf_t pb;
+    int mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    int best = -1;
+    /* as resources_create() does for RC, but a pooled buffer outlives the session's QP type and may serve
+     * an RC session next, so it is registered for atomics whenever the device has them */
+    if (dm->atomic_cap != IBV_ATOMIC_NONE)
+        mr_flags |= IBV_ACCESS_REMOTE_ATOMIC;
+    {
+        std::lock_guard<std::mutex> guard(dm->lock);
+        /* the smallest free buffer that is large enough */
+        for (size_t i = 0; i < dm->bufs.size(); i++) {
+            if (!dm->bufs[i].in_use && dm->bufs[i].size >= size &&
+                (best < 0 || dm->bufs[i].size < dm->bufs[best].size))
+                best = (int) i;
         }
-    if (res->pd)
-        if (ibv_dealloc_pd(res->pd)) {
-            fprintf(stderr, "failed to deallocate PD\n");
-            rc = 1;
+        if (best >= 0) {
+            dm->bufs[best].in_use = 1;
+            pb = dm->bufs[best];
         }
-    if (res->ib_ctx)
-        if (ibv_close_device(res->ib_ctx)) {
-            fprintf(stderr, "failed to close device context\n");
-            rc = 1;
+    }
+    if (best < 0) {
+        /* none fits, register a new one and keep it for later sessions */
+        pb.size = 4096;
+        while (pb.size < size)
+            pb.size <<= 1;
+        pb.buf = (char *) malloc(pb.size);
+        if (!pb.buf) {
+            fprintf(stderr, "failed to malloc %zu bytes to memory buffer\n", pb.size);
+            return 1;
         }
-    if (res->sock >= 0)
-        if (close(res->sock)) {
-            fprintf(stderr, "failed to close socket\n");
-            rc = 1;
+        pb.mr = ibv_reg_mr(dm->pd, pb.buf, pb.size, mr_flags);
+        if (!pb.mr) {
+            fprintf(stderr, "ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
+            free(pb.buf);
+            return 1;
         }
+        pb.in_use = 1;
+        std::lock_guard<std::mutex> guard(dm->lock);
+        dm->bufs.push_back(pb);
+    }
+    memset(pb.buf, 0, size);
+    res->buf = pb.buf;
+    res->mr = pb.mr;
+    res->shared_buf = 1;
+    return 0;
+}
+
+void daemon_put_buf(struct daemon_t *dm, char *buf) {
+    std::lock_guard<std::mutex> guard(dm->lock);
+    for (auto &pb : dm->bufs) {
+        if (pb.buf == buf)
+            pb.in_use = 0;
+    }
+}
+
+void daemon_close(struct daemon_t *dm) {
+    for (auto &pb : dm->bufs) {
+        if (ibv_dereg_mr(pb.mr))
+            fprintf(stderr, "failed to deregister MR\n");
+        free(pb.buf);
+    }
+    dm->bufs.clear();
+    if (dm->pd && ibv_dealloc_pd(dm->pd))
+        fprintf(stderr, "failed to deallocate PD\n");
+    if (dm->ib_ctx && ibv_close_device(dm->ib_ctx))
+        fprintf(stderr, "failed to close device context\n");
+    dm->pd = NULL;
+    dm->ib_ctx = NULL;
+}
+
+void record_session(struct daemon_t *dm, struct session_stats_t *stats) {
+    std::lock_guard<std::mutex> guard(dm->lock);
+    dm->stats.push_back(*stats);
+    log_info("session %d: %s, %d iterations, setup %.1f us, run %.1f us, result %d\n", stats->id, stats->op,
+            stats->count, stats->setup_us, stats->run_us, stats->rc);
+}
+
+void print_session_stats(struct daemon_t *dm) {
+    int failed = 0;
+    std::lock_guard<std::mutex> guard(dm->lock);
+    log_info("%6s %-10s %10s %10s %6s %-4s %12s %12s %6s %4s\n", "id", "op", "iterations", "size", "depth",
+            "qp", "setup us", "run us", "pooled", "rc");
+    for (auto &st : dm->stats) {
+        log_info("%6d %-10s %10d %10u %6d %-4s %12.1f %12.1f %6s %4d\n", st.id, st.op, st.count,
+                st.msg_size, st.depth, transport_name(st.qp_type), st.setup_us, st.run_us,
+                st.pooled_buf ? "yes" : "no", st.rc);
+        if (st.rc)
+            failed++;
+    }
+    log_info("%zu sessions served, %d failed\n", dm->stats.size(), failed);
+}
+
+int session_release(struct session_t *s) {
+    char *buf = s->res.shared_buf ? s->res.buf : NULL;
+    int rc = resources_destroy(&s->res);
+    /* the buffer goes back to the pool only once the MR can't be reached through the QP anymore */
+    if (buf)
+        daemon_put_buf(s->dm, buf);
+    free(s);
     return rc;
 }
 
-int connect_qp(struct resources *res) {
-    struct cm_con_data_t local_con_data;
-    struct cm_con_data_t remote_con_data;
-    struct cm_con_data_t tmp_con_data;
-    int rc = 0;
-    char temp_char;
-    union ibv_gid my_gid;
-    if (config.gid_idx >= 0) {
-        rc = ibv_query_gid(res->ib_ctx, config.ib_port, config.gid_idx, &my_gid);
-        if (rc) {
-            fprintf(stderr, "could not get gid for port %d, index %d\n", config.ib_port, config.gid_idx);
-            goto connect_qp_exit;
+struct session_t *session_accept(int sock, const struct ctrl_frame_t *hello, const struct config_t *defaults,
+                                 struct daemon_t *dm, struct ibv_cq *cq, int cq_room) {
+    struct session_t *s;
+    struct resources *res;
+    struct config_t *cfg;
+    struct ctrl_session_t req;
+    struct ctrl_accept_t accepted;
+    const char *reason = NULL;
+    size_t size;
+    int count = 0;
+    s = (struct session_t *) malloc(sizeof(struct session_t));
+    if (!s) {
+        reason = "out of memory";
+        fprintf(stderr, "rejecting session: %s\n", reason);
+        ctrl_send(sock, CTRL_REJECT, reason, strlen(reason));
+        close(sock);
+        return NULL;
+    }
+    /* every session starts over from the command line, the client's request is applied on top */
+    s->cfg = *defaults;
+    s->dm = dm;
+    s->start = 0;
+    s->state = SESSION_HELLO;
+    s->frame.got = 0;
+    s->tag = 0;
+    s->syncs = 0;
+    s->sent = 0;
+    s->done = 0;
+    s->pending = 0;
+    s->owed = 0;
+    s->psn = 0;
+    s->active_ns = 0;
+    s->timer = 0;
+    s->closing = 0;
+    memset(&s->stats, 0, sizeof(s->stats));
+    memset(&s->bw, 0, sizeof(s->bw));
+    cfg = &s->cfg;
+    res = &s->res;
+    resources_init(res, cfg);
+    res->sock = sock;
+    if (hello->hdr.version != CTRL_VERSION) {
+        reason = "unsupported control protocol version";
+    } else if (hello->hdr.type != CTRL_HELLO || hello->hdr.len != sizeof(req)) {
+        reason = "expected HELLO";
+    } else {
+        memcpy(&req, hello->payload, sizeof(req));
+        reason = configure_session(cfg, &req, &count);
+    }
+    /* listen before accepting, so the client can't connect too early */
+    if (!reason && cfg->use_rdmacm && cm_listen(res, cfg))
+        reason = "failed to listen for RDMA-CM connections";
+    /* the CM opens its own device context, only sessions connected over TCP share the daemon's */
+    if (!reason && dm && !cfg->use_rdmacm) {
+        res->ib_ctx = dm->ib_ctx;
+        res->pd = dm->pd;
+        res->shared_dev = 1;
+        size = cfg->buf_size + (cfg->qp_type == IBV_QPT_UD ? UD_GRH_SIZE : 0);
+        if (daemon_get_buf(dm, res, size))
+            reason = "failed to get a registered buffer";
+        else if (cfg->qp_type == IBV_QPT_UD)
+            res->grh = res->buf + cfg->buf_size;
+        /* sessions polling for themselves would take the completions of the other QPs on a shared CQ */
+        if (!reason && cq && (session_passive(s) || session_evented(s))) {
+            if (2 * cfg->depth > cq_room) {
+                reason = "queue depth doesn't fit into the shard's CQ";
+            } else {
+                res->cq = cq;
+                res->shared_cq = 1;
+            }
         }
+    }
+    if (reason) {
+        fprintf(stderr, "rejecting session: %s\n", reason);
+        ctrl_send(sock, CTRL_REJECT, reason, strlen(reason));
+        session_release(s);
+        return NULL;
+    }
+    accepted.buf_size = htonll(cfg->buf_size);
+    accepted.msg_size = htonl(cfg->msg_size);
+    if (ctrl_send(sock, CTRL_ACCEPT, &accepted, sizeof(accepted))) {
+        session_release(s);
+        return NULL;
+    }
+    s->stats.id = ++bench_daemon.sessions;
+    strncpy(s->stats.op, cfg->operation, CTRL_OP_LEN);
+    s->stats.count = count;
+    s->stats.msg_size = cfg->msg_size;
+    s->stats.depth = cfg->depth;
+    s->stats.qp_type = cfg->qp_type;
+    s->stats.pooled_buf = res->shared_buf;
+    log_info("session %d: op %s, %d iterations\n", s->stats.id, cfg->operation, count);
+    print_config(cfg);
+    return s;
+}
+
+struct session_t *session_open(int sock, const struct config_t *defaults, struct daemon_t *dm, struct ibv_cq *cq,
+                               int cq_room) {
+    struct ctrl_frame_t hello;
+    if (ctrl_recv(sock, &hello.hdr, hello.payload, sizeof(hello.payload))) {
+        close(sock);
+        return NULL;
+    }
+    return session_accept(sock, &hello, defaults, dm, cq, cq_room);
+}
+
+int session_connect(struct session_t *s) {
+    struct resources *res = &s->res;
+    struct config_t *cfg = &s->cfg;
+    uint64_t start = now_ns();
+    int rc;
+    if (cfg->use_rdmacm) {
+        rc = cm_resources_create(res, cfg);
+        if (rc)
+            fprintf(stderr, "failed to connect through RDMA-CM\n");
     } else {
-        memset(&my_gid, 0, sizeof my_gid);
-    }
-    /* exchange using TCP sockets info required to connect QPs */
-    local_con_data.addr = htonll((uintptr_t) res->buf);
-    local_con_data.rkey = htonl(res->mr->rkey);
-    local_con_data.qp_num = htonl(res->qp->qp_num);
-    local_con_data.lid = htons(res->port_attr.lid);
-    memcpy(local_con_data.gid, &my_gid, 16);
-    fprintf(stdout, "\nLocal LID = 0x%x\n", res->port_attr.lid);
-    if (sock_sync_data(res->sock, sizeof(struct cm_con_data_t), (char *) &local_con_data, (char *) &tmp_con_data) < 0) {
-        fprintf(stderr, "failed to exchange connection data between sides\n");
-        rc = 1;
-        goto connect_qp_exit;
-    }
-    remote_con_data.addr = ntohll(tmp_con_data.addr);
-    remote_con_data.rkey = ntohl(tmp_con_data.rkey);
-    remote_con_data.qp_num = ntohl(tmp_con_data.qp_num);
-    remote_con_data.lid = ntohs(tmp_con_data.lid);
-    memcpy(remote_con_data.gid, tmp_con_data.gid, 16);
-    res->remote_props = remote_con_data;
-    fprintf(stdout, "Remote address = 0x%" PRIx64 "\n", remote_con_data.addr);
-    fprintf(stdout, "Remote rkey = 0x%x\n", remote_con_data.rkey);
-    fprintf(stdout, "Remote QP number = 0x%x\n", remote_con_data.qp_num);
-    fprintf(stdout, "Remote LID = 0x%x\n", remote_con_data.lid);
-    if (config.gid_idx >= 0) {
-        uint8_t *p = remote_con_data.gid;
-        fprintf(stdout, "Remote GID = %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:"
-                        "%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
-                p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
-                p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
-    }
-    /* modify the QP to init */
-    rc = modify_qp_to_init(res->qp);
-    if (rc) {
-        fprintf(stderr, "failed to modify QP state to INIT\n");
-        goto connect_qp_exit;
-    }
-    rc = modify_qp_to_rtr(res->qp, remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid);
-    if (rc) {
-        fprintf(stderr, "failed to modify QP state to RTR\n");
-        goto connect_qp_exit;
-    }
-    rc = modify_qp_to_rts(res->qp);
-    if (rc) {
-        fprintf(stderr, "failed to modify QP state to RTS\n");
-        goto connect_qp_exit;
-    }
-    fprintf(stdout, "QP %u successfully connected\n", res->qp->qp_num);
-    /* sync to make sure that both sides are in states that they can connect to prevent packet loss */
-    if (sock_sync_data(res->sock, 1, "Q", &temp_char)) {
-        fprintf(stderr, "sync error after QPs are were moved to RTS\n");
+        rc = resources_create(res) || connect_qp(res);
+        if (rc)
+            fprintf(stderr, "failed to connect QPs\n");
+    }
+    s->stats.setup_us = (now_ns() - start) / 1e3;
+    s->start = now_ns();
+    if (rc)
+        return rc;
+    log_info("connection setup (%s) took %.1f us\n", cfg->use_rdmacm ? "rdmacm" : "tcp", s->stats.setup_us);
+    results_context(cfg->dev_name, cfg->ib_port, &res->port_attr, transport_name(cfg->qp_type));
+    return 0;
+}
+
+int session_run(struct session_t *s) {
+    s->start = now_ns();
+    return run_session(&s->res, s->stats.count);
+}
+
+int session_close(struct session_t *s, int rc) {
+    struct session_stats_t stats = s->stats;
+    stats.run_us = (now_ns() - s->start) / 1e3;
+    if (session_release(s)) {
+        fprintf(stderr, "failed to destroy resources\n");
         rc = 1;
     }
-    connect_qp_exit:
+    stats.rc = rc;
+    record_session(&bench_daemon, &stats);
     return rc;
 }
 
-int sock_sync_data(int sock, int xfer_size, char *local_data, char *remote_data) {
+int session_passive(const struct session_t *s) {
+    return !strcmp(s->cfg.operation, "openloop") || !strcmp(s->cfg.operation, "pool");
+}
+
+int session_evented(const struct session_t *s) {
+    static const char *ops[] = {"bw", "wbw", "pingpong", "send", "receive", "read", "write", "chase", "sge"};
+    for (const char *op : ops) {
+        if (!strcmp(s->cfg.operation, op))
+            return 1;
+    }
+    return 0;
+}
+
+int session_begin(struct session_t *s) {
+    char tag = 'O';
+    s->start = now_ns();
+    if (!strcmp(s->cfg.operation, "pool")) {
+        strcpy(s->res.buf, RDMAMSGR);
+        return 0;
+    }
+    /* the client's reads or writes don't involve us until its sweep is done */
+    return ctrl_send(s->res.sock, CTRL_SYNC, &tag, 1);
+}
+
+int serve_pool_msg(struct resources *res) {
+    struct ctrl_hdr_t hdr;
+    char payload[CTRL_MAX_PAYLOAD];
+    /* the client only talks to us to fix up the QP, everything else is one-sided */
+    if (ctrl_recv(res->sock, &hdr, payload, sizeof(payload)))
+        return 1;
+    if (hdr.type == CTRL_RECOVER && recover_qp(res))
+        return -1;
+    return 0;
+}
+
+void serve_pooled_conn(struct session_t *s) {
+    int rc;
+    block_stop_signals();
+    session_begin(s);
+    while ((rc = serve_pool_msg(&s->res)) == 0)
+        ;
+    session_close(s, rc < 0);
+}
+
+int accept_session(int sock, std::vector<std::thread> &pooled) {
+    struct session_t *s;
+    s = session_open(sock, &config, config.daemon ? &bench_daemon : NULL, NULL, 0);
+    if (!s)
+        return 1;
+    if (session_connect(s))
+        return session_close(s, 1);
+    /* a pooled connection lives as long as the client keeps it, so it gets its own thread */
+    if (!strcmp(s->cfg.operation, "pool")) {
+        pooled.emplace_back(serve_pooled_conn, s);
+        return 0;
+    }
+    return session_close(s, session_run(s));
+}
+
+/* the session is done with the shard, a stopping shard ends with its last one */
+static void shard_session_done(struct shard_t *sh) {
+    sh->served++;
+    sh->load--;
+    if (sh->stopping.load() && !sh->load.load())
+        sh->loop.stop();
+}
+
+static void shard_end_session(struct shard_t *sh, struct session_t *s, int rc) {
+    auto &live = sh->sessions;
+    sh->loop.remove(s->res.sock);
+    if (s->timer)
+        sh->loop.cancel_timer(s->timer);
+    if (s->res.qp)
+        sh->qps.erase(s->res.qp->qp_num);
+    if (s->res.shared_cq)
+        sh->cq_reserved -= 2 * s->cfg.depth;
+    live.erase(std::remove(live.begin(), live.end(), s), live.end());
+    session_close(s, rc);
+    /* what the QP left in the CQ finds no session anymore and is dropped */
+    sh->loop.drain_cq(sh->cq);
+    shard_session_done(sh);
+}
+
+static void shard_cancel_timer(struct shard_t *sh, struct session_t *s) {
+    if (s->timer) {
+        sh->loop.cancel_timer(s->timer);
+        s->timer = 0;
+    }
+}
+
+/* the session goes once the loop is through this round, there may be more of its events in it */
+static void shard_finish(struct shard_t *sh, struct session_t *s, int rc) {
+    if (s->closing)
+        return;
+    s->closing = 1;
+    shard_cancel_timer(sh, s);
+    sh->loop.add_timer(0, [sh, s, rc]() { shard_end_session(sh, s, rc); });
+}
+
+/* the client owes us a frame while the QP is connected or recovered, it gets SETUP_TIMEOUT_MS for it */
+static void shard_expect(struct shard_t *sh, struct session_t *s, const char *what) {
+    shard_cancel_timer(sh, s);
+    s->timer = sh->loop.add_timer((uint64_t) SETUP_TIMEOUT_MS * 1000000, [sh, s, what]() {
+        s->timer = 0;
+        fprintf(stderr, "session %d: no %s from the client within %d ms\n", s->stats.id, what, SETUP_TIMEOUT_MS);
+        shard_finish(sh, s, 1);
+    });
+}
+
+static int session_bw(const struct session_t *s) {
+    return !strcmp(s->cfg.operation, "bw") || !strcmp(s->cfg.operation, "wbw");
+}
+
+/* our next SYNC of the op */
+static int shard_sync(struct session_t *s) {
+    s->sent++;
+    return ctrl_send(s->res.sock, CTRL_SYNC, &s->tag, 1);
+}
+
+/* every message is in, or the rest was lost, the client hears so with the second SYNC */
+static void shard_bw_done(struct shard_t *sh, struct session_t *s) {
+    shard_cancel_timer(sh, s);
+    bw_report(&s->res, s->stats.count, &s->bw);
+    s->bw.done = 1;
+    if (shard_sync(s)) {
+        fprintf(stderr, "session %d: sync error after bandwidth test\n", s->stats.id);
+        shard_finish(sh, s, 1);
+    } else if (s->syncs == 2) {
+        shard_finish(sh, s, 0);
+    }
+}
+
+/* fails the op if nothing completed for MAX_POLL_CQ_TIMEOUT, like polling for it would */
+static void shard_watch(struct shard_t *sh, struct session_t *s) {
+    uint64_t timeout = (uint64_t) MAX_POLL_CQ_TIMEOUT * 1000000;
+    uint64_t idle = now_ns() - std::max(s->active_ns, s->start);
+    s->timer = 0;
+    if (idle < timeout) {
+        s->timer = sh->loop.add_timer(timeout - idle, [sh, s]() { shard_watch(sh, s); });
+        return;
+    }
+    if (session_bw(s)) {
+        /* unreliable transports simply stop delivering what was lost */
+        if (s->cfg.qp_type != IBV_QPT_RC && s->bw.received > 0) {
+            shard_bw_done(sh, s);
+            return;
+        }
+        fprintf(stderr, "session %d: failed to receive message %d\n", s->stats.id, s->bw.received);
+    } else {
+        fprintf(stderr, "session %d: %s stalled at message %d\n", s->stats.id, s->cfg.operation, s->done);
+    }
+    shard_finish(sh, s, 1);
+}
+
+/* every request is answered, the client hears so with the second SYNC once the replies are out */
+static void shard_pingpong_done(struct shard_t *sh, struct session_t *s) {
+    log_info("answered %d %s ping-pong messages of %u bytes\n", s->stats.count, transport_name(s->cfg.qp_type),
+            s->cfg.msg_size);
+    if (shard_sync(s)) {
+        fprintf(stderr, "session %d: sync error after ping-pong\n", s->stats.id);
+        shard_finish(sh, s, 1);
+    } else if (s->syncs == 2) {
+        shard_finish(sh, s, 0);
+    } else {
+        shard_expect(sh, s, "SYNC");
+    }
+}
+
+static void shard_bw_wc(struct shard_t *sh, struct session_t *s, const struct ibv_wc *wc) {
+    if (bw_recv(&s->res, wc, &s->bw)) {
+        shard_finish(sh, s, 1);
+        return;
+    }
+    if (s->bw.received == s->stats.count)
+        shard_bw_done(sh, s);
+}
+
+static void shard_pingpong_wc(struct shard_t *sh, struct session_t *s, const struct ibv_wc *wc) {
+    struct resources *res = &s->res;
+    uint32_t size = s->cfg.msg_size;
+    if (!(wc->opcode & IBV_WC_RECV)) {
+        s->pending--;
+    } else {
+        s->done++;
+        memcpy(res->buf + size, res->buf, size);
+        /* the next request must find a receive posted before we answer this one */
+        if (s->done < s->stats.count && pingpong_post(res, 0)) {
+            fprintf(stderr, "session %d: failed to post RR\n", s->stats.id);
+            shard_finish(sh, s, 1);
+            return;
+        }
+        s->owed++;
+    }
+    /* a reply waits for the completion of an earlier one when the SQ is full */
+    while (s->owed > 0 && s->pending < (int) res->qp_cap.max_send_wr) {
+        if (pingpong_post(res, 1)) {
+            fprintf(stderr, "session %d: failed to post SR\n", s->stats.id);
+            shard_finish(sh, s, 1);
+            return;
+        }
+        s->owed--;
+        s->pending++;
+    }
+    if (s->done == s->stats.count && !s->pending && !s->owed) {
+        shard_cancel_timer(sh, s);
+        shard_pingpong_done(sh, s);
+    }
+}
+
+/* one message of a send or receive session is through, the next one goes or the op is over */
+static void shard_transfer_wc(struct shard_t *sh, struct session_t *s) {
+    struct resources *res = &s->res;
+    int sending = !strcmp(s->cfg.operation, "send");
+    if (++s->done == s->stats.count) {
+        if (sending)
+            log_info("RDMA send operation took %lld ns\n", (long long) (now_ns() - s->start));
+        else
+            log_info("Message is: %s\n", res->buf);
+        shard_finish(sh, s, 0);
+        return;
+    }
+    if (sending ? post_send(res, IBV_WR_SEND) : post_receive(res)) {
+        fprintf(stderr, "session %d: failed to post %s\n", s->stats.id, sending ? "SR" : "RR");
+        shard_finish(sh, s, 1);
+    }
+}
+
+static void shard_wc(struct shard_t *sh, const struct ibv_wc *wc) {
+    auto it = sh->qps.find(wc->qp_num);
+    struct session_t *s;
+    /* left behind by a session that is gone */
+    if (it == sh->qps.end())
+        return;
+    s = it->second;
+    /* or flushed by a recovery */
+    if (s->closing || s->state != SESSION_RUNNING || s->bw.done)
+        return;
+    s->active_ns = now_ns();
+    if (wc->status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "session %d: %s failed with status 0x%x\n", s->stats.id, s->cfg.operation, wc->status);
+        shard_finish(sh, s, 1);
+        return;
+    }
+    if (session_bw(s))
+        shard_bw_wc(sh, s, wc);
+    else if (!strcmp(s->cfg.operation, "pingpong"))
+        shard_pingpong_wc(sh, s, wc);
+    else
+        shard_transfer_wc(sh, s);
+}
+
+/* the QP is connected, the op starts and goes on from the loop's completions and control frames */
+static int shard_start_op(struct shard_t *sh, struct session_t *s) {
+    struct resources *res = &s->res;
+    const char *op = s->cfg.operation;
+    int count = s->stats.count;
+    s->start = now_ns();
+    s->state = SESSION_RUNNING;
+    if (session_passive(s)) {
+        s->tag = !strcmp(op, "pool") ? 0 : 'O';
+        return session_begin(s);
+    }
+    if (session_bw(s)) {
+        s->tag = 'B';
+        return bw_begin(res, count, &s->bw) || shard_sync(s);
+    }
+    if (!strcmp(op, "pingpong")) {
+        s->tag = 'P';
+        if ((count > 0 && pingpong_post(res, 0)) || shard_sync(s))
+            return 1;
+        if (!count)
+            shard_pingpong_done(sh, s);
+        return 0;
+    }
+    if (!strcmp(op, "send") || !strcmp(op, "receive")) {
+        if (!count) {
+            shard_finish(sh, s, 0);
+            return 0;
+        }
+        if (!strcmp(op, "send")) {
+            strcpy(res->buf, MSG);
+            if (post_send(res, IBV_WR_SEND))
+                return 1;
+        } else if (post_receive(res)) {
+            return 1;
+        }
+        shard_watch(sh, s);
+        return 0;
+    }
+    /* read, write, chase and sge are one-sided, we only sync before and after the client's ops */
+    if (!strcmp(op, "read")) {
+        s->tag = 'R';
+        strcpy(res->buf, RDMAMSGR);
+    } else if (!strcmp(op, "write")) {
+        s->tag = 'W';
+        strcpy(res->buf, RDMAMSGW);
+    } else if (!strcmp(op, "chase")) {
+        s->tag = 'C';
+        if (build_chase_list(res, s->cfg.chase_nodes))
+            return 1;
+    } else {
+        s->tag = 'G';
+    }
+    return shard_sync(s);
+}
+
+/* the client's SYNC of the op came in, it answers ours */
+static int shard_synced(struct shard_t *sh, struct session_t *s) {
+    const char *op = s->cfg.operation;
+    s->syncs++;
+    if (!strcmp(op, "openloop")) {
+        shard_finish(sh, s, 0);
+    } else if (session_bw(s)) {
+        /* the client's SYNC before it starts sending and the one once it is done, in any order with ours */
+        if (s->syncs == 1 && !s->bw.done) {
+            s->start = now_ns();
+            if (s->bw.received >= s->stats.count)
+                shard_bw_done(sh, s);
+            else
+                shard_watch(sh, s);
+        } else if (s->syncs == 2 && s->bw.done) {
+            shard_finish(sh, s, 0);
+        }
+    } else if (!strcmp(op, "pingpong")) {
+        /* the requests come once the client has our first SYNC, they may have been answered already */
+        if (s->syncs == 1 && s->done < s->stats.count) {
+            s->start = now_ns();
+            shard_watch(sh, s);
+        } else if (s->syncs == 2 && s->sent == 2) {
+            shard_finish(sh, s, 0);
+        }
+    } else if (s->syncs == 1) {
+        /* the client's one-sided ops run between the two rounds */
+        if (!strcmp(op, "write"))
+            log_info("Contents of server buffer: '%s'\n", s->res.buf);
+        return shard_sync(s);
+    } else {
+        shard_finish(sh, s, !strcmp(op, "sge") ? check_fragments(&s->res) : 0);
+    }
+    return 0;
+}
+
+/* the client asks for recovery with a RECOVER instead of its SYNC, the PSNs are exchanged through the loop */
+static int shard_recover(struct shard_t *sh, struct session_t *s) {
+    uint32_t psn;
+    if (!s->cfg.recover) {
+        fprintf(stderr, "client requested QP recovery without asking for it in its session\n");
+        return 1;
+    }
+    if (recover_qp_begin(&s->res, &s->psn))
+        return 1;
+    psn = htonl(s->psn);
+    if (ctrl_send(s->res.sock, CTRL_PSN, &psn, sizeof(psn)))
+        return 1;
+    s->state = SESSION_RECOVER_PSN;
+    shard_expect(sh, s, "PSN");
+    return 0;
+}
+
+/* a complete frame from the client, the session's state says what it has to be */
+static int shard_frame(struct shard_t *sh, struct session_t *s) {
+    const struct ctrl_frame_t *f = &s->frame;
+    struct resources *res = &s->res;
+    struct cm_con_data_t remote;
+    uint32_t psn;
+    char tag = 'Q';
+    switch (s->state) {
+        case SESSION_CONN_DATA:
+            if (ctrl_frame_expect(f, CTRL_CONN_DATA, sizeof(remote)))
+                return 1;
+            memcpy(&remote, f->payload, sizeof(remote));
+            if (connect_qp_remote(res, &remote) || ctrl_send(res->sock, CTRL_SYNC, &tag, 1))
+                return 1;
+            s->state = SESSION_CONNECTED;
+            shard_expect(sh, s, "SYNC 'Q'");
+            return 0;
+        case SESSION_CONNECTED:
+            if (ctrl_frame_sync(f, 'Q'))
+                return 1;
+            shard_cancel_timer(sh, s);
+            s->stats.setup_us = (now_ns() - s->start) / 1e3;
+            log_info("connection setup (tcp) took %.1f us\n", s->stats.setup_us);
+            results_context(s->cfg.dev_name, s->cfg.ib_port, &res->port_attr, transport_name(s->cfg.qp_type));
+            return shard_start_op(sh, s);
+        case SESSION_RECOVER_PSN:
+            if (ctrl_frame_expect(f, CTRL_PSN, sizeof(psn)))
+                return 1;
+            memcpy(&psn, f->payload, sizeof(psn));
+            if (recover_qp_finish(res, s->psn, ntohl(psn)) || ctrl_send(res->sock, CTRL_SYNC, &tag, 1))
+                return 1;
+            s->state = SESSION_RECOVERED;
+            shard_expect(sh, s, "SYNC 'Q'");
+            return 0;
+        case SESSION_RECOVERED:
+            if (ctrl_frame_sync(f, 'Q'))
+                return 1;
+            shard_cancel_timer(sh, s);
+            log_info("session %d: QP %u recovered, local PSN 0x%x\n", s->stats.id, res->qp->qp_num, s->psn);
+            s->state = SESSION_RUNNING;
+            /* the client's RECOVER took our SYNC off the wire, it goes out once more */
+            return s->tag && ctrl_send(res->sock, CTRL_SYNC, &s->tag, 1);
+        case SESSION_RUNNING:
+            /* as when served from a thread, only the ops waiting on the client's SYNC can recover */
+            if (f->hdr.type == CTRL_RECOVER && (session_passive(s) || s->tag == 'R' || s->tag == 'W'))
+                return shard_recover(sh, s);
+            /* the client only talks to a pooled connection to fix up the QP, everything else is one-sided */
+            if (!strcmp(s->cfg.operation, "pool"))
+                return 0;
+            if (!s->tag) {
+                fprintf(stderr, "session %d: unexpected control frame during %s\n", s->stats.id, s->cfg.operation);
+                return 1;
+            }
+            if (ctrl_frame_sync(f, s->tag))
+                return 1;
+            return shard_synced(sh, s);
+        default:
+            return 1;
+    }
+}
+
+/* takes what the client sent without blocking and handles every frame that is complete */
+static void shard_ctrl(struct shard_t *sh, struct session_t *s) {
     int rc;
-    int read_bytes = 0;
-    int total_read_bytes = 0;
-    rc = write(sock, local_data, xfer_size);
-    if (rc < xfer_size) {
-        fprintf(stderr, "failed to send data during sock_sync_data\n");
+    while (!s->closing) {
+        rc = ctrl_recv_some(s->res.sock, &s->frame);
+        if (!rc)
+            return;
+        if (rc < 0) {
+            /* a pooled connection is over once the client closes it */
+            if (!strcmp(s->cfg.operation, "pool") && s->state == SESSION_RUNNING) {
+                shard_finish(sh, s, 0);
+                return;
+            }
+            /* send and receive need nothing more from it, the client may be gone before our last completion */
+            if (!s->tag && s->state == SESSION_RUNNING) {
+                sh->loop.remove(s->res.sock);
+                return;
+            }
+            fprintf(stderr, "session %d failed on its control socket\n", s->stats.id);
+            shard_finish(sh, s, 1);
+            return;
+        }
+        rc = shard_frame(sh, s);
+        s->frame.got = 0;
+        if (rc) {
+            fprintf(stderr, "session %d failed on its control socket\n", s->stats.id);
+            shard_finish(sh, s, 1);
+            return;
+        }
+    }
+}
+
+/* the HELLO is answered, the QP is created and our half of the connection data goes out */
+static int shard_connect(struct shard_t *sh, struct session_t *s) {
+    struct cm_con_data_t local;
+    if (resources_create(&s->res) || connect_qp_local(&s->res, &local)) {
+        fprintf(stderr, "failed to connect QPs\n");
+        return 1;
+    }
+    sh->qps[s->res.qp->qp_num] = s;
+    if (ctrl_send(s->res.sock, CTRL_CONN_DATA, &local, sizeof(local)))
+        return 1;
+    s->state = SESSION_CONN_DATA;
+    shard_expect(sh, s, "CONN_DATA");
+    return 0;
+}
+
+/* sets up and runs a session that has to block, then tells the loop to join the thread */
+static void shard_worker_run(struct shard_t *sh, struct shard_worker_t *w, struct session_t *s) {
+    uint64_t kick = 1;
+    if (session_connect(s)) {
+        fprintf(stderr, "shard %d: failed to connect session %d\n", sh->id, s->stats.id);
+        session_close(s, 1);
+    } else if (!strcmp(s->cfg.operation, "pool")) {
+        serve_pooled_conn(s);
     } else {
-        rc = 0;
+        session_close(s, session_run(s));
+    }
+    w->done = 1;
+    if (write(sh->wake_fd, &kick, sizeof(kick)) != sizeof(kick))
+        perror("shard eventfd");
+}
+
+/* joins the workers whose sessions are over, they count as finished sessions of the shard from here on */
+static void shard_reap_workers(struct shard_t *sh, int wait) {
+    for (auto it = sh->workers.begin(); it != sh->workers.end();) {
+        if (!wait && !it->done.load()) {
+            ++it;
+            continue;
+        }
+        it->thread.join();
+        it = sh->workers.erase(it);
+        shard_session_done(sh);
+    }
+}
+
+static void shard_open_session(struct shard_t *sh, int sock, const struct ctrl_frame_t *hello) {
+    struct session_t *s = session_accept(sock, hello, &sh->cfg, &sh->dm, sh->cq, sh->cq->cqe - sh->cq_reserved);
+    if (!s) {
+        shard_session_done(sh);
+        return;
+    }
+    /* zcsend and scenario poll a CQ of their own and the CM blocks while connecting, they must not hold up
+       the loop's other sessions. They get a thread of their own, which inherits the shard's signal mask */
+    if (s->cfg.use_rdmacm || !s->res.shared_cq) {
+        struct shard_worker_t &w = sh->workers.emplace_back();
+        w.done = 0;
+        w.thread = std::thread(shard_worker_run, sh, &w, s);
+        return;
+    }
+    /* everything else is set up and run from the loop, the client's frames come in as they are sent */
+    s->start = now_ns();
+    sh->cq_reserved += 2 * s->cfg.depth;
+    sh->sessions.push_back(s);
+    if (sh->loop.add(s->res.sock, EPOLLIN, [sh, s](uint32_t) { shard_ctrl(sh, s); }) || shard_connect(sh, s)) {
+        fprintf(stderr, "shard %d: failed to connect session %d\n", sh->id, s->stats.id);
+        shard_end_session(sh, s, 1);
     }
-    while (!rc && total_read_bytes < xfer_size) {
-        read_bytes = read(sock, remote_data, xfer_size);
-        if (read_bytes > 0) {
-            total_read_bytes += read_bytes;
+}
+
+/* a socket that was handed over, it gets HELLO_TIMEOUT_MS to send its HELLO */
+static void shard_wait_hello(struct shard_t *sh, int sock) {
+    struct ctrl_frame_t *hello = (struct ctrl_frame_t *) calloc(1, sizeof(struct ctrl_frame_t));
+    uint64_t timer;
+    if (!hello) {
+        close(sock);
+        shard_session_done(sh);
+        return;
+    }
+    timer = sh->loop.add_timer((uint64_t) HELLO_TIMEOUT_MS * 1000000, [sh, sock, hello]() {
+        fprintf(stderr, "shard %d: no HELLO within %d ms, dropping the connection\n", sh->id, HELLO_TIMEOUT_MS);
+        sh->loop.remove(sock);
+        close(sock);
+        free(hello);
+        shard_session_done(sh);
+    });
+    /* the HELLO may come in pieces, the loop goes on with the other sessions in between */
+    if (sh->loop.add(sock, EPOLLIN, [sh, sock, timer, hello](uint32_t) {
+        int rc = ctrl_recv_some(sock, hello);
+        if (!rc)
+            return;
+        sh->loop.cancel_timer(timer);
+        sh->loop.remove(sock);
+        if (rc < 0) {
+            close(sock);
+            shard_session_done(sh);
         } else {
-            rc = read_bytes;
+            shard_open_session(sh, sock, hello);
         }
+        free(hello);
+    })) {
+        sh->loop.cancel_timer(timer);
+        close(sock);
+        free(hello);
+        shard_session_done(sh);
     }
-    return rc;
 }
 
-int modify_qp_to_init(struct ibv_qp *qp) {
-    struct ibv_qp_attr attr;
-    int flags;
-    int rc;
-    memset(&attr, 0, sizeof(attr));
-    attr.qp_state = IBV_QPS_INIT;
-    attr.port_num = config.ib_port;
-    attr.pkey_index = 0;
-    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-    flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
-    rc = ibv_modify_qp(qp, &attr, flags);
-    if (rc) {
-        fprintf(stderr, "failed to modify QP state to INIT\n");
+static void shard_wake(struct shard_t *sh) {
+    std::vector<int> socks;
+    uint64_t kicks;
+    if (read(sh->wake_fd, &kicks, sizeof(kicks)) < 0 && errno != EAGAIN)
+        perror("shard eventfd");
+    {
+        std::lock_guard<std::mutex> guard(sh->lock);
+        socks.swap(sh->handoff);
     }
-    return rc;
+    for (int sock : socks)
+        shard_wait_hello(sh, sock);
+    shard_reap_workers(sh, 0);
+    if (sh->stopping.load() && !sh->load.load())
+        sh->loop.stop();
 }
 
-int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, uint8_t *dgid) {
-    struct ibv_qp_attr attr;
-    int flags;
-    int rc;
-    memset(&attr, 0, sizeof(attr));
-    attr.qp_state = IBV_QPS_RTR;
-    attr.path_mtu = IBV_MTU_256;
-    attr.dest_qp_num = remote_qpn;
-    attr.rq_psn = 0;
-    attr.max_dest_rd_atomic = 1;
-    attr.min_rnr_timer = 0x12;
-    attr.ah_attr.is_global = 0;
-    attr.ah_attr.dlid = dlid;
-    attr.ah_attr.sl = 0;
-    attr.ah_attr.src_path_bits = 0;
-    attr.ah_attr.port_num = config.ib_port;
-    if (config.gid_idx >= 0) {
-        attr.ah_attr.is_global = 1;
-        attr.ah_attr.port_num = 1;
-        memcpy(&attr.ah_attr.grh.dgid, dgid, 16);
-        attr.ah_attr.grh.flow_label = 0;
-        attr.ah_attr.grh.hop_limit = 1;
-        attr.ah_attr.grh.sgid_index = config.gid_idx;
-        attr.ah_attr.grh.traffic_class = 0;
-    }
-    flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
-            IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
-    rc = ibv_modify_qp(qp, &attr, flags);
-    if (rc)
-        fprintf(stderr, "failed to modify QP state to RTR\n");
-    return rc;
+void shard_run(struct shard_t *sh) {
+    struct ibv_device_attr attr;
+    cpu_set_t cpus;
+    int entries = 0;
+    block_stop_signals();
+    CPU_ZERO(&cpus);
+    CPU_SET(sh->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+        log_info("shard %d: failed to pin to cpu %d, running unpinned\n", sh->id, sh->cpu);
+    /* the loop sleeps in epoll_wait() when idle, SCHED_FIFO doesn't let it starve the core */
+    if (sh->cfg.rt_prio > 0 && rt_tune_thread(&sh->cfg, sh->id))
+        log_info("shard %d: running with the default scheduler\n", sh->id);
+    /* opened and registered from the pinned thread, so the buffers are first touched on its node */
+    if (daemon_open(&sh->dm, &sh->cfg, sh->cfg.pool_bufs, sh->cfg.pool_buf_size) ||
+        ibv_query_device(sh->dm.ib_ctx, &attr)) {
+        fprintf(stderr, "shard %d: failed to open device %s\n", sh->id, sh->cfg.dev_name);
+        goto shard_run_exit;
+    }
+    entries = std::min(SHARD_CQ_SIZE, attr.max_cqe);
+    sh->channel = ibv_create_comp_channel(sh->dm.ib_ctx);
+    if (!sh->channel) {
+        fprintf(stderr, "shard %d: failed to create a completion channel\n", sh->id);
+        goto shard_run_exit;
+    }
+    sh->cq = ibv_create_cq(sh->dm.ib_ctx, entries, NULL, sh->channel, 0);
+    if (!sh->cq) {
+        fprintf(stderr, "shard %d: failed to create a CQ with %d entries\n", sh->id, entries);
+        goto shard_run_exit;
+    }
+    if (sh->loop.open() || sh->loop.add(sh->wake_fd, EPOLLIN, [sh](uint32_t) { shard_wake(sh); }) ||
+        sh->loop.add_cq(sh->cq, [sh](const struct ibv_wc *wc) { shard_wc(sh, wc); }))
+        goto shard_run_exit;
+    log_info("shard %d: running on cpu %d with a CQ of %d entries\n", sh->id, sh->cpu, sh->cq->cqe);
+    sh->state = 1;
+    if (sh->loop.run())
+        fprintf(stderr, "shard %d: event loop failed\n", sh->id);
+shard_run_exit:
+    while (!sh->sessions.empty())
+        shard_end_session(sh, sh->sessions.back(), 1);
+    /* their sessions end when their clients are done, the device goes only after them */
+    shard_reap_workers(sh, 1);
+    {
+        std::lock_guard<std::mutex> guard(sh->lock);
+        for (int sock : sh->handoff)
+            close(sock);
+        sh->handoff.clear();
+    }
+    if (sh->cq) {
+        sh->loop.remove_cq(sh->cq);
+        if (ibv_destroy_cq(sh->cq))
+            fprintf(stderr, "shard %d: failed to destroy CQ\n", sh->id);
+        sh->cq = NULL;
+    }
+    if (sh->channel && ibv_destroy_comp_channel(sh->channel))
+        fprintf(stderr, "shard %d: failed to destroy completion channel\n", sh->id);
+    sh->channel = NULL;
+    daemon_close(&sh->dm);
+    if (sh->state == 0)
+        sh->state = -1;
 }
 
-int modify_qp_to_rts(struct ibv_qp *qp) {
-    struct ibv_qp_attr attr;
-    int flags;
-    int rc;
-    memset(&attr, 0, sizeof(attr));
-    attr.qp_state = IBV_QPS_RTS;
-    attr.timeout = 0x12;
-    attr.retry_cnt = 6;
-    attr.rnr_retry = 0;
-    attr.sq_psn = 0;
-    attr.max_rd_atomic = 1;
-    flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
-            IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
-    rc = ibv_modify_qp(qp, &attr, flags);
-    if (rc) {
-        fprintf(stderr, "failed to modify QP state to RTS\n");
+int shards_start(std::vector<std::unique_ptr<struct shard_t>> &shards, int count) {
+    std::vector<int> allowed;
+    cpu_set_t cpus;
+    int i;
+    /* shard i goes to the i-th cpu we may run on, or that --pin picked, they wrap around if there are more
+       shards than cpus */
+    if (config.pin) {
+        for (i = 0; i < rt_cpu_count(); i++)
+            allowed.push_back(rt_cpu(i));
+    } else if (sched_getaffinity(0, sizeof(cpus), &cpus)) {
+        perror("sched_getaffinity");
+        return 1;
     }
-    return rc;
+    for (i = 0; i < CPU_SETSIZE && !config.pin; i++) {
+        if (CPU_ISSET(i, &cpus))
+            allowed.push_back(i);
+    }
+    if ((int) allowed.size() < count)
+        log_info("%d shards on %zu cpus, some of them share a core\n", count, allowed.size());
+    for (i = 0; i < count; i++) {
+        std::unique_ptr<struct shard_t> sh(new shard_t());
+        sh->id = i;
+        sh->cpu = allowed[i % allowed.size()];
+        /* main() resolved the device name before any thread started, so opening the device on the copy
+           writes nothing, and no shard reads what another one or the main thread may write */
+        sh->cfg = config;
+        sh->wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (sh->wake_fd < 0) {
+            perror("eventfd");
+            return 1;
+        }
+        shards.push_back(std::move(sh));
+    }
+    for (auto &sh : shards)
+        sh->thread = std::thread(shard_run, sh.get());
+    for (auto &sh : shards) {
+        while (sh->state.load() == 0)
+            std::this_thread::yield();
+        if (sh->state.load() < 0)
+            return 1;
+    }
+    return 0;
 }
 
-int poll_completion(struct resources *res) {
-    struct ibv_wc wc;
-    unsigned long start_time_msec;
-    unsigned long cur_time_msec;
-    struct timeval cur_time;
-    int poll_result;
+void shard_assign(std::vector<std::unique_ptr<struct shard_t>> &shards, int sock) {
+    struct shard_t *least = shards[0].get();
+    uint64_t kick = 1;
+    for (auto &sh : shards) {
+        if (sh->load.load() < least->load.load())
+            least = sh.get();
+    }
+    least->load++;
+    {
+        std::lock_guard<std::mutex> guard(least->lock);
+        least->handoff.push_back(sock);
+    }
+    if (write(least->wake_fd, &kick, sizeof(kick)) != sizeof(kick))
+        perror("shard eventfd");
+}
+
+void shards_stop(std::vector<std::unique_ptr<struct shard_t>> &shards) {
+    uint64_t kick = 1;
+    /* the accept loop is over, nothing is handed out anymore and each shard stops once its sessions are done */
+    for (auto &sh : shards) {
+        sh->stopping = 1;
+        if (sh->wake_fd >= 0 && write(sh->wake_fd, &kick, sizeof(kick)) != sizeof(kick))
+            perror("shard eventfd");
+        if (sh->thread.joinable())
+            sh->thread.join();
+        if (sh->wake_fd >= 0)
+            close(sh->wake_fd);
+        const struct event_loop_stats_t &st = sh->loop.stats();
+        log_info("shard %d on cpu %d: %d sessions, %" PRIu64 " waits, %" PRIu64 " completion events, %" PRIu64
+                 " completions, %" PRIu64 " timers\n", sh->id, sh->cpu, sh->served, st.waits, st.cq_events,
+                st.completions, st.timers);
+    }
+    shards.clear();
+}
+
+int serve_sessions(void) {
+    std::vector<std::thread> pooled;
+    std::vector<std::unique_ptr<struct shard_t>> shards;
+    struct sigaction sa;
+    int listenfd;
+    int sock;
     int rc = 0;
-    /* poll the completion for a while before giving up of doing it .. */
-    gettimeofday(&cur_time, NULL);
-    start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-    int count = 0;
-    do {
-        count++;
-        poll_result = ibv_poll_cq(res->cq, 1, &wc);
-        gettimeofday(&cur_time, NULL);
-        cur_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-    } while ((poll_result == 0) && ((cur_time_msec - start_time_msec) < MAX_POLL_CQ_TIMEOUT));
-    printf("poll count: %d\n", count);
-    if (poll_result < 0) {
-        /* poll CQ failed */
-        fprintf(stderr, "poll CQ failed\n");
-        rc = 1;
-    } else if (poll_result == 0) {
-        /* the CQ is empty */
-        fprintf(stderr, "completion wasn't found in the CQ after timeout\n");
+    /* the shards open the device and register buffers of their own */
+    if (config.daemon && !config.shards &&
+        daemon_open(&bench_daemon, &config, config.pool_bufs, config.pool_buf_size)) {
+        daemon_close(&bench_daemon);
+        return 1;
+    }
+    listenfd = sock_listen(config.tcp_port);
+    if (listenfd < 0) {
+        daemon_close(&bench_daemon);
+        return 1;
+    }
+    /* no SA_RESTART, the signal has to interrupt accept() */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    if (config.shards && shards_start(shards, config.shards)) {
+        fprintf(stderr, "failed to start %d shards\n", config.shards);
+        stop_serving = 1;
         rc = 1;
-    } else {
-        /* CQE found */
-        fprintf(stdout, "completion was found in CQ with status 0x%x\n", wc.status);
-        /* check the completion status (here we don't care about the completion opcode */
-        if (wc.status != IBV_WC_SUCCESS) {
-            fprintf(stderr, "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n", wc.status, wc.vendor_err);
+    }
+    if (!stop_serving)
+        log_info("waiting on port %d for sessions\n", config.tcp_port);
+    /* every other thread blocks SIGINT and SIGTERM, so they interrupt this accept() */
+    while (!stop_serving) {
+        sock = accept(listenfd, NULL, 0);
+        if (sock < 0) {
+            /* the client may have given up before we got to it */
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("server accept");
             rc = 1;
+            break;
         }
+        /* the shards only ever see sockets that are there already, none of them waits in accept() */
+        if (config.shards)
+            shard_assign(shards, sock);
+        else
+            accept_session(sock, pooled);
     }
+    shards_stop(shards);
+    close(listenfd);
+    /* pooled connections end when their clients close them */
+    for (auto &conn : pooled)
+        conn.join();
+    print_session_stats(&bench_daemon);
+    daemon_close(&bench_daemon);
     return rc;
 }
 
 int main(int argc, char *argv[]) {
-    struct resources res;
     int rc = 0;
-    char temp_char;
-    int count = 0;
+    /* seeds the chase shuffle and the PSNs a recovered QP starts over from */
+    srand48(getpid() ^ time(NULL));
     while (true) {
         int c;
         static struct option long_options[] = {
@@ -430,10 +1715,30 @@ int main(int argc, char *argv[]) {
                 {.name = "ib-port", .has_arg = 1, .val = 'i'},
                 {.name = "gid-idx", .has_arg = 1, .val = 'g'},
                 {.name = "op", .has_arg = 1, .val = 'o'},
-                {.name = "times", .has_arg = 1, .val = 't'},
+                {.name = "size", .has_arg = 1, .val = 's'},
+                {.name = "sge", .has_arg = 1, .val = 'e'},
+                {.name = "depth", .has_arg = 1, .val = 'q'},
+                {.name = "transport", .has_arg = 1, .val = 'x'},
+                {.name = "cm", .has_arg = 1, .val = 'c'},
+                {.name = "conns", .has_arg = 1, .val = 'k'},
+                {.name = "threads", .has_arg = 1, .val = 'j'},
+                {.name = "recover", .has_arg = 0, .val = 'R'},
+                {.name = "format", .has_arg = 1, .val = 'F'},
+                {.name = "output", .has_arg = 1, .val = 'O'},
+                {.name = "verbose", .has_arg = 0, .val = 'v'},
+                {.name = "quiet", .has_arg = 0, .val = 'Q'},
+                {.name = "daemon", .has_arg = 0, .val = 'D'},
+                {.name = "bufs", .has_arg = 1, .val = 'b'},
+                {.name = "buf-size", .has_arg = 1, .val = 'B'},
+                {.name = "nodes", .has_arg = 1, .val = 'n'},
+                {.name = "shards", .has_arg = 1, .val = 'H'},
+                {.name = "pin", .has_arg = 0, .val = 'N'},
+                {.name = "cpus", .has_arg = 1, .val = 'U'},
+                {.name = "fifo", .has_arg = 1, .val = 'Y'},
+                {.name = "mlock", .has_arg = 0, .val = 'M'},
                 {.name = NULL, .has_arg = 0, .val = '\0'}
         };
-        c = getopt_long(argc, argv, "p:d:i:g:o:t:", long_options, NULL);
+        c = getopt_long(argc, argv, "p:d:i:g:o:s:e:q:x:c:k:j:RDb:B:n:H:F:O:vQNU:Y:M", long_options, NULL);
         if (c == -1) {
             break;
         }
@@ -461,93 +1766,156 @@ int main(int argc, char *argv[]) {
             case 'o':
                 config.operation = strdup(optarg);
                 break;
-            case 't':
-                count = strtol(optarg, NULL, 0);
+            case 's':
+                config.msg_size = strtoul(optarg, NULL, 0);
+                if (config.msg_size == 0) {
+                    fprintf(stderr, "Invalid message size\n");
+                    return 1;
+                }
+                break;
+            case 'e':
+                config.max_sge = strtol(optarg, NULL, 0);
+                if (config.max_sge <= 0) {
+                    fprintf(stderr, "Invalid number of SGEs\n");
+                    return 1;
+                }
+                break;
+            case 'q':
+                config.depth = strtol(optarg, NULL, 0);
+                if (config.depth <= 0) {
+                    fprintf(stderr, "Invalid queue depth\n");
+                    return 1;
+                }
+                break;
+            case 'x':
+                if (parse_transport(optarg, &config.qp_type)) {
+                    fprintf(stderr, "Invalid transport %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (parse_cm(optarg, &config.use_rdmacm)) {
+                    fprintf(stderr, "Invalid connection setup %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                config.conns = strtol(optarg, NULL, 0);
+                if (config.conns <= 0) {
+                    fprintf(stderr, "Invalid number of connections\n");
+                    return 1;
+                }
+                break;
+            case 'j':
+                config.threads = strtol(optarg, NULL, 0);
+                if (config.threads <= 0) {
+                    fprintf(stderr, "Invalid number of threads\n");
+                    return 1;
+                }
+                break;
+            case 'R':
+                config.recover = 1;
+                break;
+            case 'F':
+                config.result_format = strdup(optarg);
+                break;
+            case 'O':
+                config.result_path = strdup(optarg);
+                break;
+            case 'v':
+                verbosity++;
+                break;
+            case 'Q':
+                verbosity = VERBOSE_QUIET;
+                break;
+            case 'D':
+                config.daemon = 1;
+                break;
+            case 'b':
+                config.pool_bufs = strtol(optarg, NULL, 0);
+                if (config.pool_bufs < 0) {
+                    fprintf(stderr, "Invalid number of buffers\n");
+                    return 1;
+                }
+                break;
+            case 'B':
+                config.pool_buf_size = strtoull(optarg, NULL, 0);
+                if (config.pool_buf_size == 0) {
+                    fprintf(stderr, "Invalid buffer size\n");
+                    return 1;
+                }
+                break;
+            case 'n':
+                config.chase_nodes = strtol(optarg, NULL, 0);
+                if (config.chase_nodes <= 0) {
+                    fprintf(stderr, "Invalid number of nodes\n");
+                    return 1;
+                }
+                break;
+            case 'H':
+                config.shards = strtol(optarg, NULL, 0);
+                if (config.shards < 0) {
+                    fprintf(stderr, "Invalid number of shards\n");
+                    return 1;
+                }
+                break;
+            case 'N':
+                config.pin = 1;
+                break;
+            case 'U':
+                config.pin = 1;
+                config.cpus = strdup(optarg);
+                break;
+            case 'Y':
+                config.rt_prio = strtol(optarg, NULL, 0);
+                if (config.rt_prio < sched_get_priority_min(SCHED_FIFO) ||
+                    config.rt_prio > sched_get_priority_max(SCHED_FIFO)) {
+                    fprintf(stderr, "Invalid SCHED_FIFO priority\n");
+                    return 1;
+                }
+                break;
+            case 'M':
+                config.lock_mem = 1;
                 break;
             default:
                 fprintf(stderr, "Invalid command line argument\n");
                 return 1;
         }
     }
-    print_config();
-    resources_init(&res);
-    if (resources_create(&res)) {
-        fprintf(stderr, "failed to create resources\n");
-        goto main_exit;
-    }
-    if (connect_qp(&res)) {
-        fprintf(stderr, "failed to connect QPs\n");
-        goto main_exit;
+    if (!strcmp(config.operation, "chase")) {
+        /* the whole list lives in the registered region */
+        config.buf_size = (size_t) config.chase_nodes * CHASE_NODE_SIZE;
+    } else if (!strcmp(config.operation, "sge")) {
+        /* the client writes all of its fragments back to back */
+        config.buf_size = (size_t) config.max_sge * config.msg_size;
+    } else if (!strcmp(config.operation, "zcsend")) {
+        /* one receive slot per message the client can have in flight */
+        config.buf_size = (size_t) config.depth * (sizeof(struct msg_hdr_t) + config.msg_size);
+    } else if (!strcmp(config.operation, "pingpong")) {
+        if (config.msg_size < sizeof(uint64_t))
+            config.msg_size = sizeof(uint64_t);
+        config.buf_size = (size_t) 2 * config.msg_size;
+    } else if (!strcmp(config.operation, "bw") || !strcmp(config.operation, "wbw")) {
+        /* one receive slot per message the client can have in flight */
+        if (config.msg_size < sizeof(uint64_t))
+            config.msg_size = sizeof(uint64_t);
+        config.buf_size = (size_t) config.depth * config.msg_size;
     }
-    if (strcmp(config.operation, "send") == 0) {
-        strcpy(res.buf, MSG);
-        std::chrono::nanoseconds total(0);
-        for (int i = 0; i < count; ++i) {
-            if (post_send(&res, IBV_WR_SEND)) {
-                fprintf(stderr, "failed to post SR\n");
-                goto main_exit;
-            }
-            auto start = std::chrono::high_resolution_clock::now();
-            if (poll_completion(&res)) {
-                fprintf(stderr, "poll completion failed\n");
-                goto main_exit;
-            }
-            auto end = std::chrono::high_resolution_clock::now();
-            std::chrono::nanoseconds elapsed = end - start;
-            total += elapsed;
-        }
-        fprintf(stdout, "RDMA send operation took %lld ns\n", total.count());
-    } else if (strcmp(config.operation, "receive") == 0) {
-        for (int i = 0; i < count; ++i) {
-            if (post_receive(&res)) {
-                fprintf(stderr, "failed to post RR\n");
-                goto main_exit;
-            }
-            if (poll_completion(&res)) {
-                fprintf(stderr, "poll completion failed\n");
-                goto main_exit;
-            }
-        }
-        fprintf(stdout, "Message is: %s\n", res.buf);
-    } else if (!strcmp(config.operation, "read")) {
-        /* setup server buffer with read message */
-        strcpy(res.buf, RDMAMSGR);
-        /* Sync so we are sure server side has data ready before client tries to read it */
-        /* just send a dummy char back and forth */
-        if (sock_sync_data(res.sock, 1, "R", &temp_char)) {
-            fprintf(stderr, "sync error before RDMA ops\n");
-            rc = 1;
-            goto main_exit;
-        }
-        if (sock_sync_data(res.sock, 1, "R", &temp_char)) {
-            fprintf(stderr, "sync error before RDMA ops\n");
-            rc = 1;
-            goto main_exit;
-        }
-    } else if (!strcmp(config.operation, "write")) {
-        strcpy(res.buf, RDMAMSGW);
-        /* Sync so server will know that client is done mucking with its memory */
-        /* just send a dummy char back and forth */
-        if (sock_sync_data(res.sock, 1, "W", &temp_char)) {
-            fprintf(stderr, "sync error after RDMA ops\n");
-            rc = 1;
-            goto main_exit;
-        }
-        fprintf(stdout, "Contents of server buffer: '%s'\n", res.buf);
-        if (sock_sync_data(res.sock, 1, "W", &temp_char)) {
-            fprintf(stderr, "sync error after RDMA ops\n");
-            rc = 1;
-            goto main_exit;
-        }
+    if (results_open(config.result_format, config.result_path))
+        return 1;
+    /* --pin looks for the cores next to the device before it is opened */
+    resolve_device_name(&config);
+    /* the shards pin themselves, without them sessions are served from this thread */
+    if (rt_setup(&config) || (!config.shards && rt_tune_thread(&config, 0)))
+        return 1;
+    if (!strcmp(config.operation, "connbench")) {
+        print_config(&config);
+        /* sets up its own connections, nothing is negotiated */
+        rc = serve_connbench(config.conns, config.threads);
+        log_info("test result is %d\n", rc);
     } else {
-        fprintf(stderr, "unknown operation\n");
-        goto main_exit;
-    }
-    main_exit:
-    if (resources_destroy(&res)) {
-        fprintf(stderr, "failed to destroy resources\n");
-        rc = 1;
+        rc = serve_sessions();
     }
-    fprintf(stdout, "test result is %d\n", rc);
+    results_close();
     return rc;
 }
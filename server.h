@@ -5,7 +5,18 @@
 #ifndef RDMA_TEST_SERVER_H
 #define RDMA_TEST_SERVER_H
 
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include "rdma_common.h"
+#include "endpoint.h"
+#include "event_loop.h"
+#include "realtime.h"
+#include "results.h"
 
 struct config_t config = {
         "mlx5_0",  /* dev_name */
@@ -13,25 +24,255 @@ struct config_t config = {
         2345, /* tcp_port */
         10241,     /* ib_port */
         0, /* gid_idx */
-        "send" /* mode */
+        "send", /* mode */
+        MSG_SIZE, /* buf_size */
+        1 << 16, /* chase_nodes */
+        1, /* max_sge */
+        MSG_SIZE, /* msg_size */
+        1, /* depth */
+        IBV_QPT_RC, /* qp_type */
+        0, /* peers */
+        0, /* use_rdmacm */
+        1, /* conns */
+        1, /* threads */
+        0, /* recover */
+        -1, /* inject_error */
+        1, /* spares */
+        0, /* daemon */
+        8, /* pool_bufs */
+        1 << 20, /* pool_buf_size */
+        NULL, /* scenario */
+        "text", /* result_format */
+        NULL, /* result_path */
+        NULL, /* rates */
+        "poisson", /* arrival */
+        "read", /* load_op */
+        0, /* slo_ns */
+        99.0, /* slo_percentile */
+        NULL, /* sizes */
+        NULL, /* transports */
+        0, /* selective_signal */
+        0, /* max_inline */
+        NULL, /* profile */
+        1024, /* coros */
+        0, /* shards */
+        0, /* pin */
+        NULL, /* cpus */
+        0, /* rt_prio */
+        0 /* lock_mem */
 };
 
-int resources_create(struct resources *res);
+/* a registered buffer the daemon hands out to sessions */
+struct pooled_buf_t {
+    char *buf;
+    struct ibv_mr *mr;
+    size_t size;
+    int in_use;
+};
+
+/* what one session did, kept for the life of the daemon */
+struct session_stats_t {
+    int id;
+    char op[CTRL_OP_LEN + 1];
+    int count;
+    uint32_t msg_size;
+    int depth;
+    enum ibv_qp_type qp_type;
+    double setup_us;      /* resources_create() + connect_qp() */
+    double run_us;        /* the op itself, or how long a pooled connection was kept */
+    int pooled_buf;       /* the buffer came from the pool instead of being registered for the session */
+    int rc;
+};
+
+/* device, PD and registered buffers shared by every session of the daemon */
+struct daemon_t {
+    struct ibv_context *ib_ctx;
+    struct ibv_pd *pd;
+    enum ibv_atomic_cap atomic_cap;           /* whether RC sessions can target the buffers with atomics */
+    std::mutex lock;                          /* pooled connections finish on their own threads */
+    std::vector<struct pooled_buf_t> bufs;
+    std::vector<struct session_stats_t> stats;
+    std::atomic<int> sessions;                /* accepted so far, numbers the next one */
+};
+
+/* how far the receiving side of a bandwidth test got */
+struct recv_progress_t {
+    int received;
+    int out_of_order;       /* sequence gaps */
+    int imm;                /* the messages were writes with immediate data */
+    uint64_t expected;      /* next sequence number */
+    uint64_t first_ns;      /* the first message */
+    uint64_t last_ns;       /* the latest one */
+    int done;               /* all of it came in or the rest was lost, our second SYNC is out */
+};
+
+/* how far a session a shard drives from its loop got */
+enum session_state {
+    SESSION_HELLO,          /* the client's HELLO isn't answered yet */
+    SESSION_CONN_DATA,      /* our CONN_DATA is out, the client's is due */
+    SESSION_CONNECTED,      /* the QP is in RTS and our SYNC 'Q' is out, the client's is due */
+    SESSION_RUNNING,        /* the op is under way */
+    SESSION_RECOVER_PSN,    /* the QP is back in RESET and our PSN is out, the client's is due */
+    SESSION_RECOVERED       /* the QP is in RTS again and our SYNC 'Q' is out, the client's is due */
+};
+
+/* one client's session, from its HELLO until it is torn down */
+struct session_t {
+    struct resources res;
+    struct config_t cfg;            /* the server's settings with the client's request applied */
+    struct session_stats_t stats;
+    struct daemon_t *dm;            /* device and buffer the session uses, NULL to set up its own */
+    uint64_t start;                 /* when the op, or the wait for a passive session's client, started */
+    /* sessions a shard drives from its event loop */
+    enum session_state state;
+    struct ctrl_frame_t frame;      /* the control frame coming in */
+    char tag;                       /* the op's SYNC tag, 0 if it exchanges none */
+    int syncs;                      /* SYNCs the client sent since the op started */
+    int sent;                       /* and the ones we sent */
+    int done;                       /* messages of a two-sided op that are through */
+    int pending;                    /* sends posted and not completed yet */
+    int owed;                       /* ping-pong replies waiting for room in the SQ */
+    uint32_t psn;                   /* ours while the QP is recovered */
+    uint64_t active_ns;             /* the latest completion */
+    struct recv_progress_t bw;
+    uint64_t timer;                 /* the loop's timer watching the session, 0 for none */
+    int closing;                    /* it is torn down at the end of the round, further events are ignored */
+};
+
+/* entries of a shard's CQ, capped by what the device allows */
+#define SHARD_CQ_SIZE 4096
+/* how long a shard waits for the HELLO of a connection it was handed */
+#define HELLO_TIMEOUT_MS 5000
+/* how long a shard waits for each frame the client owes while the QP is connected or recovered */
+#define SETUP_TIMEOUT_MS 10000
+
+/* a session that polls a CQ of its own, it runs on a thread next to the shard's loop */
+struct shard_worker_t {
+    std::thread thread;
+    std::atomic<int> done;          /* the session is closed, the loop joins the thread */
+};
+
+/*
+ * One event loop pinned to a core. It opens the device, registers its buffers and creates the CQ the QPs
+ * of its sessions complete on, so nothing on the data path is shared with another shard. Sockets,
+ * the CQ's completion channel and timers all go through one epoll set: control messages, completions and
+ * timeouts are handled as they come. The main thread accepts and hands the sockets over through handoff,
+ * which is the only thing the shards lock, so no session ever waits for another one to be set up.
+ */
+struct shard_t {
+    int id;
+    int cpu;                        /* the core the loop is pinned to */
+    std::thread thread;
+    struct config_t cfg;            /* the shard's own copy of the settings, its sessions start from it */
+    struct daemon_t dm;             /* the shard's device, PD and registered buffers */
+    struct ibv_comp_channel *channel;
+    struct ibv_cq *cq;
+    int cq_reserved;                /* entries the sessions on cq may have pending at once */
+    rdma::EventLoop loop;
+    std::unordered_map<uint32_t, struct session_t *> qps;  /* sessions driven by completions, by QP number */
+    std::vector<struct session_t *> sessions;              /* every session on the loop */
+    std::list<struct shard_worker_t> workers;              /* sessions that run next to the loop */
+    int wake_fd;                    /* eventfd kicked after a handoff, when a worker is done or to stop */
+    std::mutex lock;                /* guards handoff */
+    std::vector<int> handoff;       /* accepted sockets the loop hasn't picked up yet */
+    std::atomic<int> load;          /* sessions handed to the shard and not finished yet */
+    std::atomic<int> stopping;
+    std::atomic<int> state;         /* 1 once the CQ is there, -1 if the shard couldn't start */
+    int served;
+};
+
+int build_chase_list(struct resources *res, int nodes);
+
+int serve_zcsend(struct resources *res, int count);
+
+/* ping-pong requests land in the first half of the buffer, replies go out of the second half */
+int pingpong_post(struct resources *res, int reply);
+
+int serve_pingpong(struct resources *res, int count);
+
+int bw_begin(struct resources *res, int count, struct recv_progress_t *p);
+
+/* takes in one message, its slot goes back to the RQ */
+int bw_recv(struct resources *res, const struct ibv_wc *wc, struct recv_progress_t *p);
+
+void bw_report(struct resources *res, int count, const struct recv_progress_t *p);
+
+int serve_bw(struct resources *res, int count);
+
+int serve_connbench(int conns, int threads);
+
+int daemon_open(struct daemon_t *dm, struct config_t *cfg, int bufs, size_t buf_size);
+
+int daemon_get_buf(struct daemon_t *dm, struct resources *res, size_t size);
+
+void daemon_put_buf(struct daemon_t *dm, char *buf);
+
+void daemon_close(struct daemon_t *dm);
+
+void record_session(struct daemon_t *dm, struct session_stats_t *stats);
+
+void print_session_stats(struct daemon_t *dm);
+
+const char *session_op(const char *client_op);
+
+const char *configure_session(struct config_t *cfg, const struct ctrl_session_t *req, int *count);
+
+/*
+ * Answers the client's HELLO, NULL if the session was rejected. Sessions that don't poll for themselves
+ * go on cq if given, when they fit into the cq_room entries left.
+ */
+struct session_t *session_accept(int sock, const struct ctrl_frame_t *hello, const struct config_t *defaults,
+                                 struct daemon_t *dm, struct ibv_cq *cq, int cq_room);
+
+/* reads the client's HELLO and answers it, see session_accept() */
+struct session_t *session_open(int sock, const struct config_t *defaults, struct daemon_t *dm, struct ibv_cq *cq,
+                               int cq_room);
+
+/* sets up the session's QP and connects it to the client's, blocks until the client is there as well */
+int session_connect(struct session_t *s);
+
+int session_run(struct session_t *s);
+
+/* tears the session down and records how it went, returns rc or 1 if the teardown failed */
+int session_close(struct session_t *s, int rc);
+
+int session_release(struct session_t *s);
+
+/* the client's ops are one-sided, the session only waits on its control socket */
+int session_passive(const struct session_t *s);
+
+/* a shard can drive the session from its completions and control frames, nothing of it blocks */
+int session_evented(const struct session_t *s);
+
+int session_begin(struct session_t *s);
+
+int serve_pool_msg(struct resources *res);
+
+void serve_pooled_conn(struct session_t *s);
+
+int serve_scenario(struct resources *res);
+
+/* the fragments of an sge session must have landed in order */
+int check_fragments(struct resources *res);
+
+int run_session(struct resources *res, int count);
 
-void resources_init(struct resources *res);
+int accept_session(int sock, std::vector<std::thread> &pooled);
 
-void print_config(void);
+void shard_run(struct shard_t *sh);
 
-int resources_destroy(struct resources *res);
+int shards_start(std::vector<std::unique_ptr<struct shard_t>> &shards, int count);
 
-int sock_sync_data(int sock, int xfer_size, char *local_data, char *remote_data);
+/* gives the socket to the shard with the fewest sessions */
+void shard_assign(std::vector<std::unique_ptr<struct shard_t>> &shards, int sock);
 
-int modify_qp_to_init(struct ibv_qp *qp);
+void shards_stop(std::vector<std::unique_ptr<struct shard_t>> &shards);
 
-int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn, uint16_t dlid, uint8_t *dgid);
+int serve_sessions(void);
 
-int modify_qp_to_rts(struct ibv_qp *qp);
+/* one control message while waiting for the client's SYNC tag, 0 after a recovery, 1 once it came, -1 on error */
+int serve_sync_msg(struct resources *res, char tag);
 
-int poll_completion(struct resources *res);
+int serve_until_sync(struct resources *res, char tag);
 
 #endif //RDMA_TEST_SERVER_H
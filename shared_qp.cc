@@ -0,0 +1,189 @@
+#include <algorithm>
+#include "shared_qp.h"
+
+namespace rdma {
+
+SharedQp::SharedQp(struct resources *res, int ring_size) : res_(res), inflight_(res->qp_cap.max_send_wr) {
+    uint64_t size = 1;
+    while (size < (uint64_t) std::max(ring_size, 2))
+        size <<= 1;
+    ring_.reset(new cell_t[size]);
+    mask_ = size - 1;
+    for (uint64_t i = 0; i < size; i++)
+        ring_[i].seq.store(i, std::memory_order_relaxed);
+}
+
+SharedQp::~SharedQp() {
+    stop();
+}
+
+int SharedQp::start() {
+    if (owner_.joinable())
+        return 0;
+    memset(&stats_, 0, sizeof(stats_));
+    stopping_ = 0;
+    failed_ = 0;
+    owner_ = std::thread(&SharedQp::run, this);
+    return 0;
+}
+
+int SharedQp::stop() {
+    if (!owner_.joinable())
+        return failed_.load();
+    stopping_ = 1;
+    owner_.join();
+    stats_.full_waits = full_waits_.load();
+    return failed_.load();
+}
+
+int SharedQp::enqueue(const struct rdma_op_t *op, struct dispatch_req_t *req) {
+    uint64_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    int waited = 0;
+    cell_t *cell;
+    if (op->num_sge != 1) {
+        fprintf(stderr, "the shared QP takes WRs with one SGE, not %d\n", op->num_sge);
+        return 1;
+    }
+    /* claim the next cell, it is free once the owner has moved its seq a whole lap ahead */
+    while (true) {
+        cell = &ring_[pos & mask_];
+        int64_t diff = (int64_t) (cell->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            if (failed_.load() || !owner_.joinable()) {
+                fprintf(stderr, "the shared QP isn't running\n");
+                return 1;
+            }
+            if (!waited++)
+                full_waits_++;
+            std::this_thread::yield();
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+    cell->op = *op;
+    cell->sge = *op->sg_list;
+    cell->req = req;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return 0;
+}
+
+/* owner thread only, 0 if the ring is empty */
+int SharedQp::dequeue(struct rdma_op_t *op, struct ibv_sge *sge, struct dispatch_req_t **req) {
+    cell_t *cell = &ring_[dequeue_pos_ & mask_];
+    if (cell->seq.load(std::memory_order_acquire) != dequeue_pos_ + 1)
+        return 0;
+    *op = cell->op;
+    *sge = cell->sge;
+    *req = cell->req;
+    cell->seq.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+    dequeue_pos_++;
+    return 1;
+}
+
+/* a CQE for the WR posted as seq, the unsignaled ones before it completed with it */
+void SharedQp::complete(uint64_t seq, const struct ibv_wc *wc) {
+    struct ibv_wc done;
+    size_t slots = inflight_.size();
+    memset(&done, 0, sizeof(done));
+    done.status = IBV_WC_SUCCESS;
+    while (completed_ < seq) {
+        struct dispatch_req_t *req = inflight_[completed_++ % slots];
+        req->cb(req->ctx, req, &done);
+    }
+    if (completed_ == seq) {
+        struct dispatch_req_t *req = inflight_[completed_++ % slots];
+        req->cb(req->ctx, req, wc);
+    }
+}
+
+static void fail_req(struct dispatch_req_t *req) {
+    struct ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.status = IBV_WC_GENERAL_ERR;
+    req->cb(req->ctx, req, &wc);
+}
+
+void SharedQp::run() {
+    struct rdma_op_t ops[MAX_POST_BATCH];
+    struct ibv_sge sges[MAX_POST_BATCH];
+    struct dispatch_req_t *reqs[MAX_POST_BATCH];
+    struct ibv_wc wc[16];
+    int slots = (int) inflight_.size();
+    int selective = res_->cfg->selective_signal;
+    uint64_t last_progress = now_ns();
+    unsigned long spins = 0;
+    int room;
+    int got;
+    int n;
+    int i;
+    posted_ = 0;
+    completed_ = 0;
+    while (true) {
+        room = std::min(MAX_POST_BATCH, slots - (int) (posted_ - completed_));
+        n = 0;
+        while (n < room && dequeue(&ops[n], &sges[n], &reqs[n]))
+            n++;
+        if (n && failed_.load()) {
+            /* nothing is posted any more, whoever still submits hears about it */
+            for (i = 0; i < n; i++)
+                fail_req(reqs[i]);
+        } else if (n) {
+            for (i = 0; i < n; i++) {
+                ops[i].sg_list = &sges[i];
+                ops[i].wr_id = posted_ + i;
+                if (!selective || i == n - 1)
+                    ops[i].send_flags |= IBV_SEND_SIGNALED;
+                else
+                    ops[i].send_flags &= ~IBV_SEND_SIGNALED;
+                inflight_[(posted_ + i) % slots] = reqs[i];
+            }
+            if (post_send_batch(res_, ops, n)) {
+                fprintf(stderr, "failed to post a chain of %d WRs\n", n);
+                failed_ = 1;
+                for (i = 0; i < n; i++)
+                    fail_req(reqs[i]);
+            } else {
+                posted_ += n;
+                stats_.wrs += n;
+                stats_.doorbells++;
+                stats_.max_chain = std::max(stats_.max_chain, n);
+            }
+        }
+        if (posted_ > completed_) {
+            got = ibv_poll_cq(res_->cq, 16, wc);
+            if (got < 0) {
+                fprintf(stderr, "poll CQ failed\n");
+                got = 0;
+                failed_ = 1;
+                while (completed_ < posted_)
+                    fail_req(inflight_[completed_++ % slots]);
+            }
+            for (i = 0; i < got; i++) {
+                if (wc[i].status != IBV_WC_SUCCESS)
+                    failed_ = 1;
+                complete(wc[i].wr_id, &wc[i]);
+            }
+            if (got > 0) {
+                last_progress = now_ns();
+            } else if ((++spins & 4095) == 0 &&
+                       now_ns() - last_progress > (uint64_t) MAX_POLL_CQ_TIMEOUT * 1000000) {
+                fprintf(stderr, "completion wasn't found in the CQ after timeout, %" PRIu64 " WRs outstanding\n",
+                        posted_ - completed_);
+                failed_ = 1;
+                while (completed_ < posted_)
+                    fail_req(inflight_[completed_++ % slots]);
+            }
+        } else {
+            last_progress = now_ns();
+            /* the submitters are done by the time stop() is called, an empty ring stays empty */
+            if (!n && stopping_.load())
+                return;
+        }
+    }
+}
+
+} // namespace rdma
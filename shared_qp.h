@@ -0,0 +1,73 @@
+#ifndef RDMA_TEST_SHARED_QP_H
+#define RDMA_TEST_SHARED_QP_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "rdma_common.h"
+#include "dispatcher.h"
+
+/* what the owner thread of a shared QP has done since it was started */
+struct shared_qp_stats_t {
+    uint64_t wrs;          /* WRs posted */
+    uint64_t doorbells;    /* ibv_post_send() calls, each one a chain of WRs */
+    int max_chain;         /* longest chain posted at once */
+    uint64_t full_waits;   /* enqueues that found the ring full and had to wait */
+};
+
+/*
+ * A QP any number of threads submit to without taking a lock. enqueue() copies the WR into a bounded
+ * multi-producer ring, the one owner thread takes as many as the send queue has room for, chains them into
+ * a single ibv_post_send() and polls the CQ. Completion callbacks run on the owner thread like with the
+ * dispatcher. On a QP created for selective signaling only the last WR of a chain asks for a completion,
+ * RC completes in order so it stands for the others. The owner thread is the only one touching the QP and
+ * its CQ.
+ */
+namespace rdma {
+
+class SharedQp {
+public:
+    /* ring_size is rounded up to a power of two */
+    explicit SharedQp(struct resources *res, int ring_size = 4096);
+    ~SharedQp();
+    SharedQp(const SharedQp &) = delete;
+    SharedQp &operator=(const SharedQp &) = delete;
+    int start();
+    /* posts what is queued and waits for it, non-zero if a WR couldn't be posted or the CQ stalled */
+    int stop();
+    /* op must have one SGE, it is copied; waits while the ring is full */
+    int enqueue(const struct rdma_op_t *op, struct dispatch_req_t *req);
+    /* only stable once stopped */
+    const struct shared_qp_stats_t &stats() const { return stats_; }
+
+private:
+    struct cell_t {
+        std::atomic<uint64_t> seq;   /* the position this cell can be written at, or that position + 1 once full */
+        struct rdma_op_t op;
+        struct ibv_sge sge;
+        struct dispatch_req_t *req;
+    };
+    int dequeue(struct rdma_op_t *op, struct ibv_sge *sge, struct dispatch_req_t **req);
+    void complete(uint64_t seq, const struct ibv_wc *wc);
+    void run();
+
+    struct resources *res_;
+    std::unique_ptr<cell_t[]> ring_;
+    uint64_t mask_;
+    alignas(64) std::atomic<uint64_t> enqueue_pos_{0};
+    alignas(64) uint64_t dequeue_pos_ = 0;
+    /* owner thread only: the WRs on the send queue, oldest first, indexed by post sequence */
+    std::vector<struct dispatch_req_t *> inflight_;
+    uint64_t posted_ = 0;
+    uint64_t completed_ = 0;
+    std::thread owner_;
+    std::atomic<int> stopping_{0};
+    std::atomic<int> failed_{0};
+    std::atomic<uint64_t> full_waits_{0};
+    struct shared_qp_stats_t stats_ = {};
+};
+
+} // namespace rdma
+
+#endif //RDMA_TEST_SHARED_QP_H